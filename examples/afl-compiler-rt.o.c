@@ -20,6 +20,7 @@
 #include "config.h"
 #include "types.h"
 #include "cmplog.h"
+#include "edgelist.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +34,7 @@
 #include <errno.h>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #ifndef __HAIKU__
   #include <sys/shm.h>
 #endif
@@ -81,6 +83,19 @@ u8 * __afl_fuzz_ptr;
 u32  __afl_fuzz_len_dummy;
 u32 *__afl_fuzz_len = &__afl_fuzz_len_dummy;
 
+/* Optional dirty block map: one byte per (1 << DIRTY_BLOCK_SHIFT) bytes of
+   __afl_area_ptr, set for each block an edge gets written to, so the fuzzer
+   only needs to reset and scan those. NULL unless the fuzzer passes one. */
+
+u8 *__afl_dirty_ptr;
+
+/* Optional sparse edge list (see edgelist.h), filled next to the map. The
+   slots remember where in the list an edge went, tagged with the list epoch. */
+
+afl_edge_list_t *__afl_edges;
+static u64 *     __afl_edge_slots;
+static u32       __afl_edge_slots_size;
+
 u32 __afl_final_loc;
 u32 __afl_map_size = MAP_SIZE;
 u32 __afl_dictionary_len;
@@ -117,6 +132,110 @@ static u8 is_persistent;
 
 static u8 _is_sancov;
 
+/* Slot values besides (epoch << 32 | index in the list), for the current epoch */
+
+#define EDGE_SLOT_PENDING 0xffffffffU /* Another thread is adding the edge */
+#define EDGE_SLOT_DROPPED 0xfffffffeU /* The list was full */
+
+/* (Re)maps the slots for the id space of edges. Lazily mapped, untouched slots
+   never get backed by memory. One thread does it, the others skip their hits
+   meanwhile. Swapping in a list of another size while the target runs is not
+   supported, the old slots go away under the other threads. */
+
+static u8 __afl_edges_map_slots(afl_edge_list_t *edges) {
+
+  static u8 lock;
+
+  if (__atomic_test_and_set(&lock, __ATOMIC_ACQUIRE)) { return 0; }
+
+  if (__afl_edge_slots_size != edges->max_id) {
+
+    if (__afl_edge_slots) { munmap(__afl_edge_slots, (size_t)__afl_edge_slots_size * sizeof(u64)); }
+    __afl_edge_slots = mmap(NULL, (size_t)edges->max_id * sizeof(u64), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (__afl_edge_slots == MAP_FAILED) {
+
+      __afl_edge_slots = NULL;
+      __afl_edge_slots_size = 0;
+      __afl_edges = NULL;
+      __atomic_clear(&lock, __ATOMIC_RELEASE);
+      return 0;
+
+    }
+
+    __atomic_store_n(&__afl_edge_slots_size, edges->max_id, __ATOMIC_RELEASE);
+
+  }
+
+  __atomic_clear(&lock, __ATOMIC_RELEASE);
+  return 1;
+
+}
+
+/* Records a hit of edge id in the edge list. Target threads may race: the
+   first hit claims the slot with a CAS and the list entry with an atomic add,
+   so each edge goes in once. Hits racing with that first one are not counted. */
+
+static void __afl_edges_hit(u32 id) {
+
+  afl_edge_list_t *edges = __afl_edges;
+
+  if (unlikely(id >= edges->max_id)) { return; }
+
+  if (unlikely(__atomic_load_n(&__afl_edge_slots_size, __ATOMIC_ACQUIRE) != edges->max_id)) {
+
+    if (!__afl_edges_map_slots(edges)) { return; }
+
+  }
+
+  u32  epoch = edges->epoch;
+  u64 *slot_ptr = &__afl_edge_slots[id];
+  u64  slot = __atomic_load_n(slot_ptr, __ATOMIC_ACQUIRE);
+
+  if ((u32)(slot >> 32) != epoch) {
+
+    /* First hit in this run, unless another thread beats us to it */
+    u64 pending = ((u64)epoch << 32) | EDGE_SLOT_PENDING;
+    if (!__atomic_compare_exchange_n(slot_ptr, &slot, pending, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) { return; }
+
+    u32 idx = __atomic_load_n(&edges->count, __ATOMIC_RELAXED);
+    do {
+
+      if (unlikely(idx >= edges->capacity)) {
+
+        idx = EDGE_SLOT_DROPPED;
+        break;
+
+      }
+
+    } while (!__atomic_compare_exchange_n(&edges->count, &idx, idx + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (likely(idx != EDGE_SLOT_DROPPED)) {
+
+      edges->edges[idx].id = id;
+      edges->edges[idx].count = 0;
+
+    }
+
+    slot = ((u64)epoch << 32) | idx;
+    __atomic_store_n(slot_ptr, slot, __ATOMIC_RELEASE);
+
+  }
+
+  switch ((u32)slot) {
+
+    case EDGE_SLOT_PENDING:
+      return;
+    case EDGE_SLOT_DROPPED:
+      __atomic_fetch_add(&edges->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    default:
+      __atomic_fetch_add(&edges->edges[(u32)slot].count, 1, __ATOMIC_RELAXED);
+
+  }
+
+}
+
 /* Uninspired gcc plugin instrumentation */
 
 void __afl_trace(const u32 x) {
@@ -126,6 +245,9 @@ void __afl_trace(const u32 x) {
 
   u8 *p = &__afl_area_ptr[prev ^ x];
 
+  if (__afl_dirty_ptr) { __afl_dirty_ptr[(prev ^ x) >> DIRTY_BLOCK_SHIFT] = 1; }
+  if (__afl_edges) { __afl_edges_hit(prev ^ x); }
+
 #if 1                                                                              /* enable for neverZero feature. */
   #if __GNUC__
   u8 c = __builtin_add_overflow(*p, 1, p);
@@ -373,6 +495,85 @@ static void __afl_map_shm(void) {
 
   }
 
+  id_str = getenv(DIRTY_SHM_ENV_VAR);
+
+  if (id_str) {
+
+    /* Sized by the fuzzer's map, which may be larger than ours */
+    size_t dirty_size;
+
+#ifdef USEMMAP
+    struct stat st;
+    int         shm_fd = shm_open(id_str, O_RDWR, 0600);
+    if (shm_fd == -1 || fstat(shm_fd, &st)) {
+
+      fprintf(stderr, "shm_open() failed\n");
+      exit(1);
+
+    }
+
+    dirty_size = st.st_size;
+    __afl_dirty_ptr = mmap(0, dirty_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (__afl_dirty_ptr == MAP_FAILED) {
+
+      close(shm_fd);
+      fprintf(stderr, "mmap() failed\n");
+      exit(2);
+
+    }
+
+#else
+    struct shmid_ds ds;
+    u32             shm_id = atoi(id_str);
+
+    if (shmctl(shm_id, IPC_STAT, &ds)) _exit(1);
+    dirty_size = ds.shm_segsz;
+    __afl_dirty_ptr = shmat(shm_id, NULL, 0);
+#endif
+
+    if (__afl_dirty_ptr == (void *)-1) _exit(1);
+
+    /* We did write to the first block above */
+    __afl_dirty_ptr[0] = 1;
+
+    /* With trace-pc-guard, every edge goes through __sanitizer_cov_trace_pc_guard,
+       which marks its block. Inline instrumentation writes the map behind our
+       back, so the fuzzer has to keep scanning all of it. */
+    if (_is_sancov) { __afl_dirty_ptr[dirty_size - 1] = 1; }
+
+  }
+
+  id_str = getenv(EDGES_SHM_ENV_VAR);
+
+  if (id_str) {
+
+#ifdef USEMMAP
+    struct stat st;
+    int         shm_fd = shm_open(id_str, O_RDWR, 0600);
+    if (shm_fd == -1 || fstat(shm_fd, &st)) {
+
+      fprintf(stderr, "shm_open() failed\n");
+      exit(1);
+
+    }
+
+    __afl_edges = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (__afl_edges == MAP_FAILED) {
+
+      close(shm_fd);
+      fprintf(stderr, "mmap() failed\n");
+      exit(2);
+
+    }
+
+#else
+    __afl_edges = shmat(atoi(id_str), NULL, 0);
+#endif
+
+    if (__afl_edges == (void *)-1) _exit(1);
+
+  }
+
   id_str = getenv(CMPLOG_SHM_ENV_VAR);
 
   if (getenv("AFL_DEBUG")) { fprintf(stderr, "DEBUG: cmplog id_str %s\n", id_str == NULL ? "<null>" : id_str); }
@@ -571,6 +772,7 @@ static void __afl_start_snapshots(void) {
         }
 
         __afl_area_ptr[0] = 1;
+        if (__afl_dirty_ptr) { __afl_dirty_ptr[0] = 1; }
         memset(__afl_prev_loc, 0, NGRAM_SIZE_MAX * sizeof(PREV_LOC_T));
 
         return;
@@ -819,6 +1021,7 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
       memset(__afl_area_ptr, 0, __afl_map_size);
       __afl_area_ptr[0] = 1;
+      if (__afl_dirty_ptr) { __afl_dirty_ptr[0] = 1; }
       memset(__afl_prev_loc, 0, NGRAM_SIZE_MAX * sizeof(PREV_LOC_T));
 
     }
@@ -836,6 +1039,7 @@ int __afl_persistent_loop(unsigned int max_cnt) {
       raise(SIGSTOP);
 
       __afl_area_ptr[0] = 1;
+      if (__afl_dirty_ptr) { __afl_dirty_ptr[0] = 1; }
       memset(__afl_prev_loc, 0, NGRAM_SIZE_MAX * sizeof(PREV_LOC_T));
 
       return 1;
@@ -847,6 +1051,8 @@ int __afl_persistent_loop(unsigned int max_cnt) {
          dummy output region. */
 
       __afl_area_ptr = __afl_area_initial;
+      __afl_dirty_ptr = NULL;
+      __afl_edges = NULL;
 
     }
 
@@ -999,6 +1205,9 @@ void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
 
 #endif
 
+  if (__afl_dirty_ptr) { __afl_dirty_ptr[*guard >> DIRTY_BLOCK_SHIFT] = 1; }
+  if (__afl_edges) { __afl_edges_hit(*guard); }
+
 }
 
 /* Init callback. Populates instrumentation IDs. Note that we're using
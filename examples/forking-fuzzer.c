@@ -83,78 +83,11 @@ static afl_exit_t fsrv_run_target_custom(afl_executor_t *fsrv_executor) {
 
   afl_forkserver_t *fsrv = (afl_forkserver_t *)fsrv_executor;
 
-  s32 res;
-  u32 exec_ms;
-  u32 write_value = fsrv->last_run_timed_out;
-
-  /* After this memset, fsrv->trace_bits[] are effectively volatile, so we
-     must prevent any earlier operations from venturing into that
-     territory. */
-
+  /* The default run_target leaves the map alone, we want a clean one each run.
+     It also measures fsrv->last_run_time for our timeout observer. */
   memset(fsrv->trace_bits, 0, fsrv->map_size);
 
-  MEM_BARRIER();
-
-  /* we have the fork server (or faux server) up and running
-  First, tell it if the previous run timed out. */
-
-  if ((res = write(fsrv->fsrv_ctl_fd, &write_value, 4)) != 4) {
-
-    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
-
-  }
-
-  fsrv->last_run_timed_out = 0;
-
-  if ((res = read(fsrv->fsrv_st_fd, &fsrv->child_pid, 4)) != 4) {
-
-    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
-
-  }
-
-  if (fsrv->child_pid <= 0) { FATAL("Fork server is misbehaving (OOM?)"); }
-
-  exec_ms = afl_read_s32_timed(fsrv->fsrv_st_fd, &fsrv->child_status, fsrv->exec_tmout);
-
-  fsrv->last_run_time = exec_ms;
-
-  if (exec_ms > fsrv->exec_tmout) {
-
-    /* If there was no response from forkserver after timeout seconds,
-    we kill the child. The forkserver should inform us afterwards */
-
-    kill(fsrv->child_pid, SIGKILL);
-    fsrv->last_run_timed_out = 1;
-    if (read(fsrv->fsrv_st_fd, &fsrv->child_status, 4) < 4) { exec_ms = 0; }
-
-  }
-
-  if (!exec_ms) {}
-
-  if (!WIFSTOPPED(fsrv->child_status)) { fsrv->child_pid = 0; }
-
-  fsrv->total_execs++;
-  if (!fsrv->use_stdin) { unlink(fsrv->out_file); }
-
-  /* Any subsequent operations on fsrv->trace_bits must not be moved by the
-     compiler below this point. Past this location, fsrv->trace_bits[]
-     behave very normally and do not have to be treated as volatile. */
-
-  MEM_BARRIER();
-
-  /* Report outcome to caller. */
-
-  if (WIFSIGNALED(fsrv->child_status)) {
-
-    fsrv->last_kill_signal = WTERMSIG(fsrv->child_status);
-
-    if (fsrv->last_run_timed_out && fsrv->last_kill_signal == SIGKILL) { return AFL_EXIT_TIMEOUT; }
-
-    return AFL_EXIT_CRASH;
-
-  }
-
-  return AFL_EXIT_OK;
+  return fsrv_run_target(fsrv_executor);
 
 }
 
@@ -229,6 +162,8 @@ afl_engine_t *initialize_engine_instance(char *target_path, char *in_dir, char *
 
   /* Let's now create a simple map-based observation channel */
   afl_observer_covmap_t *trace_bits_channel = afl_observer_covmap_new(MAP_SIZE);
+  /* Bucket the hitcounts, like AFL */
+  trace_bits_channel->classify_counts = true;
   fsrv->base.funcs.observer_add(&fsrv->base, &trace_bits_channel->base);
 
   afl_shmem_to_env_var(&trace_bits_channel->shared_map, "__AFL_SHM_ID");
@@ -447,7 +382,7 @@ int main(int argc, char **argv) {
 
     llmp_broker_once(llmp_broker);
 
-    usleep(500);
+    llmp_broker_await_msgs(llmp_broker, 50);
     u64 execs = 0;
     u64 crashes = 0;
     for (size_t i = 0; i < fuzz_workers_count; ++i) {
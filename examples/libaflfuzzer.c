@@ -17,6 +17,8 @@
 /* Ooops! we found a crash :) - Let's hope it was in the target... */
 #define LLMP_TAG_CRASH_V1 (0x101DEAD1)
 #define LLMP_TAG_TIMEOUT_V1 (0xA51EE851)
+/* A crash the executor caught (AFL_CATCH_CRASHES): the client wrote it already, and goes on */
+#define LLMP_TAG_CAUGHT_CRASH_V1 (0xCA4C4ED1)
 
 int                       LLVMFuzzerTestOneInput(const uint8_t *, size_t);
 __attribute__((weak)) int LLVMFuzzerInitialize(int *argc, char ***argv);
@@ -27,6 +29,8 @@ extern u32 __afl_map_size;
 
 /* pointer to the bitmap used by map-absed feedback, we'll report it if we crash. */
 static u8 *virgin_bits;
+/* The virgin map shared by all fuzzers. If set, crash reports don't need to carry our own virgin_bits */
+static u8 *shared_virgin_bits;
 /* The current client this process works on. We need this for our segfault handler */
 static llmp_client_t *current_client = NULL;
 /* Ptr to the message we're trying to fuzz right now - in case we crash... */
@@ -47,6 +51,12 @@ typedef struct cur_state {
 
 } cur_state_t;
 
+static size_t cur_state_len(afl_input_t *input) {
+
+  return sizeof(cur_state_t) + (shared_virgin_bits ? 0 : __afl_map_size) + input->len;
+
+}
+
 /* Stats message the client will send every once in a while */
 typedef struct broker_client_stats {
 
@@ -59,10 +69,10 @@ typedef struct broker_client_stats {
 /* all stats about the current run */
 typedef struct fuzzer_stats {
 
-  u64                         queue_entry_count;
   u64                         crashes;
   u64                         timeouts;
   struct broker_client_stats *clients;
+  u32                         client_count;
 
 } fuzzer_stats_t;
 
@@ -174,7 +184,7 @@ static afl_ret_t in_memory_fuzzer_initialize(afl_executor_t *executor) {
 
 void write_cur_state(llmp_message_t *out_msg) {
 
-  if (out_msg->buf_len < sizeof(cur_state_t) + __afl_map_size + current_input->len) {
+  if (out_msg->buf_len < cur_state_len(current_input)) {
 
     FATAL("Message not large enough for our state!");
 
@@ -182,7 +192,7 @@ void write_cur_state(llmp_message_t *out_msg) {
 
   /* first virgin bits[map_size], then the crasing/timeouting input buf */
   cur_state_t *state = LLMP_MSG_BUF_AS(out_msg, cur_state_t);
-  state->map_size = __afl_map_size;
+  state->map_size = shared_virgin_bits ? 0 : __afl_map_size;
   memcpy(state->payload, virgin_bits, state->map_size);
   state->current_input_len = current_input->len;
   state->calibration_idx = calibration_idx;
@@ -190,6 +200,15 @@ void write_cur_state(llmp_message_t *out_msg) {
 
 }
 
+/* The broker restarts us after the crash/timeout msg. Get the msgs still waiting in the batch out before it,
+  in the room execute() reserved for them, so we don't have to map a new page in the signal handler. */
+static void flush_batch_before_crash_msg(void) {
+
+  current_fuzz_input_msg = llmp_client_batch_flush_before(current_client, current_fuzz_input_msg);
+  if (!current_fuzz_input_msg) { FATAL("Error sending the batched msgs!"); }
+
+}
+
 static void handle_timeout(int sig, siginfo_t *info, void *ucontext) {
 
   (void)sig;
@@ -205,7 +224,7 @@ static void handle_timeout(int sig, siginfo_t *info, void *ucontext) {
 
   }
 
-  if (current_fuzz_input_msg->buf_len != sizeof(cur_state_t) + __afl_map_size + current_input->len) {
+  if (current_fuzz_input_msg->buf_len != cur_state_len(current_input)) {
 
     FATAL("Unexpected current_fuzz_input_msg length during timeout handling!");
 
@@ -224,8 +243,10 @@ static void handle_timeout(int sig, siginfo_t *info, void *ucontext) {
 
   }
 
+  flush_batch_before_crash_msg();
   write_cur_state(current_fuzz_input_msg);
   current_fuzz_input_msg->tag = LLMP_TAG_TIMEOUT_V1;
+  llmp_client_compress(current_client, current_fuzz_input_msg);
   if (!llmp_client_send(current_client, current_fuzz_input_msg)) { FATAL("Error sending timeout info!"); }
   DBG("We sent off the timeout at %p. Now waiting for broker to kill us :)", info->si_addr);
 
@@ -279,13 +300,15 @@ static void handle_crash(int sig, siginfo_t *info, void *ucontext) {
   if (current_fuzz_input_msg) {
 
     if (!current_input ||
-        current_fuzz_input_msg->buf_len != sizeof(cur_state_t) + __afl_map_size + current_input->len) {
+        current_fuzz_input_msg->buf_len != cur_state_len(current_input)) {
 
       FATAL("Unexpected current_fuzz_input_msg length during crash handling!");
 
     }
 
+    flush_batch_before_crash_msg();
     write_cur_state(current_fuzz_input_msg);
+    llmp_client_compress(current_client, current_fuzz_input_msg);
     llmp_client_send(current_client, current_fuzz_input_msg);
     DBG("We sent off the crash at %p. Now waiting for broker...", info->si_addr);
 
@@ -333,16 +356,28 @@ static void setup_signal_handlers(void) {
 void client_send_stats(afl_engine_t *engine) {
 
   llmp_client_t * llmp_client = engine->llmp_client;
-  llmp_message_t *msg = llmp_client_alloc_next(llmp_client, sizeof(u64));
+  llmp_message_t *msg = llmp_client_batch_alloc(llmp_client, sizeof(u64));
   msg->tag = LLMP_TAG_EXEC_STATS_V1;
   u64 *x = (u64 *)msg->buf;
   *x = engine->executions;
   engine->executions = 0;
-  llmp_client_send(llmp_client, msg);
+  llmp_client_batch_send(llmp_client, msg);
   engine->last_update = afl_get_cur_time_s();
 
 }
 
+/* Lets the broker count a crash we caught and wrote ourselves */
+void client_send_caught_crash(afl_engine_t *engine) {
+
+  llmp_client_t * llmp_client = engine->llmp_client;
+  llmp_message_t *msg = llmp_client_batch_alloc(llmp_client, sizeof(u64));
+  msg->tag = LLMP_TAG_CAUGHT_CRASH_V1;
+  u64 *x = (u64 *)msg->buf;
+  *x = 1;
+  llmp_client_batch_send(llmp_client, msg);
+
+}
+
 u8 execute(afl_engine_t *engine, afl_input_t *input) {
 
   size_t          i;
@@ -366,14 +401,20 @@ u8 execute(afl_engine_t *engine, afl_input_t *input) {
 
   /* TODO: use the msg buf in input directly */
   current_input = input;
-  current_fuzz_input_msg =
-      llmp_client_alloc_next(engine->llmp_client, sizeof(cur_state_t) + __afl_map_size + input->len);
+  current_fuzz_input_msg = llmp_client_alloc_after_batch(engine->llmp_client, cur_state_len(input));
   if (!current_fuzz_input_msg) { FATAL("Could not allocate crash message. Quitting!"); }
 
   /* we may crash, who knows.
   TODO: Actually use this buffer to mutate and fuzz, saves us copy time. */
   current_fuzz_input_msg->tag = LLMP_TAG_CRASH_V1;
 
+  /* Crash reports may carry a whole virgin map, mostly 0xff, so the handlers compress them. Not with malloc. */
+  if (llmp_client_compress_reserve(engine->llmp_client, cur_state_len(input)) != AFL_RET_SUCCESS) {
+
+    FATAL("Could not allocate the crash message compression buffer. Quitting!");
+
+  }
+
   afl_exit_t run_result = executor->funcs.run_target_cb(executor);
   engine->executions++;
 
@@ -404,8 +445,14 @@ u8 execute(afl_engine_t *engine, afl_input_t *input) {
       return AFL_RET_SUCCESS;
     default: {
 
-      /* TODO: We'll never reach this, actually... */
-      if (afl_input_dump_to_crashfile(executor->current_input, queue_dirpath) == AFL_RET_SUCCESS) engine->crashes++;
+      /* The executor caught the crash (AFL_CATCH_CRASHES), so handle_crash did not report it to the broker */
+      if (afl_input_dump_to_crashfile(executor->current_input, queue_dirpath) == AFL_RET_SUCCESS) {
+
+        engine->crashes++;
+        client_send_caught_crash(engine);
+
+      }
+
       return AFL_RET_WRITE_TO_CRASH;
 
     }
@@ -434,6 +481,9 @@ afl_engine_t *initialize_broker(char *in_dir, char *queue_dir, int argc, char *a
 
   in_memory_executor->argc = argc;
   in_memory_executor->argv = afl_argv_cpy_dup(argc, argv);
+  /* Crashes get written to the crashes dir, and we go on, instead of the broker restarting us. For targets that
+   * survive a crash halfway through an input. */
+  in_memory_executor->catch_crashes = !!getenv("AFL_CATCH_CRASHES");
   // in_memory_executor->base.funcs.init_cb = in_memory_fuzzer_initialize;
 
   /* Observation channel, map based, we initialize this ourselves since we don't
@@ -447,6 +497,8 @@ afl_engine_t *initialize_broker(char *in_dir, char *queue_dir, int argc, char *a
   observer_covmap->shared_map.map = __afl_area_ptr;  // Coverage "Map" we have
   observer_covmap->shared_map.map_size = __afl_map_size;
   observer_covmap->shared_map.shm_id = -1;
+  /* Bucket the hitcounts, like AFL */
+  observer_covmap->classify_counts = true;
   in_memory_executor->base.funcs.observer_add(&in_memory_executor->base, &observer_covmap->base);
 
   /* We create a simple feedback queue for coverage here*/
@@ -463,6 +515,7 @@ afl_engine_t *initialize_broker(char *in_dir, char *queue_dir, int argc, char *a
   /* Coverage Feedback initialization */
   afl_feedback_cov_t *coverage_feedback = afl_feedback_cov_new(coverage_feedback_queue, observer_covmap);
   if (!coverage_feedback) { FATAL("Error initializing feedback"); }
+  if (shared_virgin_bits) { afl_feedback_cov_set_shared_virgin_bits(coverage_feedback, shared_virgin_bits); }
 
   /* Let's build an engine now */
   afl_engine_t *engine = afl_engine_new(&in_memory_executor->base, NULL, new_global_queue);
@@ -508,9 +561,8 @@ afl_engine_t *initialize_broker(char *in_dir, char *queue_dir, int argc, char *a
     if (!input) { FATAL("Could not create input"); }
     u32 cnt;
     u32 input_len = 64;
+    if (!afl_input_reserve(input, input_len + 1)) { PFATAL("Could not allocate input bytes"); }
     input->len = input_len;
-    input->bytes = calloc(input_len + 1, 1);
-    if (!input->bytes) { PFATAL("Could not allocate input bytes"); }
 
     for (cnt = 0; cnt < input_len; cnt++) {
 
@@ -547,6 +599,14 @@ void fuzzer_process_main(llmp_client_t *llmp_client, void *data) {
 
   afl_engine_t *engine = (afl_engine_t *)data;
   engine->llmp_client = llmp_client;
+
+  /* The other fuzzers' stats and crashes are of no use to us */
+  if (llmp_client_subscribe(llmp_client, LLMP_TAG_NEW_QUEUE_ENTRY_V1) != AFL_RET_SUCCESS) {
+
+    FATAL("Could not subscribe to new queue entries");
+
+  }
+
   engine->cpu_bound = bind_to_cpu();
 
   if (engine->cpu_bound == -1) { FATAL("Error binding to CPU :("); }
@@ -564,9 +624,6 @@ void fuzzer_process_main(llmp_client_t *llmp_client, void *data) {
 
   if (!observer_covmap) { FATAL("Got no covmap observer"); }
 
-  /* set the global virgin_bits for error handlers, so we can restore them after a crash */
-  virgin_bits = observer_covmap->shared_map.map;
-
   afl_stage_t *            stage = engine->fuzz_one->stages[0];
   afl_mutator_scheduled_t *mutators_havoc = (afl_mutator_scheduled_t *)stage->mutators[0];
   afl_feedback_cov_t *     coverage_feedback = NULL;
@@ -583,6 +640,9 @@ void fuzzer_process_main(llmp_client_t *llmp_client, void *data) {
 
   if (!coverage_feedback) { FATAL("No coverage feedback added to engine"); }
 
+  /* set the global virgin_bits for error handlers, so we can restore them after a crash */
+  virgin_bits = coverage_feedback->virgin_bits;
+
   in_memory_fuzzer_initialize(engine->executor);
 
   /* The actual fuzzing */
@@ -634,9 +694,13 @@ bool broker_handle_client_restart(llmp_broker_t *broker, llmp_broker_clientdata_
   DBG("Removing old/crashed client");
 
   /* TODO: We should probably waite for the old client pid to finish (or kill it?) before creating a new one */
-  clientdata->client_state->current_broadcast_map = NULL;  // Don't kill our map :)
   llmp_client_delete(clientdata->client_state);
-  afl_shmem_deinit(clientdata->cur_client_map);
+  /* The broker may still forward messages from the old page after we return */
+  if (llmp_broker_retain_map(broker, clientdata->cur_client_map) != AFL_RET_SUCCESS) {
+
+    afl_shmem_deinit(clientdata->cur_client_map);
+
+  }
 
   DBG("Creating new client #phoenix");
   clientdata->client_state = llmp_client_new_unconnected();
@@ -645,20 +709,23 @@ bool broker_handle_client_restart(llmp_broker_t *broker, llmp_broker_clientdata_
   clientdata->client_state->id = client_id;
   /* link the new broker to the client at the position of the old client by connecting shmems. */
   /* TODO: Do this inside the forked thread instead? Right now, we're mapping it twice... */
-  afl_shmem_t *broadcast_map = calloc(1, sizeof(afl_shmem_t));
-  if (!broadcast_map) { PFATAL("Could not alloc mem for broadcast map"); }
-  afl_shmem_by_str(broadcast_map, broker->broadcast_maps[0].shm_str, broker->broadcast_maps[0].map_size);
-  clientdata->client_state->current_broadcast_map = broadcast_map;
+  afl_shmem_by_str(clientdata->client_state->current_broadcast_map, broker->broadcast_maps[0].shm_str,
+                   broker->broadcast_maps[0].map_size);
+  afl_shmem_by_str(&clientdata->client_state->doorbell_map, broker->doorbell_map.shm_str,
+                   broker->doorbell_map.map_size);
 
   afl_shmem_by_str(clientdata->cur_client_map, clientdata->client_state->out_maps[0].shm_str,
                    clientdata->client_state->out_maps[0].map_size);
+  /* It starts reading at the oldest broadcast page left, don't let the broker unmap that one */
+  shmem2page(clientdata->cur_client_map)->broadcast_page_read =
+      shmem2page(clientdata->client_state->current_broadcast_map)->page_seq;
 
   /* restore the old virgin_bits for this fuzzer before reforking */
   afl_engine_t *engine = (afl_engine_t *)clientdata->data;
   size_t        i;
   for (i = 0; i < engine->feedbacks_count; i++) {
 
-    if (engine->feedbacks[i]->tag == AFL_FEEDBACK_TAG_COV) {
+    if (engine->feedbacks[i]->tag == AFL_FEEDBACK_TAG_COV && state->map_size) {
 
       afl_feedback_cov_set_virgin_bits((afl_feedback_cov_t *)engine->feedbacks[i], state->payload, state->map_size);
 
@@ -683,7 +750,11 @@ bool broker_handle_client_restart(llmp_broker_t *broker, llmp_broker_clientdata_
 /* A hook to keep stats in the broker thread */
 bool broker_message_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *clientdata, llmp_message_t *msg, void *data) {
 
-  fuzzer_stats_t *       fuzzer_stats = ((fuzzer_stats_t *)data);
+  fuzzer_stats_t *fuzzer_stats = ((fuzzer_stats_t *)data);
+
+  /* Not one of our fuzzers, but for example a bridge to other brokers: just forward */
+  if (!clientdata->client_state->id || clientdata->client_state->id > fuzzer_stats->client_count) { return true; }
+
   broker_client_stats_t *client_stats = &fuzzer_stats->clients[clientdata->client_state->id - 1];
   client_stats->last_msg_time = afl_get_cur_time();
 
@@ -694,11 +765,14 @@ bool broker_message_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *client
   switch (msg->tag) {
 
     case LLMP_TAG_NEW_QUEUE_ENTRY_V1:
-      fuzzer_stats->queue_entry_count++;
-      return true;  // Forward this to the clients
+      return true;  // Forward this to the clients (unless the coverage filter drops it)
     case LLMP_TAG_EXEC_STATS_V1:
       client_stats->total_execs += *(LLMP_MSG_BUF_AS(msg, u64));
       return false;  // don't forward this to the clients
+    case LLMP_TAG_CAUGHT_CRASH_V1:
+      /* Already written by the client, which goes on fuzzing: just count it */
+      fuzzer_stats->crashes += *(LLMP_MSG_BUF_AS(msg, u64));
+      return false;
     case LLMP_TAG_TIMEOUT_V1:
       DBG("We found a timeout...");
       /* write timeout output */
@@ -845,22 +919,39 @@ int main(int argc, char **argv) {
 
   if (!afl_dir_exists(in_dir)) { FATAL("Oops, seed input directory %s does not seem to be valid.", in_dir); }
 
+  /* One virgin map for all fuzzers, so only the first one to find an edge reports it */
+  afl_shmem_t shared_virgin = {0};
+  if (!afl_shmem_init(&shared_virgin, __afl_map_size)) { FATAL("Could not create the shared virgin map"); }
+  memset(shared_virgin.map, 0xff, __afl_map_size);
+  shared_virgin_bits = shared_virgin.map;
+
   afl_engine_t **engines = malloc(sizeof(afl_engine_t *) * thread_count);
   if (!engines) { PFATAL("Could not allocate engine buffer!"); }
 
   llmp_broker_t *llmp_broker = llmp_broker_new();
   if (!llmp_broker) { FATAL("Broker creation failed"); }
 
+  /* Unmap the broadcast pages all fuzzers read past, so the broker doesn't keep every msg ever sent.
+  The fuzzers copy what they keep. Restarted fuzzers then only get the entries from the oldest page left.
+  AFL_LLMP_KEEP_PAGES keeps them all. */
+  llmp_broker->gc_broadcast_pages = !getenv("AFL_LLMP_KEEP_PAGES");
+
   /* This is not necessary but gives us the option to add additional processes to the fuzzer at runtime. */
   if (!llmp_broker_register_local_server(llmp_broker, broker_port)) { FATAL("Broker register failed"); }
 
   OKF("Created broker.");
 
+  /* Only forward the queue entries that are still novel once they reach the broker */
+  afl_broker_cov_filter_t *cov_filter = afl_broker_cov_filter_new(__afl_map_size);
+  if (!cov_filter) { FATAL("Could not create the broker coverage filter"); }
+  llmp_broker_add_message_hook(llmp_broker, afl_broker_cov_filter_hook, cov_filter);
+
   /* The message hook will intercept all messages from all clients - and listen for stats. */
   fuzzer_stats_t fuzzer_stats = {0};
   llmp_broker_add_message_hook(llmp_broker, broker_message_hook, &fuzzer_stats);
   fuzzer_stats.clients = malloc(thread_count * sizeof(broker_client_stats_t));
   if (!fuzzer_stats.clients) { PFATAL("Unable to alloc memory"); }
+  fuzzer_stats.client_count = thread_count;
 
   for (i = 0; i < thread_count; i++) {
 
@@ -880,6 +971,24 @@ int main(int argc, char **argv) {
 
   }
 
+  /* Share the queue entries with the fuzzers on other machines:
+  AFL_LLMP_BRIDGE=port listens for them, AFL_LLMP_BRIDGE=host:port connects to one.
+  We only listen on localhost (for ssh tunnels), unless AFL_LLMP_BRIDGE_REMOTE is set: the bridge has no auth. */
+  char *bridge = getenv("AFL_LLMP_BRIDGE");
+  if (bridge) {
+
+    char *port_str = strrchr(bridge, ':');
+    if (port_str) { *port_str++ = '\0'; }
+
+    if (!llmp_broker_register_tcp_bridge(llmp_broker, port_str ? bridge : NULL, atoi(port_str ? port_str : bridge),
+                                         !!getenv("AFL_LLMP_BRIDGE_REMOTE"))) {
+
+      FATAL("Could not register the tcp bridge");
+
+    }
+
+  }
+
   // Before we start the broker, we close the stderr file. Since the in-mem
   // fuzzer runs in the same process, this is necessary for stats collection.
 
@@ -901,12 +1010,12 @@ int main(int argc, char **argv) {
 
   while (1) {
 
-    /* Chill a bit */
-    usleep(175);
-
     /* Forward all messages that arrived in the meantime */
     llmp_broker_once(llmp_broker);
 
+    /* Chill until the clients send something new (or it's time to paint the ui) */
+    llmp_broker_await_msgs(llmp_broker, 50);
+
     /* Paint ui every second */
     if ((time_cur = afl_get_cur_time_s()) > time_prev) {
 
@@ -932,7 +1041,7 @@ int main(int argc, char **argv) {
       }
 
       SAYF("paths=%llu crashes=%llu timeouts=%llu elapsed=%llu execs=%llu exec/s=%llu\r",
-           fuzzer_stats.queue_entry_count, fuzzer_stats.crashes, fuzzer_stats.timeouts, time_elapsed, total_execs,
+           cov_filter->forwarded, fuzzer_stats.crashes, fuzzer_stats.timeouts, time_elapsed, total_execs,
            total_execs / time_elapsed);
 
       fflush(stdout);
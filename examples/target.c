@@ -1,27 +1,60 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+/* Ask the forkserver to hand us our inputs in shared memory (see afl-compiler-rt.o.c) */
+int                   __afl_sharedmem_fuzzing = 1;
+extern unsigned char *__afl_fuzz_ptr;
+extern unsigned int * __afl_fuzz_len;
+
+/* Tells the fuzzer we can run many inputs per process, in the __afl_persistent_loop below */
+static volatile char *persistent_sig __attribute__((used)) = "##SIG_AFL_PERSISTENT##";
+int                   __afl_persistent_loop(unsigned int max_cnt);
+
+/* Tells the fuzzer we start the forkserver ourselves, in __afl_manual_init, once our setup is done */
+static volatile char *defer_sig __attribute__((used)) = "##SIG_AFL_DEFER_FORKSRV##";
+void                  __afl_manual_init(void);
+
 char file_name[20] = "./testcase";
 
 int main() {
 
-  char input[100] = {'\x00'};
+  /* Anything expensive goes here: it runs once, all children inherit it */
+  __afl_manual_init();
 
-  int r = read(0, input, 4);
-  if (!r) { puts("Error!\n"); }
+  while (__afl_persistent_loop(1000)) {
 
-  printf("In target\n");
+    char input[100] = {'\x00'};
 
-  if (input[2] == 'B' || input[2] == 'C') {
+    int r;
+    if (__afl_fuzz_ptr) {
 
-    puts("1st block hit");
+      r = *__afl_fuzz_len < 4 ? *__afl_fuzz_len : 4;
+      memcpy(input, __afl_fuzz_ptr, r);
 
-    if (input[2] == 'C') {
+    } else {
 
-      puts("2nd block hit");
-      *(volatile int *)(NULL) = 0x0;  // Crash
+      /* Not run by a fuzzer that can do that */
+      r = read(0, input, 4);
+
+    }
+
+    if (!r) { puts("Error!\n"); }
+
+    printf("In target\n");
+
+    if (input[2] == 'B' || input[2] == 'C') {
+
+      puts("1st block hit");
+
+      if (input[2] == 'C') {
+
+        puts("2nd block hit");
+        *(volatile int *)(NULL) = 0x0;  // Crash
+
+      }
 
     }
 
@@ -30,4 +63,3 @@ int main() {
   exit(0);
 
 }
-
@@ -40,6 +40,8 @@
 #include "feedback.h"
 #include "stage.h"
 #include "os.h"
+#include "memsnapshot.h"
+#include "runner.h"
 #include "afl-returns.h"
 
 /*
@@ -63,6 +65,17 @@ struct afl_executor_funcs {
 
   void (*observers_reset)(afl_executor_t *);  // Reset the observation channels
 
+  /* Optional, for executors that run several inputs at once, like afl_fsrv_pool_t. The stage then mutates and
+  evaluates inputs while others still run, see afl_stage_perform. */
+  bool (*submit_cb)(afl_executor_t *, afl_input_t *);  // Starts a run on the input, false if all runs are busy
+  afl_input_t *(*collect_cb)(afl_executor_t *, s32 timeout_ms, afl_exit_t *);  // A finished input, NULL if none
+
+  /* Runs count inputs, filling in exit_codes and calling on_run (can be NULL) after each of them. Defaults to
+  afl_executor_run_batch, executors that can amortize work over several inputs override it. See also
+  afl_engine_execute_batch. */
+  afl_ret_t (*run_batch)(afl_executor_t *, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                         afl_batch_run_cb on_run, void *data);
+
 };
 
 // This is like the generic vtable for the executor.
@@ -84,6 +97,8 @@ void         afl_executor_deinit(afl_executor_t *);
 afl_ret_t    afl_executor_add_observer(afl_executor_t *, afl_observer_t *);
 afl_input_t *afl_executor_get_current_input(afl_executor_t *);
 void         afl_observers_reset(afl_executor_t *);
+afl_ret_t    afl_executor_run_batch(afl_executor_t *, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                                    afl_batch_run_cb on_run, void *data);
 
 // Function used to create an executor, we alloc the memory ourselves and
 // initialize the executor
@@ -124,6 +139,18 @@ typedef struct afl_forkserver {
 
   u8 last_kill_signal;                                                          /* Signal that killed the child     */
 
+  afl_shmem_t shmem_fuzz;                                                       /* u32 len, then the input buf      */
+  u8          use_shmem_fuzz;                                                   /* Target reads inputs from shmem   */
+  u8          persistent_mode;                                                  /* Child loops over inputs          */
+  u8          deferred_mode;                                                    /* Target calls __afl_manual_init   */
+
+  s32 epoll_fd,                                                                 /* Status pipe and timer_fd         */
+      timer_fd;                                                                 /* Fires after exec_tmout           */
+  u8  timer_armed;
+  u64 exec_start_us;                                                            /* When the current run started     */
+
+  afl_observer_covmap_t *covmap;                                                /* Given to the target, if set      */
+
 } afl_forkserver_t;
 
 /* Functions related to the forkserver defined above */
@@ -131,6 +158,55 @@ afl_forkserver_t *fsrv_init(char *target_path, char **extra_target_args);
 afl_exit_t        fsrv_run_target(afl_executor_t *fsrv_executor);
 u8                fsrv_place_input(afl_executor_t *fsrv_executor, afl_input_t *input);
 afl_ret_t         fsrv_start(afl_executor_t *fsrv_executor);
+u8                fsrv_destroy(afl_executor_t *fsrv_executor);
+afl_ret_t         fsrv_run_batch(afl_executor_t *fsrv_executor, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                                 afl_batch_run_cb on_run, void *data);
+
+#ifdef __linux__
+/* Runs without waiting for the target, so one engine can supervise several forkservers at once:
+  fsrv_run_target_async() them, fsrv_group_wait() for any of them, then fsrv_run_target_collect() its result. */
+void              fsrv_run_target_async(afl_forkserver_t *fsrv);
+bool              fsrv_poll(afl_forkserver_t *fsrv, s32 timeout_ms);
+afl_exit_t        fsrv_run_target_collect(afl_forkserver_t *fsrv);
+s32               fsrv_group_new(void);
+afl_ret_t         fsrv_group_add(s32 group_fd, afl_forkserver_t *fsrv);
+afl_forkserver_t *fsrv_group_wait(s32 group_fd, s32 timeout_ms);
+
+/* Several forkservers of the same target for one engine, each with its own coverage map. The stage keeps them all
+  busy through submit_cb and collect_cb, so one thread can saturate its core with slow targets. Add the covmap
+  observer to the pool as to a forkserver: it holds the coverage of the input collect_cb returned last. */
+typedef struct afl_fsrv_pool {
+
+  afl_executor_t base;
+
+  afl_forkserver_t **     fsrvs;
+  afl_observer_covmap_t **covmaps;     /* The map of each forkserver, copied to covmap once its run is collected */
+  afl_input_t **          inputs;      /* What each forkserver runs, NULL if it is idle */
+  u32 *                   batch_idxs;  /* For run_batch, the position of each forkserver's input in the batch */
+  u32                     fsrvs_count;
+  u32                     running;
+
+  afl_observer_covmap_t *covmap;  /* The first covmap observer of the pool, if any */
+  s32                    group_fd;
+
+  u32 exec_tmout;     /* Configurable exec timeout (ms), for each forkserver */
+  u32 last_run_time;  /* Time the input collect_cb returned last took */
+  u64 total_execs;
+
+} afl_fsrv_pool_t;
+
+afl_fsrv_pool_t *fsrv_pool_init(char *target_path, char **target_args, u32 fsrvs_count);
+afl_ret_t        fsrv_pool_start(afl_executor_t *pool_executor);
+u8               fsrv_pool_destroy(afl_executor_t *pool_executor);
+bool             fsrv_pool_submit(afl_executor_t *pool_executor, afl_input_t *input);
+afl_input_t *    fsrv_pool_collect(afl_executor_t *pool_executor, s32 timeout_ms, afl_exit_t *exit_code);
+u8               fsrv_pool_place_input(afl_executor_t *pool_executor, afl_input_t *input);
+afl_exit_t       fsrv_pool_run_target(afl_executor_t *pool_executor);
+/* Keeps all forkservers busy with the batch. on_run gets the inputs in the order they finish, which need not be the
+  order of the batch. */
+afl_ret_t fsrv_pool_run_batch(afl_executor_t *pool_executor, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                              afl_batch_run_cb on_run, void *data);
+#endif
 
 /* In-memory executor */
 
@@ -145,12 +221,58 @@ typedef struct in_memory_executor {
   int                   argc;  // To support libfuzzer harnesses
   afl_stage_t *         stage;
   afl_queue_global_t *  global_queue;
+  afl_mem_snapshot_t *  mem_snapshot;  // If set, taken before the first run and restored after each one
+  u8                    catch_crashes; // Recover from crashing signals in the harness, see in_memory_run_target
 
 } in_memory_executor_t;
 
+/* With catch_crashes set, SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT in the harness jump back here, on an
+  alternate signal stack, and the run ends with the matching crash exit code instead of the process. The harness
+  doesn't get to clean up: whatever it leaked or left half-written stays that way, unless a mem_snapshot puts it
+  back. Crashes outside of the harness go to the handlers installed before. */
 afl_exit_t in_memory_run_target(afl_executor_t *executor);
 u8         in_mem_executor_place_input(afl_executor_t *executor, afl_input_t *input);
+afl_ret_t  in_memory_run_batch(afl_executor_t *executor, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                               afl_batch_run_cb on_run, void *data);
 void       in_memory_executor_init(in_memory_executor_t *in_memory_executor, harness_function_type harness);
 
+/* Snapshot executor */
+
+/* Runs the harness in a child forked from us once (so after the harness init), which resets its memory after each
+  run with the AFL snapshot LKM (see snapshot-inl.h). Without the module, the child forks again for each run.
+  Whatever the harness wrote is gone after the run, unless it is in shared memory: that's where the coverage map has
+  to be, like an afl_observer_covmap_t map. A crash or timeout only costs a new child. */
+typedef struct snapshot_range {
+
+  void *start, *end;
+  bool  include;
+
+} snapshot_range_t;
+
+typedef struct snapshot_executor {
+
+  in_memory_executor_t base;
+
+  afl_shmem_t input_shm;     /* u32 len, then the input */
+  afl_os_t    child;         /* Runs the harness, handler_process is 0 until we (re)spawn it */
+  s32         ctl_fd, st_fd; /* Our ends of the pipes to the child */
+  u32         exec_tmout;    /* Configurable exec timeout (ms), 0 for none */
+  u8          use_snapshot;  /* The LKM is there, else the child forks for each run */
+
+  snapshot_range_t *ranges;  /* Passed on to the LKM before the child takes its snapshot */
+  size_t            ranges_count;
+
+} snapshot_executor_t;
+
+afl_ret_t  snapshot_executor_init(snapshot_executor_t *snapshot_executor, harness_function_type harness);
+void       snapshot_executor_deinit(snapshot_executor_t *snapshot_executor);
+afl_ret_t  snapshot_executor_add_range(snapshot_executor_t *snapshot_executor, void *start, void *end, bool include);
+afl_ret_t  snapshot_executor_start(afl_executor_t *executor);
+u8         snapshot_executor_place_input(afl_executor_t *executor, afl_input_t *input);
+afl_exit_t snapshot_executor_run_target(afl_executor_t *executor);
+
+AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(snapshot_executor, AFL_DECL_PARAMS(harness_function_type harness),
+                                   AFL_CALL_PARAMS(harness))
+
 #endif
 
@@ -314,6 +314,27 @@
 
 #define SHM_FUZZ_ENV_VAR "__AFL_SHM_FUZZ_ID"
 
+/* Environment variable used to pass the SHM ID of the optional dirty block
+   map: one byte per (1 << DIRTY_BLOCK_SHIFT) bytes of the coverage map, set
+   by the instrumentation for each block it writes to. The last byte of the
+   shm (DIRTY_MAP_COMPLETE) is set by instrumentation that marks every write
+   to the map. Until then, all blocks count as dirty. */
+
+#define DIRTY_SHM_ENV_VAR "__AFL_SHM_DIRTY_ID"
+#define DIRTY_BLOCK_SHIFT 6
+
+/* Number of blocks of a coverage map of the given size */
+
+#define DIRTY_MAP_BLOCKS(map_size) (((map_size) + (1 << DIRTY_BLOCK_SHIFT) - 1) >> DIRTY_BLOCK_SHIFT)
+
+/* Size of the dirty block map for a coverage map of the given size, with the marker, padded to 8 bytes */
+
+#define DIRTY_MAP_SIZE(map_size) ((DIRTY_MAP_BLOCKS(map_size) + 1 + 7) & ~(size_t)7)
+
+/* Index of the marker. It's the last byte, the target may not know our map size. */
+
+#define DIRTY_MAP_COMPLETE(map_size) (DIRTY_MAP_SIZE(map_size) - 1)
+
 /* Other less interesting, internal-only variables. */
 
 #define CLANG_ENV_VAR "__AFL_CLANG_MODE"
@@ -0,0 +1,64 @@
+/*
+   american fuzzy lop++ - edge list header
+   ---------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Layout of the sparse edge list in shared memory, shared between the
+   fuzzer (afl_observer_edgelist_t) and the instrumentation runtime.
+
+ */
+
+#ifndef _AFL_EDGELIST_H
+#define _AFL_EDGELIST_H
+
+#include "types.h"
+
+/* Environment variable used to pass the SHM ID of the edge list */
+
+#define EDGES_SHM_ENV_VAR "__AFL_SHM_EDGES_ID"
+
+typedef struct afl_edge {
+
+  u32 id;
+  u32 count;
+
+} afl_edge_t;
+
+/* The instrumentation appends an entry the first time it sees an edge in a
+   run and bumps its count on later hits. Entries belong to the current run if
+   they were added after the last epoch change, so the fuzzer resets the list
+   by bumping epoch and zeroing count, no matter how large the edge id space.
+   Target threads add entries and bump counts atomically. */
+
+typedef struct afl_edge_list {
+
+  volatile u32 epoch;     /* Bumped by the fuzzer for every run, never 0 */
+  volatile u32 count;     /* Entries used in this run */
+  u32          capacity;  /* Entries available */
+  u32          max_id;    /* Edge ids >= max_id are not recorded */
+  volatile u32 dropped;   /* Edges not recorded because the list was full */
+  u32          padding;
+
+  afl_edge_t edges[];
+
+} afl_edge_list_t;
+
+#define AFL_EDGE_LIST_SIZE(capacity) (sizeof(afl_edge_list_t) + (size_t)(capacity) * sizeof(afl_edge_t))
+
+#endif
+
@@ -32,6 +32,7 @@
 #include "common.h"
 #include "queue.h"
 #include "feedback.h"
+#include "os.h"
 #include "afl-returns.h"
 #include "xxh3.h"
 #include "xxhash.h"
@@ -91,7 +92,16 @@ void      afl_set_fuzz_one(afl_engine_t *, afl_fuzz_one_t *);
 afl_ret_t afl_engine_add_feedback(afl_engine_t *, afl_feedback_t *);
 void      afl_set_global_queue(afl_engine_t *engine, afl_queue_global_t *global_queue);
 
-u8        afl_engine_execute(afl_engine_t *, afl_input_t *);
+/* Called by an executor's run_batch after each input of the batch ran, while the observers still hold its coverage.
+  idx is the position of the input in the batch. */
+typedef void (*afl_batch_run_cb)(afl_executor_t *executor, u32 idx, afl_exit_t exit_code, void *data);
+
+u8 afl_engine_execute(afl_engine_t *, afl_input_t *);
+/* Like afl_engine_execute for each input, in one run_batch of the executor. on_run (can be NULL) gets called after
+  the engine handled each result, e.g. to ask the feedbacks about the input. */
+afl_ret_t afl_engine_execute_batch(afl_engine_t *, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                                   afl_batch_run_cb on_run, void *data);
+u8        afl_engine_handle_run_result(afl_engine_t *, afl_exit_t);
 afl_ret_t afl_engine_load_testcases_from_dir(afl_engine_t *, char *);
 void      afl_engine_load_zero_testcase(size_t);
 afl_ret_t afl_engine_handle_new_message(afl_engine_t *, llmp_message_t *);
@@ -109,5 +119,33 @@ AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(afl_engine,
                                                    afl_queue_global_t *global_queue),
                                    AFL_CALL_PARAMS(executor, fuzz_one, global_queue))
 
+/* Broker side coverage filter. Keeps a virgin map and an index of the coverage
+   hashes seen so far, and only lets LLMP_TAG_NEW_QUEUE_ENTRY_V1 messages pass
+   that are still novel when they reach the broker. Entries without coverage
+   info (cov_count 0) always pass. Register it with
+   llmp_broker_add_message_hook(broker, afl_broker_cov_filter_hook, filter). */
+typedef struct afl_broker_cov_filter {
+
+  u8 *   virgin_bits;
+  size_t map_size;
+
+  /* Open addressing hash set of coverage hashes, size is a power of two */
+  u64 *  hashes;
+  size_t hashes_size;
+  size_t hashes_count;
+
+  u64 forwarded, dropped;
+
+} afl_broker_cov_filter_t;
+
+afl_ret_t afl_broker_cov_filter_init(afl_broker_cov_filter_t *filter, size_t map_size);
+void      afl_broker_cov_filter_deinit(afl_broker_cov_filter_t *filter);
+
+AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(afl_broker_cov_filter, AFL_DECL_PARAMS(size_t map_size), AFL_CALL_PARAMS(map_size))
+
+/* The llmp_message_hook_func. Also stores the coverage hash in the entry info. */
+bool afl_broker_cov_filter_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *msg,
+                                void *filter);
+
 #endif
 
@@ -32,6 +32,7 @@
 
 #define AFL_FEEDBACK_TAG_BASE (0xFEEDB43E)
 #define AFL_FEEDBACK_TAG_COV (0xFEEDC0F8)
+#define AFL_FEEDBACK_TAG_EDGELIST (0xFEEDED6E)
 
 typedef struct afl_queue_feedback afl_queue_feedback_t;
 typedef struct afl_feedback       afl_feedback_t;
@@ -66,6 +67,12 @@ AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(afl_feedback, AFL_DECL_PARAMS(afl_queue_feedb
 
 /* Simple MaximizeMapFeedback implementation */
 
+/* A novelty kernel compares the trace_bits of one run against the virgin_bits,
+   clears everything it saw from the virgin_bits and returns 1.0 for new edges,
+   0.5 for new hitcounts only and 0.0 if nothing new showed up.
+   map_size has to be a multiple of 8. */
+typedef float(afl_feedback_cov_novelty_func)(u8 *trace_bits, u8 *virgin_bits, size_t map_size);
+
 /* Coverage Feedback */
 typedef struct afl_feedback_cov {
 
@@ -77,6 +84,14 @@ typedef struct afl_feedback_cov {
   u8 *   virgin_bits;
   size_t size;
 
+  /* Optional virgin map shared with other fuzzers, see afl_feedback_cov_set_shared_virgin_bits */
+  u8 *shared_virgin_bits;
+
+  /* The novelty kernels used by is_interesting, picked for the current cpu at init.
+     The classify one buckets the raw hitcounts in the same pass. */
+  afl_feedback_cov_novelty_func *novelty_kernel;
+  afl_feedback_cov_novelty_func *classify_novelty_kernel;
+
 } afl_feedback_cov_t;
 
 afl_ret_t afl_feedback_cov_init(afl_feedback_cov_t *feedback, afl_queue_feedback_t *queue,
@@ -90,8 +105,59 @@ AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(afl_feedback_cov,
 /* Set virgin bits according to the map passed into the func */
 afl_ret_t afl_feedback_cov_set_virgin_bits(afl_feedback_cov_t *feedback, u8 *virgin_bits_copy_from, size_t size);
 
+/* Makes novelty global: new bits get claimed in a virgin map shared by all
+   fuzzers (for example an afl_shmem_t of the same size, memset to 0xff, created
+   before forking). Only the first fuzzer to clear a bit finds it interesting.
+   The local virgin_bits stay as a cache, the shared map is only touched (using
+   atomics) when a run looks interesting locally. */
+void afl_feedback_cov_set_shared_virgin_bits(afl_feedback_cov_t *feedback, u8 *shared_virgin_bits);
+
 /* Returns the "interestingness" of the current feedback */
 float afl_feedback_cov_is_interesting(afl_feedback_t *feedback, afl_executor_t *fsrv);
 
+/* The novelty kernels. The SIMD versions skip over all-zero blocks of the trace
+   map and only look at the virgin map where the trace has bits set.
+   The classify_novelty kernels also bucket the hitcounts of the trace map in
+   place (like afl_observer_covmap_classify_counts) before comparing them.
+   Only call the SIMD versions if the cpu supports them. There is no SSE2 one: with
+   16 byte lanes, it was slower than the scalar kernel (64 bit words) on some maps. */
+float afl_feedback_cov_novelty_scalar(u8 *trace_bits, u8 *virgin_bits, size_t map_size);
+float afl_feedback_cov_classify_novelty_scalar(u8 *trace_bits, u8 *virgin_bits, size_t map_size);
+#if defined(__x86_64__) || defined(__i386__)
+float afl_feedback_cov_novelty_avx2(u8 *trace_bits, u8 *virgin_bits, size_t map_size);
+float afl_feedback_cov_novelty_avx512(u8 *trace_bits, u8 *virgin_bits, size_t map_size);
+float afl_feedback_cov_classify_novelty_avx2(u8 *trace_bits, u8 *virgin_bits, size_t map_size);
+float afl_feedback_cov_classify_novelty_avx512(u8 *trace_bits, u8 *virgin_bits, size_t map_size);
+#endif
+
+/* Returns the fastest (classify_)novelty kernel the current cpu supports */
+afl_feedback_cov_novelty_func *afl_feedback_cov_novelty_best(void);
+afl_feedback_cov_novelty_func *afl_feedback_cov_classify_novelty_best(void);
+
+/* Edge list feedback, the counterpart of afl_observer_edgelist_t */
+typedef struct afl_feedback_edgelist {
+
+  afl_feedback_t base;
+
+  afl_observer_edgelist_t *observer_edges;
+
+  /* The hitcount buckets seen so far, one byte per edge id (the inverse of
+     virgin_bits). Zeroed lazily by the OS, so edges never hit cost nothing. */
+  u8 *   seen_buckets;
+  size_t size;
+
+} afl_feedback_edgelist_t;
+
+afl_ret_t afl_feedback_edgelist_init(afl_feedback_edgelist_t *feedback, afl_queue_feedback_t *queue,
+                                     afl_observer_edgelist_t *observer_edges);
+void      afl_feedback_edgelist_deinit(afl_feedback_edgelist_t *feedback);
+
+AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(afl_feedback_edgelist,
+                                   AFL_DECL_PARAMS(afl_queue_feedback_t *queue, afl_observer_edgelist_t *observer_edges),
+                                   AFL_CALL_PARAMS(queue, observer_edges))
+
+/* 1.0 for new edges, 0.5 for new hitcount buckets, 0.0 else. Only walks the list. */
+float afl_feedback_edgelist_is_interesting(afl_feedback_t *feedback, afl_executor_t *executor);
+
 #endif
 
@@ -52,7 +52,7 @@ struct afl_input {
   u8 *   bytes;  // Raw input bytes
   size_t len;    // Length of the input
 
-  u8 *copy_buf;
+  u8 *copy_buf;  // afl_realloc'd buf the input owns, bytes points to it unless they were set from the outside
 
   struct afl_input_funcs funcs;
 
@@ -61,7 +61,12 @@ struct afl_input {
 afl_ret_t afl_input_init(afl_input_t *input);
 void      afl_input_deinit(afl_input_t *input);
 
-// Default implementations of the functions for raw input vtable
+/* Makes the input's bytes live in a buf of at least size bytes that it owns (copy_buf), copying them over if they
+  were set from the outside. Returns the bytes, or NULL if out of mem, leaving the input as it was. */
+u8 *afl_input_reserve(afl_input_t *input, size_t size);
+
+// Default implementations of the functions for raw input vtable. copy and deserialize copy the bytes, the copy owns
+// them.
 
 void         afl_input_deserialize(afl_input_t *this_input, u8 *bytes, size_t len);
 u8 *         afl_input_serialize(afl_input_t *this_input);
@@ -40,9 +40,34 @@ current map.
  \|/                \|/                \|/
 [client0]        [client1]    ...    [clientN]
 
-In the future, if we need zero copy, the current_broadcast_map could instead
-list the client_out_map ID an offset for each message. In that case, the clients
-also need to create new shmaps once their bufs are filled up.
+For messages of at least broker->zero_copy_min_len bytes, the broker does not
+copy at all: the current_broadcast_map instead lists the client_out_map ID and
+the offset of the message (LLMP_TAG_MSG_REF_V1). The receiving clients map the
+sender's page on demand and llmp_client_recv hands out the original message.
+The broker keeps referenced pages mapped, so they stay around after the sender
+moved on to a new page.
+
+Each client acks the broadcast page it currently reads in the header of its own
+out page (broadcast_page_read). With broker->gc_broadcast_pages set, the broker
+unmaps broadcast pages, and referenced client pages, once all clients read
+past them. Messages are only valid until the client moves on to the next page,
+so keep a copy of everything you still need.
+
+Brokers can be linked, to scale past what a single broker loop can handle, or
+to span several machines. A link is a client of both brokers, passing on all
+messages it reads on one side to the other side. Each message only passes a link
+once (by its origin and number there, see LLMP_B2B_SEEN_SIZE): nothing gets echoed
+back. The first link (or tcp bridge) a message passes names its origin, with a
+random id of its own. For example, run one
+sub-broker per NUMA node for its local clients, each linked to a root broker
+with llmp_broker_register_parent_link. Across machines, llmp_tcp_bridge_t
+relays the messages over tcp instead of shared maps:
+
+[root broker] <-- link --> [sub broker 0] <-> [client0] ... [clientN]
+      |
+      |_________ link --> [sub broker 1] <-> ...
+      |
+ [tcp bridge] <== tcp ==> [tcp bridge] <-> [other machine's broker] <-> ...
 
 
 To use, you will have to create a broker using llmp_broker_new().
@@ -65,6 +90,17 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 /* What byte count llmp messages should be aligned to */
 #define LLMP_ALIGNMENT (64)
 
+/* Messages at least this large get broadcasted by reference, see broker->zero_copy_min_len */
+#define LLMP_ZERO_COPY_MIN_LEN (4096)
+
+/* A client batch (see llmp_client_batch_alloc) goes out once it would grow past this many bytes... */
+#define LLMP_BATCH_MAX_LEN (1 << 16)
+/* ...or once it is this many ms old */
+#define LLMP_BATCH_MAX_MS (100)
+
+/* A good client->compress_min_len: smaller msgs are not worth the effort */
+#define LLMP_COMPRESS_MIN_LEN (4096)
+
 /* llmp tags */
 #define LLMP_TAG_NEW_QUEUE_ENTRY_V1 (0xC0ADDED1)
 
@@ -89,6 +125,10 @@ typedef struct llmp_message {
   u32 sender;
   /* unique id for this msg */
   u32 message_id;
+  /* Once the msg passed between brokers: where it came from, and its number there, see llmp_b2b_link_t.
+  0 before. */
+  u32 origin;
+  u32 origin_id;
   /* the length of the payload, as requested by the caller */
   size_t buf_len;
   /* the actual length of the payload, including padding to the next msg */
@@ -129,12 +169,28 @@ typedef struct llmp_page {
   size_t size_used;
   /* The largest allocated element so far */
   size_t max_alloc_size;
+  /* Counts up for each new page of the same sender */
+  size_t page_seq;
+  /* Only used on client pages, written by the sender: the page_seq of the
+  broadcast page it currently reads. It's done with all older ones. */
+  volatile size_t broadcast_page_read;
   /* The messages start here. They can be of variable size, so don't address
    * them by array. */
   llmp_message_t messages[];
 
 } __attribute__((__packed__)) llmp_page_t;
 
+/* Lets clients wake up a sleeping broker (see llmp_broker_await_msgs), or brokers a sleeping client
+   (see llmp_client_register_doorbell). Lives in its own small sharedmap, mapped by both sides. */
+typedef struct llmp_doorbell {
+
+  /* Bumped by each client after each send (or by the brokers after each broadcast) */
+  volatile u32 ring;
+  /* Set while somebody waits for a ring. Only then it needs a wakeup. */
+  volatile u32 sleeping;
+
+} llmp_doorbell_t;
+
 /* For the client: state (also used as metadata by broker) */
 typedef struct llmp_client {
 
@@ -154,22 +210,141 @@ typedef struct llmp_client {
   size_t new_out_page_hook_count;
   /* The hooks we'll call for each new shared map */
   llmp_hookdata_t *new_out_page_hooks;
+  /* The broker's doorbell (llmp_doorbell_t), rung after each send, if mapped */
+  afl_shmem_t doorbell_map;
+  /* Other clients' pages we mapped to read messages broadcasted by reference */
+  size_t       ref_map_count;
+  afl_shmem_t *ref_maps;
+  /* Set by the broker on launch if it unmaps broadcast pages all clients read
+  (broker->gc_broadcast_pages). Then, we have to keep reading, else we pin old pages. */
+  bool gc_broadcast_pages;
+  /* The tags we receive (see llmp_client_subscribe), or all, if there are none.
+  The mask has the bit of each tag set (llmp_tag_bit), to skip most others without looking them up. */
+  size_t subscribed_tag_count;
+  u32 *  subscribed_tags;
+  u64    subscribed_tags_mask;
+  /* Small msgs packed by llmp_client_batch_alloc, to go out in a single frame */
+  u8 *            batch_buf;
+  size_t          batch_len;
+  u32             batch_count;
+  u64             batch_start_time;
+  llmp_message_t *batch_pending;
+  /* Flush thresholds for the batch, 0 for LLMP_BATCH_MAX_LEN and LLMP_BATCH_MAX_MS */
+  size_t batch_max_len;
+  u32    batch_max_ms;
+  /* llmp_client_send compresses msgs from this size on (if it makes them smaller), 0 to never compress.
+  Receivers get them inflated, valid until their next llmp_client_recv. See also llmp_client_compress. */
+  size_t compress_min_len;
+  u8 *   compress_buf;
+  /* The last msg received, inflated */
+  u8 *decompress_buf;
 
 } llmp_client_t;
 
 typedef struct llmp_broker_client_metadata llmp_broker_clientdata_t;
 
+/* For the broker: a client page kept mapped, as broadcasted references may still point into it */
+typedef struct llmp_broker_ref_map {
+
+  afl_shmem_t map;
+  /* The page_seq of the broadcast page that was current when the map got retained.
+  Once all clients read past it, nobody needs the map anymore. */
+  size_t broadcast_page_seq;
+
+} llmp_broker_ref_map_t;
+
+/* Msgs passing between brokers get deduplicated by origin and number (msg->origin, msg->origin_id),
+  in a direct-mapped cache with this many entries (per link, and per tcp peer) */
+#define LLMP_B2B_SEEN_SIZE (1 << 16)
+
+/* A link between two brokers on the same machine: a client of each.
+  See llmp_b2b_link_once. */
+typedef struct llmp_b2b_link {
+
+  /* Our client at the (sub) broker */
+  llmp_client_t *client;
+  /* Our client at the parent broker */
+  llmp_client_t *parent;
+  /* The origin we give the msgs we pass on first (random), and how many we did */
+  u32 origin;
+  u32 origin_msgs;
+  /* Ids of the msgs that already passed, either way */
+  u64 *seen;
+
+} llmp_b2b_link_t;
+
+/* A peer at the other end of a tcp bridge */
+typedef struct llmp_tcp_bridge_peer {
+
+  int fd;
+  /* Our connect to the peer did not go through yet */
+  bool connecting;
+  /* Received bytes, until a frame is complete */
+  u8 *   in_buf;
+  size_t in_len;
+  /* Frames not written to the socket yet, from out_sent on */
+  u8 *   out_buf;
+  size_t out_len;
+  size_t out_sent;
+  /* Ids of the msgs this peer has already */
+  u64 *seen;
+
+} llmp_tcp_bridge_peer_t;
+
+/* Relays all msgs between our broker (through client) and the brokers of its peers, via tcp.
+  Either listens for peers on port, or connects to hostname:port (and reconnects, if needed).
+  Peers only get what got broadcasted after they connected. See llmp_tcp_bridge_once. */
+typedef struct llmp_tcp_bridge {
+
+  /* Set before llmp_tcp_bridge_init: listen for peers on all interfaces, instead of just localhost.
+  There is no authentication, anyone who can connect exchanges msgs with our broker. */
+  bool listen_remote;
+
+  llmp_client_t *client;
+  /* The origin we give the msgs we pass on first (random), and how many we did */
+  u32 origin;
+  u32 origin_msgs;
+  /* The peer to connect to, or NULL to listen */
+  char *hostname;
+  /* If we listen on port 0, this becomes the port we got */
+  int port;
+  /* Listening socket, or -1 */
+  int listenfd;
+  /* Polled along with the peers, or -1: readable once our broker broadcasted (see llmp_clientloop_tcp_bridge) */
+  int wakefd;
+  /* When we last tried to connect (ms) */
+  u64 last_connect_time;
+
+  size_t                  peer_count;
+  llmp_tcp_bridge_peer_t *peers;
+  struct pollfd *         pollfds;
+
+  /* Ids of the msgs we broadcasted already */
+  u64 *seen;
+
+} llmp_tcp_bridge_t;
+
 /* A convenient clientloop function that can be run threaded on llmp broker
  * startup */
 typedef void (*llmp_clientloop_func)(llmp_client_t *client_state, void *data);
 
 /* A hook able to intercept messages arriving at the broker.
 If return is false, message will not be delivered to clients.
+Compressed messages get inflated for the hooks. The broker then compresses the
+hooks' version again: if it changed, that version goes out (compressed, if it
+still compresses), else the sender's message does. So each compressed message
+that gets forwarded costs the broker one extra compression pass.
 This is synchronous, if you need long-running message handlers, register a
 client instead. */
 typedef bool(llmp_message_hook_func)(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *msg,
                                      void *data);
 
+/* A hook able to intercept a run of count consecutive messages arriving at the
+broker at once (walk them with llmp_msg_next). Clear forward[i] to not deliver
+the i-th message to the clients. Called before the per-message hooks. */
+typedef void(llmp_message_batch_hook_func)(llmp_broker_t *broker, llmp_broker_clientdata_t *client,
+                                           llmp_message_t *first, size_t count, bool *forward, void *data);
+
 /* A hook getting called for each new page this client creates.
 Map points to the new map, containing the page, data point to the data passed when set up the hook. */
 typedef void(llmp_client_new_page_hook_func)(llmp_client_t *client, llmp_page_t *new_out_page, void *data);
@@ -204,6 +379,12 @@ struct llmp_broker_client_metadata {
   /* The last message we/the broker received for this client. */
   llmp_message_t *last_msg_broker_read;
 
+  /* If we broadcasted a reference into cur_client_map, it has to stay mapped */
+  bool cur_client_map_referenced;
+
+  /* The client's doorbell, to ring after our broadcasts (see llmp_client_register_doorbell), if mapped */
+  afl_shmem_t broadcast_doorbell_map;
+
   /* pthread associated to this client, if we have a threaded client */
   pthread_t *pthread;
   /* process ID, if the client is a process */
@@ -228,9 +409,36 @@ struct llmp_broker_state {
   size_t           msg_hook_count;
   llmp_hookdata_t *msg_hooks;
 
+  size_t           msg_batch_hook_count;
+  llmp_hookdata_t *msg_batch_hooks;
+  /* Scratch space for the batch hooks' forward flags */
+  bool * batch_forward;
+  size_t batch_forward_size;
+
   size_t                    llmp_client_count;
   llmp_broker_clientdata_t *llmp_clients;
 
+  /* Messages from this size on get broadcasted by reference instead of copied, 0 to always copy */
+  size_t zero_copy_min_len;
+  /* Client pages we broadcasted references to, kept mapped */
+  size_t                 ref_map_count;
+  llmp_broker_ref_map_t *ref_maps;
+
+  /* Unmap broadcast pages (and referenced client pages) once all clients read past them.
+  Clients joining later then start at the oldest page left, instead of the very first one.
+  Set this before launching the clients. */
+  bool gc_broadcast_pages;
+
+  /* The doorbell clients ring after each send */
+  afl_shmem_t doorbell_map;
+  /* The ring count before the last llmp_broker_once */
+  u32 doorbell_seen;
+
+  /* The compressed msg the hooks currently look at, inflated */
+  u8 *decompress_buf;
+  /* Scratch space to compress it again, in case the hooks changed it */
+  u8 *compress_buf;
+
 };
 
 /* Get a message buf as type if size matches (larger than, due to align),
@@ -262,6 +470,20 @@ static inline llmp_page_t *shmem2page(afl_shmem_t *afl_shmem) {
 /* If a msg is contained in the current page */
 bool llmp_msg_in_page(llmp_page_t *page, llmp_message_t *msg);
 
+/* The msg following this one in the same page */
+static inline llmp_message_t *llmp_msg_next(llmp_message_t *msg) {
+
+  return (llmp_message_t *)((u8 *)msg + sizeof(llmp_message_t) + msg->buf_len_padded);
+
+}
+
+/* The bit of this tag in llmp_client_t->subscribed_tags_mask */
+static inline u64 llmp_tag_bit(u32 tag) {
+
+  return 1ULL << ((tag * 0x9E3779B1U) >> 26);
+
+}
+
 /* Creates a new client process that will connect to the given port */
 llmp_client_t *llmp_client_new(int port);
 
@@ -279,6 +501,11 @@ llmp_message_t *llmp_client_recv(llmp_client_t *client);
   then returns that message. */
 llmp_message_t *llmp_client_recv_blocking(llmp_client_t *client);
 
+/* From now on, only receive msgs with this tag (or the tags subscribed to before).
+Without any subscriptions, a client receives everything. Others msgs get skipped
+in llmp_client_recv, large ones broadcasted by reference without mapping the sender's page. */
+afl_ret_t llmp_client_subscribe(llmp_client_t *client, u32 tag);
+
 /* Will return a ptr to the next msg buf, potentially mapping a new page automatically, if needed.
 Never call alloc_next multiple times without either sending or cancelling the last allocated message for this page!
 There can only ever be up to one message allocated per page at each given time. */
@@ -295,6 +522,42 @@ void llmp_client_cancel(llmp_client_t *client, llmp_message_t *msg);
 /* Commits a msg to the client's out buf. After this, don't  write to this msg anymore! */
 bool llmp_client_send(llmp_client_t *client_state, llmp_message_t *msg);
 
+/* Asks the broker of client to ring the doorbell (a llmp_doorbell_t) in doorbell_map after each broadcast,
+so the client can sleep until there is something new. See llmp_clientloop_b2b_link. */
+afl_ret_t llmp_client_register_doorbell(llmp_client_t *client, afl_shmem_t *doorbell_map);
+
+/* Compresses the msg (the last one allocated) for llmp_client_send, if that makes it smaller, whatever its size.
+Does not allocate for msgs up to the size passed to llmp_client_compress_reserve, so it is fine in a signal handler. */
+void llmp_client_compress(llmp_client_t *client, llmp_message_t *msg);
+
+/* Preallocates the scratch space llmp_client_compress needs for msgs of up to size bytes */
+afl_ret_t llmp_client_compress_reserve(llmp_client_t *client, size_t size);
+
+/* Like llmp_client_alloc_next, but packs the msg into the client's current batch.
+The broker unpacks the batch and handles its msgs as if they were sent one by one,
+so small msgs share the frame header, alignment and publication costs.
+Msgs too large for a batch get allocated directly, after flushing the batch.
+Send with llmp_client_batch_send. Flush the batch before llmp_client_send-ing other msgs, if order matters. */
+llmp_message_t *llmp_client_batch_alloc(llmp_client_t *client, size_t size);
+
+/* Adds the msg from llmp_client_batch_alloc to the batch, flushes if the batch is due */
+bool llmp_client_batch_send(llmp_client_t *client, llmp_message_t *msg);
+
+/* Sends the batch, if it is older than client->batch_max_ms. Call this regularly. */
+bool llmp_client_batch_flush_if_due(llmp_client_t *client);
+
+/* Sends all batched msgs now */
+bool llmp_client_batch_flush(llmp_client_t *client);
+
+/* Like llmp_client_alloc_next, for a msg that may have to go out right after the current batch.
+Also reserves room for the batch in front of it, see llmp_client_batch_flush_before. */
+llmp_message_t *llmp_client_alloc_after_batch(llmp_client_t *client, size_t size);
+
+/* Sends the batch ahead of the (not yet sent) msg from llmp_client_alloc_after_batch, and returns where the msg is
+now, with its tag, but not its contents. As long as nothing got batched in between, both fit the room reserved,
+without mapping a new page, so this is fine in a signal handler. Returns NULL on error. */
+llmp_message_t *llmp_client_batch_flush_before(llmp_client_t *client, llmp_message_t *msg);
+
 /* Adds a hook that gets called in the client for each new outgoing page the client creates (after start or EOP). */
 afl_ret_t llmp_client_add_new_out_page_hook(llmp_client_t *client, llmp_client_new_page_hook_func *hook, void *data);
 
@@ -302,6 +565,36 @@ afl_ret_t llmp_client_add_new_out_page_hook(llmp_client_t *client, llmp_client_n
  the broker's initial map str */
 void llmp_clientloop_tcp(llmp_client_t *client_state, void *data);
 
+/* Sets up a link between the brokers of client (the sub broker) and parent */
+afl_ret_t llmp_b2b_link_init(llmp_b2b_link_t *link, llmp_client_t *client, llmp_client_t *parent);
+
+/* Cleans up the link. The clients stay. */
+void llmp_b2b_link_deinit(llmp_b2b_link_t *link);
+
+/* Passes all new msgs of each broker on to the other, unless they passed the link before.
+  Returns the number of msgs read. */
+size_t llmp_b2b_link_once(llmp_b2b_link_t *link);
+
+/* A clientloop linking its broker to the parent broker with a local server
+  (llmp_broker_register_local_server) at port (passed as data). */
+void llmp_clientloop_b2b_link(llmp_client_t *client_state, void *data);
+
+/* Sets up a tcp bridge for the broker of client. If hostname is NULL, listens
+  for peers on port (on localhost, unless bridge->listen_remote is set, 0 picks a free one),
+  else connects to hostname:port on the first llmp_tcp_bridge_once. Keep hostname alive. */
+afl_ret_t llmp_tcp_bridge_init(llmp_tcp_bridge_t *bridge, llmp_client_t *client, char *hostname, int port);
+
+/* Disconnects all peers and cleans up the bridge. The client stays. */
+void llmp_tcp_bridge_deinit(llmp_tcp_bridge_t *bridge);
+
+/* Sends our broker's new msgs to all peers that don't have them yet, and passes
+  the new msgs from the peers on to our broker. Waits up to timeout_ms for the
+  peers (and the wakefd) if there was nothing to do. Returns the number of msgs read. */
+size_t llmp_tcp_bridge_once(llmp_tcp_bridge_t *bridge, u32 timeout_ms);
+
+/* A clientloop running a tcp bridge, data is an llmp_tcp_bridge_t with hostname and port set */
+void llmp_clientloop_tcp_bridge(llmp_client_t *client_state, void *data);
+
 /* Allocate and set up the new broker instance. Afterwards, run with broker_run. */
 afl_ret_t llmp_broker_init(llmp_broker_t *broker);
 
@@ -335,10 +628,29 @@ bool llmp_broker_launch_clientloops(llmp_broker_t *broker);
  tcp */
 bool llmp_broker_register_local_server(llmp_broker_t *broker, int port);
 
+/* Register a threaded client linking this (sub) broker to a parent broker on
+ this machine, that has a local server (llmp_broker_register_local_server) at parent_port */
+bool llmp_broker_register_parent_link(llmp_broker_t *broker, int parent_port);
+
+/* Register a threaded client bridging this broker to other brokers via tcp.
+ If hostname is NULL, listens for them on port (on all interfaces if listen_remote, else on localhost),
+ else connects to hostname:port */
+bool llmp_broker_register_tcp_bridge(llmp_broker_t *broker, char *hostname, int port, bool listen_remote);
+
 /* Adds a hook that gets called for each new message the broker touches.
 if the callback returns false, the message is not forwarded to the clients. */
 afl_ret_t llmp_broker_add_message_hook(llmp_broker_t *broker, llmp_message_hook_func *hook, void *data);
 
+/* Adds a hook that gets called once for each run of new messages the broker
+touches, see llmp_message_batch_hook_func. */
+afl_ret_t llmp_broker_add_message_batch_hook(llmp_broker_t *broker, llmp_message_batch_hook_func *hook, void *data);
+
+/* Keeps a (client) map mapped until all clients read past the current broadcast
+page (or the broker gets deinited, if broker->gc_broadcast_pages is not set).
+A message hook replacing a client's page has to hand the old one over to this,
+instead of unmapping it: the messages accepted before may still get forwarded. */
+afl_ret_t llmp_broker_retain_map(llmp_broker_t *broker, afl_shmem_t *map);
+
 /* The broker walks all pages and looks for changes, then broadcasts them on
  its own shared page.
  Never returns. */
@@ -353,5 +665,10 @@ void llmp_broker_run(llmp_broker_t *broker);
  * its own shared page, once. */
 void llmp_broker_once(llmp_broker_t *broker);
 
+/* Sleeps until a client sent something since the start of the last
+ llmp_broker_once, or timeout_ms passed. Returns right away if there already
+ is something new. */
+void llmp_broker_await_msgs(llmp_broker_t *broker, u32 timeout_ms);
+
 #endif                                                                                                    /* LLMP_H */
 
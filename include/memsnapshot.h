@@ -0,0 +1,72 @@
+#ifndef AFL_MEMSNAPSHOT_H
+#define AFL_MEMSNAPSHOT_H
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "common.h"
+#include "afl-returns.h"
+
+/* A snapshot of some memory ranges of our own process, restored without fork or kernel module.
+   After each run, only the pages written to get copied back. The kernel tells us which ones, through the
+   userfaultfd async write protection (Linux 6.7+), or else the soft-dirty bits in /proc/self/pagemap.
+   Without either, whole ranges get copied back. Clearing the soft-dirty bits clears them for the whole process, so
+   only one snapshot at a time uses them, the others copy whole ranges.
+
+   Only register memory the harness owns: its globals (see afl_mem_snapshot_add_module) and the arenas it
+   allocates from. Restoring memory the fuzzer uses as well, like the malloc heap, would corrupt it. */
+
+typedef enum afl_mem_snapshot_tracking {
+
+  AFL_MEM_SNAPSHOT_FULL,        /* Copy all ranges back */
+  AFL_MEM_SNAPSHOT_UFFD_WP,     /* userfaultfd write protection, the pages written are in PAGEMAP_SCAN */
+  AFL_MEM_SNAPSHOT_SOFT_DIRTY,  /* Soft-dirty bits in /proc/self/pagemap, cleared through clear_refs */
+
+} afl_mem_snapshot_tracking_t;
+
+typedef struct afl_mem_snapshot_range {
+
+  u8 *   start;
+  size_t len;
+  u8 *   copy;  /* The contents at afl_mem_snapshot_take */
+
+} afl_mem_snapshot_range_t;
+
+typedef struct afl_mem_snapshot {
+
+  afl_mem_snapshot_range_t *ranges;
+  size_t                    ranges_count;
+
+  afl_mem_snapshot_tracking_t tracking;
+  size_t                      page_size;
+  s32                         uffd, pagemap_fd, clear_refs_fd;
+
+  /* Reusable buf for the pagemap entries of a range */
+  u64 *pagemap_buf;
+
+  bool taken;
+  u64  restored_pages;  /* Pages copied back so far */
+
+} afl_mem_snapshot_t;
+
+afl_ret_t afl_mem_snapshot_init(afl_mem_snapshot_t *snapshot);
+void      afl_mem_snapshot_deinit(afl_mem_snapshot_t *snapshot);
+
+/* Adds [start, start + len), extended to whole pages. Takes effect with the next afl_mem_snapshot_take. */
+afl_ret_t afl_mem_snapshot_add_range(afl_mem_snapshot_t *snapshot, void *start, size_t len);
+
+/* Adds the writable segments (.data, .bss) of the binary or library that addr is part of, as far as its program
+   headers say, without the part that is read only after relocation (RELRO).
+   Meant for harnesses in their own library: for the binary the fuzzer is linked into, that's the fuzzer's globals as
+   well. */
+afl_ret_t afl_mem_snapshot_add_module(afl_mem_snapshot_t *snapshot, void *addr);
+
+/* Saves the ranges as they are now, and starts tracking writes to them */
+afl_ret_t afl_mem_snapshot_take(afl_mem_snapshot_t *snapshot);
+
+/* Puts everything written since the last take or restore back to the snapshot */
+void afl_mem_snapshot_restore(afl_mem_snapshot_t *snapshot);
+
+AFL_NEW_AND_DELETE_FOR(afl_mem_snapshot)
+
+#endif                                                                                          /* AFL_MEMSNAPSHOT_H */
@@ -30,9 +30,11 @@
 #include "common.h"
 #include "shmem.h"
 #include "afl-returns.h"
+#include "edgelist.h"
 
 #define AFL_OBSERVER_TAG_BASE (0x0B5EB45E)
 #define AFL_OBSERVER_TAG_COVMAP (0x0B5EC0FE)
+#define AFL_OBSERVER_TAG_EDGELIST (0x0B5EED6E)
 
 typedef struct afl_observer afl_observer_t;
 
@@ -85,20 +87,83 @@ struct afl_observer_covmap {
 
   afl_shmem_t shared_map;
 
+  /* Bucket the hitcounts after each run, like AFL's classify_counts (default: off, raw counts) */
+  bool classify_counts;
+  /* The map still holds raw hitcounts. post_exec leaves the bucketing to the
+     first one reading the map, so it can be done in the same pass (see
+     afl_feedback_cov_is_interesting). */
+  bool counts_raw;
+
+  /* Optional dirty block map, see afl_observer_covmap_track_dirty. Unused if map is NULL. */
+  afl_shmem_t dirty_map;
+
   struct afl_observer_covmap_funcs funcs;
 
 };
 
+/* Hitcount -> bucket, as in AFL */
+extern const u8 afl_count_class_lookup8[256];
+
 u8 *   afl_observer_covmap_get_trace_bits(afl_observer_covmap_t *obs_channel);
 size_t afl_observer_covmap_get_map_size(afl_observer_covmap_t *obs_channel);
 
+/* Buckets the hitcounts in the map now, if that did not happen yet */
+void afl_observer_covmap_classify_counts(afl_observer_covmap_t *obs_channel);
+
+/* Allocates the dirty block map (one byte per 1 << DIRTY_BLOCK_SHIFT bytes of
+   the coverage map). The instrumentation has to set the byte for each block it
+   writes to: pass it on with afl_shmem_to_env_var(&obs_channel->dirty_map,
+   DIRTY_SHM_ENV_VAR), or point __afl_dirty_ptr at it when fuzzing in memory.
+   Only once the DIRTY_MAP_COMPLETE byte is set as well, which the runtime does
+   for trace-pc-guard targets, reset and the coverage feedback visit just the
+   dirty blocks. Until then, every block counts as dirty. */
+afl_ret_t afl_observer_covmap_track_dirty(afl_observer_covmap_t *obs_channel);
+
+/* Returns the index of the first dirty block >= block, or SIZE_MAX if there is none.
+   The block starts at (index << DIRTY_BLOCK_SHIFT) in the coverage map. */
+size_t afl_observer_covmap_next_dirty(afl_observer_covmap_t *obs_channel, size_t block);
+
+/* Length of a (dirty) block, the last one of the map may be cut short */
+static inline size_t afl_observer_covmap_block_len(afl_observer_covmap_t *obs_channel, size_t block) {
+
+  size_t offset = block << DIRTY_BLOCK_SHIFT;
+  size_t len = obs_channel->shared_map.map_size - offset;
+
+  return len < (1 << DIRTY_BLOCK_SHIFT) ? len : (1 << DIRTY_BLOCK_SHIFT);
+
+}
+
 // Functions to initialize and delete a map based observation channel
 
 afl_ret_t afl_observer_covmap_init(afl_observer_covmap_t *, size_t map_size);
 void      afl_observer_covmap_deinit(afl_observer_covmap_t *);
 void      afl_observer_covmap_reset(afl_observer_t *);
+void      afl_observer_covmap_post_exec(afl_observer_t *, afl_engine_t *);
 
 AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(afl_observer_covmap, AFL_DECL_PARAMS(size_t map_size), AFL_CALL_PARAMS(map_size))
 
+/* Sparse alternative to the covmap: the instrumentation appends (edge id, count)
+   pairs to a list in shared memory (see edgelist.h). Reset and the matching
+   feedback only cost as much as the edges hit, independent of the map size.
+   Pass the list on with afl_shmem_to_env_var(&obs_channel->shared_list,
+   EDGES_SHM_ENV_VAR), or point __afl_edges at it when fuzzing in memory. */
+
+typedef struct afl_observer_edgelist {
+
+  afl_observer_t base;
+
+  afl_shmem_t      shared_list;
+  afl_edge_list_t *edges;  // shared_list.map
+
+} afl_observer_edgelist_t;
+
+/* max_edges is the size of the edge id space, capacity the max number of distinct edges per run */
+afl_ret_t afl_observer_edgelist_init(afl_observer_edgelist_t *, u32 max_edges, u32 capacity);
+void      afl_observer_edgelist_deinit(afl_observer_edgelist_t *);
+void      afl_observer_edgelist_reset(afl_observer_t *);
+
+AFL_NEW_AND_DELETE_FOR_WITH_PARAMS(afl_observer_edgelist, AFL_DECL_PARAMS(u32 max_edges, u32 capacity),
+                                   AFL_CALL_PARAMS(max_edges, capacity))
+
 #endif
 
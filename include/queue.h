@@ -33,6 +33,7 @@
 #include "input.h"
 #include "shmem.h"
 #include "feedback.h"
+#include "edgelist.h"
 
 /*
 This is the generic interface implementation for the queue and queue entries.
@@ -64,6 +65,34 @@ typedef struct __attribute__((__packed__)) afl_entry_info {
 
 } afl_entry_info_t;
 
+/* Payload of a LLMP_TAG_NEW_QUEUE_ENTRY_V1 message: the info, then cov_count
+   (map index, bucketed hitcount) pairs of the coverage the entry hit, then the
+   input bytes. The coverage lets the broker drop entries that are no longer
+   novel (see afl_broker_cov_filter_t), cov_count 0 means unknown. */
+typedef struct afl_entry_msg {
+
+  afl_entry_info_t info;
+  u32              input_len;
+  u32              cov_count;
+  u8               data[];
+
+} afl_entry_msg_t;
+
+#define AFL_ENTRY_MSG_SIZE(cov_count, input_len) \
+  (sizeof(afl_entry_msg_t) + (cov_count) * sizeof(afl_edge_t) + (input_len))
+
+static inline afl_edge_t *afl_entry_msg_cov(afl_entry_msg_t *entry_msg) {
+
+  return (afl_edge_t *)entry_msg->data;
+
+}
+
+static inline u8 *afl_entry_msg_input(afl_entry_msg_t *entry_msg) {
+
+  return entry_msg->data + entry_msg->cov_count * sizeof(afl_edge_t);
+
+}
+
 struct afl_entry {
 
   afl_entry_info_t *info;
@@ -0,0 +1,115 @@
+/*
+   american fuzzy lop++ - fuzzer header
+   ------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   The runner fuzzes with several engines in one process, one thread each,
+   without a broker in between.
+
+ */
+
+#ifndef LIBRUNNER_H
+#define LIBRUNNER_H
+
+#include <pthread.h>
+
+#include "types.h"
+#include "common.h"
+#include "queue.h"
+#include "afl-returns.h"
+
+/* Entries fuzzed in a row by the worker that took them from the shared cursor, unless other workers steal them */
+#define AFL_RUNNER_CHUNK 8
+
+typedef struct afl_runner afl_runner_t;
+
+typedef struct afl_runner_worker {
+
+  afl_runner_t *runner;
+  afl_engine_t *engine;
+  pthread_t     thread;
+  s32           cpu;  /* Pinned to this core, -1 for none */
+
+  /* Corpus indices to fuzz next. We take from the back, idle workers steal from the front. */
+  pthread_mutex_t lock;
+  u32 *           deque;
+  size_t          deque_start, deque_count, deque_size;
+
+  /* What the engine fuzzes: a copy of the corpus entry, so the stages may change it */
+  afl_entry_t entry;
+  afl_input_t input;
+
+  size_t    published;  /* Entries of the engine's global queue already in the corpus */
+  u64       steals;     /* Entries we got from other workers */
+  afl_ret_t ret;        /* Why the worker stopped */
+
+} afl_runner_worker_t;
+
+/* Each engine needs its own executor, feedbacks, fuzz_one and global queue, and no llmp client: what it finds goes
+  right into its global queue. From there, the runner puts a copy of it in the corpus all workers fuzz, which never
+  changes once there. Adding an engine hands its global queue's get_next_in_queue over to the runner.
+  So that an entry is only new to the engine that found it first, give the coverage feedbacks of all engines the same
+  afl_feedback_cov_set_shared_virgin_bits. */
+struct afl_runner {
+
+  afl_runner_worker_t **workers;
+  size_t                workers_count;
+
+  /* Only grows while running, written by the worker that found the entry. The runner owns the entries. */
+  pthread_rwlock_t corpus_lock;
+  afl_entry_t **   corpus;
+  size_t           corpus_count;
+  size_t           cursor;  /* Where the next pass over the corpus takes its next chunk */
+
+  bool running;
+  bool stop;
+
+};
+
+typedef struct afl_runner_stats {
+
+  u64    executions, crashes, steals;
+  size_t corpus_count;
+  u64    start_time;  /* Of the engine that started first, 0 before */
+  size_t workers_count;
+
+} afl_runner_stats_t;
+
+afl_ret_t afl_runner_init(afl_runner_t *runner);
+void      afl_runner_deinit(afl_runner_t *runner);
+
+/* cpu is the core to pin the engine's thread to, -1 for none */
+afl_ret_t afl_runner_add_engine(afl_runner_t *runner, afl_engine_t *engine, s32 cpu);
+
+/* Shares the entries all engines have so far (at least one has to have some), then starts the threads */
+afl_ret_t afl_runner_start(afl_runner_t *runner);
+
+/* Makes the workers stop after their current fuzz_one, afl_runner_join waits for them */
+void      afl_runner_stop(afl_runner_t *runner);
+afl_ret_t afl_runner_join(afl_runner_t *runner);
+
+/* Sums of all engines, fine to call while running. The engines count without atomics, the sums may lag a bit. */
+void afl_runner_get_stats(afl_runner_t *runner, afl_runner_stats_t *stats);
+
+/* The get_next_in_queue of the engines' global queues: the entry from the corpus the worker fuzzes next */
+afl_entry_t *afl_runner_next_in_queue(afl_queue_t *queue, int engine_id);
+
+AFL_NEW_AND_DELETE_FOR(afl_runner)
+
+#endif
+
@@ -25,6 +25,9 @@
 
 #include "input.h"
 
+/* How many inputs afl_stage_perform mutates before it runs them, in one afl_engine_execute_batch */
+#define AFL_STAGE_BATCH_SIZE 32
+
 struct afl_stage_funcs {
 
   afl_ret_t (*perform)(afl_stage_t *, afl_input_t *input);
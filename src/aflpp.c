@@ -19,12 +19,33 @@
    This is the actual code for the library framework.
 
  */
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE 1
+#endif
+
 #include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
+#endif
+#include <sys/wait.h>
 
 #include "aflpp.h"
 #include "stdbool.h"
 #include "afl-returns.h"
 
+#ifdef __linux__
+  /* The snapshot executor only needs some of its helpers */
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wunused-function"
+  #include "snapshot-inl.h"
+  #pragma GCC diagnostic pop
+#endif
+
 afl_ret_t afl_executor_init(afl_executor_t *executor) {
 
   memset(executor, 0, sizeof(afl_executor_t));
@@ -39,6 +60,9 @@ afl_ret_t afl_executor_init(afl_executor_t *executor) {
   executor->funcs.run_target_cb = NULL;
   executor->funcs.observer_add = afl_executor_add_observer;
   executor->funcs.observers_reset = afl_observers_reset;
+  executor->funcs.submit_cb = NULL;
+  executor->funcs.collect_cb = NULL;
+  executor->funcs.run_batch = afl_executor_run_batch;
 
   return AFL_RET_SUCCESS;
 
@@ -93,6 +117,49 @@ void afl_observers_reset(afl_executor_t *executor) {
 
 }
 
+/* The default run_batch: one input after the other, the way afl_engine_execute runs them */
+afl_ret_t afl_executor_run_batch(afl_executor_t *executor, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                                 afl_batch_run_cb on_run, void *data) {
+
+  u32 i;
+  for (i = 0; i < count; i++) {
+
+    executor->funcs.observers_reset(executor);
+    executor->funcs.place_input_cb(executor, inputs[i]);
+
+    exit_codes[i] = executor->funcs.run_target_cb(executor);
+    if (on_run) { on_run(executor, i, exit_codes[i], data); }
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* If the binary at path contains sig, like the PERSIST_SIG compiled in by __AFL_LOOP, or the DEFER_SIG of __AFL_INIT */
+static bool fsrv_target_has_sig(char *path, char *sig) {
+
+  struct stat st;
+  int         fd = open(path, O_RDONLY);
+  if (fd < 0) { return false; }
+
+  if (fstat(fd, &st) || !st.st_size) {
+
+    close(fd);
+    return false;
+
+  }
+
+  u8 *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { return false; }
+
+  bool found = memmem(map, st.st_size, sig, strlen(sig)) != NULL;
+  munmap(map, st.st_size);
+  return found;
+
+}
+
 /* Function to simple initialize the forkserver */
 afl_forkserver_t *fsrv_init(char *target_path, char **target_args) {
 
@@ -110,10 +177,16 @@ afl_forkserver_t *fsrv_init(char *target_path, char **target_args) {
   fsrv->base.funcs.init_cb = fsrv_start;
   fsrv->base.funcs.place_input_cb = fsrv_place_input;
   fsrv->base.funcs.run_target_cb = fsrv_run_target;
+  fsrv->base.funcs.run_batch = fsrv_run_batch;
+  fsrv->base.funcs.destroy_cb = fsrv_destroy;
   fsrv->use_stdin = 1;
 
   fsrv->target_path = target_path;
   fsrv->target_args = target_args;
+  /* The target loops over many inputs per process, see fsrv_start */
+  fsrv->persistent_mode = fsrv_target_has_sig(target_path, PERSIST_SIG);
+  /* The target starts the forkserver itself, once its setup is done */
+  fsrv->deferred_mode = fsrv_target_has_sig(target_path, DEFER_SIG);
   fsrv->out_file = calloc(1, 50);
   snprintf(fsrv->out_file, 50, "out-%d", rand());
 
@@ -141,7 +214,8 @@ afl_forkserver_t *fsrv_init(char *target_path, char **target_args) {
 
     } else {
 
-      fsrv->out_fd = open((char *)fsrv->out_file, O_WRONLY | O_CREAT, 0600);
+      /* Inputs get appended, each child reads on where the last one stopped. So start empty, whatever was there. */
+      fsrv->out_fd = open((char *)fsrv->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
       if (!fsrv->out_fd) {
 
         afl_executor_deinit(&fsrv->base);
@@ -166,6 +240,19 @@ afl_forkserver_t *fsrv_init(char *target_path, char **target_args) {
 
   }
 
+  /* Targets built for it read their inputs from here, instead of a file (see fsrv_start) */
+  if (!afl_shmem_init(&fsrv->shmem_fuzz, MAX_FILE + sizeof(u32))) {
+
+    WARNF("Could not create the shared memory for inputs, falling back to files");
+
+  }
+
+  fsrv->epoll_fd = -1;
+  fsrv->timer_fd = -1;
+  fsrv->fsrv_ctl_fd = -1;
+  fsrv->fsrv_st_fd = -1;
+  fsrv->fsrv_pid = -1;
+
   /* exec related stuff */
   fsrv->child_pid = -1;
   fsrv->exec_tmout = 0;                                                                  /* Default exec time in ms */
@@ -174,6 +261,30 @@ afl_forkserver_t *fsrv_init(char *target_path, char **target_args) {
 
 }
 
+#ifdef __linux__
+/* The epoll set, with the status pipe and our timeout timer, lives as long as the forkserver */
+static afl_ret_t fsrv_init_epoll(afl_forkserver_t *fsrv) {
+
+  if (fsrv->epoll_fd >= 0) { close(fsrv->epoll_fd); }
+  if (fsrv->timer_fd >= 0) { close(fsrv->timer_fd); }
+  fsrv->timer_armed = 0;
+
+  fsrv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  fsrv->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fsrv->epoll_fd < 0 || fsrv->timer_fd < 0) { return AFL_RET_ERRNO; }
+
+  struct epoll_event ev = {.events = EPOLLIN};
+  ev.data.fd = fsrv->fsrv_st_fd;
+  if (epoll_ctl(fsrv->epoll_fd, EPOLL_CTL_ADD, fsrv->fsrv_st_fd, &ev)) { return AFL_RET_ERRNO; }
+  ev.data.fd = fsrv->timer_fd;
+  if (epoll_ctl(fsrv->epoll_fd, EPOLL_CTL_ADD, fsrv->timer_fd, &ev)) { return AFL_RET_ERRNO; }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+#endif
+
 /* This function starts up the forkserver for further process requests */
 afl_ret_t fsrv_start(afl_executor_t *fsrv_executor) {
 
@@ -211,6 +322,23 @@ afl_ret_t fsrv_start(afl_executor_t *fsrv_executor) {
     dup2(fsrv->dev_null_fd, 1);
     dup2(fsrv->dev_null_fd, 2);
 
+    if (fsrv->shmem_fuzz.map) { afl_shmem_to_env_var(&fsrv->shmem_fuzz, SHM_FUZZ_ENV_VAR); }
+
+    /* Our own map, instead of whatever the parent put in its env (that's shared by all threads) */
+    if (fsrv->covmap) {
+
+      afl_shmem_to_env_var(&fsrv->covmap->shared_map, SHM_ENV_VAR);
+      if (fsrv->covmap->dirty_map.map) { afl_shmem_to_env_var(&fsrv->covmap->dirty_map, DIRTY_SHM_ENV_VAR); }
+
+    }
+
+    /* The child stops itself with SIGSTOP after each input, and gets SIGCONT for the next one, instead of a new fork */
+    if (fsrv->persistent_mode) { setenv(PERSIST_ENV_VAR, "1", 1); }
+
+    /* The runtime won't start the forkserver at process entry, but in __afl_manual_init. Children get forked from
+    there, sharing whatever the target set up before copy-on-write. */
+    if (fsrv->deferred_mode) { setenv(DEFER_ENV_VAR, "1", 1); }
+
     /* Set up control and status pipes, close the unneeded original fds. */
 
     if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) { PFATAL("dup2() failed"); }
@@ -244,6 +372,16 @@ afl_ret_t fsrv_start(afl_executor_t *fsrv_executor) {
   fsrv->fsrv_ctl_fd = ctl_pipe[1];
   fsrv->fsrv_st_fd = st_pipe[0];
 
+#ifdef __linux__
+  if (fsrv_init_epoll(fsrv) != AFL_RET_SUCCESS) {
+
+    kill(fsrv->fsrv_pid, SIGKILL);
+    return AFL_RET_ERRNO;
+
+  }
+
+#endif
+
   /* Wait for the fork server to come up, but don't wait too long. */
 
   rlen = 0;
@@ -277,6 +415,70 @@ afl_ret_t fsrv_start(afl_executor_t *fsrv_executor) {
 
   if (rlen == 4) {
 
+    if (fsrv->persistent_mode) { OKF("Persistent mode binary detected."); }
+    if (fsrv->deferred_mode) { OKF("Deferred forkserver binary detected."); }
+
+    /* A target that would like its inputs in shared memory (or has a dictionary for us) waits for our answer before
+    anything else. Agreeing to shared memory, it maps it before the first run. Otherwise, it reads from the file. */
+    fsrv->use_shmem_fuzz = 0;
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED && (status & (FS_OPT_SHDMEM_FUZZ | FS_OPT_AUTODICT))) {
+
+      u32 reply = 0;
+      if ((status & FS_OPT_SHDMEM_FUZZ) && fsrv->shmem_fuzz.map) {
+
+        reply = FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ;
+
+      } else if (status & FS_OPT_SHDMEM_FUZZ) {
+
+        WARNF("No shared memory for inputs, the target reads them from the file");
+
+      }
+
+      if (write(fsrv->fsrv_ctl_fd, &reply, 4) != 4) {
+
+        WARNF("Fork server handshake failed");
+        kill(fsrv->fsrv_pid, SIGKILL);
+        return AFL_RET_BROKEN_TARGET;
+
+      }
+
+      fsrv->use_shmem_fuzz = !!reply;
+
+      /* Without the shared memory, the runtime takes our answer for its first run request, as it does for
+      forkservers that don't know about options. Wait that run (on the still empty input) out, so the statuses
+      we read from now on belong to our runs. */
+      if (!fsrv->use_shmem_fuzz) {
+
+        u32 exec_ms = 0;
+        if (read(fsrv->fsrv_st_fd, &fsrv->child_pid, 4) == 4 && fsrv->child_pid > 0) {
+
+          exec_ms = fsrv->exec_tmout ? afl_read_s32_timed(fsrv->fsrv_st_fd, &fsrv->child_status, fsrv->exec_tmout)
+                                     : read(fsrv->fsrv_st_fd, &fsrv->child_status, 4) == 4;
+
+        }
+
+        if (fsrv->exec_tmout && exec_ms > fsrv->exec_tmout) {
+
+          kill(fsrv->child_pid, SIGKILL);
+          fsrv->last_run_timed_out = 1;
+          exec_ms = read(fsrv->fsrv_st_fd, &fsrv->child_status, 4) == 4;
+
+        }
+
+        if (!exec_ms) {
+
+          WARNF("Fork server handshake failed");
+          kill(fsrv->fsrv_pid, SIGKILL);
+          return AFL_RET_BROKEN_TARGET;
+
+        }
+
+        if (!WIFSTOPPED(fsrv->child_status)) { fsrv->child_pid = 0; }
+
+      }
+
+    }
+
     OKF("All right - fork server is up.");
     return AFL_RET_SUCCESS;
 
@@ -299,6 +501,18 @@ u8 fsrv_place_input(afl_executor_t *fsrv_executor, afl_input_t *input) {
 
   afl_forkserver_t *fsrv = (afl_forkserver_t *)fsrv_executor;
 
+  if (fsrv->use_shmem_fuzz) {
+
+    /* No file involved, the target reads len and buf right from the map */
+    u32 len = MIN(input->len, (size_t)MAX_FILE);
+    memcpy(fsrv->shmem_fuzz.map + sizeof(u32), input->bytes, len);
+    *(u32 *)fsrv->shmem_fuzz.map = len;
+
+    fsrv->base.current_input = input;
+    return len;
+
+  }
+
   if (!fsrv->use_stdin) { fsrv->out_fd = open(fsrv->out_file, O_RDWR | O_CREAT | O_EXCL, 00600); }
 
   ssize_t write_len = write(fsrv->out_fd, input->bytes, input->len);
@@ -313,14 +527,18 @@ u8 fsrv_place_input(afl_executor_t *fsrv_executor, afl_input_t *input) {
 
 }
 
-/* Execute target application. Return status
-   information.*/
-afl_exit_t fsrv_run_target(afl_executor_t *fsrv_executor) {
+/* Kills a child that ran for too long. The forkserver reports its status next. */
+static void fsrv_kill_child(afl_forkserver_t *fsrv) {
 
-  afl_forkserver_t *fsrv = (afl_forkserver_t *)fsrv_executor;
+  kill(fsrv->child_pid, SIGKILL);
+  fsrv->last_run_timed_out = 1;
+
+}
+
+/* Tells the forkserver to run the placed input, without waiting for the result */
+static void fsrv_request_run(afl_forkserver_t *fsrv) {
 
   s32 res;
-  u32 exec_ms;
   u32 write_value = fsrv->last_run_timed_out;
 
   /* After this memset, fsrv->trace_bits[] are effectively volatile, so we
@@ -350,25 +568,29 @@ afl_exit_t fsrv_run_target(afl_executor_t *fsrv_executor) {
 
   if (fsrv->child_pid <= 0) { FATAL("Fork server is misbehaving (OOM?)"); }
 
-  exec_ms = afl_read_s32_timed(fsrv->fsrv_st_fd, &fsrv->child_status, fsrv->exec_tmout);
+  fsrv->exec_start_us = afl_get_cur_time_us();
 
-  if (exec_ms > fsrv->exec_tmout) {
+}
+
+/* Evaluates a run, once the forkserver reported the child status */
+static afl_exit_t fsrv_collect(afl_forkserver_t *fsrv) {
+
+  fsrv->last_run_time = (afl_get_cur_time_us() - fsrv->exec_start_us) / 1000;
 
-    /* If there was no response from forkserver after timeout seconds,
-    we kill the child. The forkserver should inform us afterwards */
+#ifdef __linux__
+  if (fsrv->timer_armed) {
 
-    kill(fsrv->child_pid, SIGKILL);
-    fsrv->last_run_timed_out = 1;
-    if (read(fsrv->fsrv_st_fd, &fsrv->child_status, 4) < 4) { exec_ms = 0; }
+    struct itimerspec disarm = {0};
+    timerfd_settime(fsrv->timer_fd, 0, &disarm, NULL);
+    fsrv->timer_armed = 0;
 
   }
 
-  if (!exec_ms) {}
+#endif
 
   if (!WIFSTOPPED(fsrv->child_status)) { fsrv->child_pid = 0; }
 
   fsrv->total_execs++;
-  if (!fsrv->use_stdin) { unlink(fsrv->out_file); }
 
   /* Any subsequent operations on fsrv->trace_bits must not be moved by the
      compiler below this point. Past this location, fsrv->trace_bits[]
@@ -392,50 +614,1141 @@ afl_exit_t fsrv_run_target(afl_executor_t *fsrv_executor) {
 
 }
 
-/* An in-mem executor we have */
+#ifdef __linux__
+/* Handles what happened on the epoll set of this forkserver, waiting up to timeout_ms (-1 for ever) for something to
+ * happen. Kills the child once its timer expires. Returns true once the child status is in. */
+bool fsrv_poll(afl_forkserver_t *fsrv, s32 timeout_ms) {
 
-void in_memory_executor_init(in_memory_executor_t *in_memory_executor, harness_function_type harness) {
+  struct epoll_event events[2];
+  bool               done = false, timed_out = false;
 
-  afl_executor_init(&in_memory_executor->base);
-  in_memory_executor->harness = harness;
-  in_memory_executor->argv = NULL;
-  in_memory_executor->argc = 0;
+  int n = epoll_wait(fsrv->epoll_fd, events, 2, timeout_ms);
+  if (n < 0 && errno != EINTR) { PFATAL("epoll_wait() failed"); }
 
-  in_memory_executor->base.funcs.run_target_cb = in_memory_run_target;
-  in_memory_executor->base.funcs.place_input_cb = in_mem_executor_place_input;
+  int i;
+  for (i = 0; i < n; i++) {
+
+    if (events[i].data.fd == fsrv->timer_fd) {
+
+      u64 expirations;
+      timed_out = read(fsrv->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+
+    } else {
+
+      s32 res = read(fsrv->fsrv_st_fd, &fsrv->child_status, 4);
+      if (res != 4) { RPFATAL(res, "Unable to communicate with fork server"); }
+      done = true;
+
+    }
+
+  }
+
+  /* If the status came in at the same time, the child made it */
+  if (timed_out && !done) {
+
+    fsrv->timer_armed = 0;
+    fsrv_kill_child(fsrv);
+
+  }
+
+  return done;
 
 }
 
-void in_memory_executor_deinit(in_memory_executor_t *in_memory_executor) {
+/* Starts the target on the placed input and returns right away. The timer of this forkserver kills the child after
+ * exec_tmout ms. Collect the result with fsrv_poll, or fsrv_group_wait, then fsrv_run_target_collect. */
+void fsrv_run_target_async(afl_forkserver_t *fsrv) {
 
-  afl_executor_deinit(&in_memory_executor->base);
-  in_memory_executor->harness = NULL;
-  in_memory_executor->argv = NULL;
-  in_memory_executor->argc = 0;
+  fsrv_request_run(fsrv);
 
-  in_memory_executor->base.funcs.run_target_cb = in_memory_run_target;
-  in_memory_executor->base.funcs.place_input_cb = in_mem_executor_place_input;
+  if (fsrv->exec_tmout) {
+
+    struct itimerspec timeout = {0};
+    timeout.it_value.tv_sec = fsrv->exec_tmout / 1000;
+    timeout.it_value.tv_nsec = (fsrv->exec_tmout % 1000) * 1000000;
+    if (timerfd_settime(fsrv->timer_fd, 0, &timeout, NULL)) { PFATAL("timerfd_settime() failed"); }
+    fsrv->timer_armed = 1;
+
+  }
 
 }
 
-u8 in_mem_executor_place_input(afl_executor_t *executor, afl_input_t *input) {
+/* The result of the run started by fsrv_run_target_async, once fsrv_poll returned true */
+afl_exit_t fsrv_run_target_collect(afl_forkserver_t *fsrv) {
 
-  executor->current_input = input;
-  return 0;
+  afl_exit_t run_result = fsrv_collect(fsrv);
+  if (!fsrv->use_stdin && !fsrv->use_shmem_fuzz) { unlink(fsrv->out_file); }
+  return run_result;
 
 }
 
-afl_exit_t in_memory_run_target(afl_executor_t *executor) {
+/* A new epoll set to wait on several forkservers at once. Returns -1 on error. */
+s32 fsrv_group_new(void) {
 
-  in_memory_executor_t *in_memory_executor = (in_memory_executor_t *)executor;
+  return epoll_create1(EPOLL_CLOEXEC);
 
-  afl_input_t *input = in_memory_executor->base.current_input;
+}
 
-  u8 *data = (input->funcs.serialize) ? (input->funcs.serialize(input)) : input->bytes;
+/* Adds a started forkserver to the group. (Re)starting it later needs another fsrv_group_add. */
+afl_ret_t fsrv_group_add(s32 group_fd, afl_forkserver_t *fsrv) {
+
+  struct epoll_event ev = {.events = EPOLLIN};
+  ev.data.ptr = fsrv;
+  if (epoll_ctl(group_fd, EPOLL_CTL_ADD, fsrv->epoll_fd, &ev)) { return AFL_RET_ERRNO; }
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Waits for any forkserver in the group to finish its run (killing those that time out on the way).
+ * Returns it, ready for fsrv_run_target_collect, or NULL if nothing happened for timeout_ms. */
+afl_forkserver_t *fsrv_group_wait(s32 group_fd, s32 timeout_ms) {
+
+  struct epoll_event ev;
+
+  while (1) {
+
+    int n = epoll_wait(group_fd, &ev, 1, timeout_ms);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) { return NULL; }
+
+    afl_forkserver_t *fsrv = (afl_forkserver_t *)ev.data.ptr;
+    if (fsrv_poll(fsrv, 0)) { return fsrv; }
+
+  }
+
+}
+
+#endif
+
+/* Runs the placed input, and leaves the out_file to the caller */
+static afl_exit_t fsrv_run(afl_forkserver_t *fsrv) {
+
+  fsrv_request_run(fsrv);
+
+#ifdef __linux__
+  /* The epoll timeout does it, no need to arm the timer for a single run */
+  while (!fsrv_poll(fsrv, fsrv->exec_tmout ? (s32)fsrv->exec_tmout : -1)) {
+
+    if (fsrv->exec_tmout && afl_get_cur_time_us() - fsrv->exec_start_us >= (u64)fsrv->exec_tmout * 1000) {
+
+      /* If there was no response from forkserver after timeout seconds,
+      we kill the child. The forkserver should inform us afterwards */
+      fsrv_kill_child(fsrv);
+      while (!fsrv_poll(fsrv, -1)) {}
+      break;
+
+    }
+
+  }
+
+#else
+  u32 exec_ms = afl_read_s32_timed(fsrv->fsrv_st_fd, &fsrv->child_status, fsrv->exec_tmout);
+
+  if (exec_ms > fsrv->exec_tmout) {
+
+    fsrv_kill_child(fsrv);
+    if (read(fsrv->fsrv_st_fd, &fsrv->child_status, 4) < 4) { RPFATAL(-1, "Unable to communicate with fork server"); }
+
+  }
+
+#endif
+
+  return fsrv_collect(fsrv);
+
+}
 
-  afl_exit_t run_result = in_memory_executor->harness(&in_memory_executor->base, data, input->len);
+/* Execute target application. Return status
+   information.*/
+afl_exit_t fsrv_run_target(afl_executor_t *fsrv_executor) {
+
+  afl_forkserver_t *fsrv = (afl_forkserver_t *)fsrv_executor;
 
+  afl_exit_t run_result = fsrv_run(fsrv);
+  if (!fsrv->use_stdin && !fsrv->use_shmem_fuzz) { unlink(fsrv->out_file); }
   return run_result;
 
 }
 
+/* The run_batch of the forkserver. With inputs from a file, the batch rewrites the same file in place, instead of
+  creating and unlinking one for each run. */
+afl_ret_t fsrv_run_batch(afl_executor_t *fsrv_executor, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                         afl_batch_run_cb on_run, void *data) {
+
+  afl_forkserver_t *fsrv = (afl_forkserver_t *)fsrv_executor;
+
+  /* Nothing to save with stdin or shared memory, or if someone put their own run in (like forking-fuzzer.c) */
+  if (fsrv->use_stdin || fsrv->use_shmem_fuzz || fsrv->base.funcs.place_input_cb != fsrv_place_input ||
+      fsrv->base.funcs.run_target_cb != fsrv_run_target) {
+
+    return afl_executor_run_batch(fsrv_executor, inputs, count, exit_codes, on_run, data);
+
+  }
+
+  s32 fd = open(fsrv->out_file, O_RDWR | O_CREAT | O_TRUNC, 00600);
+  if (fd < 0) { return AFL_RET_FILE_OPEN_ERROR; }
+
+  afl_ret_t ret = AFL_RET_SUCCESS;
+  u32       i;
+  for (i = 0; i < count; i++) {
+
+    afl_input_t *input = inputs[i];
+
+    fsrv->base.funcs.observers_reset(&fsrv->base);
+
+    ssize_t write_len = pwrite(fd, input->bytes, input->len, 0);
+    if (write_len < 0 || (size_t)write_len != input->len || ftruncate(fd, input->len)) {
+
+      ret = AFL_RET_SHORT_WRITE;
+      break;
+
+    }
+
+    fsrv->base.current_input = input;
+
+    exit_codes[i] = fsrv_run(fsrv);
+    if (on_run) { on_run(fsrv_executor, i, exit_codes[i], data); }
+
+  }
+
+  close(fd);
+  unlink(fsrv->out_file);
+
+  return ret;
+
+}
+
+/* Kills the forkserver and closes what fsrv_start opened, fsrv_start can start it again */
+static void fsrv_stop(afl_forkserver_t *fsrv) {
+
+  /* A persistent child may still wait for its next input */
+  if (fsrv->child_pid > 0) { kill(fsrv->child_pid, SIGKILL); }
+  if (fsrv->fsrv_pid > 0) {
+
+    kill(fsrv->fsrv_pid, SIGKILL);
+    waitpid(fsrv->fsrv_pid, NULL, 0);
+
+  }
+
+  fsrv->child_pid = -1;
+  fsrv->fsrv_pid = -1;
+
+  if (fsrv->fsrv_ctl_fd >= 0) { close(fsrv->fsrv_ctl_fd); }
+  if (fsrv->fsrv_st_fd >= 0) { close(fsrv->fsrv_st_fd); }
+  if (fsrv->epoll_fd >= 0) { close(fsrv->epoll_fd); }
+  if (fsrv->timer_fd >= 0) { close(fsrv->timer_fd); }
+  fsrv->fsrv_ctl_fd = -1;
+  fsrv->fsrv_st_fd = -1;
+  fsrv->epoll_fd = -1;
+  fsrv->timer_fd = -1;
+  fsrv->timer_armed = 0;
+  fsrv->use_shmem_fuzz = 0;
+
+}
+
+/* Stops the forkserver and frees what fsrv_init allocated, except the struct itself */
+u8 fsrv_destroy(afl_executor_t *fsrv_executor) {
+
+  afl_forkserver_t *fsrv = (afl_forkserver_t *)fsrv_executor;
+
+  fsrv_stop(fsrv);
+  if (fsrv->shmem_fuzz.map) { afl_shmem_deinit(&fsrv->shmem_fuzz); }
+
+  close(fsrv->dev_null_fd);
+  if (fsrv->out_fd > 0) { close(fsrv->out_fd); }
+  free(fsrv->out_file);
+  fsrv->out_file = NULL;
+
+  afl_executor_deinit(&fsrv->base);
+  return 0;
+
+}
+
+#ifdef __linux__
+/* A pool of fsrvs_count forkservers for target_path. Set exec_tmout and add the observers before starting it. */
+afl_fsrv_pool_t *fsrv_pool_init(char *target_path, char **target_args, u32 fsrvs_count) {
+
+  afl_fsrv_pool_t *pool = calloc(1, sizeof(afl_fsrv_pool_t));
+  if (!pool || !fsrvs_count) {
+
+    free(pool);
+    return NULL;
+
+  }
+
+  if (afl_executor_init(&pool->base)) {
+
+    free(pool);
+    return NULL;
+
+  }
+
+  pool->base.funcs.init_cb = fsrv_pool_start;
+  pool->base.funcs.destroy_cb = fsrv_pool_destroy;
+  pool->base.funcs.place_input_cb = fsrv_pool_place_input;
+  pool->base.funcs.run_target_cb = fsrv_pool_run_target;
+  pool->base.funcs.submit_cb = fsrv_pool_submit;
+  pool->base.funcs.collect_cb = fsrv_pool_collect;
+  pool->base.funcs.run_batch = fsrv_pool_run_batch;
+  pool->group_fd = -1;
+
+  pool->fsrvs = calloc(fsrvs_count, sizeof(afl_forkserver_t *));
+  pool->covmaps = calloc(fsrvs_count, sizeof(afl_observer_covmap_t *));
+  pool->inputs = calloc(fsrvs_count, sizeof(afl_input_t *));
+  pool->batch_idxs = calloc(fsrvs_count, sizeof(u32));
+  if (!pool->fsrvs || !pool->covmaps || !pool->inputs || !pool->batch_idxs) {
+
+    fsrv_pool_destroy(&pool->base);
+    free(pool);
+    return NULL;
+
+  }
+
+  size_t args_count = 0;
+  while (target_args[args_count]) {
+
+    args_count++;
+
+  }
+
+  u32 i;
+  for (i = 0; i < fsrvs_count; i++) {
+
+    /* fsrv_init replaces @@ in the args with its own out_file */
+    char **args = calloc(args_count + 1, sizeof(char *));
+    if (args) { memcpy(args, target_args, args_count * sizeof(char *)); }
+
+    pool->fsrvs[i] = args ? fsrv_init(target_path, args) : NULL;
+    if (!pool->fsrvs[i]) {
+
+      free(args);
+      fsrv_pool_destroy(&pool->base);
+      free(pool);
+      return NULL;
+
+    }
+
+    pool->fsrvs_count++;
+
+  }
+
+  return pool;
+
+}
+
+static afl_ret_t fsrv_pool_start_one(afl_fsrv_pool_t *pool, u32 i) {
+
+  afl_forkserver_t *fsrv = pool->fsrvs[i];
+
+  if (pool->covmap && !pool->covmaps[i]) {
+
+    pool->covmaps[i] = afl_observer_covmap_new(pool->covmap->shared_map.map_size);
+    if (!pool->covmaps[i]) { return AFL_RET_ALLOC; }
+    pool->covmaps[i]->classify_counts = pool->covmap->classify_counts;
+    if (pool->covmap->dirty_map.map) {
+
+      AFL_TRY(afl_observer_covmap_track_dirty(pool->covmaps[i]), { return err; });
+
+    }
+
+    fsrv->covmap = pool->covmaps[i];
+    fsrv->trace_bits = pool->covmaps[i]->shared_map.map;
+    fsrv->map_size = pool->covmaps[i]->shared_map.map_size;
+
+  }
+
+  fsrv->exec_tmout = pool->exec_tmout;
+  AFL_TRY(fsrv_start(&fsrv->base), { return err; });
+  AFL_TRY(fsrv_group_add(pool->group_fd, fsrv), { return err; });
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Starts all forkservers, each with its own copy of the covmap observer we have. All or none: if one fails, the ones
+ * started already get stopped again. */
+afl_ret_t fsrv_pool_start(afl_executor_t *pool_executor) {
+
+  afl_fsrv_pool_t *pool = (afl_fsrv_pool_t *)pool_executor;
+
+  u32 i;
+  for (i = 0; i < pool->base.observors_count; i++) {
+
+    if (pool->base.observors[i]->tag == AFL_OBSERVER_TAG_COVMAP) {
+
+      pool->covmap = (afl_observer_covmap_t *)pool->base.observors[i];
+      break;
+
+    }
+
+  }
+
+  if (pool->group_fd < 0) { pool->group_fd = fsrv_group_new(); }
+  if (pool->group_fd < 0) { return AFL_RET_ERRNO; }
+
+  for (i = 0; i < pool->fsrvs_count; i++) {
+
+    AFL_TRY(fsrv_pool_start_one(pool, i), {
+
+      u32 j;
+      for (j = 0; j <= i; j++) {
+
+        fsrv_stop(pool->fsrvs[j]);
+
+      }
+
+      return err;
+
+    });
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Stops all forkservers. Inputs still running are not ours to free. */
+u8 fsrv_pool_destroy(afl_executor_t *pool_executor) {
+
+  afl_fsrv_pool_t *pool = (afl_fsrv_pool_t *)pool_executor;
+
+  u32 i;
+  for (i = 0; i < pool->fsrvs_count; i++) {
+
+    char **args = pool->fsrvs[i]->target_args;
+    fsrv_destroy(&pool->fsrvs[i]->base);
+    free(pool->fsrvs[i]);
+    free(args);
+    if (pool->covmaps[i]) { afl_observer_covmap_delete(pool->covmaps[i]); }
+
+  }
+
+  if (pool->group_fd >= 0) { close(pool->group_fd); }
+  pool->group_fd = -1;
+
+  free(pool->fsrvs);
+  free(pool->covmaps);
+  free(pool->inputs);
+  free(pool->batch_idxs);
+  pool->fsrvs = NULL;
+  pool->covmaps = NULL;
+  pool->inputs = NULL;
+  pool->batch_idxs = NULL;
+  pool->fsrvs_count = 0;
+  pool->running = 0;
+
+  afl_executor_deinit(&pool->base);
+  return 0;
+
+}
+
+/* The forkserver the input runs on, -1 if all are busy */
+static s32 fsrv_pool_submit_slot(afl_fsrv_pool_t *pool, afl_input_t *input) {
+
+  u32 i;
+  for (i = 0; i < pool->fsrvs_count; i++) {
+
+    if (pool->inputs[i]) { continue; }
+
+    afl_forkserver_t *fsrv = pool->fsrvs[i];
+    fsrv->exec_tmout = pool->exec_tmout;
+    fsrv_place_input(&fsrv->base, input);
+    fsrv_run_target_async(fsrv);
+
+    pool->inputs[i] = input;
+    pool->running++;
+    return i;
+
+  }
+
+  return -1;
+
+}
+
+/* Starts a run of input on an idle forkserver. The input has to stay around until collected. */
+bool fsrv_pool_submit(afl_executor_t *pool_executor, afl_input_t *input) {
+
+  return fsrv_pool_submit_slot((afl_fsrv_pool_t *)pool_executor, input) >= 0;
+
+}
+
+/* Moves the coverage of a finished run to the map the feedbacks look at, and leaves src clean for the next run */
+static void fsrv_pool_copy_map(afl_observer_covmap_t *dst, afl_observer_covmap_t *src) {
+
+  if (!src->dirty_map.map) {
+
+    memcpy(dst->shared_map.map, src->shared_map.map, dst->shared_map.map_size);
+    src->base.funcs.reset(&src->base);
+    return;
+
+  }
+
+  dst->base.funcs.reset(&dst->base);
+
+  for (size_t block = afl_observer_covmap_next_dirty(src, 0); block != SIZE_MAX;
+       block = afl_observer_covmap_next_dirty(src, block + 1)) {
+
+    size_t offset = block << DIRTY_BLOCK_SHIFT;
+    memcpy(dst->shared_map.map + offset, src->shared_map.map + offset, afl_observer_covmap_block_len(src, block));
+    dst->dirty_map.map[block] = 1;
+
+  }
+
+  /* Every block src may have written to is marked in dst now */
+  dst->dirty_map.map[DIRTY_MAP_COMPLETE(dst->shared_map.map_size)] = 1;
+
+  src->base.funcs.reset(&src->base);
+
+}
+
+/* The forkserver of the next finished run, -1 if none */
+static s32 fsrv_pool_collect_slot(afl_fsrv_pool_t *pool, s32 timeout_ms, afl_exit_t *exit_code) {
+
+  if (!pool->running) { return -1; }
+
+  afl_forkserver_t *fsrv = fsrv_group_wait(pool->group_fd, timeout_ms);
+  if (!fsrv) { return -1; }
+
+  u32 i = 0;
+  while (pool->fsrvs[i] != fsrv) {
+
+    i++;
+
+  }
+
+  afl_exit_t run_result = fsrv_run_target_collect(fsrv);
+  if (exit_code) { *exit_code = run_result; }
+
+  if (pool->covmap) { fsrv_pool_copy_map(pool->covmap, pool->covmaps[i]); }
+  pool->last_run_time = fsrv->last_run_time;
+  pool->total_execs++;
+
+  pool->base.current_input = pool->inputs[i];
+  pool->inputs[i] = NULL;
+  pool->running--;
+
+  return i;
+
+}
+
+/* Waits up to timeout_ms (-1 for ever) for a submitted input to finish. Returns it, with its coverage in the covmap
+ * observer and its exit code in exit_code. Returns NULL if nothing finished in time, or nothing runs. */
+afl_input_t *fsrv_pool_collect(afl_executor_t *pool_executor, s32 timeout_ms, afl_exit_t *exit_code) {
+
+  if (fsrv_pool_collect_slot((afl_fsrv_pool_t *)pool_executor, timeout_ms, exit_code) < 0) { return NULL; }
+  return pool_executor->current_input;
+
+}
+
+u8 fsrv_pool_place_input(afl_executor_t *pool_executor, afl_input_t *input) {
+
+  pool_executor->current_input = input;
+  return 0;
+
+}
+
+/* One run at a time, for callers that don't submit (like afl_engine_execute) */
+afl_exit_t fsrv_pool_run_target(afl_executor_t *pool_executor) {
+
+  afl_fsrv_pool_t *pool = (afl_fsrv_pool_t *)pool_executor;
+  afl_exit_t       run_result = AFL_EXIT_OK;
+
+  /* We would hand back the result of some other input */
+  if (pool->running) { FATAL("Forkserver pool still has %u runs to collect", pool->running); }
+
+  fsrv_pool_submit(pool_executor, pool_executor->current_input);
+  fsrv_pool_collect(pool_executor, -1, &run_result);
+  return run_result;
+
+}
+
+afl_ret_t fsrv_pool_run_batch(afl_executor_t *pool_executor, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                              afl_batch_run_cb on_run, void *data) {
+
+  afl_fsrv_pool_t *pool = (afl_fsrv_pool_t *)pool_executor;
+
+  if (pool->running) { FATAL("Forkserver pool still has %u runs to collect", pool->running); }
+
+  u32 submitted = 0, collected = 0;
+  while (collected < count) {
+
+    s32 slot;
+    while (submitted < count && (slot = fsrv_pool_submit_slot(pool, inputs[submitted])) >= 0) {
+
+      pool->batch_idxs[slot] = submitted++;
+
+    }
+
+    afl_exit_t exit_code = AFL_EXIT_OK;
+    slot = fsrv_pool_collect_slot(pool, -1, &exit_code);
+    if (slot < 0) { return AFL_RET_EXEC_ERROR; }
+
+    u32 idx = pool->batch_idxs[slot];
+    exit_codes[idx] = exit_code;
+    collected++;
+
+    if (on_run) { on_run(pool_executor, idx, exit_code, data); }
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+#endif
+
+/* An in-mem executor we have */
+
+void in_memory_executor_init(in_memory_executor_t *in_memory_executor, harness_function_type harness) {
+
+  afl_executor_init(&in_memory_executor->base);
+  in_memory_executor->harness = harness;
+  in_memory_executor->argv = NULL;
+  in_memory_executor->argc = 0;
+  in_memory_executor->mem_snapshot = NULL;
+  in_memory_executor->catch_crashes = 0;
+
+  in_memory_executor->base.funcs.run_target_cb = in_memory_run_target;
+  in_memory_executor->base.funcs.place_input_cb = in_mem_executor_place_input;
+  in_memory_executor->base.funcs.run_batch = in_memory_run_batch;
+
+}
+
+void in_memory_executor_deinit(in_memory_executor_t *in_memory_executor) {
+
+  afl_executor_deinit(&in_memory_executor->base);
+  in_memory_executor->harness = NULL;
+  in_memory_executor->argv = NULL;
+  in_memory_executor->argc = 0;
+
+  in_memory_executor->base.funcs.run_target_cb = in_memory_run_target;
+  in_memory_executor->base.funcs.place_input_cb = in_mem_executor_place_input;
+
+}
+
+u8 in_mem_executor_place_input(afl_executor_t *executor, afl_input_t *input) {
+
+  executor->current_input = input;
+  return 0;
+
+}
+
+/* Crash recovery for the in-memory executor */
+
+#define IN_MEM_ALT_STACK_SIZE (64 * 1024)
+
+static const int in_mem_crash_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+static struct sigaction in_mem_old_actions[NSIG];                       /* Whoever handled the signals before us */
+static pthread_once_t   in_mem_handlers_once = PTHREAD_ONCE_INIT;
+
+/* Where to jump to from a crash, NULL outside of the harness. Each thread runs its own harness. */
+static __thread sigjmp_buf *in_mem_crash_jmp;
+static __thread bool        in_mem_alt_stack_set;
+
+static void in_mem_crash_handler(int sig, siginfo_t *info, void *ucontext) {
+
+  sigjmp_buf *crash_jmp = in_mem_crash_jmp;
+
+  if (crash_jmp) {
+
+    in_mem_crash_jmp = NULL;
+    siglongjmp(*crash_jmp, sig);
+
+  }
+
+  /* Not our crash */
+  struct sigaction *old_action = &in_mem_old_actions[sig];
+
+  if (old_action->sa_flags & SA_SIGINFO) {
+
+    old_action->sa_sigaction(sig, info, ucontext);
+
+  } else if (old_action->sa_handler == SIG_DFL) {
+
+    /* Dies once we return, the signal is blocked until then */
+    sigaction(sig, old_action, NULL);
+    raise(sig);
+
+  } else if (old_action->sa_handler != SIG_IGN) {
+
+    old_action->sa_handler(sig);
+
+  }
+
+}
+
+static void in_mem_install_crash_handlers(void) {
+
+  struct sigaction sa = {0};
+  size_t           i;
+
+  sa.sa_sigaction = in_mem_crash_handler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+
+  for (i = 0; i < sizeof(in_mem_crash_signals) / sizeof(in_mem_crash_signals[0]); i++) {
+
+    if (sigaction(in_mem_crash_signals[i], &sa, &in_mem_old_actions[in_mem_crash_signals[i]]) < 0) {
+
+      PFATAL("Could not set the crash handler for signal %d", in_mem_crash_signals[i]);
+
+    }
+
+  }
+
+}
+
+/* A stack overflow in the harness leaves no stack to handle it on. The alt stack is per thread, and stays until the
+  thread exits. */
+static void in_mem_setup_alt_stack(void) {
+
+  stack_t old_stack = {0};
+
+  if (sigaltstack(NULL, &old_stack) < 0) { PFATAL("Could not get the signal stack"); }
+
+  /* Someone (like ASan) set one up already */
+  if (!(old_stack.ss_flags & SS_DISABLE)) {
+
+    in_mem_alt_stack_set = true;
+    return;
+
+  }
+
+  stack_t alt_stack = {0};
+
+  alt_stack.ss_sp = mmap(NULL, IN_MEM_ALT_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (alt_stack.ss_sp == MAP_FAILED) { PFATAL("Could not map the signal stack"); }
+  alt_stack.ss_size = IN_MEM_ALT_STACK_SIZE;
+
+  if (sigaltstack(&alt_stack, NULL) < 0) { PFATAL("Could not set the signal stack"); }
+  in_mem_alt_stack_set = true;
+
+}
+
+static afl_exit_t in_mem_exit_for_signal(int sig) {
+
+  switch (sig) {
+
+    case SIGSEGV:
+      return AFL_EXIT_SEGV;
+    case SIGBUS:
+      return AFL_EXIT_BUS;
+    case SIGFPE:
+      return AFL_EXIT_FPE;
+    case SIGILL:
+      return AFL_EXIT_ILL;
+    case SIGABRT:
+      return AFL_EXIT_ABRT;
+    default:
+      return AFL_EXIT_CRASH;
+
+  }
+
+}
+
+/* Calls the harness, jumping back here if it crashes. Nothing in here may change between sigsetjmp and a crash. */
+static afl_exit_t in_mem_run_harness_catching(in_memory_executor_t *in_memory_executor, u8 *data, size_t len) {
+
+  sigjmp_buf crash_jmp;
+
+  if (!in_mem_alt_stack_set) { in_mem_setup_alt_stack(); }
+  pthread_once(&in_mem_handlers_once, in_mem_install_crash_handlers);
+
+  /* Saves the signal mask, the handler runs with the crashing signal blocked */
+  int sig = sigsetjmp(crash_jmp, 1);
+  if (sig) { return in_mem_exit_for_signal(sig); }
+
+  in_mem_crash_jmp = &crash_jmp;
+  afl_exit_t run_result = in_memory_executor->harness(&in_memory_executor->base, data, len);
+  in_mem_crash_jmp = NULL;
+
+  return run_result;
+
+}
+
+afl_exit_t in_memory_run_target(afl_executor_t *executor) {
+
+  in_memory_executor_t *in_memory_executor = (in_memory_executor_t *)executor;
+
+  afl_input_t *input = in_memory_executor->base.current_input;
+
+  u8 *data = (input->funcs.serialize) ? (input->funcs.serialize(input)) : input->bytes;
+
+  afl_mem_snapshot_t *mem_snapshot = in_memory_executor->mem_snapshot;
+
+  /* The harness is initialized by now, this is the state each run starts from */
+  if (mem_snapshot && !mem_snapshot->taken && afl_mem_snapshot_take(mem_snapshot) != AFL_RET_SUCCESS) {
+
+    FATAL("Could not take the memory snapshot");
+
+  }
+
+  afl_exit_t run_result;
+
+  if (in_memory_executor->catch_crashes) {
+
+    run_result = in_mem_run_harness_catching(in_memory_executor, data, input->len);
+
+  } else {
+
+    run_result = in_memory_executor->harness(&in_memory_executor->base, data, input->len);
+
+  }
+
+  /* After a crash as well */
+  if (mem_snapshot) { afl_mem_snapshot_restore(mem_snapshot); }
+
+  return run_result;
+
+}
+
+/* The run_batch of the in-memory executor. With catch_crashes, the crash handling gets set up once for the whole
+  batch: a crash jumps back to the one sigsetjmp of the batch (saving the signal mask costs a syscall), which goes on
+  with the next input from there. */
+afl_ret_t in_memory_run_batch(afl_executor_t *executor, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                              afl_batch_run_cb on_run, void *data) {
+
+  in_memory_executor_t *in_memory_executor = (in_memory_executor_t *)executor;
+  afl_mem_snapshot_t *  mem_snapshot = in_memory_executor->mem_snapshot;
+  sigjmp_buf            crash_jmp;
+  volatile u32          i = 0;
+
+  /* Someone put their own run in, like the snapshot executor */
+  if (executor->funcs.place_input_cb != in_mem_executor_place_input ||
+      executor->funcs.run_target_cb != in_memory_run_target) {
+
+    return afl_executor_run_batch(executor, inputs, count, exit_codes, on_run, data);
+
+  }
+
+  if (in_memory_executor->catch_crashes) {
+
+    if (!in_mem_alt_stack_set) { in_mem_setup_alt_stack(); }
+    pthread_once(&in_mem_handlers_once, in_mem_install_crash_handlers);
+
+    /* Nothing but i may change between here and a crash */
+    int sig = sigsetjmp(crash_jmp, 1);
+    if (sig) {
+
+      exit_codes[i] = in_mem_exit_for_signal(sig);
+      if (mem_snapshot) { afl_mem_snapshot_restore(mem_snapshot); }
+      if (on_run) { on_run(executor, i, exit_codes[i], data); }
+      i++;
+
+    }
+
+  }
+
+  for (; i < count; i++) {
+
+    afl_input_t *input = inputs[i];
+    u8 *         buf = (input->funcs.serialize) ? (input->funcs.serialize(input)) : input->bytes;
+
+    executor->funcs.observers_reset(executor);
+    executor->current_input = input;
+
+    /* The harness is initialized by now, this is the state each run starts from */
+    if (mem_snapshot && !mem_snapshot->taken && afl_mem_snapshot_take(mem_snapshot) != AFL_RET_SUCCESS) {
+
+      FATAL("Could not take the memory snapshot");
+
+    }
+
+    if (in_memory_executor->catch_crashes) {
+
+      in_mem_crash_jmp = &crash_jmp;
+      exit_codes[i] = in_memory_executor->harness(executor, buf, input->len);
+      in_mem_crash_jmp = NULL;
+
+    } else {
+
+      exit_codes[i] = in_memory_executor->harness(executor, buf, input->len);
+
+    }
+
+    if (mem_snapshot) { afl_mem_snapshot_restore(mem_snapshot); }
+    if (on_run) { on_run(executor, i, exit_codes[i], data); }
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* The snapshot executor */
+
+afl_ret_t snapshot_executor_init(snapshot_executor_t *snapshot_executor, harness_function_type harness) {
+
+  in_memory_executor_init(&snapshot_executor->base, harness);
+
+  snapshot_executor->base.base.funcs.init_cb = snapshot_executor_start;
+  snapshot_executor->base.base.funcs.place_input_cb = snapshot_executor_place_input;
+  snapshot_executor->base.base.funcs.run_target_cb = snapshot_executor_run_target;
+
+  if (!afl_shmem_init(&snapshot_executor->input_shm, MAX_FILE + sizeof(u32))) {
+
+    in_memory_executor_deinit(&snapshot_executor->base);
+    return AFL_RET_ERROR_INITIALIZE;
+
+  }
+
+  afl_process_init(&snapshot_executor->child, 0);
+  snapshot_executor->ctl_fd = -1;
+  snapshot_executor->st_fd = -1;
+  snapshot_executor->exec_tmout = 0;
+  snapshot_executor->use_snapshot = 0;
+  snapshot_executor->ranges = NULL;
+  snapshot_executor->ranges_count = 0;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Collects the child once it died, the next run spawns a new one */
+static afl_exit_t snapshot_executor_reap(snapshot_executor_t *snapshot_executor) {
+
+  afl_exit_t run_result = afl_proc_wait(&snapshot_executor->child, false);
+
+  close(snapshot_executor->ctl_fd);
+  close(snapshot_executor->st_fd);
+  snapshot_executor->ctl_fd = -1;
+  snapshot_executor->st_fd = -1;
+  snapshot_executor->child.handler_process = 0;
+
+  return run_result;
+
+}
+
+void snapshot_executor_deinit(snapshot_executor_t *snapshot_executor) {
+
+  if (snapshot_executor->child.handler_process) {
+
+    kill(-snapshot_executor->child.handler_process, SIGKILL);
+    snapshot_executor_reap(snapshot_executor);
+
+  }
+
+  afl_shmem_deinit(&snapshot_executor->input_shm);
+
+  afl_free(snapshot_executor->ranges);
+  snapshot_executor->ranges = NULL;
+  snapshot_executor->ranges_count = 0;
+
+  in_memory_executor_deinit(&snapshot_executor->base);
+
+}
+
+/* Has the LKM snapshot [start, end) (include) or leave it alone (exclude), on top of the writable private pages it
+ * takes by default. Applies to the children spawned from now on. */
+afl_ret_t snapshot_executor_add_range(snapshot_executor_t *snapshot_executor, void *start, void *end, bool include) {
+
+  snapshot_range_t *ranges =
+      afl_realloc(snapshot_executor->ranges, (snapshot_executor->ranges_count + 1) * sizeof(snapshot_range_t));
+  if (!ranges) { return AFL_RET_ALLOC; }
+
+  snapshot_executor->ranges = ranges;
+  snapshot_range_t *range = &snapshot_executor->ranges[snapshot_executor->ranges_count++];
+  range->start = start;
+  range->end = end;
+  range->include = include;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* The child: takes its snapshot, then runs the harness for each input we ask for, until the pipe closes */
+static void snapshot_executor_child(snapshot_executor_t *snapshot_executor) {
+
+  in_memory_executor_t *in_memory_executor = &snapshot_executor->base;
+  bool                  use_snapshot = false;
+  u32                   go;
+
+#ifdef __linux__
+  if (snapshot_executor->use_snapshot) {
+
+    size_t i;
+    for (i = 0; i < snapshot_executor->ranges_count; i++) {
+
+      snapshot_range_t *range = &snapshot_executor->ranges[i];
+      if (range->include) {
+
+        afl_snapshot_include_vmrange(range->start, range->end);
+
+      } else {
+
+        afl_snapshot_exclude_vmrange(range->start, range->end);
+
+      }
+
+    }
+
+    /* No need for the stack, each run writes its own. Ours, with the loop below, stays as it is. */
+    use_snapshot = !afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS | AFL_SNAPSHOT_NOSTACK);
+    if (!use_snapshot) { WARNF("Could not take a snapshot, forking for each run"); }
+
+  }
+
+#endif
+
+  while (read(snapshot_executor->ctl_fd, &go, 4) == 4) {
+
+    u8 *input = snapshot_executor->input_shm.map;
+    u32 len = *(u32 *)input;
+    s32 run_result;
+
+    if (use_snapshot) {
+
+      run_result = in_memory_executor->harness(&in_memory_executor->base, input + sizeof(u32), len);
+
+    } else {
+
+      afl_os_t run;
+      afl_process_init(&run, 0);
+
+      switch (afl_proc_fork(&run)) {
+
+        case CHILD:
+          _exit(in_memory_executor->harness(&in_memory_executor->base, input + sizeof(u32), len));
+        case FORK_FAILED:
+          _exit(1);
+        default:
+          run_result = afl_proc_wait(&run, false);
+
+      }
+
+    }
+
+    if (write(snapshot_executor->st_fd, &run_result, 4) != 4) { _exit(1); }
+
+#ifdef __linux__
+    /* While the parent looks at the result */
+    if (use_snapshot) { afl_snapshot_restore(); }
+#endif
+
+  }
+
+  _exit(0);
+
+}
+
+static afl_ret_t snapshot_executor_spawn(snapshot_executor_t *snapshot_executor) {
+
+  int ctl_pipe[2], st_pipe[2];
+
+  if (pipe(ctl_pipe)) { return AFL_RET_ERRNO; }
+  if (pipe(st_pipe)) {
+
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    return AFL_RET_ERRNO;
+
+  }
+
+  switch (afl_proc_fork(&snapshot_executor->child)) {
+
+    case FORK_FAILED:
+      close(ctl_pipe[0]);
+      close(ctl_pipe[1]);
+      close(st_pipe[0]);
+      close(st_pipe[1]);
+      return AFL_RET_ERRNO;
+
+    case CHILD:
+      /* Our own process group, so that a timeout kills the runs we fork, too */
+      setsid();
+      close(ctl_pipe[1]);
+      close(st_pipe[0]);
+      snapshot_executor->ctl_fd = ctl_pipe[0];
+      snapshot_executor->st_fd = st_pipe[1];
+      snapshot_executor_child(snapshot_executor);
+      break;
+
+    default:
+      break;
+
+  }
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+  snapshot_executor->ctl_fd = ctl_pipe[1];
+  snapshot_executor->st_fd = st_pipe[0];
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Looks for the LKM and spawns the first child. Call it once the harness is initialized. */
+afl_ret_t snapshot_executor_start(afl_executor_t *executor) {
+
+  snapshot_executor_t *snapshot_executor = (snapshot_executor_t *)executor;
+
+#ifdef __linux__
+  snapshot_executor->use_snapshot = afl_snapshot_dev_fd > 0 || afl_snapshot_init() >= 0;
+#endif
+
+  if (snapshot_executor->use_snapshot) {
+
+    OKF("Snapshot module found, restoring memory after each run.");
+
+  } else {
+
+    WARNF("No snapshot module, forking for each run.");
+
+  }
+
+  return snapshot_executor_spawn(snapshot_executor);
+
+}
+
+u8 snapshot_executor_place_input(afl_executor_t *executor, afl_input_t *input) {
+
+  snapshot_executor_t *snapshot_executor = (snapshot_executor_t *)executor;
+
+  u8 *data = (input->funcs.serialize) ? (input->funcs.serialize(input)) : input->bytes;
+  u32 len = MIN(input->len, (size_t)MAX_FILE);
+
+  memcpy(snapshot_executor->input_shm.map + sizeof(u32), data, len);
+  *(u32 *)snapshot_executor->input_shm.map = len;
+
+  executor->current_input = input;
+  return 0;
+
+}
+
+afl_exit_t snapshot_executor_run_target(afl_executor_t *executor) {
+
+  snapshot_executor_t *snapshot_executor = (snapshot_executor_t *)executor;
+  s32                  run_result = AFL_EXIT_OK;
+  u32                  go = 1;
+
+  if (!snapshot_executor->child.handler_process && snapshot_executor_spawn(snapshot_executor) != AFL_RET_SUCCESS) {
+
+    PFATAL("Could not spawn the snapshot executor child");
+
+  }
+
+  if (write(snapshot_executor->ctl_fd, &go, 4) != 4) { return snapshot_executor_reap(snapshot_executor); }
+
+  if (!snapshot_executor->exec_tmout) {
+
+    if (read(snapshot_executor->st_fd, &run_result, 4) != 4) { return snapshot_executor_reap(snapshot_executor); }
+    return run_result;
+
+  }
+
+  u32 exec_ms = afl_read_s32_timed(snapshot_executor->st_fd, &run_result, snapshot_executor->exec_tmout);
+
+  /* The child died (crashed, the harness called exit, ...) */
+  if (!exec_ms) { return snapshot_executor_reap(snapshot_executor); }
+
+  if (exec_ms > snapshot_executor->exec_tmout) {
+
+    /* Reported as AFL_EXIT_TIMEOUT */
+    kill(-snapshot_executor->child.handler_process, SIGKILL);
+    return snapshot_executor_reap(snapshot_executor);
+
+  }
+
+  return run_result;
+
+}
@@ -240,16 +240,39 @@ afl_ret_t afl_engine_handle_new_message(afl_engine_t *engine, llmp_message_t *ms
 
   if (msg->tag == LLMP_TAG_NEW_QUEUE_ENTRY_V1) {
 
+    afl_entry_msg_t *entry_msg = (afl_entry_msg_t *)msg->buf;
+    if (msg->buf_len < sizeof(afl_entry_msg_t) ||
+        msg->buf_len < AFL_ENTRY_MSG_SIZE((u64)entry_msg->cov_count, (u64)entry_msg->input_len)) {
+
+      WARNF("Ignoring broken queue entry msg of size %zu", msg->buf_len);
+      return AFL_RET_SUCCESS;
+
+    }
+
     afl_input_t *input = afl_input_new();
     if (!input) { return AFL_RET_ALLOC; }
 
-    /* the msg will stick around forever, so this is safe. */
-    input->bytes = msg->buf;
-    input->len = msg->buf_len;
+    /* the msg is gone once the llmp client moves on to the next page, copy what we keep. */
+    if (!afl_input_reserve(input, entry_msg->input_len + 1)) {
+
+      afl_input_delete(input);
+      return AFL_RET_ALLOC;
+
+    }
 
-    afl_entry_info_t *info_ptr = (afl_entry_info_t *)((u8 *)(msg->buf + msg->buf_len));
+    memcpy(input->bytes, afl_entry_msg_input(entry_msg), entry_msg->input_len);
+    input->bytes[entry_msg->input_len] = 0;
+    input->len = entry_msg->input_len;
 
-    afl_entry_t *new_entry = afl_entry_new(input, info_ptr);
+    afl_entry_t *new_entry = afl_entry_new(input, NULL);
+    if (!new_entry) {
+
+      afl_input_delete(input);
+      return AFL_RET_ALLOC;
+
+    }
+
+    memcpy(new_entry->info, &entry_msg->info, sizeof(afl_entry_info_t));
 
     /* Users can experiment here, adding entries to different queues based on
      * the message tag. Right now, let's just add it to all queues*/
@@ -270,7 +293,6 @@ afl_ret_t afl_engine_handle_new_message(afl_engine_t *engine, llmp_message_t *ms
 
 u8 afl_engine_execute(afl_engine_t *engine, afl_input_t *input) {
 
-  size_t          i;
   afl_executor_t *executor = engine->executor;
 
   executor->funcs.observers_reset(executor);
@@ -281,6 +303,55 @@ u8 afl_engine_execute(afl_engine_t *engine, afl_input_t *input) {
 
   afl_exit_t run_result = executor->funcs.run_target_cb(executor);
 
+  return afl_engine_handle_run_result(engine, run_result);
+
+}
+
+typedef struct afl_engine_batch {
+
+  afl_engine_t *   engine;
+  afl_input_t **   inputs;
+  afl_batch_run_cb on_run;
+  void *           data;
+
+} afl_engine_batch_t;
+
+static void afl_engine_batch_on_run(afl_executor_t *executor, u32 idx, afl_exit_t exit_code, void *data) {
+
+  afl_engine_batch_t *batch = (afl_engine_batch_t *)data;
+
+  /* For the crash file, whatever ran last */
+  executor->current_input = batch->inputs[idx];
+  afl_engine_handle_run_result(batch->engine, exit_code);
+
+  if (batch->on_run) { batch->on_run(executor, idx, exit_code, batch->data); }
+
+}
+
+afl_ret_t afl_engine_execute_batch(afl_engine_t *engine, afl_input_t **inputs, u32 count, afl_exit_t *exit_codes,
+                                   afl_batch_run_cb on_run, void *data) {
+
+  afl_executor_t *   executor = engine->executor;
+  afl_engine_batch_t batch = {.engine = engine, .inputs = inputs, .on_run = on_run, .data = data};
+
+  if (engine->start_time == 0) { engine->start_time = time(NULL); }
+
+  if (!executor->funcs.run_batch) {
+
+    return afl_executor_run_batch(executor, inputs, count, exit_codes, afl_engine_batch_on_run, &batch);
+
+  }
+
+  return executor->funcs.run_batch(executor, inputs, count, exit_codes, afl_engine_batch_on_run, &batch);
+
+}
+
+/* Everything after the run of executor->current_input: observers, stats, crashes */
+u8 afl_engine_handle_run_result(afl_engine_t *engine, afl_exit_t run_result) {
+
+  size_t          i;
+  afl_executor_t *executor = engine->executor;
+
   engine->executions++;
 
   /* We've run the target with the executor, we can now simply postExec call the
@@ -320,6 +391,13 @@ afl_ret_t afl_engine_loop(afl_engine_t *engine) {
 
     afl_ret_t fuzz_one_ret = engine->fuzz_one->funcs.perform(engine->fuzz_one);
 
+    /* The new queue entries we found may still wait in the llmp batch */
+    if (engine->llmp_client && !llmp_client_batch_flush_if_due(engine->llmp_client)) {
+
+      return AFL_RET_UNKNOWN_ERROR;
+
+    }
+
     /* let's call this engine's message handler */
 
     if (engine->funcs.handle_new_message) {
@@ -453,3 +531,150 @@ afl_ret_t afl_engine_check_configuration(afl_engine_t *engine) {
 
 }
 
+
+afl_ret_t afl_broker_cov_filter_init(afl_broker_cov_filter_t *filter, size_t map_size) {
+
+  memset(filter, 0, sizeof(afl_broker_cov_filter_t));
+
+  filter->virgin_bits = malloc(map_size);
+  if (!filter->virgin_bits) { return AFL_RET_ALLOC; }
+  memset(filter->virgin_bits, 0xff, map_size);
+  filter->map_size = map_size;
+
+  filter->hashes_size = 1024;
+  filter->hashes = calloc(filter->hashes_size, sizeof(u64));
+  if (!filter->hashes) {
+
+    free(filter->virgin_bits);
+    filter->virgin_bits = NULL;
+    return AFL_RET_ALLOC;
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+void afl_broker_cov_filter_deinit(afl_broker_cov_filter_t *filter) {
+
+  free(filter->virgin_bits);
+  filter->virgin_bits = NULL;
+  free(filter->hashes);
+  filter->hashes = NULL;
+  filter->hashes_size = 0;
+  filter->hashes_count = 0;
+
+}
+
+/* Adds the hash to the set. Returns false if it was in there already.
+   0 marks an empty slot. */
+static bool afl_broker_cov_filter_insert(afl_broker_cov_filter_t *filter, u64 hash) {
+
+  if (!hash) { hash = 1; }
+
+  if ((filter->hashes_count + 1) * 2 > filter->hashes_size) {
+
+    size_t new_size = filter->hashes_size * 2;
+    u64 *  new_hashes = calloc(new_size, sizeof(u64));
+    /* Without the index, we still have the virgin map to decide */
+    if (!new_hashes) { return true; }
+
+    for (size_t i = 0; i < filter->hashes_size; i++) {
+
+      if (!filter->hashes[i]) { continue; }
+      size_t j = filter->hashes[i] & (new_size - 1);
+      while (new_hashes[j]) {
+
+        j = (j + 1) & (new_size - 1);
+
+      }
+
+      new_hashes[j] = filter->hashes[i];
+
+    }
+
+    free(filter->hashes);
+    filter->hashes = new_hashes;
+    filter->hashes_size = new_size;
+
+  }
+
+  size_t i = hash & (filter->hashes_size - 1);
+  while (filter->hashes[i]) {
+
+    if (filter->hashes[i] == hash) { return false; }
+    i = (i + 1) & (filter->hashes_size - 1);
+
+  }
+
+  filter->hashes[i] = hash;
+  filter->hashes_count++;
+  return true;
+
+}
+
+bool afl_broker_cov_filter_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *msg,
+                                void *data) {
+
+  (void)broker;
+  (void)client;
+
+  if (msg->tag != LLMP_TAG_NEW_QUEUE_ENTRY_V1) { return true; }
+
+  afl_broker_cov_filter_t *filter = (afl_broker_cov_filter_t *)data;
+  afl_entry_msg_t *        entry_msg = LLMP_MSG_BUF_AS(msg, afl_entry_msg_t);
+
+  if (!entry_msg || !entry_msg->cov_count ||
+      msg->buf_len < AFL_ENTRY_MSG_SIZE((u64)entry_msg->cov_count, (u64)entry_msg->input_len)) {
+
+    filter->forwarded++;
+    return true;
+
+  }
+
+  afl_edge_t *cov = afl_entry_msg_cov(entry_msg);
+  u32         cov_count = entry_msg->cov_count;
+
+  entry_msg->info.hash = XXH64(cov, cov_count * sizeof(afl_edge_t), HASH_CONST);
+
+  /* Somebody sent the exact same coverage before */
+  if (!afl_broker_cov_filter_insert(filter, entry_msg->info.hash)) {
+
+    filter->dropped++;
+    return false;
+
+  }
+
+  bool novel = false;
+  for (u32 i = 0; i < cov_count; i++) {
+
+    /* Can't tell, better let it through */
+    if (unlikely(cov[i].id >= filter->map_size)) {
+
+      novel = true;
+      continue;
+
+    }
+
+    if (filter->virgin_bits[cov[i].id] & cov[i].count) {
+
+      filter->virgin_bits[cov[i].id] &= ~cov[i].count;
+      novel = true;
+
+    }
+
+  }
+
+  if (novel) {
+
+    filter->forwarded++;
+
+  } else {
+
+    filter->dropped++;
+
+  }
+
+  return novel;
+
+}
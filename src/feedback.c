@@ -28,6 +28,10 @@
 #include "observer.h"
 #include "aflpp.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+#endif
+
 afl_ret_t afl_feedback_init(afl_feedback_t *feedback, afl_queue_feedback_t *queue) {
 
   feedback->queue = queue;
@@ -87,6 +91,9 @@ afl_ret_t afl_feedback_cov_init(afl_feedback_cov_t *feedback, afl_queue_feedback
   });
 
   feedback->size = size;
+  feedback->shared_virgin_bits = NULL;
+  feedback->novelty_kernel = afl_feedback_cov_novelty_best();
+  feedback->classify_novelty_kernel = afl_feedback_cov_classify_novelty_best();
   feedback->base.funcs.is_interesting = afl_feedback_cov_is_interesting;
 
   feedback->base.tag = AFL_FEEDBACK_TAG_COV;
@@ -119,6 +126,12 @@ afl_ret_t afl_feedback_cov_set_virgin_bits(afl_feedback_cov_t *feedback, u8 *vir
 
 }
 
+void afl_feedback_cov_set_shared_virgin_bits(afl_feedback_cov_t *feedback, u8 *shared_virgin_bits) {
+
+  feedback->shared_virgin_bits = shared_virgin_bits;
+
+}
+
 void afl_feedback_cov_deinit(afl_feedback_cov_t *feedback) {
 
   free(feedback->virgin_bits);
@@ -128,6 +141,54 @@ void afl_feedback_cov_deinit(afl_feedback_cov_t *feedback) {
 
 }
 
+/* Claims the bits set in trace_bits in the shared virgin map, using atomic
+   fetch-and. Only the first fuzzer to clear a bit sees it as new. The local
+   virgin map picks up whatever the others found in the same words. */
+static float novelty_shared(u8 *trace_bits, u8 *virgin_bits, u8 *shared_virgin_bits, size_t len) {
+
+  u64 *current = (u64 *)trace_bits;
+  u64 *virgin = (u64 *)virgin_bits;
+  u64 *shared = (u64 *)shared_virgin_bits;
+
+  float ret = 0.0;
+
+  for (size_t i = 0; i < (len >> 3); i++) {
+
+    u64 cur = current[i];
+    if (likely(!cur)) { continue; }
+
+    /* Plain load first, most words are known to everyone already */
+    u64 old = __atomic_load_n(&shared[i], __ATOMIC_RELAXED);
+    if (cur & old) {
+
+      old = __atomic_fetch_and(&shared[i], ~cur, __ATOMIC_RELAXED);
+
+      if ((cur & old) && ret < 1.0) {
+
+        ret = 0.5;
+        for (u32 j = 0; j < 64; j += 8) {
+
+          if (((cur >> j) & 0xff) && ((old >> j) & 0xff) == 0xff) {
+
+            ret = 1.0;
+            break;
+
+          }
+
+        }
+
+      }
+
+    }
+
+    virgin[i] &= old & ~cur;
+
+  }
+
+  return ret;
+
+}
+
 float __attribute__((hot)) afl_feedback_cov_is_interesting(afl_feedback_t *feedback, afl_executor_t *fsrv) {
 
   (void)fsrv;
@@ -139,28 +200,115 @@ float __attribute__((hot)) afl_feedback_cov_is_interesting(afl_feedback_t *feedb
   afl_feedback_cov_t *   map_feedback = (afl_feedback_cov_t *)feedback;
   afl_observer_covmap_t *obs_channel = map_feedback->observer_cov;
 
+  // the map size must be a minimum of 8 bytes.
+  // for variable/dynamic map sizes this is ensured in the forkserver
+
+  float ret = 0.0;
+
+  /* post_exec may have left the bucketing to us, do it while we are at it */
+  afl_feedback_cov_novelty_func *kernel =
+      obs_channel->counts_raw ? map_feedback->classify_novelty_kernel : map_feedback->novelty_kernel;
+  obs_channel->counts_raw = false;
+
+  if (obs_channel->dirty_map.map) {
+
+    /* Only look at the blocks the target wrote to */
+    for (size_t block = afl_observer_covmap_next_dirty(obs_channel, 0); block != SIZE_MAX;
+         block = afl_observer_covmap_next_dirty(obs_channel, block + 1)) {
+
+      size_t offset = block << DIRTY_BLOCK_SHIFT;
+      float  block_ret = kernel(obs_channel->shared_map.map + offset, map_feedback->virgin_bits + offset,
+                               afl_observer_covmap_block_len(obs_channel, block));
+      if (block_ret > ret) { ret = block_ret; }
+
+    }
+
+  } else {
+
+    ret = kernel(obs_channel->shared_map.map, map_feedback->virgin_bits, obs_channel->shared_map.map_size);
+
+  }
+
+  /* Nothing new to us means nothing new to anyone. Else, see if we were first. */
+  if (unlikely(ret > 0.0) && map_feedback->shared_virgin_bits) {
+
+    ret = 0.0;
+
+    if (obs_channel->dirty_map.map) {
+
+      for (size_t block = afl_observer_covmap_next_dirty(obs_channel, 0); block != SIZE_MAX;
+           block = afl_observer_covmap_next_dirty(obs_channel, block + 1)) {
+
+        size_t offset = block << DIRTY_BLOCK_SHIFT;
+        float  block_ret = novelty_shared(obs_channel->shared_map.map + offset, map_feedback->virgin_bits + offset,
+                                         map_feedback->shared_virgin_bits + offset,
+                                         afl_observer_covmap_block_len(obs_channel, block));
+        if (block_ret > ret) { ret = block_ret; }
+
+      }
+
+    } else {
+
+      ret = novelty_shared(obs_channel->shared_map.map, map_feedback->virgin_bits, map_feedback->shared_virgin_bits,
+                           obs_channel->shared_map.map_size);
+
+    }
+
+  }
+
+#ifdef DEBUG
+  DBG("MAP: %p %lu", obs_channel->shared_map.map, obs_channel->shared_map.map_size);
+  for (u32 j = 0; j < obs_channel->shared_map.map_size; j++) {
+
+    if (obs_channel->shared_map.map[j]) { printf(" %04x=%02x", j, obs_channel->shared_map.map[j]); }
+
+  }
+
+  printf(" ret=%f\n", ret);
+#endif
+
+  return ret;
+
+}
+
+/* The actual kernels. With classify set, each non-zero word of the trace gets
+   bucketed (see afl_observer_covmap_classify_counts) and written back right
+   before it is compared, so the map is only streamed through once. */
+
+static inline __attribute__((always_inline)) float novelty_scalar(u8 *trace_bits, u8 *virgin_bits, size_t map_size,
+                                                                  bool classify) {
+
 #ifdef WORD_SIZE_64
 
-  u64 *current = (u64 *)obs_channel->shared_map.map;
-  u64 *virgin = (u64 *)map_feedback->virgin_bits;
+  u64 *current = (u64 *)trace_bits;
+  u64 *virgin = (u64 *)virgin_bits;
 
-  u32 i = (obs_channel->shared_map.map_size >> 3);
+  size_t i = (map_size >> 3);
 
 #else
 
-  u32 *current = (u32 *)obs_channel->shared_map.map;
-  u32 *virgin = (u32 *)map_feedback->virgin_bits;
+  u32 *current = (u32 *)trace_bits;
+  u32 *virgin = (u32 *)virgin_bits;
 
-  u32 i = (obs_channel->shared_map.map_size >> 2);
+  size_t i = (map_size >> 2);
 
 #endif                                                                                             /* ^WORD_SIZE_64 */
-  // the map size must be a minimum of 8 bytes.
-  // for variable/dynamic map sizes this is ensured in the forkserver
 
   float ret = 0.0;
 
   while (i--) {
 
+    if (classify && unlikely(*current)) {
+
+      u8 *cur = (u8 *)current;
+      for (u32 j = 0; j < sizeof(*current); j++) {
+
+        cur[j] = afl_count_class_lookup8[cur[j]];
+
+      }
+
+    }
+
     /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
        that have not been already cleared from the virgin map - since this will
        almost always be the case. */
@@ -168,7 +316,7 @@ float __attribute__((hot)) afl_feedback_cov_is_interesting(afl_feedback_t *feedb
     // the (*current) is unnecessary but speeds up the overall comparison
     if (unlikely(*current) && unlikely(*current & *virgin)) {
 
-      if (likely(ret < 2)) {
+      if (likely(ret < 1.0)) {
 
         u8 *cur = (u8 *)current;
         u8 *vir = (u8 *)virgin;
@@ -211,18 +359,365 @@ float __attribute__((hot)) afl_feedback_cov_is_interesting(afl_feedback_t *feedb
 
   }
 
-#ifdef DEBUG
-  DBG("MAP: %p %lu", obs_channel->shared_map.map, obs_channel->shared_map.map_size);
-  for (u32 j = 0; j < obs_channel->shared_map.map_size; j++) {
+  return ret;
 
-    if (obs_channel->shared_map.map[j]) { printf(" %04x=%02x", j, obs_channel->shared_map.map[j]); }
+}
+
+float __attribute__((hot)) afl_feedback_cov_novelty_scalar(u8 *trace_bits, u8 *virgin_bits, size_t map_size) {
+
+  return novelty_scalar(trace_bits, virgin_bits, map_size, false);
+
+}
+
+float __attribute__((hot)) afl_feedback_cov_classify_novelty_scalar(u8 *trace_bits, u8 *virgin_bits, size_t map_size) {
+
+  return novelty_scalar(trace_bits, virgin_bits, map_size, true);
+
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* The SIMD kernels look at 64 (128 for AVX-512) bytes of the trace map at a
+   time and move on right away if they are all zero. Only for the rare blocks
+   with bits set, the virgin map gets loaded at all.
+   What's left at the end of the map is handed to the scalar kernel. */
+
+/* Bucketing with two nibble lookups: values < 16 come from the low nibble
+   table, everything else from the high nibble table. */
+static inline __attribute__((target("avx2"), always_inline)) __m256i classify_avx2(__m256i cur) {
+
+  const __m256i lut_lo = _mm256_setr_epi8(0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16, 0, 1, 2, 4, 8, 8, 8, 8,
+                                          16, 16, 16, 16, 16, 16, 16, 16);
+  const __m256i lut_hi = _mm256_setr_epi8(0, 32, 64, 64, 64, 64, 64, 64, -128, -128, -128, -128, -128, -128, -128, -128,
+                                          0, 32, 64, 64, 64, 64, 64, 64, -128, -128, -128, -128, -128, -128, -128, -128);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+  __m256i lo = _mm256_and_si256(cur, nibble);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(cur, 4), nibble);
+  __m256i hi_zero = _mm256_cmpeq_epi8(hi, _mm256_setzero_si256());
+
+  return _mm256_or_si256(_mm256_and_si256(hi_zero, _mm256_shuffle_epi8(lut_lo, lo)), _mm256_shuffle_epi8(lut_hi, hi));
+
+}
+
+/* One 32 byte lane of the AVX2 kernel */
+static inline __attribute__((target("avx2"), always_inline)) float novelty_lane_avx2(u8 *trace_bits, u8 *virgin_bits,
+                                                                                     float ret, bool classify) {
+
+  __m256i cur = _mm256_loadu_si256((__m256i *)trace_bits);
+
+  if (_mm256_testz_si256(cur, cur)) { return ret; }
+
+  if (classify) {
+
+    cur = classify_avx2(cur);
+    _mm256_storeu_si256((__m256i *)trace_bits, cur);
 
   }
 
-  printf(" ret=%f\n", ret);
-#endif
+  __m256i vir = _mm256_loadu_si256((__m256i *)virgin_bits);
+
+  if (_mm256_testz_si256(cur, vir)) { return ret; }
+
+  __m256i cur_zero = _mm256_cmpeq_epi8(cur, _mm256_setzero_si256());
+  if (_mm256_movemask_epi8(_mm256_andnot_si256(cur_zero, _mm256_cmpeq_epi8(vir, _mm256_set1_epi8(-1))))) {
+
+    ret = 1.0;
+
+  } else if (ret < 1.0) {
+
+    ret = 0.5;
+
+  }
+
+  _mm256_storeu_si256((__m256i *)virgin_bits, _mm256_andnot_si256(cur, vir));
+  return ret;
+
+}
+
+static inline __attribute__((target("avx2"), always_inline)) float novelty_avx2(u8 *trace_bits, u8 *virgin_bits,
+                                                                                size_t map_size, bool classify) {
+
+  float  ret = 0.0;
+  size_t i;
+
+  for (i = 0; i + 64 <= map_size; i += 64) {
+
+    __m256i c0 = _mm256_loadu_si256((__m256i *)(trace_bits + i));
+    __m256i c1 = _mm256_loadu_si256((__m256i *)(trace_bits + i + 32));
+    __m256i all = _mm256_or_si256(c0, c1);
+
+    if (likely(_mm256_testz_si256(all, all))) { continue; }
+
+    ret = novelty_lane_avx2(trace_bits + i, virgin_bits + i, ret, classify);
+    ret = novelty_lane_avx2(trace_bits + i + 32, virgin_bits + i + 32, ret, classify);
+
+  }
+
+  if (i < map_size) {
+
+    float tail = novelty_scalar(trace_bits + i, virgin_bits + i, map_size - i, classify);
+    if (tail > ret) { ret = tail; }
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((hot, target("avx2"))) float afl_feedback_cov_novelty_avx2(u8 *trace_bits, u8 *virgin_bits,
+                                                                          size_t map_size) {
+
+  return novelty_avx2(trace_bits, virgin_bits, map_size, false);
+
+}
+
+__attribute__((hot, target("avx2"))) float afl_feedback_cov_classify_novelty_avx2(u8 *trace_bits, u8 *virgin_bits,
+                                                                                   size_t map_size) {
+
+  return novelty_avx2(trace_bits, virgin_bits, map_size, true);
+
+}
+
+/* Same as classify_avx2, on 64 bytes */
+static inline __attribute__((target("avx512f,avx512bw"), always_inline)) __m512i classify_avx512(__m512i cur) {
+
+  const __m512i lut_lo = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16));
+  const __m512i lut_hi = _mm512_broadcast_i32x4(
+      _mm_setr_epi8(0, 32, 64, 64, 64, 64, 64, 64, -128, -128, -128, -128, -128, -128, -128, -128));
+  const __m512i nibble = _mm512_set1_epi8(0x0f);
+
+  __m512i   lo = _mm512_and_si512(cur, nibble);
+  __m512i   hi = _mm512_and_si512(_mm512_srli_epi16(cur, 4), nibble);
+  __mmask64 hi_zero = _mm512_testn_epi8_mask(hi, hi);
+
+  return _mm512_mask_shuffle_epi8(_mm512_shuffle_epi8(lut_hi, hi), hi_zero, lut_lo, lo);
+
+}
+
+/* One 64 byte lane of the AVX-512 kernel */
+static inline __attribute__((target("avx512f,avx512bw"), always_inline)) float novelty_lane_avx512(u8 *trace_bits,
+                                                                                                   u8 *virgin_bits,
+                                                                                                   float ret,
+                                                                                                   bool  classify) {
+
+  __m512i   cur = _mm512_loadu_si512((void *)trace_bits);
+  __mmask64 cur_set = _mm512_test_epi8_mask(cur, cur);
+
+  if (!cur_set) { return ret; }
 
+  if (classify) {
+
+    cur = classify_avx512(cur);
+    _mm512_storeu_si512((void *)trace_bits, cur);
+
+  }
+
+  __m512i vir = _mm512_loadu_si512((void *)virgin_bits);
+
+  if (!_mm512_test_epi8_mask(cur, vir)) { return ret; }
+
+  if (cur_set & _mm512_cmpeq_epi8_mask(vir, _mm512_set1_epi8(-1))) {
+
+    ret = 1.0;
+
+  } else if (ret < 1.0) {
+
+    ret = 0.5;
+
+  }
+
+  _mm512_storeu_si512((void *)virgin_bits, _mm512_andnot_si512(cur, vir));
   return ret;
 
 }
 
+static inline __attribute__((target("avx512f,avx512bw"), always_inline)) float novelty_avx512(u8 *  trace_bits,
+                                                                                              u8 *  virgin_bits,
+                                                                                              size_t map_size,
+                                                                                              bool   classify) {
+
+  float  ret = 0.0;
+  size_t i;
+
+  for (i = 0; i + 128 <= map_size; i += 128) {
+
+    __m512i c0 = _mm512_loadu_si512((void *)(trace_bits + i));
+    __m512i c1 = _mm512_loadu_si512((void *)(trace_bits + i + 64));
+    __m512i all = _mm512_or_si512(c0, c1);
+
+    if (likely(!_mm512_test_epi64_mask(all, all))) { continue; }
+
+    ret = novelty_lane_avx512(trace_bits + i, virgin_bits + i, ret, classify);
+    ret = novelty_lane_avx512(trace_bits + i + 64, virgin_bits + i + 64, ret, classify);
+
+  }
+
+  if (i < map_size) {
+
+    float tail = novelty_avx2(trace_bits + i, virgin_bits + i, map_size - i, classify);
+    if (tail > ret) { ret = tail; }
+
+  }
+
+  return ret;
+
+}
+
+__attribute__((hot, target("avx512f,avx512bw"))) float afl_feedback_cov_novelty_avx512(u8 *trace_bits, u8 *virgin_bits,
+                                                                                        size_t map_size) {
+
+  return novelty_avx512(trace_bits, virgin_bits, map_size, false);
+
+}
+
+__attribute__((hot, target("avx512f,avx512bw"))) float afl_feedback_cov_classify_novelty_avx512(u8 *  trace_bits,
+                                                                                                 u8 *  virgin_bits,
+                                                                                                 size_t map_size) {
+
+  return novelty_avx512(trace_bits, virgin_bits, map_size, true);
+
+}
+
+#endif                                                                          /* __x86_64__ || __i386__ */
+
+afl_feedback_cov_novelty_func *afl_feedback_cov_novelty_best(void) {
+
+  static afl_feedback_cov_novelty_func *best = NULL;
+
+  if (likely(best)) { return best; }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512bw")) {
+
+    best = afl_feedback_cov_novelty_avx512;
+
+  } else if (__builtin_cpu_supports("avx2")) {
+
+    best = afl_feedback_cov_novelty_avx2;
+
+  }
+
+#endif
+
+  if (!best) { best = afl_feedback_cov_novelty_scalar; }
+
+  return best;
+
+}
+
+afl_feedback_cov_novelty_func *afl_feedback_cov_classify_novelty_best(void) {
+
+  static afl_feedback_cov_novelty_func *best = NULL;
+
+  if (likely(best)) { return best; }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512bw")) {
+
+    best = afl_feedback_cov_classify_novelty_avx512;
+
+  } else if (__builtin_cpu_supports("avx2")) {
+
+    best = afl_feedback_cov_classify_novelty_avx2;
+
+  }
+
+#endif
+
+  if (!best) { best = afl_feedback_cov_classify_novelty_scalar; }
+
+  return best;
+
+}
+
+/* Edge list feedback */
+
+afl_ret_t afl_feedback_edgelist_init(afl_feedback_edgelist_t *feedback, afl_queue_feedback_t *queue,
+                                     afl_observer_edgelist_t *observer_edges) {
+
+  size_t size = observer_edges->edges->max_id;
+
+  feedback->observer_edges = observer_edges;
+
+  /* Large callocs get fresh zero pages from the OS, only the ones we touch cost memory */
+  feedback->seen_buckets = calloc(1, size);
+  if (!feedback->seen_buckets) { return AFL_RET_ALLOC; }
+
+  AFL_TRY(afl_feedback_init(&feedback->base, queue), {
+
+    free(feedback->seen_buckets);
+    return err;
+
+  });
+
+  feedback->size = size;
+  feedback->base.funcs.is_interesting = afl_feedback_edgelist_is_interesting;
+
+  feedback->base.tag = AFL_FEEDBACK_TAG_EDGELIST;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+void afl_feedback_edgelist_deinit(afl_feedback_edgelist_t *feedback) {
+
+  free(feedback->seen_buckets);
+  feedback->seen_buckets = NULL;
+  feedback->size = 0;
+  afl_feedback_deinit(&feedback->base);
+
+}
+
+float __attribute__((hot)) afl_feedback_edgelist_is_interesting(afl_feedback_t *feedback, afl_executor_t *executor) {
+
+  (void)executor;
+
+#ifdef AFL_DEBUG
+  if (feedback->tag != AFL_FEEDBACK_TAG_EDGELIST) { FATAL("Called edgelist_is_interesting with non-edgelist feeback"); }
+#endif
+
+  afl_feedback_edgelist_t *list_feedback = (afl_feedback_edgelist_t *)feedback;
+  afl_edge_list_t *        edges = list_feedback->observer_edges->edges;
+
+  u32   count = edges->count;
+  float ret = 0.0;
+
+  if (count > edges->capacity) { count = edges->capacity; }
+
+  for (u32 i = 0; i < count; i++) {
+
+    afl_edge_t *edge = &edges->edges[i];
+
+    if (unlikely(edge->id >= list_feedback->size)) { continue; }
+
+    u8  bucket = edge->count > 255 ? 128 : afl_count_class_lookup8[edge->count];
+    u8 *seen = &list_feedback->seen_buckets[edge->id];
+
+    if (unlikely(bucket & ~*seen)) {
+
+      if (!*seen) {
+
+        ret = 1.0;
+
+      } else if (ret < 1.0) {
+
+        ret = 0.5;
+
+      }
+
+      *seen |= bucket;
+
+    }
+
+  }
+
+  return ret;
+
+}
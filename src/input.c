@@ -58,14 +58,9 @@ afl_ret_t afl_input_init(afl_input_t *input) {
 
 void afl_input_deinit(afl_input_t *input) {
 
-  /* Deiniting requires a little hack. We free the byte ONLY if copy buf is not NULL. Because then we can assume that
-   * the input is in the queue*/
-  if (input->bytes && input->copy_buf) {
-
-    free(input->bytes);
-    afl_free(input->copy_buf);
-
-  }
+  /* We only free the buf the input owns (copy_buf). Bytes set from the outside stay with whoever set them. */
+  afl_free(input->copy_buf);
+  input->copy_buf = NULL;
 
   input->bytes = NULL;
   input->len = 0;
@@ -74,6 +69,22 @@ void afl_input_deinit(afl_input_t *input) {
 
 }
 
+u8 *afl_input_reserve(afl_input_t *input, size_t size) {
+
+  bool owned = input->bytes && input->bytes == input->copy_buf;
+
+  if (size < input->len) { size = input->len; }
+  u8 *buf = afl_realloc(input->copy_buf, size);
+  if (!buf) { return NULL; }
+
+  if (!owned && input->bytes) { memcpy(buf, input->bytes, input->len); }
+  input->copy_buf = buf;
+  input->bytes = buf;
+
+  return buf;
+
+}
+
 // default implemenatations for the vtable functions for the raw_input type
 
 void afl_input_clear(afl_input_t *input) {
@@ -89,9 +100,9 @@ afl_input_t *afl_input_copy(afl_input_t *orig_inp) {
 
   afl_input_t *copy_inp = afl_input_new();
   if (!copy_inp) { return NULL; }
-  copy_inp->bytes = afl_realloc(orig_inp->copy_buf, (orig_inp->len) * sizeof(u8));
-  orig_inp->copy_buf = copy_inp->bytes;
-  if (!copy_inp->bytes) {
+
+  /* The copy owns its bytes: stages keep several copies around, and mutate them */
+  if (!afl_input_reserve(copy_inp, orig_inp->len)) {
 
     afl_input_delete(copy_inp);
     return NULL;
@@ -106,8 +117,10 @@ afl_input_t *afl_input_copy(afl_input_t *orig_inp) {
 
 void afl_input_deserialize(afl_input_t *input, u8 *bytes, size_t len) {
 
-  if (input->bytes) free(input->bytes);
-  input->bytes = bytes;
+  input->len = 0;
+  if (!afl_input_reserve(input, len)) { return; }
+
+  memmove(input->bytes, bytes, len);
   input->len = len;
 
   return;
@@ -134,25 +147,21 @@ afl_ret_t afl_input_load_from_file(afl_input_t *input, char *fname) {
 
   }
 
-  input->len = st.st_size;
-  input->bytes = calloc(input->len + 1, 1);
-  if (!input->bytes) {
+  input->len = 0;
+  if (!afl_input_reserve(input, st.st_size + 1)) {
 
     close(fd);
     return AFL_RET_ALLOC;
 
   }
 
-  ssize_t ret = read(fd, input->bytes, input->len);
+  ssize_t ret = read(fd, input->bytes, st.st_size);
   close(fd);
 
-  if (ret < 0 || (size_t)ret != input->len) {
-
-    free(input->bytes);
-    input->bytes = NULL;
-    return AFL_RET_SHORT_READ;
+  if (ret < 0 || ret != st.st_size) { return AFL_RET_SHORT_READ; }
 
-  }
+  input->len = st.st_size;
+  input->bytes[input->len] = 0;
 
   return AFL_RET_SUCCESS;
 
@@ -61,8 +61,10 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 #include <stdbool.h>
 #include <pthread.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <sys/wait.h>
@@ -72,13 +74,19 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
 #endif
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef __linux__
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
 
 #include "config.h"
 #include "debug.h"
 #include "alloc-inl.h"
 #include "aflpp.h"
 #include "common.h"
+#include "rand.h"
 #include "llmp.h"
+#include "xxhash.h"
 
 /* INTERNAL TAG
   At EOP from worker to main, restart from offset 0,
@@ -99,6 +107,20 @@ Then register some clientloops using llmp_broker_register_threaded_clientloop
   We allocated this message before */
 #define LLMP_TAG_ALLOCATED_V1 (0xA143AF11)
 
+/* INTERNAL TAG
+  Several msgs from the same client, packed into one.
+  The payload is of type `llmp_payload_batch_t`. */
+#define LLMP_TAG_BATCH_V1 (0xBA7C4ED1)
+
+/* INTERNAL TAG
+  The client wants its doorbell rung after each broadcast, see llmp_client_register_doorbell.
+  The payload is of type `llmp_payload_new_page_t`, naming the doorbell's map. */
+#define LLMP_TAG_DOORBELL_V1 (0xD002BE11)
+
+/* A msg compressed by llmp_client_send, see client->compress_min_len.
+  The payload is of type `llmp_payload_compressed_t`, the broker and the clients inflate it transparently. */
+#define LLMP_TAG_COMPRESSED_V1 (0xC0B7E551)
+
 /* Just a random msg */
 #define LLMP_ALIVE_V1 (0xA11431)
 
@@ -116,12 +138,87 @@ typedef struct llmp_payload_new_page {
 
 } __attribute__((__packed__)) llmp_payload_new_page_t;
 
+/* A message the broker broadcasted by reference, pointing into the sender's page.
+  This is an internal message!
+  LLMP_TAG_MSG_REF_V1
+  */
+#define LLMP_TAG_MSG_REF_V1 (0x2EF2EF1)
+
+typedef struct llmp_payload_msg_ref {
+
+  /* size of the sender's map */
+  size_t map_size;
+  /* 0-terminated str handle for the sender's map */
+  char shm_str[AFL_SHMEM_STRLEN_MAX];
+  /* offset of the original message in the sender's map */
+  size_t offset;
+  /* tag of the original message, to skip it without mapping the sender's map */
+  u32 tag;
+
+} __attribute__((__packed__)) llmp_payload_msg_ref_t;
+
+/* The tags llmp acts on itself. The new page payload (llmp_payload_new_page_t) has no tag of its own, it comes with
+  LLMP_TAG_END_OF_PAGE_V1 or LLMP_TAG_DOORBELL_V1. Msgs from other brokers must never carry one of these: ours would
+  take them for control msgs of the client passing them on. */
+static inline bool llmp_tag_is_internal(u32 tag) {
+
+  switch (tag) {
+
+    case LLMP_TAG_END_OF_PAGE_V1:
+    case LLMP_TAG_CLIENT_ADDED_V1:
+    case LLMP_TAG_UNALLOCATED_V1:
+    case LLMP_TAG_ALLOCATED_V1:
+    case LLMP_TAG_BATCH_V1:
+    case LLMP_TAG_DOORBELL_V1:
+    case LLMP_TAG_COMPRESSED_V1:
+    case LLMP_TAG_MSG_REF_V1:
+      return true;
+    default:
+      return false;
+
+  }
+
+}
+
+/* A batch of msgs from one client, handled by the broker as if they were sent one by one.
+  This is an internal message!
+  LLMP_TAG_BATCH_V1
+  */
+typedef struct llmp_payload_batch {
+
+  /* the number of msgs following */
+  u64 msg_count;
+  /* the msgs, with ids counting up from 1 and padded to 8 bytes each */
+  u8 msgs[];
+
+} __attribute__((__packed__)) llmp_payload_batch_t;
+
+/* A compressed msg.
+  LLMP_TAG_COMPRESSED_V1
+  */
+typedef struct llmp_payload_compressed {
+
+  /* tag of the original msg */
+  u32 tag;
+  /* length of the original payload */
+  u64 buf_len;
+  /* the original payload, run-length encoded (see llmp_rle_compress) */
+  u8 data[];
+
+} __attribute__((__packed__)) llmp_payload_compressed_t;
+
+/* Runs shorter than this are cheaper to encode as literals */
+#define LLMP_RLE_MIN_RUN (4)
+
 /* We need at least this much space at the end of each page to notify about the
  * next page/restart */
 #define LLMP_MSG_END_OF_PAGE_LEN (llmp_align(sizeof(llmp_message_t) + sizeof(llmp_payload_new_page_t)))
 
 #define LLMP_PAGE_HEADER_LEN (offsetof(llmp_page_t, messages))
 
+/* The broker forwards runs of consecutive messages with a single memcpy, up to this many bytes at once */
+#define LLMP_BROKER_RUN_MAX_LEN (1 << 16)
+
 /* If a msg is contained in the current page */
 bool llmp_msg_in_page(llmp_page_t *page, llmp_message_t *msg) {
 
@@ -130,6 +227,180 @@ bool llmp_msg_in_page(llmp_page_t *page, llmp_message_t *msg) {
 
 }
 
+/* If the broker handles this msg on its own, instead of in a run with the msgs around it */
+static inline bool llmp_msg_handled_alone(llmp_message_t *msg) {
+
+  return msg->tag == LLMP_TAG_END_OF_PAGE_V1 || msg->tag == LLMP_TAG_CLIENT_ADDED_V1 || msg->tag == LLMP_TAG_BATCH_V1 ||
+         msg->tag == LLMP_TAG_COMPRESSED_V1 || msg->tag == LLMP_TAG_DOORBELL_V1;
+
+}
+
+/* The tag of the msg, or of the original msg if it got compressed */
+static inline u32 llmp_msg_tag(llmp_message_t *msg) {
+
+  if (msg->tag != LLMP_TAG_COMPRESSED_V1) { return msg->tag; }
+  llmp_payload_compressed_t *payload = LLMP_MSG_BUF_AS(msg, llmp_payload_compressed_t);
+  return payload ? payload->tag : msg->tag;
+
+}
+
+/* Writes val as LEB128 varint, returns the new dst, or NULL if it doesn't fit */
+static inline u8 *llmp_rle_put_varint(u8 *dst, u8 *dst_end, size_t val) {
+
+  do {
+
+    if (dst == dst_end) { return NULL; }
+    *dst++ = (val & 0x7f) | (val > 0x7f ? 0x80 : 0);
+    val >>= 7;
+
+  } while (val);
+
+  return dst;
+
+}
+
+/* Reads a LEB128 varint, returns the new src, or NULL if it's broken */
+static inline u8 *llmp_rle_get_varint(u8 *src, u8 *src_end, size_t *val) {
+
+  u32 shift;
+  *val = 0;
+  for (shift = 0; shift < 64; shift += 7) {
+
+    if (src == src_end) { return NULL; }
+    *val |= (size_t)(*src & 0x7f) << shift;
+    if (!(*src++ & 0x80)) { return src; }
+
+  }
+
+  return NULL;
+
+}
+
+/* Writes a token of len literal bytes */
+static inline u8 *llmp_rle_put_literals(u8 *dst, u8 *dst_end, u8 *src, size_t len) {
+
+  if (!(dst = llmp_rle_put_varint(dst, dst_end, len << 1)) || (size_t)(dst_end - dst) < len) { return NULL; }
+  memcpy(dst, src, len);
+  return dst + len;
+
+}
+
+/* Run-length encodes src, made for large maps that are mostly 0x00 or 0xff.
+  Each token is a varint of (len << 1 | is_run), followed by the byte to repeat len times, or by len literal bytes.
+  Returns the encoded length, or 0 if it would take more than dst_max bytes. */
+static size_t llmp_rle_compress(u8 *dst, size_t dst_max, u8 *src, size_t src_len) {
+
+  u8 *   out = dst;
+  u8 *   out_end = dst + dst_max;
+  size_t i = 0, literal_start = 0;
+
+  while (i < src_len) {
+
+    size_t run = 1;
+    while (i + run < src_len && src[i + run] == src[i]) {
+
+      run++;
+
+    }
+
+    if (run < LLMP_RLE_MIN_RUN) {
+
+      i += run;
+      continue;
+
+    }
+
+    if (i > literal_start && !(out = llmp_rle_put_literals(out, out_end, src + literal_start, i - literal_start))) {
+
+      return 0;
+
+    }
+
+    if (!(out = llmp_rle_put_varint(out, out_end, run << 1 | 1)) || out == out_end) { return 0; }
+    *out++ = src[i];
+
+    i += run;
+    literal_start = i;
+
+  }
+
+  if (src_len > literal_start && !(out = llmp_rle_put_literals(out, out_end, src + literal_start, src_len - literal_start))) {
+
+    return 0;
+
+  }
+
+  return out - dst;
+
+}
+
+/* Decodes llmp_rle_compress output. Returns false if src is broken, or does not decode to exactly dst_len bytes. */
+static bool llmp_rle_decompress(u8 *dst, size_t dst_len, u8 *src, size_t src_len) {
+
+  u8 *   in = src;
+  u8 *   in_end = src + src_len;
+  size_t out_len = 0;
+
+  while (in < in_end) {
+
+    size_t token;
+    if (!(in = llmp_rle_get_varint(in, in_end, &token))) { return false; }
+
+    size_t len = token >> 1;
+    if (len > dst_len - out_len) { return false; }
+
+    if (token & 1) {
+
+      if (in == in_end) { return false; }
+      memset(dst + out_len, *in++, len);
+
+    } else {
+
+      if (len > (size_t)(in_end - in)) { return false; }
+      memcpy(dst + out_len, in, len);
+      in += len;
+
+    }
+
+    out_len += len;
+
+  }
+
+  return out_len == dst_len;
+
+}
+
+/* Returns the msg, or its decompressed version in the scratch space, if it got compressed.
+  Returns NULL for broken msgs. */
+static llmp_message_t *llmp_msg_inflate(u8 **scratch_p, llmp_message_t *msg) {
+
+  if (msg->tag != LLMP_TAG_COMPRESSED_V1) { return msg; }
+
+  llmp_payload_compressed_t *payload = LLMP_MSG_BUF_AS(msg, llmp_payload_compressed_t);
+  if (!payload) { return NULL; }
+
+  llmp_message_t *out = afl_realloc(*scratch_p, sizeof(llmp_message_t) + payload->buf_len);
+  if (!out) { return NULL; }
+  *scratch_p = (u8 *)out;
+
+  if (!llmp_rle_decompress(out->buf, payload->buf_len, payload->data,
+                           msg->buf_len - sizeof(llmp_payload_compressed_t))) {
+
+    return NULL;
+
+  }
+
+  out->tag = payload->tag;
+  out->sender = msg->sender;
+  out->message_id = msg->message_id;
+  out->origin = msg->origin;
+  out->origin_id = msg->origin_id;
+  out->buf_len = payload->buf_len;
+  out->buf_len_padded = payload->buf_len;
+  return out;
+
+}
+
 /* allign to LLMP_ALIGNNMENT bytes */
 static inline size_t llmp_align(size_t to_align) {
 
@@ -156,6 +427,8 @@ static void _llmp_page_init(llmp_page_t *page, u32 sender, size_t size) {
   page->sender = sender;
   page->current_msg_id = 0;
   page->max_alloc_size = 0;
+  page->page_seq = 0;
+  page->broadcast_page_read = 0;
   page->size_total = size;
   page->size_used = 0;
   page->messages->message_id = 0;
@@ -270,8 +543,9 @@ llmp_message_t *llmp_alloc_eop(llmp_page_t *page, llmp_message_t *last_msg) {
 
   if (ret->tag == LLMP_TAG_ALLOCATED_V1) { FATAL("Did not call send() on last message!"); }
 
+  ret->buf_len = sizeof(llmp_payload_new_page_t);
   ret->buf_len_padded = sizeof(llmp_payload_new_page_t);
-  ret->message_id = last_msg ? last_msg->message_id += 1 : 1;
+  ret->message_id = last_msg ? last_msg->message_id + 1 : 1;
   ret->tag = LLMP_TAG_END_OF_PAGE_V1;
 
   page->size_used += LLMP_MSG_END_OF_PAGE_LEN;
@@ -383,6 +657,8 @@ llmp_message_t *llmp_alloc_next(llmp_page_t *page, llmp_message_t *last_msg, siz
 
   ret->buf_len_padded = buf_len_padded;
   ret->buf_len = buf_len;
+  ret->origin = 0;
+  ret->origin_id = 0;
 
   /* DBG("Returning new message at %p with len %ld, TAG was %x", ret, ret->buf_len_padded, ret->tag); */
 
@@ -438,6 +714,24 @@ llmp_page_t *llmp_new_page_shmem(afl_shmem_t *uninited_afl_shmem, size_t sender,
 
 }
 
+/* Wakes up whoever waits at the doorbell (the broker, for new messages), if anybody */
+static inline void llmp_doorbell_ring(afl_shmem_t *doorbell_map) {
+
+  llmp_doorbell_t *doorbell = (llmp_doorbell_t *)doorbell_map->map;
+  if (!doorbell) { return; }
+
+  /* Pairs with llmp_doorbell_await: either the waiter sees our ring, or we see it sleeping */
+  __atomic_fetch_add(&doorbell->ring, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&doorbell->sleeping, __ATOMIC_SEQ_CST)) {
+
+#ifdef __linux__
+    syscall(SYS_futex, &doorbell->ring, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+
+  }
+
+}
+
 /* This function handles EOP by creating a new shared page and informing the
   listener about it using a EOP message. */
 static afl_shmem_t *llmp_handle_out_eop(afl_shmem_t *maps, size_t *map_count_p, llmp_message_t **last_msg_p) {
@@ -470,8 +764,10 @@ static afl_shmem_t *llmp_handle_out_eop(afl_shmem_t *maps, size_t *map_count_p,
 
   *map_count_p = map_count + 1;
 
-  new_map->current_msg_id = old_map->current_msg_id;
+  /* The receivers start over with a fresh msg id count on the new page */
   new_map->max_alloc_size = old_map->max_alloc_size;
+  new_map->page_seq = old_map->page_seq + 1;
+  new_map->broadcast_page_read = old_map->broadcast_page_read;
 
   /* On the old map, place a last message linking to the new map for the clients
    * to consume */
@@ -598,847 +894,2382 @@ static llmp_broker_clientdata_t *llmp_broker_register_client(llmp_broker_t *brok
 
 }
 
-/* broker broadcast to its own page for all others to read */
-static inline void llmp_broker_handle_new_msgs(llmp_broker_t *broker, llmp_broker_clientdata_t *client) {
+/* Each client starts with the very first map (or the oldest one left, see broker->gc_broadcast_pages).
+  They should then iterate through all maps once and work on all old messages.
+  The client gets its own mapping: it will unmap it once it moves on to the next page. */
+static bool llmp_broker_map_client_broadcast(llmp_broker_t *broker, llmp_broker_clientdata_t *client) {
 
-  // TODO: We could memcpy a range of pending messages, instead of one by one.
-  /* DBG("llmp_broker_handle_new_msgs %p %p->%u\n", broker, client, client->client_state->id); */
+  afl_shmem_t *broadcast_map = calloc(1, sizeof(afl_shmem_t));
+  if (!broadcast_map) { return false; }
 
-  llmp_page_t *incoming = shmem2page(client->cur_client_map);
-  u32          current_message_id = client->last_msg_broker_read ? client->last_msg_broker_read->message_id : 0;
-  while (current_message_id != incoming->current_msg_id) {
+  if (!afl_shmem_by_str(broadcast_map, broker->broadcast_maps[0].shm_str, broker->broadcast_maps[0].map_size)) {
 
-    llmp_message_t *msg = llmp_recv(incoming, client->last_msg_broker_read);
+    free(broadcast_map);
+    return false;
 
-    DBG("Broker send: our current_message_id for client %d (at ptr %p) is "
-        "%d%s, now processing msg id %d with tag 0x%X",
-        client->client_state->id, client, current_message_id,
-        client->last_msg_broker_read ? "" : " (last msg was NULL)", msg->message_id, msg->tag);
+  }
 
-    if (!msg) { FATAL("No message received but not all message ids receved! Data out of sync?"); }
+  client->client_state->current_broadcast_map = broadcast_map;
+  shmem2page(client->cur_client_map)->broadcast_page_read = shmem2page(broadcast_map)->page_seq;
+  return true;
 
-    if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+}
 
-      llmp_payload_new_page_t *pageinfo = LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
-      if (!pageinfo) {
+/* Keeps a (client) map mapped in the broker until all clients read past the current broadcast page.
+  Used for pages that messages got broadcasted by reference from. */
+afl_ret_t llmp_broker_retain_map(llmp_broker_t *broker, afl_shmem_t *map) {
 
-        FATAL("Illegal message length for EOP (is %zu, expected %u)", msg->buf_len_padded,
-              sizeof(llmp_payload_new_page_t));
+  llmp_broker_ref_map_t *ref_maps =
+      afl_realloc(broker->ref_maps, (broker->ref_map_count + 1) * sizeof(llmp_broker_ref_map_t));
+  if (!ref_maps) { return AFL_RET_ALLOC; }
 
-      }
+  broker->ref_maps = ref_maps;
+  llmp_broker_ref_map_t *ref_map = &broker->ref_maps[broker->ref_map_count++];
+  memcpy(&ref_map->map, map, sizeof(afl_shmem_t));
+  ref_map->broadcast_page_seq = shmem2page(_llmp_broker_current_broadcast_map(broker))->page_seq;
+  return AFL_RET_SUCCESS;
 
-      DBG("Got EOP from client %d. Mapping new map.", client->client_state->id);
+}
 
-      /* We can reuse the map mem space, no need to free and calloc.
-      However, the pageinfo points to the map we're about to unmap.
-      Copy the contents first. */
+/* Broadcasts a link to the msg with the map_id and offset, instead of the msg */
+static void llmp_broker_forward_ref(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *msg) {
 
-      llmp_payload_new_page_t pageinfo_cpy;
-      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+  DBG("Broadcasting msg with id %d, tag 0x%X by reference", msg->message_id, msg->tag);
+  llmp_message_t *out = llmp_broker_alloc_next(broker, sizeof(llmp_payload_msg_ref_t));
 
-      afl_shmem_t *client_map = client->cur_client_map;
-      shmem2page(client_map)->save_to_unmap = true;
-      afl_shmem_deinit(client_map);
+  out->tag = LLMP_TAG_MSG_REF_V1;
+  out->sender = msg->sender;
 
-      if (!afl_shmem_by_str(client_map, pageinfo->shm_str, pageinfo->map_size)) {
+  llmp_payload_msg_ref_t *ref = (llmp_payload_msg_ref_t *)out->buf;
+  ref->map_size = client->cur_client_map->map_size;
+  memcpy(ref->shm_str, client->cur_client_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+  ref->offset = (u8 *)msg - client->cur_client_map->map;
+  ref->tag = llmp_msg_tag(msg);
+  client->cur_client_map_referenced = true;
 
-        FATAL("Could not get shmem by str for map %s of size %zu", pageinfo->shm_str, pageinfo->map_size);
+  llmp_page_t *out_page = shmem2page(_llmp_broker_current_broadcast_map(broker));
 
-      }
+  out->message_id = out_page->current_msg_id + 1;
 
-    } else if (msg->tag == LLMP_TAG_CLIENT_ADDED_V1) {
+  if (!llmp_send(out_page, out)) { FATAL("Error sending msg"); }
 
-      DBG("Will add a new client.");
+  broker->last_msg_sent = out;
 
-      /* This client informs us about yet another new client
-      add it to the list! Also, no need to forward this msg. */
-      llmp_payload_new_page_t *pageinfo = LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
-      if (!pageinfo) {
+}
 
-        WARNF(
-            "Ignoring broken CLIENT_ADDED msg due to incorrect size. "
-            "Expected %zu but got %zu",
-            sizeof(llmp_payload_new_page_t), msg->buf_len_padded);
+/* Copies count consecutive messages (run_len bytes) from a client page to the
+  broadcast page in one go, then replaces their ids with ours and publishes
+  them at once. */
+static void llmp_broker_forward_run(llmp_broker_t *broker, llmp_message_t *first, size_t count, size_t run_len) {
 
-      }
+  if (!count) { return; }
 
-      /* register_client may realloc the clients, we need to find ours again */
-      u32 client_id = client->client_state->id;
-      if (!llmp_broker_register_client(broker, pageinfo->shm_str, pageinfo->map_size)) {
+  DBG("Broadcasting %zu msgs, starting with id %d", count, first->message_id);
 
-        FATAL("Could not register clientprocess with shm_str %s", pageinfo->shm_str);
+  llmp_message_t *out = llmp_broker_alloc_next(broker, run_len - sizeof(llmp_message_t));
+  size_t          out_len = sizeof(llmp_message_t) + out->buf_len_padded;
 
-      }
+  memcpy(out, first, run_len);
 
-      client->client_type = LLMP_CLIENT_TYPE_FOREIGN_PROCESS;
+  llmp_page_t *   out_page = shmem2page(_llmp_broker_current_broadcast_map(broker));
+  u32             message_id = out_page->current_msg_id;
+  llmp_message_t *msg = out;
+  size_t          i;
+  for (i = 1; i < count; i++) {
 
-      /* find client again */
-      client = &broker->llmp_clients[client_id];
+    msg->message_id = ++message_id;
+    msg = _llmp_next_msg_ptr(msg);
 
-    } else {
+  }
 
-      bool   forward_msg = true;
-      size_t i;
-      for (i = 0; i < broker->msg_hook_count; i++) {
+  msg->message_id = ++message_id;
 
-        llmp_hookdata_t *msg_hook = &broker->msg_hooks[i];
-        forward_msg &= ((llmp_message_hook_func *)msg_hook->func)(broker, client, msg, msg_hook->data);
-        if (unlikely(!llmp_msg_in_page(shmem2page(client->cur_client_map), msg))) {
+  /* The last msg gets whatever padding our allocation added */
+  msg->buf_len_padded += out_len - run_len;
 
-          /* Special handling in case the client got exchanged inside the message_hook, for example after a crash. */
-          DBG("Message hook altered the client. We'll yield for now.");
-          return;
+  if (!llmp_send(out_page, msg)) { FATAL("Error sending msg"); }
 
-        }
+  broker->last_msg_sent = msg;
 
-      }
+}
 
-      if (likely(forward_msg)) {
+/* Runs all hooks on the pending (non-internal) messages of a client, starting
+  at first and ending at the next internal msg or last_id, and forwards the ones
+  they accept, in runs. Returns the last msg handled, or NULL if a hook exchanged
+  the client (for example after a crash), the rest should wait for now. */
+static llmp_message_t *llmp_broker_handle_msg_batch(llmp_broker_t *broker, llmp_broker_clientdata_t *client,
+                                                    llmp_message_t *first, u32 last_id) {
 
-        DBG("Broadcasting msg with id %d, tag 0x%X", msg->message_id, msg->tag);
-        llmp_message_t *out = llmp_broker_alloc_next(broker, msg->buf_len_padded);
+  llmp_message_t *msg = first;
+  size_t          count = 1;
+  size_t          i, j;
+  bool *          forward = NULL;
 
-        if (!out) {
+  if (broker->msg_batch_hook_count) {
 
-          FATAL("Error allocating %zu bytes in shmap %s", msg->buf_len_padded,
-                _llmp_broker_current_broadcast_map(broker)->shm_str);
+    /* Batch hooks need to know the whole batch upfront */
+    while (msg->message_id != last_id && !llmp_msg_handled_alone(_llmp_next_msg_ptr(msg))) {
 
-        }
+      msg = _llmp_next_msg_ptr(msg);
+      count++;
 
-        /* Copy over the whole message.
-        If we should need zero copy, we could instead post a link to the
-        original msg with the map_id and offset. */
-        DBG("broker memcpy %p->%lu %p->%lu copy %lu\n", out, out->buf_len_padded, msg, msg->buf_len_padded,
-            sizeof(llmp_message_t) + msg->buf_len_padded);
-        size_t actual_size = out->buf_len_padded;
-        memcpy(out, msg, sizeof(llmp_message_t) + msg->buf_len_padded);
-        out->buf_len_padded = actual_size;
+    }
+
+    if (count > broker->batch_forward_size) {
+
+      bool *batch_forward = afl_realloc(broker->batch_forward, count * sizeof(bool));
+      if (!batch_forward) { FATAL("Could not alloc space for %zu msgs", count); }
+      broker->batch_forward = batch_forward;
+      broker->batch_forward_size = count;
+
+    }
 
-        /* We need to replace the message ID with our own */
-        llmp_page_t *out_page = shmem2page(_llmp_broker_current_broadcast_map(broker));
+    forward = broker->batch_forward;
+    memset(forward, true, count * sizeof(bool));
 
-        out->message_id = out_page->current_msg_id + 1;
+    for (j = 0; j < broker->msg_batch_hook_count; j++) {
 
-        if (!llmp_send(out_page, out)) { FATAL("Error sending msg"); }
+      llmp_hookdata_t *msg_batch_hook = &broker->msg_batch_hooks[j];
+      ((llmp_message_batch_hook_func *)msg_batch_hook->func)(broker, client, first, count, forward,
+                                                              msg_batch_hook->data);
+      if (unlikely(!llmp_msg_in_page(shmem2page(client->cur_client_map), first))) {
 
-        broker->last_msg_sent = out;
+        DBG("Message batch hook altered the client. We'll yield for now.");
+        return NULL;
 
       }
 
     }
 
-    client->last_msg_broker_read = msg;
-    current_message_id = msg->message_id;
-
   }
 
-}
+  llmp_message_t *run_first = NULL;
+  size_t          run_count = 0, run_len = 0;
 
-/* The broker walks all pages and looks for changes, then broadcasts them on
- * its own shared page, once. */
-inline void llmp_broker_once(llmp_broker_t *broker) {
+  msg = first;
+  for (i = 0;; i++) {
 
-  u32 i;
-  MEM_BARRIER();
-  for (i = 0; i < broker->llmp_client_count; i++) {
+    bool fwd = forward ? forward[i] : true;
 
-    llmp_broker_clientdata_t *client = &broker->llmp_clients[i];
-    llmp_broker_handle_new_msgs(broker, client);
+    for (j = 0; j < broker->msg_hook_count; j++) {
 
-  }
+      llmp_hookdata_t *msg_hook = &broker->msg_hooks[j];
+      fwd &= ((llmp_message_hook_func *)msg_hook->func)(broker, client, msg, msg_hook->data);
+      if (unlikely(!llmp_msg_in_page(shmem2page(client->cur_client_map), msg))) {
 
-}
+        /* Special handling in case the client got exchanged inside the message_hook, for example after a crash.
+        The msgs accepted before still go out (the hook has to keep the old page mapped, see
+        llmp_broker_retain_map). */
+        DBG("Message hook altered the client. We'll yield for now.");
+        llmp_broker_forward_run(broker, run_first, run_count, run_len);
+        return NULL;
 
-/* The broker walks all pages and looks for changes, then broadcasts them on
- * its own shared page */
-void llmp_broker_loop(llmp_broker_t *broker) {
+      }
 
-  while (1) {
+    }
 
-    MEM_BARRIER();
-    llmp_broker_once(broker);
+    size_t msg_len = sizeof(llmp_message_t) + msg->buf_len_padded;
+    bool   by_ref = fwd && broker->zero_copy_min_len && msg->buf_len >= broker->zero_copy_min_len;
 
-    /* 5 milis of sleep for now to not busywait at 100% */
-    usleep(5 * 1000);
+    if (!fwd || by_ref || run_len + msg_len > LLMP_BROKER_RUN_MAX_LEN) {
 
-  }
+      llmp_broker_forward_run(broker, run_first, run_count, run_len);
+      run_count = 0;
+      run_len = 0;
 
-}
+    }
 
-/* A new page will be used. Notify each registered hook in the client about this fact. */
-static void llmp_client_trigger_new_out_page_hooks(llmp_client_t *client) {
+    if (by_ref) {
 
-  size_t i;
-  for (i = 0; i < client->new_out_page_hook_count; i++) {
+      llmp_broker_forward_ref(broker, client, msg);
 
-    ((llmp_client_new_page_hook_func *)client->new_out_page_hooks[i].func)(
-        client, shmem2page(&client->out_maps[client->out_map_count - 1]), client->new_out_page_hooks[i].data);
+    } else if (fwd) {
 
-  }
+      if (!run_count) { run_first = msg; }
+      run_count++;
+      run_len += msg_len;
 
-}
+    }
 
-/* A wrapper around unpacking the data, calling through to the loop */
-static void *_llmp_client_wrapped_loop(void *llmp_client_broker_metadata_ptr) {
+    if (forward ? i + 1 == count : msg->message_id == last_id || llmp_msg_handled_alone(_llmp_next_msg_ptr(msg))) {
 
-  llmp_broker_clientdata_t *metadata = (llmp_broker_clientdata_t *)llmp_client_broker_metadata_ptr;
+      break;
 
-  /* Before doing anything else:, notify registered hooks about the new page we're about to use */
-  llmp_client_trigger_new_out_page_hooks(metadata->client_state);
+    }
 
-  /*
-    if (metadata->data && (unsigned long int) metadata->data > 0x10000) {
+    msg = _llmp_next_msg_ptr(msg);
 
-      afl_engine_t *engine = (afl_engine_t *)metadata->data;
+  }
 
-      if (engine->executor->funcs.init_cb) {
+  llmp_broker_forward_run(broker, run_first, run_count, run_len);
 
-        DBG("Client init");
+  return msg;
 
-        AFL_TRY(engine->executor->funcs.init_cb(engine->executor), {
+}
 
-          FATAL("could not execute custom init function of the child");
+/* Broadcasts the inflated version of a compressed msg, as the hooks left it.
+  compressed_len is the length of its compressed payload data in broker->compress_buf, 0 if it does not compress. */
+static void llmp_broker_forward_inflated(llmp_broker_t *broker, llmp_message_t *inflated, size_t compressed_len) {
 
-        });
+  DBG("Broadcasting msg with id %d, tag 0x%X as changed by the hooks", inflated->message_id, inflated->tag);
 
-      }
+  llmp_message_t *out;
+  if (compressed_len) {
 
-    }
+    out = llmp_broker_alloc_next(broker, sizeof(llmp_payload_compressed_t) + compressed_len);
+    llmp_payload_compressed_t *payload = (llmp_payload_compressed_t *)out->buf;
+    payload->buf_len = inflated->buf_len;
+    payload->tag = inflated->tag;
+    memcpy(payload->data, broker->compress_buf, compressed_len);
+    out->tag = LLMP_TAG_COMPRESSED_V1;
 
-  */
+  } else {
 
-  DBG("Client looping");
-  metadata->clientloop(metadata->client_state, metadata->data);
+    out = llmp_broker_alloc_next(broker, inflated->buf_len);
+    memcpy(out->buf, inflated->buf, inflated->buf_len);
+    out->tag = inflated->tag;
 
-  WARNF("Client loop exited for client %d", metadata->client_state->id);
-  return NULL;
+  }
 
-}
+  out->sender = inflated->sender;
+  out->origin = inflated->origin;
+  out->origin_id = inflated->origin_id;
 
-/* launch a specific client. This function is rarely needed - all registered clients will get launched at broker_run */
-bool llmp_broker_launch_client(llmp_broker_t *broker, llmp_broker_clientdata_t *clientdata) {
+  llmp_page_t *out_page = shmem2page(_llmp_broker_current_broadcast_map(broker));
 
-  if (clientdata < broker->llmp_clients || clientdata > &broker->llmp_clients[broker->llmp_client_count - 1]) {
+  out->message_id = out_page->current_msg_id + 1;
 
-    WARNF("Illegal client specified at ptr %p (instead of %p to %p)", clientdata, broker->llmp_clients,
-          &broker->llmp_clients[broker->llmp_client_count - 1]);
-    return false;
+  if (!llmp_send(out_page, out)) { FATAL("Error sending msg"); }
 
-  }
+  broker->last_msg_sent = out;
 
-  if (clientdata->client_type == LLMP_CLIENT_TYPE_CHILD_PROCESS) {
+}
 
-    if (clientdata->pid) {
+/* Runs all hooks on the inflated version of a compressed msg, then forwards it, still compressed.
+  If the hooks changed it, their version goes out instead of the sender's.
+  Returns false if a hook exchanged the client. */
+static bool llmp_broker_handle_compressed_msg(llmp_broker_t *broker, llmp_broker_clientdata_t *client,
+                                              llmp_message_t *msg) {
+
+  llmp_message_t *inflated = llmp_msg_inflate(&broker->decompress_buf, msg);
+  if (!inflated) {
+
+    WARNF("Ignoring broken compressed msg of client %d", client->client_state->id);
+    return true;
+
+  }
+
+  bool   fwd = true;
+  size_t j;
+
+  for (j = 0; j < broker->msg_batch_hook_count; j++) {
+
+    llmp_hookdata_t *msg_batch_hook = &broker->msg_batch_hooks[j];
+    ((llmp_message_batch_hook_func *)msg_batch_hook->func)(broker, client, inflated, 1, &fwd, msg_batch_hook->data);
+    if (unlikely(!llmp_msg_in_page(shmem2page(client->cur_client_map), msg))) { return false; }
+
+  }
+
+  for (j = 0; j < broker->msg_hook_count; j++) {
+
+    llmp_hookdata_t *msg_hook = &broker->msg_hooks[j];
+    fwd &= ((llmp_message_hook_func *)msg_hook->func)(broker, client, inflated, msg_hook->data);
+    if (unlikely(!llmp_msg_in_page(shmem2page(client->cur_client_map), msg))) { return false; }
+
+  }
+
+  if (!fwd) { return true; }
+
+  /* Our compression is deterministic: if the hooks' version compresses to the sender's payload, nothing changed */
+  llmp_payload_compressed_t *payload = (llmp_payload_compressed_t *)msg->buf;
+  size_t                     max_len = inflated->buf_len > sizeof(llmp_payload_compressed_t)
+                                           ? inflated->buf_len - sizeof(llmp_payload_compressed_t)
+                                           : 0;
+  u8 *compress_buf = afl_realloc(broker->compress_buf, max_len);
+  if (!compress_buf) { FATAL("Could not allocate %zu bytes to compress a msg", max_len); }
+  broker->compress_buf = compress_buf;
+
+  size_t compressed_len = max_len ? llmp_rle_compress(compress_buf, max_len, inflated->buf, inflated->buf_len) : 0;
+  if (inflated->tag != payload->tag || compressed_len != msg->buf_len - sizeof(llmp_payload_compressed_t) ||
+      memcmp(compress_buf, payload->data, compressed_len)) {
+
+    llmp_broker_forward_inflated(broker, inflated, compressed_len);
+
+  } else if (broker->zero_copy_min_len && msg->buf_len >= broker->zero_copy_min_len) {
+
+    llmp_broker_forward_ref(broker, client, msg);
+
+  } else {
+
+    llmp_broker_forward_run(broker, msg, 1, sizeof(llmp_message_t) + msg->buf_len_padded);
+
+  }
+
+  return true;
+
+}
+
+/* If the msgs packed into this batch are all within its bounds, and numbered as expected */
+static bool llmp_batch_valid(llmp_message_t *batch_msg) {
+
+  llmp_payload_batch_t *batch = LLMP_MSG_BUF_AS(batch_msg, llmp_payload_batch_t);
+  if (!batch) { return false; }
+
+  u8 *            end = batch_msg->buf + batch_msg->buf_len;
+  llmp_message_t *msg = (llmp_message_t *)batch->msgs;
+  u64             i;
+  for (i = 0; i < batch->msg_count; i++) {
+
+    if ((size_t)(end - (u8 *)msg) < sizeof(llmp_message_t) ||
+        msg->buf_len_padded > (size_t)(end - (u8 *)msg) - sizeof(llmp_message_t) ||
+        msg->buf_len > msg->buf_len_padded || msg->message_id != i + 1) {
 
-      WARNF("Tried to relaunch already running client. Set ->pid to 0 if this is what you want.");
       return false;
 
     }
 
-    DBG("Launching new client process");
+    msg = _llmp_next_msg_ptr(msg);
 
-    int child_id = fork();
-    if (child_id < 0) {
+  }
 
-      WARNF("Could not fork");
-      return false;
+  return true;
+
+}
+
+/* broker broadcast to its own page for all others to read */
+static inline void llmp_broker_handle_new_msgs(llmp_broker_t *broker, llmp_broker_clientdata_t *client) {
+
+  /* DBG("llmp_broker_handle_new_msgs %p %p->%u\n", broker, client, client->client_state->id); */
+
+  llmp_page_t *incoming = shmem2page(client->cur_client_map);
+  u32          current_message_id = client->last_msg_broker_read ? client->last_msg_broker_read->message_id : 0;
+  while (current_message_id != incoming->current_msg_id) {
+
+    llmp_message_t *msg = llmp_recv(incoming, client->last_msg_broker_read);
+
+    if (!msg) { FATAL("No message received but not all message ids receved! Data out of sync?"); }
+
+    DBG("Broker send: our current_message_id for client %d (at ptr %p) is "
+        "%d%s, now processing msg id %d with tag 0x%X",
+        client->client_state->id, client, current_message_id,
+        client->last_msg_broker_read ? "" : " (last msg was NULL)", msg->message_id, msg->tag);
+
+    if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+
+      llmp_payload_new_page_t *pageinfo = LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+      if (!pageinfo) {
+
+        FATAL("Illegal message length for EOP (is %zu, expected %zu)", msg->buf_len_padded,
+              sizeof(llmp_payload_new_page_t));
+
+      }
+
+      DBG("Got EOP from client %d. Mapping new map.", client->client_state->id);
+
+      /* We can reuse the map mem space, no need to free and calloc.
+      However, the pageinfo points to the map we're about to unmap.
+      Copy the contents first. */
+
+      llmp_payload_new_page_t pageinfo_cpy;
+      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+
+      afl_shmem_t *client_map = client->cur_client_map;
+      shmem2page(client_map)->save_to_unmap = true;
+
+      if (client->cur_client_map_referenced) {
+
+        /* The clients may still have to read messages from this page */
+        if (llmp_broker_retain_map(broker, client_map) != AFL_RET_SUCCESS) {
+
+          FATAL("Could not alloc space to keep referenced client map");
+
+        }
+
+        client->cur_client_map_referenced = false;
+
+      } else {
+
+        afl_shmem_deinit(client_map);
+
+      }
+
+      if (!afl_shmem_by_str(client_map, pageinfo_cpy.shm_str, pageinfo_cpy.map_size)) {
+
+        FATAL("Could not get shmem by str for map %s of size %zu", pageinfo_cpy.shm_str, pageinfo_cpy.map_size);
+
+      }
+
+      /* The msg ids start over on the new page */
+      incoming = shmem2page(client_map);
+      client->last_msg_broker_read = NULL;
+      current_message_id = 0;
+      continue;
+
+    } else if (msg->tag == LLMP_TAG_CLIENT_ADDED_V1) {
+
+      DBG("Will add a new client.");
+
+      /* This client informs us about yet another new client
+      add it to the list! Also, no need to forward this msg. */
+      llmp_payload_new_page_t *pageinfo = LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+      if (!pageinfo) {
+
+        WARNF(
+            "Ignoring broken CLIENT_ADDED msg due to incorrect size. "
+            "Expected %zu but got %zu",
+            sizeof(llmp_payload_new_page_t), msg->buf_len_padded);
+
+      }
+
+      /* register_client may realloc the clients, we need to find ours again */
+      u32 client_id = client->client_state->id;
+      if (!llmp_broker_register_client(broker, pageinfo->shm_str, pageinfo->map_size)) {
+
+        FATAL("Could not register clientprocess with shm_str %s", pageinfo->shm_str);
+
+      }
+
+      client->client_type = LLMP_CLIENT_TYPE_FOREIGN_PROCESS;
+
+      /* find client again */
+      client = &broker->llmp_clients[client_id];
+
+    } else if (msg->tag == LLMP_TAG_DOORBELL_V1) {
+
+      llmp_payload_new_page_t *doorbell = LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+      afl_shmem_deinit(&client->broadcast_doorbell_map);
+      if (!doorbell || doorbell->map_size < sizeof(llmp_doorbell_t) ||
+          !afl_shmem_by_str(&client->broadcast_doorbell_map, doorbell->shm_str, doorbell->map_size)) {
+
+        WARNF("Could not map the doorbell of client %d", client->client_state->id);
+
+      }
+
+    } else if (msg->tag == LLMP_TAG_BATCH_V1) {
+
+      /* The msgs in a batch are numbered from 1, the last one ends the run */
+      llmp_payload_batch_t *batch = (llmp_payload_batch_t *)msg->buf;
+
+      if (!llmp_batch_valid(msg)) {
+
+        WARNF("Ignoring broken batch msg of client %d", client->client_state->id);
+
+      } else if (batch->msg_count &&
+                 !llmp_broker_handle_msg_batch(broker, client, (llmp_message_t *)batch->msgs, batch->msg_count)) {
+
+        /* The client got exchanged */
+        return;
+
+      }
+
+    } else if (msg->tag == LLMP_TAG_COMPRESSED_V1) {
+
+      if (!llmp_broker_handle_compressed_msg(broker, client, msg)) { return; }
+
+    } else {
+
+      /* Take all pending msgs up to the next internal one at once */
+      msg = llmp_broker_handle_msg_batch(broker, client, msg, incoming->current_msg_id);
+      if (!msg) { return; }
+
+    }
+
+    client->last_msg_broker_read = msg;
+    current_message_id = msg->message_id;
+
+  }
+
+}
+
+/* The oldest broadcast page (by page_seq) the clients [first, last) may still read, according to their acks */
+static size_t llmp_broker_min_page_read(llmp_broker_t *broker, size_t first, size_t last) {
+
+  size_t min_read = SIZE_MAX;
+  size_t i;
+  for (i = first; i < last; i++) {
+
+    llmp_page_t *client_page = shmem2page(broker->llmp_clients[i].cur_client_map);
+    /* Dead clients won't read anything anymore */
+    if (client_page->sender_dead) { continue; }
+    min_read = MIN(min_read, client_page->broadcast_page_read);
+
+  }
+
+  return min_read;
+
+}
+
+/* Unmaps all broadcast pages older than min_read, and the client maps only referenced from them */
+static void llmp_broker_gc_pages(llmp_broker_t *broker, size_t min_read) {
+
+  /* The current page stays, of course */
+  while (broker->broadcast_map_count > 1 && shmem2page(&broker->broadcast_maps[0])->page_seq < min_read) {
+
+    DBG("All clients read broadcast page %ld. Unmapping...", shmem2page(&broker->broadcast_maps[0])->page_seq);
+    afl_shmem_deinit(&broker->broadcast_maps[0]);
+    /* We remove at the start, move the other pages back. */
+    memmove(broker->broadcast_maps, broker->broadcast_maps + 1, (broker->broadcast_map_count - 1) * sizeof(afl_shmem_t));
+    broker->broadcast_map_count--;
+
+  }
+
+  size_t i, kept = 0;
+  for (i = 0; i < broker->ref_map_count; i++) {
+
+    if (broker->ref_maps[i].broadcast_page_seq < min_read) {
+
+      afl_shmem_deinit(&broker->ref_maps[i].map);
+
+    } else {
+
+      broker->ref_maps[kept++] = broker->ref_maps[i];
+
+    }
+
+  }
+
+  broker->ref_map_count = kept;
+
+}
+
+/* The broker walks all pages and looks for changes, then broadcasts them on
+ * its own shared page, once. */
+inline void llmp_broker_once(llmp_broker_t *broker) {
+
+  u32             i;
+  size_t          client_count = broker->llmp_client_count;
+  size_t          min_read = 0;
+  llmp_message_t *last_msg_sent = broker->last_msg_sent;
+
+  /* Everything sent after this will ring the doorbell again */
+  broker->doorbell_seen = __atomic_load_n(&((llmp_doorbell_t *)broker->doorbell_map.map)->ring, __ATOMIC_SEQ_CST);
+
+  /* Read the acks before the msgs: a client added by one of them may still wait
+  for a page the client that sent the msg moved past afterwards. */
+  if (broker->gc_broadcast_pages) { min_read = llmp_broker_min_page_read(broker, 0, client_count); }
+
+  MEM_BARRIER();
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    llmp_broker_clientdata_t *client = &broker->llmp_clients[i];
+    llmp_broker_handle_new_msgs(broker, client);
+
+  }
+
+  if (broker->gc_broadcast_pages) {
+
+    min_read = MIN(min_read, llmp_broker_min_page_read(broker, client_count, broker->llmp_client_count));
+    llmp_broker_gc_pages(broker, min_read);
+
+  }
+
+  /* Wake up the clients waiting for our broadcasts */
+  if (broker->last_msg_sent != last_msg_sent) {
+
+    for (i = 0; i < broker->llmp_client_count; i++) {
+
+      llmp_doorbell_ring(&broker->llmp_clients[i].broadcast_doorbell_map);
+
+    }
+
+  }
+
+}
+
+/* Sleeps until the doorbell rang more than seen times, or timeout_ms passed */
+static void llmp_doorbell_await(llmp_doorbell_t *doorbell, u32 seen, u32 timeout_ms) {
+
+  __atomic_store_n(&doorbell->sleeping, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&doorbell->ring, __ATOMIC_SEQ_CST) == seen) {
+
+#ifdef __linux__
+    /* Not a private futex, the ringers may live in other processes */
+    struct timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, &doorbell->ring, FUTEX_WAIT, seen, &timeout, NULL, 0);
+#else
+    usleep(MIN(timeout_ms, 5) * 1000);
+#endif
+
+  }
+
+  __atomic_store_n(&doorbell->sleeping, 0, __ATOMIC_SEQ_CST);
+
+}
+
+/* Sleeps until the doorbell rang since the last llmp_broker_once, or timeout_ms passed */
+void llmp_broker_await_msgs(llmp_broker_t *broker, u32 timeout_ms) {
+
+  llmp_doorbell_await((llmp_doorbell_t *)broker->doorbell_map.map, broker->doorbell_seen, timeout_ms);
+
+}
+
+/* The broker walks all pages and looks for changes, then broadcasts them on
+ * its own shared page */
+void llmp_broker_loop(llmp_broker_t *broker) {
+
+  while (1) {
+
+    MEM_BARRIER();
+    llmp_broker_once(broker);
+
+    /* Sleep until a client sends something, instead of busywaiting at 100% */
+    llmp_broker_await_msgs(broker, 100);
+
+  }
+
+}
+
+/* A new page will be used. Notify each registered hook in the client about this fact. */
+static void llmp_client_trigger_new_out_page_hooks(llmp_client_t *client) {
+
+  size_t i;
+  for (i = 0; i < client->new_out_page_hook_count; i++) {
+
+    ((llmp_client_new_page_hook_func *)client->new_out_page_hooks[i].func)(
+        client, shmem2page(&client->out_maps[client->out_map_count - 1]), client->new_out_page_hooks[i].data);
+
+  }
+
+}
+
+/* A wrapper around unpacking the data, calling through to the loop */
+static void *_llmp_client_wrapped_loop(void *llmp_client_broker_metadata_ptr) {
+
+  llmp_broker_clientdata_t *metadata = (llmp_broker_clientdata_t *)llmp_client_broker_metadata_ptr;
+
+  /* Before doing anything else:, notify registered hooks about the new page we're about to use */
+  llmp_client_trigger_new_out_page_hooks(metadata->client_state);
+
+  /*
+    if (metadata->data && (unsigned long int) metadata->data > 0x10000) {
+
+      afl_engine_t *engine = (afl_engine_t *)metadata->data;
+
+      if (engine->executor->funcs.init_cb) {
+
+        DBG("Client init");
+
+        AFL_TRY(engine->executor->funcs.init_cb(engine->executor), {
+
+          FATAL("could not execute custom init function of the child");
+
+        });
+
+      }
+
+    }
+
+  */
+
+  DBG("Client looping");
+  metadata->clientloop(metadata->client_state, metadata->data);
+
+  WARNF("Client loop exited for client %d", metadata->client_state->id);
+  return NULL;
+
+}
+
+/* launch a specific client. This function is rarely needed - all registered clients will get launched at broker_run */
+bool llmp_broker_launch_client(llmp_broker_t *broker, llmp_broker_clientdata_t *clientdata) {
+
+  if (clientdata < broker->llmp_clients || clientdata > &broker->llmp_clients[broker->llmp_client_count - 1]) {
+
+    WARNF("Illegal client specified at ptr %p (instead of %p to %p)", clientdata, broker->llmp_clients,
+          &broker->llmp_clients[broker->llmp_client_count - 1]);
+    return false;
+
+  }
+
+  clientdata->client_state->gc_broadcast_pages = broker->gc_broadcast_pages;
+
+  if (clientdata->client_type == LLMP_CLIENT_TYPE_CHILD_PROCESS) {
+
+    if (clientdata->pid) {
+
+      WARNF("Tried to relaunch already running client. Set ->pid to 0 if this is what you want.");
+      return false;
+
+    }
+
+    DBG("Launching new client process");
+
+    int child_id = fork();
+    if (child_id < 0) {
+
+      WARNF("Could not fork");
+      return false;
+
+    } else if (child_id == 0) {                                                                            /* child */
+
+      /*
+      s32 dev_null_fd = open("/dev/null", O_WRONLY);
+      dup2(dev_null_fd, 2);
+      close(dev_null_fd);
+      */
+
+      /* in the child, start loop, exit afterwards. */
+      DBG("LLMP child process started");
+      DBG("Fork child loop");
+      _llmp_client_wrapped_loop(clientdata);
+      DBG("Fork child loop exited");
+      exit(1);
+
+    }
+
+    /* parent */
+
+    clientdata->pid = child_id;
+
+    return true;
+
+  } else if (clientdata->client_type == LLMP_CLIENT_TYPE_PTHREAD) {
+
+    /* Got a pthread -> threaded client. Spwan. :) */
+    int s = pthread_create(clientdata->pthread, NULL, _llmp_client_wrapped_loop, clientdata);
+
+    if (s) {
+
+      // TODO: Better Error-handling! :)
+      WARNF("Error creating thread");
+      return false;
+
+    }
+
+  } else {
+
+    WARNF("Tried to spawn llmp child with unknown thread type.");
+    return false;
+
+  }
+
+  return true;
+
+}
+
+/* Kicks off all threaded clients in the brackground, using pthreads */
+bool llmp_broker_launch_clientloops(llmp_broker_t *broker) {
+
+  size_t i;
+
+  /* We never want pthread clients before we fork, libraries may do mutexes,
+   * etc... */
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    if (broker->llmp_clients[i].client_type == LLMP_CLIENT_TYPE_CHILD_PROCESS) {
+
+      if (!llmp_broker_launch_client(broker, &broker->llmp_clients[i])) {
+
+        WARNF("Could not launch all clients");
+        return false;
+
+      }
+
+    }
+
+  }
+
+  /* Now spawn pthread clients */
+  for (i = 0; i < broker->llmp_client_count; i++) {
+
+    if (broker->llmp_clients[i].client_type == LLMP_CLIENT_TYPE_PTHREAD) {
+
+      if (!llmp_broker_launch_client(broker, &broker->llmp_clients[i])) {
+
+        WARNF("Could not launch all clients");
+        return false;
+
+      }
+
+    }
+
+  }
+
+  return true;
+
+}
+
+/* Start all threads and the main broker. Never returns. */
+void llmp_broker_run(llmp_broker_t *broker) {
+
+  llmp_broker_launch_clientloops(broker);
+  llmp_broker_loop(broker);
+
+}
+
+/*
+ For non zero-copy, we want to get rid of old pages with duplicate messages
+ eventually. This function This funtion sees if we can unallocate older pages.
+ The broker would have informed us by setting the save_to_unmap-flag.
+*/
+static void llmp_client_prune_old_pages(llmp_client_t *client) {
+
+  u8 *current_map = client->out_maps[client->out_map_count - 1].map;
+  /* look for pages that are save_to_unmap, then unmap them. */
+  while (client->out_maps[0].map != current_map && shmem2page(&client->out_maps[0])->save_to_unmap) {
+
+    DBG("Page %ld is save to unmap. Unmapping...", shmem2page(&client->out_maps[0])->current_msg_id);
+    /* This page is save to unmap. The broker already reads or read it. */
+
+    DBG("Unmap shared map %s from client", client->out_maps[0].shm_str);
+    afl_shmem_deinit(&client->out_maps[0]);
+    /* We remove at the start, move the other pages back. */
+    memmove(client->out_maps, client->out_maps + 1, (client->out_map_count - 1) * sizeof(afl_shmem_t));
+    client->out_map_count--;
+
+  }
+
+}
+
+/* We don't have any space. Send eop, the reset to beginning of ringbuf */
+static bool llmp_client_handle_out_eop(llmp_client_t *client) {
+
+  DBG("Sending client EOP for client %d", client->id);
+
+  if (!(client->out_maps = llmp_handle_out_eop(client->out_maps, &client->out_map_count, &client->last_msg_sent))) {
+
+    DBG("An error occurred when handling client eop");
+    return false;
+
+  }
+
+  /* Prune old pages!
+    This is a good time to see if we can unallocate older pages.
+    The broker would have informed us by setting the flag
+  */
+  llmp_client_prune_old_pages(client);
+
+  /* So we got a new page. Inform potential hooks */
+  llmp_client_trigger_new_out_page_hooks(client);
+
+  return true;
+
+}
+
+/* Resolves a message the broker broadcasted by reference, mapping the sender's page if we didn't yet */
+static llmp_message_t *llmp_client_deref_msg(llmp_client_t *client, llmp_message_t *msg) {
+
+  llmp_payload_msg_ref_t *ref = LLMP_MSG_BUF_AS(msg, llmp_payload_msg_ref_t);
+  if (!ref) {
+
+    FATAL("Illegal message length for msg ref (is %zu, expected %zu)", msg->buf_len, sizeof(llmp_payload_msg_ref_t));
+
+  }
+
+  afl_shmem_t *map = NULL;
+  size_t       i;
+
+  /* Most likely, it's one of the latest pages */
+  for (i = client->ref_map_count; i > 0; i--) {
+
+    if (!strncmp(client->ref_maps[i - 1].shm_str, ref->shm_str, AFL_SHMEM_STRLEN_MAX)) {
+
+      map = &client->ref_maps[i - 1];
+      break;
+
+    }
+
+  }
+
+  if (!map) {
+
+    if (!(client->ref_maps = afl_realloc(client->ref_maps, (client->ref_map_count + 1) * sizeof(afl_shmem_t)))) {
+
+      FATAL("Could not alloc space for referenced map");
+
+    }
+
+    map = &client->ref_maps[client->ref_map_count];
+    if (!afl_shmem_by_str(map, ref->shm_str, ref->map_size)) {
+
+      FATAL("Could not get shmem by str for referenced map %s of size %zu", ref->shm_str, ref->map_size);
+
+    }
+
+    client->ref_map_count++;
+
+  }
+
+  return (llmp_message_t *)(map->map + ref->offset);
+
+}
+
+/* Tells the broker we're done with all broadcast pages before the current one */
+static inline void llmp_client_ack_broadcast_page(llmp_client_t *client) {
+
+  shmem2page(&client->out_maps[client->out_map_count - 1])->broadcast_page_read =
+      shmem2page(client->current_broadcast_map)->page_seq;
+
+}
+
+/* If the client wants msgs with this tag */
+static inline bool llmp_client_subscribed(llmp_client_t *client, u32 tag) {
+
+  if (!client->subscribed_tag_count) { return true; }
+  if (!(client->subscribed_tags_mask & llmp_tag_bit(tag))) { return false; }
+
+  size_t i;
+  for (i = 0; i < client->subscribed_tag_count; i++) {
+
+    if (client->subscribed_tags[i] == tag) { return true; }
+
+  }
+
+  return false;
+
+}
+
+/* From now on, only receive msgs with this tag (or the tags subscribed to before) */
+afl_ret_t llmp_client_subscribe(llmp_client_t *client, u32 tag) {
+
+  if (client->subscribed_tag_count && llmp_client_subscribed(client, tag)) { return AFL_RET_SUCCESS; }
+
+  u32 *subscribed_tags = afl_realloc(client->subscribed_tags, (client->subscribed_tag_count + 1) * sizeof(u32));
+  if (!subscribed_tags) { return AFL_RET_ALLOC; }
+
+  client->subscribed_tags = subscribed_tags;
+  client->subscribed_tags[client->subscribed_tag_count++] = tag;
+  client->subscribed_tags_mask |= llmp_tag_bit(tag);
+  return AFL_RET_SUCCESS;
+
+}
+
+/* A client receives a broadcast message. Returns null if no message is
+ * availiable */
+llmp_message_t *llmp_client_recv(llmp_client_t *client) {
+
+  llmp_message_t *msg = NULL;
+
+  while (1) {
+
+    /* We just started on this page */
+    if (!client->last_msg_recvd) { llmp_client_ack_broadcast_page(client); }
+
+    msg = llmp_recv(shmem2page(client->current_broadcast_map), client->last_msg_recvd);
+    if (!msg) { return NULL; }
+
+    client->last_msg_recvd = msg;
+    if (msg->tag == LLMP_TAG_UNALLOCATED_V1) {
+
+      FATAL("BUG: Read unallocated msg");
+
+    } else if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+
+      /* we reached the end of the current page.
+      We'll init a new page but can reuse the mem are of the current map.
+      However, we cannot use the message if we deinit its page, so let's copy */
+      llmp_payload_new_page_t pageinfo_cpy;
+      afl_shmem_t *           broadcast_map = client->current_broadcast_map;
+
+      llmp_payload_new_page_t *pageinfo = LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
+      if (!pageinfo) {
+
+        FATAL("Illegal message length for EOP (is %zu, expected %zu)", msg->buf_len_padded,
+              sizeof(llmp_payload_new_page_t));
+
+      }
+
+      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+
+      DBG("Got EOP from broker. Mapping new map.");
+
+      /* Never read by broker broker: shmem2page(map)->save_to_unmap = true; */
+      afl_shmem_deinit(broadcast_map);
+
+      if (!afl_shmem_by_str(client->current_broadcast_map, pageinfo_cpy.shm_str, pageinfo_cpy.map_size)) {
+
+        FATAL("Could not get shmem by str for map %s of size %zu", pageinfo_cpy.shm_str, pageinfo_cpy.map_size);
+
+      }
+
+      /* The msgs of the old page, and the ones it referenced, are gone for us now. */
+      size_t i;
+      for (i = 0; i < client->ref_map_count; i++) {
+
+        afl_shmem_deinit(&client->ref_maps[i]);
+
+      }
+
+      client->ref_map_count = 0;
+
+      /* The msg ids start over on the new page */
+      client->last_msg_recvd = NULL;
+
+    } else if (msg->tag == LLMP_TAG_MSG_REF_V1) {
+
+      /* Not interested? Then we don't even map the sender's page. */
+      llmp_payload_msg_ref_t *ref = LLMP_MSG_BUF_AS(msg, llmp_payload_msg_ref_t);
+      if (ref && !llmp_client_subscribed(client, ref->tag)) { continue; }
+
+      if ((msg = llmp_msg_inflate(&client->decompress_buf, llmp_client_deref_msg(client, msg)))) { return msg; }
+      WARNF("Ignoring broken compressed msg");
+
+    } else if (llmp_client_subscribed(client, llmp_msg_tag(msg))) {
+
+      if ((msg = llmp_msg_inflate(&client->decompress_buf, msg))) { return msg; }
+      WARNF("Ignoring broken compressed msg");
+
+    }
+
+  }
+
+}
+
+/* A client blocks/spins until the next message gets posted to the page,
+  then returns that message. */
+llmp_message_t *llmp_client_recv_blocking(llmp_client_t *client) {
+
+  llmp_page_t *page = shmem2page(client->current_broadcast_map);
+
+  while (1) {
+
+    MEM_BARRIER();
+    /* busy-wait for a new msg_id to show up in the page */
+    if (page->current_msg_id != (client->last_msg_recvd ? client->last_msg_recvd->message_id : 0)) {
+
+      DBG("Blocking read got new page->current_msg_id %ld (last msg id was %d)", page->current_msg_id,
+          (client->last_msg_recvd ? client->last_msg_recvd->message_id : 0));
+
+      llmp_message_t *ret = llmp_client_recv(client);
+      if (ret) {
+
+        DBG("blocking got new msg %d", ret->message_id);
+        return ret;
+
+      }
+
+#ifdef AFL_DEBUG
+      if (client->last_msg_recvd != NULL && client->last_msg_recvd->tag == LLMP_TAG_END_OF_PAGE_V1) {
+
+        FATAL("BUG: client recv returned null unexpectedly");
+
+      }
+
+#endif
+      /* The current page could have changed in recv (EOP) */
+      page = shmem2page(client->current_broadcast_map);
+      /* last msg will exist, even if EOP was handled internally */
+
+    }
+
+  }
+
+  llmp_message_t *msg = llmp_recv_blocking(shmem2page(client->current_broadcast_map), client->last_msg_recvd);
+  if (msg->tag == LLMP_TAG_UNALLOCATED_V1) { FATAL("BUG: Read unallocated msg"); }
+
+  client->last_msg_recvd = msg;
+  return msg;
+
+}
+
+/* Alloc the next message, internally handling end of page by allocating a new one. */
+llmp_message_t *llmp_client_alloc_next(llmp_client_t *client, size_t size) {
+
+  if (!client) FATAL("client is NULL");
+
+  llmp_message_t *msg;
+
+  msg = llmp_alloc_next(shmem2page(&client->out_maps[client->out_map_count - 1]), client->last_msg_sent, size);
+
+  if (!msg) {
+
+    /* Old pages may get pruned in handle_out_eop, so the count can stay the same */
+    u8 *last_map = client->out_maps[client->out_map_count - 1].map;
+
+    /* Page is full -> Tell broker and start from the beginning.
+    Also, pray the broker got all messaes we're overwriting. :) */
+    if (!llmp_client_handle_out_eop(client)) {
+
+      DBG("BUG: Error sending EOP");
+      return NULL;
+
+    }
+
+    if (client->out_maps[client->out_map_count - 1].map == last_map ||
+        shmem2page(&client->out_maps[client->out_map_count - 1])->messages->tag != LLMP_TAG_UNALLOCATED_V1) {
+
+      FATAL("Error in handle_out_eop");
+
+    }
+
+    /* The client_out_map will have been changed by llmp_handle_out_eop. Don't
+     * alias.
+     */
+    msg = llmp_alloc_next(shmem2page(&client->out_maps[client->out_map_count - 1]), NULL, size);
+    if (!msg) {
+
+      DBG("BUG: Something went wrong allocating a msg in the shmap");
+      return NULL;
+
+    }
+
+  }
+
+  msg->sender = client->id;
+  msg->message_id = client->last_msg_sent ? client->last_msg_sent->message_id + 1 : 1;
+
+  /* DBG("Allocated message at loc %p with buflen %ld", msg, msg->buf_len_padded); */
+
+  return msg;
+
+}
+
+/* The space a msg with a payload of buf_len takes up in a batch */
+static inline size_t llmp_batch_msg_len(size_t buf_len) {
+
+  return (sizeof(llmp_message_t) + buf_len + 7) & ~(size_t)7;
+
+}
+
+/* Sends all batched msgs now */
+bool llmp_client_batch_flush(llmp_client_t *client) {
+
+  if (!client->batch_count) { return true; }
+
+  llmp_message_t *msg = llmp_client_alloc_next(client, client->batch_len);
+  if (!msg) { return false; }
+
+  msg->tag = LLMP_TAG_BATCH_V1;
+  memcpy(msg->buf, client->batch_buf, client->batch_len);
+  ((llmp_payload_batch_t *)msg->buf)->msg_count = client->batch_count;
+
+  client->batch_len = 0;
+  client->batch_count = 0;
+  return llmp_client_send(client, msg);
+
+}
+
+llmp_message_t *llmp_client_alloc_after_batch(llmp_client_t *client, size_t size) {
+
+  if (!client->batch_count) { return llmp_client_alloc_next(client, size); }
+
+  /* The batch frame, plus the alignment of both msgs (the first one in a page may start unaligned) */
+  llmp_message_t *msg =
+      llmp_client_alloc_next(client, size + sizeof(llmp_message_t) + client->batch_len + 2 * LLMP_ALIGNMENT);
+  if (msg) { msg->buf_len = size; }
+  return msg;
+
+}
+
+llmp_message_t *llmp_client_batch_flush_before(llmp_client_t *client, llmp_message_t *msg) {
+
+  if (!client->batch_count) { return msg; }
+
+  u32    tag = msg->tag;
+  size_t size = msg->buf_len;
+
+  /* The batch takes the msg's place, the msg moves behind it, in the same page */
+  llmp_client_cancel(client, msg);
+  if (!llmp_client_batch_flush(client)) { return NULL; }
+
+  msg = llmp_client_alloc_next(client, size);
+  if (msg) { msg->tag = tag; }
+  return msg;
+
+}
+
+/* Sends the batch, if it is older than client->batch_max_ms */
+bool llmp_client_batch_flush_if_due(llmp_client_t *client) {
+
+  u32 max_ms = client->batch_max_ms ? client->batch_max_ms : LLMP_BATCH_MAX_MS;
+
+  if (!client->batch_count || afl_get_cur_time() - client->batch_start_time < max_ms) { return true; }
+  return llmp_client_batch_flush(client);
+
+}
+
+/* Like llmp_client_alloc_next, but packs the msg into the client's current batch */
+llmp_message_t *llmp_client_batch_alloc(llmp_client_t *client, size_t size) {
+
+  if (client->batch_pending) { FATAL("Did not call batch_send() on last message!"); }
+
+  size_t max_len = client->batch_max_len ? client->batch_max_len : LLMP_BATCH_MAX_LEN;
+  size_t msg_len = llmp_batch_msg_len(size);
+
+  if (sizeof(llmp_payload_batch_t) + msg_len > max_len) {
+
+    /* Too large to share a frame, goes out on its own. After the batch, to keep the order. */
+    if (!llmp_client_batch_flush(client)) { return NULL; }
+    return llmp_client_alloc_next(client, size);
+
+  }
+
+  if (client->batch_len + msg_len > max_len && !llmp_client_batch_flush(client)) { return NULL; }
+
+  if (!client->batch_count) {
+
+    client->batch_len = sizeof(llmp_payload_batch_t);
+    client->batch_start_time = afl_get_cur_time();
+
+  }
+
+  u8 *batch_buf = afl_realloc(client->batch_buf, client->batch_len + msg_len);
+  if (!batch_buf) { return NULL; }
+  client->batch_buf = batch_buf;
+
+  llmp_message_t *msg = (llmp_message_t *)(client->batch_buf + client->batch_len);
+  msg->tag = LLMP_TAG_ALLOCATED_V1;
+  msg->sender = client->id;
+  msg->message_id = client->batch_count + 1;
+  msg->origin = 0;
+  msg->origin_id = 0;
+  msg->buf_len = size;
+  msg->buf_len_padded = msg_len - sizeof(llmp_message_t);
+
+  client->batch_pending = msg;
+  return msg;
+
+}
+
+/* Adds the msg from llmp_client_batch_alloc to the batch, flushes if the batch is due */
+bool llmp_client_batch_send(llmp_client_t *client, llmp_message_t *msg) {
+
+  /* Allocated directly, it was too large */
+  if (msg != client->batch_pending) { return llmp_client_send(client, msg); }
+
+  client->batch_pending = NULL;
+  client->batch_len += sizeof(llmp_message_t) + msg->buf_len_padded;
+  client->batch_count++;
+
+  return llmp_client_batch_flush_if_due(client);
+
+}
+
+/* Cancel send of the next message, this allows us to allocate a new message without sending this one. */
+void llmp_client_cancel(llmp_client_t *client, llmp_message_t *msg) {
+
+  /* DBG("Client %d cancels send of msg at %p with tag 0x%X and size %ld", client->id, msg, msg->tag,
+   * msg->buf_len_padded); */
+  llmp_page_t *page = shmem2page(&client->out_maps[client->out_map_count - 1]);
+
+#ifdef AFL_DEBUG
+  if (!llmp_msg_in_page(page, msg)) {
+
+    FATAL("BUG: Trying to cancel msg that's not in page! (%p not in %p with size %ld)", msg, page, page->size_total);
+
+  }
+
+#endif
+
+  msg->tag = LLMP_TAG_UNALLOCATED_V1;
+  page->size_used -= msg->buf_len_padded + sizeof(llmp_message_t);
+
+}
+
+/* Replaces the (last allocated) msg by its compressed version, and gives the space saved back to the page.
+  Leaves the msg as it is if it does not get smaller. */
+static void llmp_client_compress_msg(llmp_client_t *client, llmp_message_t *msg) {
+
+  if (msg->buf_len <= sizeof(llmp_payload_compressed_t)) { return; }
+
+  size_t max_len = msg->buf_len - sizeof(llmp_payload_compressed_t);
+  u8 *   compress_buf = afl_realloc(client->compress_buf, max_len);
+  if (!compress_buf) { return; }
+  client->compress_buf = compress_buf;
+
+  size_t compressed_len = llmp_rle_compress(compress_buf, max_len, msg->buf, msg->buf_len);
+  if (!compressed_len) { return; }
+
+  llmp_payload_compressed_t *payload = (llmp_payload_compressed_t *)msg->buf;
+  payload->buf_len = msg->buf_len;
+  payload->tag = msg->tag;
+  memcpy(payload->data, compress_buf, compressed_len);
+  msg->tag = LLMP_TAG_COMPRESSED_V1;
+  msg->buf_len = sizeof(llmp_payload_compressed_t) + compressed_len;
+
+  /* Our msgs end aligned, see llmp_alloc_next */
+  llmp_page_t *page = shmem2page(&client->out_maps[client->out_map_count - 1]);
+  size_t       buf_len_padded = llmp_align((size_t)msg->buf + msg->buf_len) - (size_t)msg->buf;
+  page->size_used -= msg->buf_len_padded - buf_len_padded;
+  msg->buf_len_padded = buf_len_padded;
+  _llmp_next_msg_ptr(msg)->tag = LLMP_TAG_UNALLOCATED_V1;
+
+}
+
+void llmp_client_compress(llmp_client_t *client, llmp_message_t *msg) {
+
+  if (!llmp_msg_handled_alone(msg)) { llmp_client_compress_msg(client, msg); }
+
+}
+
+afl_ret_t llmp_client_compress_reserve(llmp_client_t *client, size_t size) {
+
+  if (size <= sizeof(llmp_payload_compressed_t)) { return AFL_RET_SUCCESS; }
+
+  u8 *compress_buf = afl_realloc(client->compress_buf, size - sizeof(llmp_payload_compressed_t));
+  if (!compress_buf) { return AFL_RET_ALLOC; }
+  client->compress_buf = compress_buf;
+  return AFL_RET_SUCCESS;
+
+}
+
+afl_ret_t llmp_client_register_doorbell(llmp_client_t *client, afl_shmem_t *doorbell_map) {
+
+  llmp_message_t *msg = llmp_client_alloc_next(client, sizeof(llmp_payload_new_page_t));
+  if (!msg) { return AFL_RET_ALLOC; }
+
+  msg->tag = LLMP_TAG_DOORBELL_V1;
+  llmp_payload_new_page_t *payload = (llmp_payload_new_page_t *)msg->buf;
+  payload->map_size = doorbell_map->map_size;
+  memcpy(payload->shm_str, doorbell_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+  return llmp_client_send(client, msg) ? AFL_RET_SUCCESS : AFL_RET_UNKNOWN_ERROR;
+
+}
+
+/* Commits a msg to the client's out ringbuf */
+bool llmp_client_send(llmp_client_t *client_state, llmp_message_t *msg) {
+
+  DBG("Client %d sends new msg at %p with tag 0x%X and size %ld", client_state->id, msg, msg->tag, msg->buf_len_padded);
+
+  llmp_page_t *page = shmem2page(&client_state->out_maps[client_state->out_map_count - 1]);
+
+#ifdef AFL_DEBUG
+  if (!llmp_msg_in_page(page, msg)) {
+
+    FATAL("BUG: Message to send not in correct page (%p not in %p with size %ld)", msg, page, page->size_total);
+
+  }
+
+#endif
+
+  if (client_state->compress_min_len && msg->buf_len >= client_state->compress_min_len &&
+      !llmp_msg_handled_alone(msg)) {
+
+    llmp_client_compress_msg(client_state, msg);
+
+  }
+
+  bool ret = llmp_send(page, msg);
+  client_state->last_msg_sent = msg;
+  llmp_doorbell_ring(&client_state->doorbell_map);
+  return ret;
+
+}
+
+/* A simple client that, on connect, reads the new client's shmap str and
+ * writes the broker's initial map str */
+void llmp_clientloop_process_server(llmp_client_t *client_state, void *data) {
+
+  int port = (int)(size_t)data;
+
+  /* The initial broadcast map, followed by the broker's doorbell */
+  llmp_payload_new_page_t initial_broadcast_map[2] = {0};
+  initial_broadcast_map[0].map_size = client_state->current_broadcast_map->map_size;
+  memcpy(initial_broadcast_map[0].shm_str, client_state->current_broadcast_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+  initial_broadcast_map[1].map_size = client_state->doorbell_map.map_size;
+  memcpy(initial_broadcast_map[1].shm_str, client_state->doorbell_map.shm_str, AFL_SHMEM_STRLEN_MAX);
+
+  struct sockaddr_in serv_addr = {0};
+
+  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  /* port 2801 */
+  serv_addr.sin_port = htons(port);
+
+  uint32_t backoff = 2;
+  while (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
+
+    WARNF("Could not bind to %d! Retrying in %d seconds.", port, backoff);
+    sleep(backoff);
+    backoff *= 2;
+
+  }
+
+  if (listen(listenfd, 10) == -1) { PFATAL("Coult not listen to %d", port); }
+
+  llmp_message_t *msg = llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+
+  while (1) {
+
+    if (!msg) { FATAL("Error allocating new client msg in tcp client!"); }
+
+    msg->tag = LLMP_TAG_CLIENT_ADDED_V1;
+    llmp_payload_new_page_t *payload = (llmp_payload_new_page_t *)msg->buf;
+
+    if (client_state->gc_broadcast_pages) {
+
+      /* Old pages may get unmapped. Follow the broadcasts while we wait, and hand out the page we're at. */
+      struct pollfd listen_poll = {.fd = listenfd, .events = POLLIN};
+      do {
+
+        while (llmp_client_recv(client_state)) {}
+
+      } while (poll(&listen_poll, 1, 100) <= 0);
+
+      initial_broadcast_map[0].map_size = client_state->current_broadcast_map->map_size;
+      memcpy(initial_broadcast_map[0].shm_str, client_state->current_broadcast_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+
+    }
+
+    int connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
+    if (connfd == -1) {
+
+      WARNF("Error on accept");
+      continue;
+
+    }
+
+    DBG("New clientprocess connected");
+
+    if (write(connfd, initial_broadcast_map, sizeof(initial_broadcast_map)) != sizeof(initial_broadcast_map)) {
+
+      WARNF("Socket_client: TCP client disconnected immediately");
+      close(connfd);
+      continue;
+
+    }
+
+    size_t rlen_total = 0;
+
+    while (rlen_total < sizeof(llmp_payload_new_page_t)) {
+
+      ssize_t rlen = read(connfd, (u8 *)payload + rlen_total, sizeof(llmp_payload_new_page_t) - rlen_total);
+      if (rlen < 0) {
+
+        // TODO: Handle EINTR?
+        WARNF("No complete map str receved from TCP client");
+        close(connfd);
+        continue;
+
+      }
+
+      rlen_total += rlen;
+
+    }
+
+    close(connfd);
+
+    DBG("Got new client with map id %s and size %ld", payload->shm_str, payload->map_size);
+
+    if (!llmp_client_send(client_state, msg)) { FATAL("BUG: Error sending incoming tcp msg to broker"); }
+
+    msg = llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+
+  }
+
+}
+
+/* Creates a new, unconnected, client state */
+llmp_client_t *llmp_client_new_unconnected() {
+
+  llmp_client_t *client_state = calloc(1, sizeof(llmp_client_t));
+
+  client_state->current_broadcast_map = calloc(1, sizeof(afl_shmem_t));
+  if (!client_state->current_broadcast_map) {
+
+    DBG("Could not allocate mem");
+    return NULL;
+
+  }
+
+  if (!(client_state->out_maps = afl_realloc((void *)client_state->out_maps, 1 * sizeof(afl_shmem_t)))) {
+
+    DBG("Could not allocate memory");
+    free(client_state->current_broadcast_map);
+    free(client_state);
+    return NULL;
+
+  }
+
+  client_state->out_map_count = 1;
+
+  if (!llmp_new_page_shmem(&client_state->out_maps[0], client_state->id, LLMP_INITIAL_MAP_SIZE)) {
+
+    DBG("Could not create sharedmem");
+    afl_free(client_state->out_maps);
+    free(client_state->current_broadcast_map);
+    free(client_state);
+    return NULL;
+
+  }
+
+  client_state->new_out_page_hook_count = 0;
+  client_state->new_out_page_hooks = NULL;
+
+  return client_state;
+
+}
+
+/* Destroys the given cient state */
+void llmp_client_delete(llmp_client_t *client_state) {
+
+  size_t i;
+  for (i = 0; i < client_state->out_map_count; i++) {
+
+    afl_shmem_deinit(&client_state->out_maps[i]);
+
+  }
+
+  afl_free(client_state->out_maps);
+  client_state->out_maps = NULL;
+  client_state->out_map_count = 0;
+
+  afl_free(client_state->new_out_page_hooks);
+  client_state->new_out_page_hooks = NULL;
+  client_state->new_out_page_hook_count = 0;
+
+  afl_shmem_deinit(client_state->current_broadcast_map);
+  free(client_state->current_broadcast_map);
+  client_state->current_broadcast_map = NULL;
+  afl_shmem_deinit(&client_state->doorbell_map);
+
+  for (i = 0; i < client_state->ref_map_count; i++) {
+
+    afl_shmem_deinit(&client_state->ref_maps[i]);
+
+  }
+
+  afl_free(client_state->ref_maps);
+  afl_free(client_state->subscribed_tags);
+  afl_free(client_state->batch_buf);
+  afl_free(client_state->compress_buf);
+  afl_free(client_state->decompress_buf);
+  free(client_state);
+
+}
+
+/* Creates a new client process that will connect to the given port */
+llmp_client_t *llmp_client_new(int port) {
+
+  int                connfd = 0;
+  struct sockaddr_in servaddr = {0};
+
+  llmp_client_t *client_state = llmp_client_new_unconnected();
+
+  client_state->current_broadcast_map = calloc(1, sizeof(afl_shmem_t));
+  if (!client_state->current_broadcast_map) {
+
+    llmp_client_delete(client_state);
+    DBG("Could not allocate mem");
+    return NULL;
+
+  }
+
+  if (!(client_state->out_maps = afl_realloc((void *)client_state->out_maps, 1 * sizeof(afl_shmem_t)))) {
+
+    DBG("Could not allocate memory");
+    free(client_state->current_broadcast_map);
+    free(client_state);
+    return NULL;
+
+  }
+
+  client_state->out_map_count = 1;
+
+  if (!llmp_new_page_shmem(&client_state->out_maps[0], client_state->id, LLMP_INITIAL_MAP_SIZE)) {
+
+    DBG("Could not create sharedmem");
+    goto error;
+
+  }
+
+  // socket create and varification
+  connfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connfd == -1) { PFATAL("Unable to create socket"); }
+
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  servaddr.sin_port = htons(port);
+
+  if (connect(connfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+
+    DBG("Unable to connect to broker at localhost:%d, make sure it's running "
+        "and has a port exposed",
+        port);
+    goto error;
+
+  }
+
+  /* The broker answers with its initial broadcast map, and its doorbell */
+  llmp_payload_new_page_t client_map_msg, broker_map_msg[2] = {0};
+  client_map_msg.map_size = client_state->out_maps[0].map_size;
+  memcpy(client_map_msg.shm_str, client_state->out_maps[0].shm_str, AFL_SHMEM_STRLEN_MAX);
+
+  if (write(connfd, &client_map_msg, sizeof(llmp_payload_new_page_t)) != sizeof(llmp_payload_new_page_t)) {
+
+    afl_shmem_deinit(&client_state->out_maps[0]);
+    free(client_state);
+    close(connfd);
+    return NULL;
+    FATAL("Socket_client: TCP server disconnected immediately");
+
+  }
+
+  size_t rlen_total = 0;
+
+  while (rlen_total < sizeof(broker_map_msg)) {
+
+    ssize_t rlen = read(connfd, (u8 *)broker_map_msg + rlen_total, sizeof(broker_map_msg) - rlen_total);
+    if (rlen <= 0) {
+
+      // TODO: Handle EINTR?
+      DBG("Got short response from broker via TCP");
+      close(connfd);
+      afl_shmem_deinit(&client_state->out_maps[0]);
+      goto error;
+
+    }
+
+    rlen_total += rlen;
+
+  }
+
+  close(connfd);
+
+  if (!afl_shmem_by_str(client_state->current_broadcast_map, broker_map_msg[0].shm_str, broker_map_msg[0].map_size)) {
+
+    // TODO: Handle EINTR?
+    DBG("Could not allocate shmem");
+    afl_shmem_deinit(&client_state->out_maps[0]);
+    goto error;
+
+  }
+
+  llmp_client_ack_broadcast_page(client_state);
+
+  if (!afl_shmem_by_str(&client_state->doorbell_map, broker_map_msg[1].shm_str, broker_map_msg[1].map_size)) {
+
+    DBG("Could not map the broker's doorbell");
+    afl_shmem_deinit(&client_state->out_maps[0]);
+    goto error;
+
+  }
+
+  return client_state;
+
+error:
+  llmp_client_delete(client_state);
+  return NULL;
 
-    } else if (child_id == 0) {                                                                            /* child */
+}
 
-      /*
-      s32 dev_null_fd = open("/dev/null", O_WRONLY);
-      dup2(dev_null_fd, 2);
-      close(dev_null_fd);
-      */
+/* A random origin for the msgs a link or bridge is the first to pass on, never 0 */
+static u32 llmp_b2b_new_origin(void) {
 
-      /* in the child, start loop, exit afterwards. */
-      DBG("LLMP child process started");
-      DBG("Fork child loop");
-      _llmp_client_wrapped_loop(clientdata);
-      DBG("Fork child loop exited");
-      exit(1);
+  afl_rand_t rand;
+  u32        origin = 1;
+  if (afl_rand_init(&rand) == AFL_RET_SUCCESS) {
 
-    }
+    origin += afl_rand_below(&rand, UINT32_MAX);
+    afl_rand_deinit(&rand);
 
-    /* parent */
+  }
 
-    clientdata->pid = child_id;
+  return origin;
 
-    return true;
+}
 
-  } else if (clientdata->client_type == LLMP_CLIENT_TYPE_PTHREAD) {
+/* A msg's identity when passing between brokers, never 0: its origin and its number there.
+  Msgs that did not pass a link or bridge yet get one now: origin (ours), numbered by *origin_msgs. */
+static inline u64 llmp_b2b_msg_id(llmp_message_t *msg, u32 origin, u32 *origin_msgs) {
 
-    /* Got a pthread -> threaded client. Spwan. :) */
-    int s = pthread_create(clientdata->pthread, NULL, _llmp_client_wrapped_loop, clientdata);
+  if (msg->origin) { return (u64)msg->origin << 32 | msg->origin_id; }
+  return (u64)origin << 32 | ++*origin_msgs;
 
-    if (s) {
+}
 
-      // TODO: Better Error-handling! :)
-      WARNF("Error creating thread");
-      return false;
+/* Remembers the msg id in the (direct-mapped) seen cache. Returns true if it was in there already.
+  Evicted ids may let a msg pass twice, but never loop. */
+static inline bool llmp_b2b_seen(u64 *seen, u64 id) {
 
-    }
+  u64 *slot = &seen[XXH64(&id, sizeof(id), HASH_CONST) & (LLMP_B2B_SEEN_SIZE - 1)];
+  if (*slot == id) { return true; }
+  *slot = id;
+  return false;
 
-  } else {
+}
 
-    WARNF("Tried to spawn llmp child with unknown thread type.");
-    return false;
+/* Sends a copy of a msg from another broker through our client, keeping its identity.
+  Callers check the tag: internal ones must not get through (llmp_tag_is_internal). */
+static bool llmp_b2b_send_copy(llmp_client_t *client, u32 tag, u8 *buf, size_t buf_len, u64 id) {
 
-  }
+  if (llmp_tag_is_internal(tag)) { return false; }
 
-  return true;
+  llmp_message_t *out = llmp_client_alloc_next(client, buf_len);
+  if (!out) { return false; }
+
+  out->tag = tag;
+  out->origin = id >> 32;
+  out->origin_id = (u32)id;
+  memcpy(out->buf, buf, buf_len);
+  return llmp_client_send(client, out);
 
 }
 
-/* Kicks off all threaded clients in the brackground, using pthreads */
-bool llmp_broker_launch_clientloops(llmp_broker_t *broker) {
+/* Sets up a link between the brokers of client (the sub broker) and parent */
+afl_ret_t llmp_b2b_link_init(llmp_b2b_link_t *link, llmp_client_t *client, llmp_client_t *parent) {
 
-  size_t i;
+  link->client = client;
+  link->parent = parent;
+  link->origin = llmp_b2b_new_origin();
+  link->origin_msgs = 0;
+  link->seen = calloc(LLMP_B2B_SEEN_SIZE, sizeof(u64));
+  if (!link->seen) { return AFL_RET_ALLOC; }
 
-  /* We never want pthread clients before we fork, libraries may do mutexes,
-   * etc... */
-  for (i = 0; i < broker->llmp_client_count; i++) {
+  return AFL_RET_SUCCESS;
 
-    if (broker->llmp_clients[i].client_type == LLMP_CLIENT_TYPE_CHILD_PROCESS) {
+}
 
-      if (!llmp_broker_launch_client(broker, &broker->llmp_clients[i])) {
+/* Cleans up the link. The clients stay. */
+void llmp_b2b_link_deinit(llmp_b2b_link_t *link) {
 
-        WARNF("Could not launch all clients");
-        return false;
+  free(link->seen);
+  link->seen = NULL;
 
-      }
+}
 
-    }
+/* Passes the broadcasts read by from on to the broker of to, unless they passed the link before */
+static size_t llmp_b2b_link_pass(llmp_b2b_link_t *link, llmp_client_t *from, llmp_client_t *to) {
 
-  }
+  size_t          count = 0;
+  llmp_message_t *msg;
+  while ((msg = llmp_client_recv(from))) {
 
-  /* Now spawn pthread clients */
-  for (i = 0; i < broker->llmp_client_count; i++) {
+    count++;
+    /* Includes the msgs we sent ourselves, coming back in the broadcasts */
+    u64 id = llmp_b2b_msg_id(msg, link->origin, &link->origin_msgs);
+    if (llmp_b2b_seen(link->seen, id)) { continue; }
 
-    if (broker->llmp_clients[i].client_type == LLMP_CLIENT_TYPE_PTHREAD) {
+    /* llmp_client_recv handles those itself, they should never show up here */
+    if (llmp_tag_is_internal(msg->tag)) {
 
-      if (!llmp_broker_launch_client(broker, &broker->llmp_clients[i])) {
+      WARNF("Not passing on msg with internal tag %X", msg->tag);
+      continue;
 
-        WARNF("Could not launch all clients");
-        return false;
+    }
 
-      }
+    if (!llmp_b2b_send_copy(to, msg->tag, msg->buf, msg->buf_len, id)) {
+
+      FATAL("Could not pass msg on to the other broker");
 
     }
 
   }
 
-  return true;
+  return count;
 
 }
 
-/* Start all threads and the main broker. Never returns. */
-void llmp_broker_run(llmp_broker_t *broker) {
+/* Passes all new msgs of each broker on to the other, unless they passed the link before.
+  Returns the number of msgs read. */
+size_t llmp_b2b_link_once(llmp_b2b_link_t *link) {
 
-  llmp_broker_launch_clientloops(broker);
-  llmp_broker_loop(broker);
+  /* Down first: what our clients found may have been known up there already */
+  size_t count = llmp_b2b_link_pass(link, link->parent, link->client);
+  return count + llmp_b2b_link_pass(link, link->client, link->parent);
 
 }
 
-/*
- For non zero-copy, we want to get rid of old pages with duplicate messages
- eventually. This function This funtion sees if we can unallocate older pages.
- The broker would have informed us by setting the save_to_unmap-flag.
-*/
-static void llmp_client_prune_old_pages(llmp_client_t *client) {
+/* A clientloop linking its broker to the parent broker with a local server at port (passed as data). */
+void llmp_clientloop_b2b_link(llmp_client_t *client_state, void *data) {
 
-  u8 *current_map = client->out_maps[client->out_map_count - 1].map;
-  /* look for pages that are save_to_unmap, then unmap them. */
-  while (client->out_maps[0].map != current_map && shmem2page(&client->out_maps[0])->save_to_unmap) {
+  int             port = (int)(size_t)data;
+  llmp_client_t * parent;
+  llmp_b2b_link_t link = {0};
+  afl_shmem_t     doorbell_map = {0};
 
-    DBG("Page %ld is save to unmap. Unmapping...", shmem2page(&client->out_maps[0])->current_msg_id);
-    /* This page is save to unmap. The broker already reads or read it. */
+  uint32_t backoff = 2;
+  while (!(parent = llmp_client_new(port))) {
 
-    DBG("Unmap shared map %s from client", client->out_maps[0].shm_str);
-    afl_shmem_deinit(&client->out_maps[0]);
-    /* We remove at the start, move the other pages back. */
-    memmove(client->out_maps, client->out_maps + 1, (client->out_map_count - 1) * sizeof(afl_shmem_t));
-    client->out_map_count--;
+    WARNF("Could not connect to the parent broker at port %d! Retrying in %d seconds.", port, backoff);
+    sleep(backoff);
+    backoff = MIN(backoff * 2, 60U);
 
   }
 
-}
+  if (llmp_b2b_link_init(&link, client_state, parent) != AFL_RET_SUCCESS) { FATAL("Could not init broker link"); }
 
-/* We don't have any space. Send eop, the reset to beginning of ringbuf */
-static bool llmp_client_handle_out_eop(llmp_client_t *client) {
+  /* Both brokers ring it after their broadcasts */
+  if (!afl_shmem_init(&doorbell_map, sizeof(llmp_doorbell_t))) { FATAL("Could not init the broker link's doorbell"); }
+  memset(doorbell_map.map, 0, sizeof(llmp_doorbell_t));
+  if (llmp_client_register_doorbell(client_state, &doorbell_map) != AFL_RET_SUCCESS ||
+      llmp_client_register_doorbell(parent, &doorbell_map) != AFL_RET_SUCCESS) {
 
-  DBG("Sending client EOP for client %d", client->id);
+    FATAL("Could not register the broker link's doorbell");
 
-  if (!(client->out_maps = llmp_handle_out_eop(client->out_maps, &client->out_map_count, &client->last_msg_sent))) {
+  }
 
-    DBG("An error occurred when handling client eop");
-    return false;
+  llmp_doorbell_t *doorbell = (llmp_doorbell_t *)doorbell_map.map;
 
-  }
+  while (1) {
 
-  /* Prune old pages!
-    This is a good time to see if we can unallocate older pages.
-    The broker would have informed us by setting the flag
-  */
-  llmp_client_prune_old_pages(client);
+    u32 seen = __atomic_load_n(&doorbell->ring, __ATOMIC_SEQ_CST);
 
-  /* So we got a new page. Inform potential hooks */
-  llmp_client_trigger_new_out_page_hooks(client);
+    /* Neither broker had anything new for us, sleep until one of them broadcasts */
+    if (!llmp_b2b_link_once(&link)) { llmp_doorbell_await(doorbell, seen, 1000); }
 
-  return true;
+  }
 
 }
 
-/* A client receives a broadcast message. Returns null if no message is
- * availiable */
-llmp_message_t *llmp_client_recv(llmp_client_t *client) {
-
-  llmp_message_t *msg = NULL;
+/* A tcp bridge frame header, in network byte order. The payload (buf_len bytes) follows. */
+typedef struct llmp_tcp_frame_hdr {
 
-  while (1) {
+  u32 tag;
+  u32 buf_len;
+  /* The msg's identity, see llmp_b2b_msg_id */
+  u32 origin;
+  u32 origin_id;
 
-    msg = llmp_recv(shmem2page(client->current_broadcast_map), client->last_msg_recvd);
-    if (!msg) { return NULL; }
+} __attribute__((__packed__)) llmp_tcp_frame_hdr_t;
 
-    client->last_msg_recvd = msg;
-    if (msg->tag == LLMP_TAG_UNALLOCATED_V1) {
+/* How much we read from a peer at once */
+#define LLMP_TCP_BRIDGE_READ_LEN (1 << 16)
 
-      FATAL("BUG: Read unallocated msg");
+/* A peer not reading what we send for this many bytes gets disconnected */
+#define LLMP_TCP_BRIDGE_MAX_BACKLOG (1 << 30)
 
-    } else if (msg->tag == LLMP_TAG_END_OF_PAGE_V1) {
+/* The largest msg we pass over a bridge: one that fits an initial page twice, like any msg should (see new_map_size).
+  Peers sending larger frames get disconnected. */
+#define LLMP_TCP_BRIDGE_MAX_FRAME_LEN (LLMP_INITIAL_MAP_SIZE / 2 - LLMP_MSG_END_OF_PAGE_LEN)
 
-      /* we reached the end of the current page.
-      We'll init a new page but can reuse the mem are of the current map.
-      However, we cannot use the message if we deinit its page, so let's copy */
-      llmp_payload_new_page_t pageinfo_cpy;
-      afl_shmem_t *           broadcast_map = client->current_broadcast_map;
+/* How often we try to connect to the peer, if we're not connected */
+#define LLMP_TCP_BRIDGE_CONNECT_INTERVAL_MS (1000)
 
-      llmp_payload_new_page_t *pageinfo = LLMP_MSG_BUF_AS(msg, llmp_payload_new_page_t);
-      if (!pageinfo) {
+/* How long we wait for a connect to the peer to go through */
+#define LLMP_TCP_BRIDGE_CONNECT_TIMEOUT_MS (5000)
 
-        FATAL("Illegal message length for EOP (is %zu, expected %zu)", msg->buf_len_padded,
-              sizeof(llmp_payload_new_page_t));
+/* Sets up a tcp bridge for the broker of client. If hostname is NULL, listens for peers on port, else connects to
+ * hostname:port on the first llmp_tcp_bridge_once. */
+afl_ret_t llmp_tcp_bridge_init(llmp_tcp_bridge_t *bridge, llmp_client_t *client, char *hostname, int port) {
 
-      }
+  bridge->client = client;
+  bridge->origin = llmp_b2b_new_origin();
+  bridge->origin_msgs = 0;
+  bridge->hostname = hostname;
+  bridge->port = port;
+  bridge->listenfd = -1;
+  bridge->wakefd = -1;
+  bridge->last_connect_time = 0;
+  bridge->peer_count = 0;
+  bridge->peers = NULL;
+  bridge->pollfds = NULL;
 
-      memcpy(&pageinfo_cpy, pageinfo, sizeof(llmp_payload_new_page_t));
+  bridge->seen = calloc(LLMP_B2B_SEEN_SIZE, sizeof(u64));
+  if (!bridge->seen) { return AFL_RET_ALLOC; }
 
-      DBG("Got EOP from broker. Mapping new map.");
+  /* We connect on the first llmp_tcp_bridge_once */
+  if (hostname) { return AFL_RET_SUCCESS; }
 
-      /* Never read by broker broker: shmem2page(map)->save_to_unmap = true; */
-      afl_shmem_deinit(broadcast_map);
+  struct sockaddr_in serv_addr = {0};
+  socklen_t          addr_len = sizeof(serv_addr);
+  int                one = 1;
 
-      if (!afl_shmem_by_str(client->current_broadcast_map, pageinfo->shm_str, pageinfo->map_size)) {
+  serv_addr.sin_family = AF_INET;
+  /* Anybody who connects gets all our msgs, and can send us any: only local peers (e.g. via an ssh tunnel), unless
+  the user asked for remote ones */
+  serv_addr.sin_addr.s_addr = htonl(bridge->listen_remote ? INADDR_ANY : INADDR_LOOPBACK);
+  serv_addr.sin_port = htons(port);
 
-        FATAL("Could not get shmem by str for map %s of size %zu", pageinfo->shm_str, pageinfo->map_size);
+  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenfd == -1) { goto error; }
 
-      }
+  if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+      bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1 || listen(listenfd, 16) == -1 ||
+      getsockname(listenfd, (struct sockaddr *)&serv_addr, &addr_len) == -1 ||
+      fcntl(listenfd, F_SETFL, O_NONBLOCK) == -1) {
 
-    } else {
+    DBG("Could not listen on port %d for bridge peers", port);
+    close(listenfd);
+    goto error;
 
-      return msg;
+  }
 
-    }
+  bridge->listenfd = listenfd;
+  bridge->port = ntohs(serv_addr.sin_port);
+  return AFL_RET_SUCCESS;
 
-  }
+error:
+  free(bridge->seen);
+  bridge->seen = NULL;
+  return AFL_RET_ERRNO;
 
 }
 
-/* A client blocks/spins until the next message gets posted to the page,
-  then returns that message. */
-llmp_message_t *llmp_client_recv_blocking(llmp_client_t *client) {
+/* Adds a connected peer to the bridge */
+static bool llmp_tcp_bridge_add_peer(llmp_tcp_bridge_t *bridge, int fd) {
 
-  llmp_page_t *page = shmem2page(client->current_broadcast_map);
+  int one = 1;
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) { return false; }
+  /* Msgs are small and latency matters */
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-  while (1) {
+  llmp_tcp_bridge_peer_t *peers =
+      afl_realloc(bridge->peers, (bridge->peer_count + 1) * sizeof(llmp_tcp_bridge_peer_t));
+  if (!peers) { return false; }
+  bridge->peers = peers;
 
-    MEM_BARRIER();
-    /* busy-wait for a new msg_id to show up in the page */
-    if (page->current_msg_id != (client->last_msg_recvd ? client->last_msg_recvd->message_id : 0)) {
+  /* Two more for the listening socket and the wakefd */
+  struct pollfd *pollfds = afl_realloc(bridge->pollfds, (bridge->peer_count + 3) * sizeof(struct pollfd));
+  if (!pollfds) { return false; }
+  bridge->pollfds = pollfds;
 
-      DBG("Blocking read got new page->current_msg_id %ld (last msg id was %d)", page->current_msg_id,
-          (client->last_msg_recvd ? client->last_msg_recvd->message_id : 0));
+  llmp_tcp_bridge_peer_t *peer = &bridge->peers[bridge->peer_count];
+  memset(peer, 0, sizeof(llmp_tcp_bridge_peer_t));
+  peer->fd = fd;
+  peer->seen = calloc(LLMP_B2B_SEEN_SIZE, sizeof(u64));
+  if (!peer->seen) { return false; }
 
-      llmp_message_t *ret = llmp_client_recv(client);
-      if (ret) {
+  bridge->peer_count++;
+  return true;
 
-        DBG("blocking got new msg %d", ret->message_id);
-        return ret;
+}
 
-      }
+/* Disconnects the peer at idx. The last peer takes its place. */
+static void llmp_tcp_bridge_remove_peer(llmp_tcp_bridge_t *bridge, size_t idx) {
 
-#ifdef AFL_DEBUG
-      if (client->last_msg_recvd != NULL && client->last_msg_recvd->tag == LLMP_TAG_END_OF_PAGE_V1) {
+  llmp_tcp_bridge_peer_t *peer = &bridge->peers[idx];
 
-        FATAL("BUG: client recv returned null unexpectedly");
+  close(peer->fd);
+  afl_free(peer->in_buf);
+  afl_free(peer->out_buf);
+  free(peer->seen);
 
-      }
+  bridge->peer_count--;
+  if (idx != bridge->peer_count) { memcpy(peer, &bridge->peers[bridge->peer_count], sizeof(llmp_tcp_bridge_peer_t)); }
 
-#endif
-      /* The current page could have changed in recv (EOP) */
-      page = shmem2page(client->current_broadcast_map);
-      /* last msg will exist, even if EOP was handled internally */
+}
 
-    }
+/* Disconnects all peers and cleans up the bridge. The client stays. */
+void llmp_tcp_bridge_deinit(llmp_tcp_bridge_t *bridge) {
+
+  while (bridge->peer_count) {
+
+    llmp_tcp_bridge_remove_peer(bridge, bridge->peer_count - 1);
 
   }
 
-  llmp_message_t *msg = llmp_recv_blocking(shmem2page(client->current_broadcast_map), client->last_msg_recvd);
-  if (msg->tag == LLMP_TAG_UNALLOCATED_V1) { FATAL("BUG: Read unallocated msg"); }
+  afl_free(bridge->peers);
+  bridge->peers = NULL;
+  afl_free(bridge->pollfds);
+  bridge->pollfds = NULL;
 
-  client->last_msg_recvd = msg;
-  return msg;
+  if (bridge->listenfd != -1) { close(bridge->listenfd); }
+  bridge->listenfd = -1;
+
+  free(bridge->seen);
+  bridge->seen = NULL;
 
 }
 
-/* Alloc the next message, internally handling end of page by allocating a new one. */
-llmp_message_t *llmp_client_alloc_next(llmp_client_t *client, size_t size) {
+/* Starts connecting to the peer at hostname:port, if we're not connected and didn't just try.
+  Doesn't block: llmp_tcp_bridge_once finishes the connect once the socket gets writable. */
+static void llmp_tcp_bridge_connect(llmp_tcp_bridge_t *bridge) {
 
-  if (!client) FATAL("client is NULL");
+  u64 cur_time = afl_get_cur_time();
+  if (bridge->last_connect_time && cur_time - bridge->last_connect_time < LLMP_TCP_BRIDGE_CONNECT_INTERVAL_MS) {
 
-  llmp_message_t *msg;
+    return;
 
-  msg = llmp_alloc_next(shmem2page(&client->out_maps[client->out_map_count - 1]), client->last_msg_sent, size);
+  }
 
-  if (!msg) {
+  bridge->last_connect_time = cur_time;
 
-    size_t last_map_count = client->out_map_count;
+  struct addrinfo  hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addr = NULL;
+  char             port_str[16];
 
-    /* Page is full -> Tell broker and start from the beginning.
-    Also, pray the broker got all messaes we're overwriting. :) */
-    if (!llmp_client_handle_out_eop(client)) {
+  snprintf(port_str, sizeof(port_str), "%d", bridge->port);
+  if (getaddrinfo(bridge->hostname, port_str, &hints, &addr)) {
 
-      DBG("BUG: Error sending EOP");
-      return NULL;
+    WARNF("Could not resolve bridge peer %s", bridge->hostname);
+    return;
 
-    }
+  }
 
-    if (client->out_map_count == last_map_count ||
-        shmem2page(&client->out_maps[client->out_map_count - 1])->messages->tag != LLMP_TAG_UNALLOCATED_V1) {
+  int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  if (fd == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+      (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1 && errno != EINPROGRESS) ||
+      !llmp_tcp_bridge_add_peer(bridge, fd)) {
 
-      FATAL("Error in handle_out_eop");
+    DBG("Could not connect to bridge peer %s:%d", bridge->hostname, bridge->port);
+    if (fd != -1) { close(fd); }
 
-    }
+  } else {
 
-    /* The client_out_map will have been changed by llmp_handle_out_eop. Don't
-     * alias.
-     */
-    msg = llmp_alloc_next(shmem2page(&client->out_maps[client->out_map_count - 1]), NULL, size);
-    if (!msg) {
+    bridge->peers[bridge->peer_count - 1].connecting = true;
 
-      DBG("BUG: Something went wrong allocating a msg in the shmap");
-      return NULL;
+  }
 
-    }
+  freeaddrinfo(addr);
 
-  }
+}
 
-  msg->sender = client->id;
-  msg->message_id = client->last_msg_sent ? client->last_msg_sent->message_id + 1 : 1;
+/* Writes as much of the peer's backlog as the socket takes. Returns false if the peer is gone. */
+static bool llmp_tcp_bridge_peer_flush(llmp_tcp_bridge_peer_t *peer) {
 
-  /* DBG("Allocated message at loc %p with buflen %ld", msg, msg->buf_len_padded); */
+  if (peer->connecting) { return true; }
 
-  return msg;
+  while (peer->out_sent < peer->out_len) {
+
+    /* Don't die of SIGPIPE if the peer is gone */
+    ssize_t wlen = send(peer->fd, peer->out_buf + peer->out_sent, peer->out_len - peer->out_sent, MSG_NOSIGNAL);
+    if (wlen < 0) {
+
+      if (errno == EINTR) { continue; }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+
+    }
+
+    peer->out_sent += wlen;
+
+  }
+
+  peer->out_len = 0;
+  peer->out_sent = 0;
+  return true;
 
 }
 
-/* Cancel send of the next message, this allows us to allocate a new message without sending this one. */
-void llmp_client_cancel(llmp_client_t *client, llmp_message_t *msg) {
+/* Queues a frame for the peer. Returns false if the peer does not keep up. */
+static bool llmp_tcp_bridge_peer_queue(llmp_tcp_bridge_peer_t *peer, u32 tag, u8 *buf, size_t buf_len, u64 id) {
 
-  /* DBG("Client %d cancels send of msg at %p with tag 0x%X and size %ld", client->id, msg, msg->tag,
-   * msg->buf_len_padded); */
-  llmp_page_t *page = shmem2page(&client->out_maps[client->out_map_count - 1]);
+  size_t frame_len = sizeof(llmp_tcp_frame_hdr_t) + buf_len;
+  if (peer->out_len - peer->out_sent + frame_len > LLMP_TCP_BRIDGE_MAX_BACKLOG) { return false; }
 
-#ifdef AFL_DEBUG
-  if (!llmp_msg_in_page(page, msg)) {
+  /* Move the unsent rest to the front, if that frees up a good amount of space */
+  if (peer->out_sent && peer->out_sent >= peer->out_len / 2) {
 
-    FATAL("BUG: Trying to cancel msg that's not in page! (%p not in %p with size %ld)", msg, page, page->size_total);
+    memmove(peer->out_buf, peer->out_buf + peer->out_sent, peer->out_len - peer->out_sent);
+    peer->out_len -= peer->out_sent;
+    peer->out_sent = 0;
 
   }
 
-#endif
+  u8 *out_buf = afl_realloc(peer->out_buf, peer->out_len + frame_len);
+  if (!out_buf) { return false; }
+  peer->out_buf = out_buf;
 
-  msg->tag = LLMP_TAG_UNALLOCATED_V1;
-  page->size_used -= msg->buf_len_padded + sizeof(llmp_message_t);
+  llmp_tcp_frame_hdr_t hdr = {
+      .tag = htonl(tag), .buf_len = htonl(buf_len), .origin = htonl(id >> 32), .origin_id = htonl((u32)id)};
+  memcpy(peer->out_buf + peer->out_len, &hdr, sizeof(llmp_tcp_frame_hdr_t));
+  memcpy(peer->out_buf + peer->out_len + sizeof(llmp_tcp_frame_hdr_t), buf, buf_len);
+  peer->out_len += frame_len;
+  return true;
 
 }
 
-/* Commits a msg to the client's out ringbuf */
-bool llmp_client_send(llmp_client_t *client_state, llmp_message_t *msg) {
+/* Reads what the peer sent, and passes all complete frames on to our broker,
+  unless we had them already. Returns false if the peer is gone. */
+static bool llmp_tcp_bridge_peer_recv(llmp_tcp_bridge_t *bridge, llmp_tcp_bridge_peer_t *peer, size_t *count) {
 
-  DBG("Client %d sends new msg at %p with tag 0x%X and size %ld", client_state->id, msg, msg->tag, msg->buf_len_padded);
+  /* Read at most one frame ahead, the rest waits in the socket */
+  while (peer->in_len < sizeof(llmp_tcp_frame_hdr_t) + LLMP_TCP_BRIDGE_MAX_FRAME_LEN) {
 
-  llmp_page_t *page = shmem2page(&client_state->out_maps[client_state->out_map_count - 1]);
+    u8 *in_buf = afl_realloc(peer->in_buf, peer->in_len + LLMP_TCP_BRIDGE_READ_LEN);
+    if (!in_buf) { return false; }
+    peer->in_buf = in_buf;
 
-#ifdef AFL_DEBUG
-  if (!llmp_msg_in_page(page, msg)) {
+    ssize_t rlen = read(peer->fd, peer->in_buf + peer->in_len, LLMP_TCP_BRIDGE_READ_LEN);
+    if (rlen == 0) { return false; }
+    if (rlen < 0) {
 
-    FATAL("BUG: Message to send not in correct page (%p not in %p with size %ld)", msg, page, page->size_total);
+      if (errno == EINTR) { continue; }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+      return false;
+
+    }
+
+    peer->in_len += rlen;
 
   }
 
-#endif
+  size_t offset = 0;
+  while (peer->in_len - offset >= sizeof(llmp_tcp_frame_hdr_t)) {
 
-  bool ret = llmp_send(page, msg);
-  client_state->last_msg_sent = msg;
-  return ret;
+    llmp_tcp_frame_hdr_t hdr;
+    memcpy(&hdr, peer->in_buf + offset, sizeof(llmp_tcp_frame_hdr_t));
 
-}
+    u32    tag = ntohl(hdr.tag);
+    size_t buf_len = ntohl(hdr.buf_len);
+    if (buf_len > LLMP_TCP_BRIDGE_MAX_FRAME_LEN) {
 
-/* A simple client that, on connect, reads the new client's shmap str and
- * writes the broker's initial map str */
-void llmp_clientloop_process_server(llmp_client_t *client_state, void *data) {
+      WARNF("Bridge peer sent a frame of %zu bytes, disconnecting", buf_len);
+      return false;
 
-  int port = (int)(size_t)data;
+    }
+
+    /* Our broker would act on it, as if our bridge client had sent it */
+    if (llmp_tag_is_internal(tag)) {
+
+      WARNF("Bridge peer sent a msg with internal tag %X, disconnecting", tag);
+      return false;
 
-  llmp_payload_new_page_t initial_broadcast_map = {0};
-  initial_broadcast_map.map_size = client_state->current_broadcast_map->map_size;
-  memcpy(initial_broadcast_map.shm_str, client_state->current_broadcast_map->shm_str, AFL_SHMEM_STRLEN_MAX);
+    }
 
-  struct sockaddr_in serv_addr = {0};
+    if (peer->in_len - offset - sizeof(llmp_tcp_frame_hdr_t) < buf_len) { break; }
 
-  int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    u8 *buf = peer->in_buf + offset + sizeof(llmp_tcp_frame_hdr_t);
+    u64 id = (u64)ntohl(hdr.origin) << 32 | ntohl(hdr.origin_id);
+    if (!ntohl(hdr.origin)) {
 
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  /* port 2801 */
-  serv_addr.sin_port = htons(port);
+      WARNF("Bridge peer sent a msg without origin, disconnecting");
+      return false;
 
-  uint32_t backoff = 2;
-  while (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
+    }
 
-    WARNF("Could not bind to %d! Retrying in %d seconds.", port, backoff);
-    sleep(backoff);
-    backoff *= 2;
+    /* The peer has it, don't send it back. The other peers get it once our broker broadcasted it. */
+    llmp_b2b_seen(peer->seen, id);
+    if (!llmp_b2b_seen(bridge->seen, id) && !llmp_b2b_send_copy(bridge->client, tag, buf, buf_len, id)) {
 
-  }
+      FATAL("Could not pass msg from bridge peer on to our broker");
 
-  if (listen(listenfd, 10) == -1) { PFATAL("Coult not listen to %d", port); }
+    }
 
-  llmp_message_t *msg = llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+    offset += sizeof(llmp_tcp_frame_hdr_t) + buf_len;
+    (*count)++;
 
-  while (1) {
+  }
 
-    if (!msg) { FATAL("Error allocating new client msg in tcp client!"); }
+  memmove(peer->in_buf, peer->in_buf + offset, peer->in_len - offset);
+  peer->in_len -= offset;
+  return true;
 
-    msg->tag = LLMP_TAG_CLIENT_ADDED_V1;
-    llmp_payload_new_page_t *payload = (llmp_payload_new_page_t *)msg->buf;
+}
 
-    int connfd = accept(listenfd, (struct sockaddr *)NULL, NULL);
-    if (connfd == -1) {
+/* Sends our broker's new msgs to all peers that don't have them yet, and passes the new msgs from the peers on to our
+ * broker. Waits up to timeout_ms for the peers if there was nothing to do. Returns the number of msgs read. */
+size_t llmp_tcp_bridge_once(llmp_tcp_bridge_t *bridge, u32 timeout_ms) {
 
-      WARNF("Error on accept");
-      continue;
+  size_t          count = 0;
+  size_t          i;
+  llmp_message_t *msg;
 
-    }
+  if (bridge->hostname && !bridge->peer_count) { llmp_tcp_bridge_connect(bridge); }
 
-    DBG("New clientprocess connected");
+  /* Without peers, the msgs are simply dropped: we don't want to pin old broadcast pages */
+  while ((msg = llmp_client_recv(bridge->client))) {
 
-    if (write(connfd, &initial_broadcast_map, sizeof(llmp_payload_new_page_t)) != sizeof(llmp_payload_new_page_t)) {
+    count++;
+    if (msg->buf_len > LLMP_TCP_BRIDGE_MAX_FRAME_LEN) {
 
-      WARNF("Socket_client: TCP client disconnected immediately");
-      close(connfd);
+      WARNF("Not passing a msg of %zu bytes over the bridge", msg->buf_len);
       continue;
 
     }
 
-    size_t rlen_total = 0;
+    u64 id = llmp_b2b_msg_id(msg, bridge->origin, &bridge->origin_msgs);
+    llmp_b2b_seen(bridge->seen, id);
 
-    while (rlen_total < sizeof(llmp_payload_new_page_t)) {
+    for (i = bridge->peer_count; i > 0; i--) {
 
-      ssize_t rlen = read(connfd, payload + rlen_total, sizeof(llmp_payload_new_page_t) - rlen_total);
-      if (rlen < 0) {
+      llmp_tcp_bridge_peer_t *peer = &bridge->peers[i - 1];
+      if (llmp_b2b_seen(peer->seen, id)) { continue; }
 
-        // TODO: Handle EINTR?
-        WARNF("No complete map str receved from TCP client");
-        close(connfd);
-        continue;
+      if (!llmp_tcp_bridge_peer_queue(peer, msg->tag, msg->buf, msg->buf_len, id)) {
 
-      }
+        WARNF("Bridge peer does not keep up, disconnecting");
+        llmp_tcp_bridge_remove_peer(bridge, i - 1);
 
-      rlen_total += rlen;
+      }
 
     }
 
-    close(connfd);
+  }
 
-    DBG("Got new client with map id %s and size %ld", payload->shm_str, payload->map_size);
+  /* Give up on a connect that takes too long, we try again later */
+  for (i = bridge->peer_count; i > 0; i--) {
 
-    if (!llmp_client_send(client_state, msg)) { FATAL("BUG: Error sending incoming tcp msg to broker"); }
+    if (bridge->peers[i - 1].connecting &&
+        afl_get_cur_time() - bridge->last_connect_time > LLMP_TCP_BRIDGE_CONNECT_TIMEOUT_MS) {
 
-    msg = llmp_client_alloc_next(client_state, sizeof(llmp_payload_new_page_t));
+      DBG("Connecting to bridge peer %s:%d timed out", bridge->hostname, bridge->port);
+      llmp_tcp_bridge_remove_peer(bridge, i - 1);
+
+    }
 
   }
 
-}
+  /* Poll the listening socket and the wakefd (if any) first, then all peers */
+  size_t         peers_idx = 0;
+  size_t         wake_idx;
+  struct pollfd *pollfds = bridge->pollfds;
+  struct pollfd  own_polls[2];
 
-/* Creates a new, unconnected, client state */
-llmp_client_t *llmp_client_new_unconnected() {
+  /* No peers yet, so no pollfds */
+  if (!pollfds) { pollfds = own_polls; }
 
-  llmp_client_t *client_state = calloc(1, sizeof(llmp_client_t));
+  if (bridge->listenfd != -1) { pollfds[peers_idx++] = (struct pollfd){.fd = bridge->listenfd, .events = POLLIN}; }
+  wake_idx = peers_idx;
+  if (bridge->wakefd != -1) { pollfds[peers_idx++] = (struct pollfd){.fd = bridge->wakefd, .events = POLLIN}; }
 
-  client_state->current_broadcast_map = calloc(1, sizeof(afl_shmem_t));
-  if (!client_state->current_broadcast_map) {
+  for (i = 0; i < bridge->peer_count; i++) {
 
-    DBG("Could not allocate mem");
-    return NULL;
+    llmp_tcp_bridge_peer_t *peer = &bridge->peers[i];
 
-  }
+    if (!llmp_tcp_bridge_peer_flush(peer)) {
 
-  if (!(client_state->out_maps = afl_realloc((void *)client_state->out_maps, 1 * sizeof(afl_shmem_t)))) {
+      /* Will be noticed and removed below */
+      DBG("Could not write to bridge peer");
 
-    DBG("Could not allocate memory");
-    free(client_state->current_broadcast_map);
-    free(client_state);
-    return NULL;
+    }
+
+    pollfds[peers_idx + i].fd = peer->fd;
+    /* A connect is done once the socket gets writable */
+    pollfds[peers_idx + i].events =
+        peer->connecting ? POLLOUT : POLLIN | (peer->out_sent < peer->out_len ? POLLOUT : 0);
+    pollfds[peers_idx + i].revents = 0;
 
   }
 
-  client_state->out_map_count = 1;
+  if (poll(pollfds, peers_idx + bridge->peer_count, count ? 0 : timeout_ms) <= 0) { return count; }
 
-  if (!llmp_new_page_shmem(&client_state->out_maps[0], client_state->id, LLMP_INITIAL_MAP_SIZE)) {
+  /* Our broker has new msgs, we pick them up on the next call */
+  if (bridge->wakefd != -1 && pollfds[wake_idx].revents & POLLIN) {
 
-    DBG("Could not create sharedmem");
-    afl_free(client_state->out_maps);
-    free(client_state->current_broadcast_map);
-    free(client_state);
-    return NULL;
+    u8 drain[64];
+    while (read(bridge->wakefd, drain, sizeof(drain)) > 0) {}
 
   }
 
-  client_state->new_out_page_hook_count = 0;
-  client_state->new_out_page_hooks = NULL;
+  /* Backwards, as removing a peer moves the last one */
+  for (i = bridge->peer_count; i > 0; i--) {
 
-  return client_state;
+    llmp_tcp_bridge_peer_t *peer = &bridge->peers[i - 1];
+    short                   revents = pollfds[peers_idx + i - 1].revents;
+    bool                    alive = true;
 
-}
+    if (peer->connecting) {
 
-/* Destroys the given cient state */
-void llmp_client_delete(llmp_client_t *client_state) {
+      int       err = 0;
+      socklen_t err_len = sizeof(err);
+      if (!revents) { continue; }
 
-  size_t i;
-  for (i = 0; i < client_state->out_map_count; i++) {
+      if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err) {
 
-    afl_shmem_deinit(&client_state->out_maps[i]);
+        DBG("Could not connect to bridge peer %s:%d", bridge->hostname, bridge->port);
+        llmp_tcp_bridge_remove_peer(bridge, i - 1);
+        continue;
 
-  }
+      }
 
-  afl_free(client_state->out_maps);
-  client_state->out_maps = NULL;
-  client_state->out_map_count = 0;
+      peer->connecting = false;
+      revents = POLLOUT;
 
-  afl_free(client_state->new_out_page_hooks);
-  client_state->new_out_page_hooks = NULL;
-  client_state->new_out_page_hook_count = 0;
+    }
 
-  afl_shmem_deinit(client_state->current_broadcast_map);
-  free(client_state->current_broadcast_map);
-  client_state->current_broadcast_map = NULL;
-  free(client_state);
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
 
-}
+      alive = llmp_tcp_bridge_peer_recv(bridge, &bridge->peers[i - 1], &count);
 
-/* Creates a new client process that will connect to the given port */
-llmp_client_t *llmp_client_new(int port) {
+    }
 
-  int                connfd = 0;
-  struct sockaddr_in servaddr = {0};
+    if (alive && revents & POLLOUT) { alive = llmp_tcp_bridge_peer_flush(&bridge->peers[i - 1]); }
 
-  llmp_client_t *client_state = llmp_client_new_unconnected();
+    if (!alive) {
 
-  client_state->current_broadcast_map = calloc(1, sizeof(afl_shmem_t));
-  if (!client_state->current_broadcast_map) {
+      WARNF("Lost bridge peer");
+      llmp_tcp_bridge_remove_peer(bridge, i - 1);
 
-    llmp_client_delete(client_state);
-    DBG("Could not allocate mem");
-    return NULL;
+    }
 
   }
 
-  if (!(client_state->out_maps = afl_realloc((void *)client_state->out_maps, 1 * sizeof(afl_shmem_t)))) {
+  if (bridge->listenfd != -1 && pollfds[0].revents & POLLIN) {
 
-    DBG("Could not allocate memory");
-    free(client_state->current_broadcast_map);
-    free(client_state);
-    return NULL;
+    int connfd;
+    while ((connfd = accept(bridge->listenfd, NULL, NULL)) != -1) {
 
-  }
+      DBG("New bridge peer connected");
+      if (!llmp_tcp_bridge_add_peer(bridge, connfd)) {
 
-  client_state->out_map_count = 1;
+        WARNF("Could not add bridge peer");
+        close(connfd);
 
-  if (!llmp_new_page_shmem(&client_state->out_maps[0], client_state->id, LLMP_INITIAL_MAP_SIZE)) {
+      }
 
-    DBG("Could not create sharedmem");
-    goto error;
+    }
 
   }
 
-  // socket create and varification
-  connfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (connfd == -1) { PFATAL("Unable to create socket"); }
+  return count;
 
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  servaddr.sin_port = htons(port);
+}
 
-  if (connect(connfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0) {
+/* What the doorbell watcher of llmp_clientloop_tcp_bridge needs */
+typedef struct llmp_tcp_bridge_watch {
 
-    DBG("Unable to connect to broker at localhost:%d, make sure it's running "
-        "and has a port exposed",
-        port);
-    goto error;
+  llmp_doorbell_t *doorbell;
+  /* The write end of the bridge's wakefd */
+  int wakefd;
 
-  }
+} llmp_tcp_bridge_watch_t;
 
-  llmp_payload_new_page_t client_map_msg, broker_map_msg = {0};
-  client_map_msg.map_size = client_state->out_maps[0].map_size;
-  memcpy(client_map_msg.shm_str, client_state->out_maps[0].shm_str, AFL_SHMEM_STRLEN_MAX);
+/* Turns rings of the bridge's doorbell into bytes on its wakefd, so the bridge can sleep in poll */
+static void *llmp_tcp_bridge_watch_doorbell(void *data) {
 
-  if (write(connfd, &client_map_msg, sizeof(llmp_payload_new_page_t)) != sizeof(llmp_payload_new_page_t)) {
+  llmp_tcp_bridge_watch_t *watch = (llmp_tcp_bridge_watch_t *)data;
+  u32                      seen = __atomic_load_n(&watch->doorbell->ring, __ATOMIC_SEQ_CST);
 
-    afl_shmem_deinit(&client_state->out_maps[0]);
-    free(client_state);
-    close(connfd);
-    return NULL;
-    FATAL("Socket_client: TCP server disconnected immediately");
+  while (1) {
+
+    llmp_doorbell_await(watch->doorbell, seen, 1000);
+
+    /* Rings after this load make the next await return right away */
+    u32 ring = __atomic_load_n(&watch->doorbell->ring, __ATOMIC_SEQ_CST);
+    if (ring == seen) { continue; }
+    seen = ring;
+
+    /* A full pipe wakes the bridge all the same */
+    if (write(watch->wakefd, "", 1) == -1 && errno != EAGAIN) { WARNF("Could not wake the tcp bridge"); }
 
   }
 
-  size_t rlen_total = 0;
+  return NULL;
 
-  while (rlen_total < sizeof(llmp_payload_new_page_t)) {
+}
 
-    ssize_t rlen = read(connfd, &broker_map_msg + rlen_total, sizeof(llmp_payload_new_page_t) - rlen_total);
-    if (rlen < 0) {
+/* A clientloop running a tcp bridge, data is an llmp_tcp_bridge_t with hostname and port set */
+void llmp_clientloop_tcp_bridge(llmp_client_t *client_state, void *data) {
 
-      // TODO: Handle EINTR?
-      DBG("Got short response from broker via TCP");
-      close(connfd);
-      afl_shmem_deinit(&client_state->out_maps[0]);
-      goto error;
+  llmp_tcp_bridge_t *     bridge = (llmp_tcp_bridge_t *)data;
+  afl_shmem_t             doorbell_map = {0};
+  llmp_tcp_bridge_watch_t watch = {0};
+  pthread_t               watcher;
+  int                     wake_pipe[2];
 
-    }
+  uint32_t backoff = 2;
+  while (llmp_tcp_bridge_init(bridge, client_state, bridge->hostname, bridge->port) != AFL_RET_SUCCESS) {
 
-    rlen_total += rlen;
+    WARNF("Could not listen on %d for bridge peers! Retrying in %d seconds.", bridge->port, backoff);
+    sleep(backoff);
+    backoff = MIN(backoff * 2, 60U);
 
   }
 
-  close(connfd);
+  /* Our broker rings it after its broadcasts, the watcher passes that on to the bridge's poll */
+  if (!afl_shmem_init(&doorbell_map, sizeof(llmp_doorbell_t))) { FATAL("Could not init the tcp bridge's doorbell"); }
+  memset(doorbell_map.map, 0, sizeof(llmp_doorbell_t));
+  if (llmp_client_register_doorbell(client_state, &doorbell_map) != AFL_RET_SUCCESS) {
 
-  if (!afl_shmem_by_str(client_state->current_broadcast_map, broker_map_msg.shm_str, broker_map_msg.map_size)) {
+    FATAL("Could not register the tcp bridge's doorbell");
 
-    // TODO: Handle EINTR?
-    DBG("Could not allocate shmem");
-    afl_shmem_deinit(&client_state->out_maps[0]);
-    goto error;
+  }
+
+  if (pipe(wake_pipe) == -1 || fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+
+    PFATAL("Could not create the tcp bridge's wake pipe");
 
   }
 
-  return client_state;
+  bridge->wakefd = wake_pipe[0];
+  watch.doorbell = (llmp_doorbell_t *)doorbell_map.map;
+  watch.wakefd = wake_pipe[1];
+  if (pthread_create(&watcher, NULL, llmp_tcp_bridge_watch_doorbell, &watch)) {
 
-error:
-  llmp_client_delete(client_state);
-  return NULL;
+    FATAL("Could not start the tcp bridge's doorbell watcher");
+
+  }
+
+  while (1) {
+
+    /* Sleeps until a peer or our broker has something for us (or a reconnect is due) */
+    llmp_tcp_bridge_once(bridge, 1000);
+
+  }
 
 }
 
@@ -1487,11 +3318,23 @@ bool llmp_broker_register_childprocess_clientloop(llmp_broker_t *broker, llmp_cl
   memcpy(client->client_state->out_maps, &client_map, sizeof(afl_shmem_t));
   client->client_state->out_map_count = 1;
 
-  /* Each client starts with the very first map.
-  They should then iterate through all maps once and work on all old messages.
-  */
-  client->client_state->current_broadcast_map = &broker->broadcast_maps[0];
-  client->client_state->out_map_count = 1;
+  if (!llmp_broker_map_client_broadcast(broker, client)) {
+
+    DBG("Could not map the broadcast map for client %d", client->client_state->id);
+    afl_shmem_deinit(&client_map);
+    afl_shmem_deinit(client->cur_client_map);
+    broker->llmp_client_count--;
+    return false;
+
+  }
+
+  /* Map the doorbell for this client, so it can wake us up */
+  if (!afl_shmem_by_str(&client->client_state->doorbell_map, broker->doorbell_map.shm_str,
+                        broker->doorbell_map.map_size)) {
+
+    DBG("Could not map the doorbell for client %d", client->client_state->id);
+
+  }
 
   DBG("Registered threaded client with id %d (loop func at %p)", client->client_state->id, client->clientloop);
 
@@ -1560,11 +3403,24 @@ bool llmp_broker_register_threaded_clientloop(llmp_broker_t *broker, llmp_client
   memcpy(client->client_state->out_maps, &client_map, sizeof(afl_shmem_t));
   client->client_state->out_map_count = 1;
 
-  /* Each client starts with the very first map.
-  They should then iterate through all maps once and work on all old messages.
-  */
-  client->client_state->current_broadcast_map = &broker->broadcast_maps[0];
-  client->client_state->out_map_count = 1;
+  if (!llmp_broker_map_client_broadcast(broker, client)) {
+
+    DBG("Could not map the broadcast map for client %d", client->client_state->id);
+    afl_shmem_deinit(&client_map);
+    afl_shmem_deinit(client->cur_client_map);
+    free(pthread);
+    broker->llmp_client_count--;
+    return false;
+
+  }
+
+  /* Map the doorbell for this client, so it can wake us up */
+  if (!afl_shmem_by_str(&client->client_state->doorbell_map, broker->doorbell_map.shm_str,
+                        broker->doorbell_map.map_size)) {
+
+    DBG("Could not map the doorbell for client %d", client->client_state->id);
+
+  }
 
   DBG("Registered threaded client with id %d (loop func at %p)", client->client_state->id, client->clientloop);
 
@@ -1587,6 +3443,50 @@ bool llmp_broker_register_local_server(llmp_broker_t *broker, int port) {
 
 }
 
+/* Register a threaded client linking this (sub) broker to a parent broker on
+ * this machine, that has a local server at parent_port */
+bool llmp_broker_register_parent_link(llmp_broker_t *broker, int parent_port) {
+
+  if (!llmp_broker_register_threaded_clientloop(broker, llmp_clientloop_b2b_link, (void *)(size_t)parent_port)) {
+
+    DBG("Error registering new threaded client");
+    return false;
+
+  }
+
+  return true;
+
+}
+
+/* Register a threaded client bridging this broker to other brokers via tcp.
+ * If hostname is NULL, listens for them on port (on all interfaces if listen_remote), else connects to hostname:port */
+bool llmp_broker_register_tcp_bridge(llmp_broker_t *broker, char *hostname, int port, bool listen_remote) {
+
+  llmp_tcp_bridge_t *bridge = calloc(1, sizeof(llmp_tcp_bridge_t));
+  if (!bridge) { return false; }
+
+  bridge->port = port;
+  bridge->listen_remote = listen_remote;
+  if (hostname && !(bridge->hostname = strdup(hostname))) {
+
+    free(bridge);
+    return false;
+
+  }
+
+  if (!llmp_broker_register_threaded_clientloop(broker, llmp_clientloop_tcp_bridge, bridge)) {
+
+    DBG("Error registering new threaded client");
+    free(bridge->hostname);
+    free(bridge);
+    return false;
+
+  }
+
+  return true;
+
+}
+
 /* Generic function to add a hook to the mem pointed to by hooks_p, using afl_realloc on the mem area, and increasing
  * hooks_count_p */
 afl_ret_t llmp_add_hook_generic(llmp_hookdata_t **hooks_p, size_t *hooks_count_p, void *new_hook_func,
@@ -1626,6 +3526,13 @@ afl_ret_t llmp_broker_add_message_hook(llmp_broker_t *broker, llmp_message_hook_
 
 }
 
+/* Adds a hook that gets called in the broker once for each run of new messages, before the per-message hooks. */
+afl_ret_t llmp_broker_add_message_batch_hook(llmp_broker_t *broker, llmp_message_batch_hook_func *hook, void *data) {
+
+  return llmp_add_hook_generic(&broker->msg_batch_hooks, &broker->msg_batch_hook_count, (void *)hook, data);
+
+}
+
 /* Allocate and set up the new broker instance. Afterwards, run with
  * broker_run.
  */
@@ -1646,6 +3553,8 @@ afl_ret_t llmp_broker_init(llmp_broker_t *broker) {
   broker->llmp_client_count = 0;
   broker->llmp_clients = NULL;
 
+  broker->zero_copy_min_len = LLMP_ZERO_COPY_MIN_LEN;
+
   if (!llmp_new_page_shmem(_llmp_broker_current_broadcast_map(broker), -1, LLMP_INITIAL_MAP_SIZE)) {
 
     DBG("Broker map init failed");
@@ -1654,6 +3563,17 @@ afl_ret_t llmp_broker_init(llmp_broker_t *broker) {
 
   }
 
+  if (!afl_shmem_init(&broker->doorbell_map, sizeof(llmp_doorbell_t))) {
+
+    DBG("Broker doorbell init failed");
+    afl_shmem_deinit(_llmp_broker_current_broadcast_map(broker));
+    afl_free(broker->broadcast_maps);
+    return AFL_RET_ALLOC;
+
+  }
+
+  memset(broker->doorbell_map.map, 0, sizeof(llmp_doorbell_t));
+
   DBG("Sucess");
   return AFL_RET_SUCCESS;
 
@@ -1672,12 +3592,33 @@ void llmp_broker_deinit(llmp_broker_t *broker) {
 
     afl_shmem_deinit(broker->llmp_clients[i].cur_client_map);
     free(broker->llmp_clients[i].cur_client_map);
+    afl_shmem_deinit(&broker->llmp_clients[i].broadcast_doorbell_map);
     // TODO: Properly clean up the client
 
   }
 
   afl_free(broker->broadcast_maps);
   broker->broadcast_map_count = 0;
+  afl_shmem_deinit(&broker->doorbell_map);
+
+  for (i = 0; i < broker->ref_map_count; i++) {
+
+    afl_shmem_deinit(&broker->ref_maps[i].map);
+
+  }
+
+  afl_free(broker->ref_maps);
+  broker->ref_maps = NULL;
+  broker->ref_map_count = 0;
+
+  afl_free(broker->batch_forward);
+  broker->batch_forward = NULL;
+  broker->batch_forward_size = 0;
+
+  afl_free(broker->decompress_buf);
+  broker->decompress_buf = NULL;
+  afl_free(broker->compress_buf);
+  broker->compress_buf = NULL;
   afl_free(broker->llmp_clients);
   broker->llmp_client_count = 0;
 
@@ -0,0 +1,459 @@
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#ifdef __linux__
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <linux/fs.h>
+  #include <linux/userfaultfd.h>
+#endif
+
+#include "memsnapshot.h"
+#include "alloc-inl.h"
+
+#ifdef __linux__
+  /* From Linux 6.7, our headers may be older than the kernel */
+  #ifndef UFFD_USER_MODE_ONLY
+    #define UFFD_USER_MODE_ONLY 1
+  #endif
+  #ifndef UFFD_FEATURE_WP_UNPOPULATED
+    #define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+  #endif
+  #ifndef UFFD_FEATURE_WP_ASYNC
+    #define UFFD_FEATURE_WP_ASYNC (1 << 15)
+  #endif
+  #ifndef PAGEMAP_SCAN
+struct page_region {
+
+  __u64 start;
+  __u64 end;
+  __u64 categories;
+
+};
+
+struct pm_scan_arg {
+
+  __u64 size;
+  __u64 flags;
+  __u64 start;
+  __u64 end;
+  __u64 walk_end;
+  __u64 vec;
+  __u64 vec_len;
+  __u64 max_pages;
+  __u64 category_inverted;
+  __u64 category_mask;
+  __u64 category_anyof_mask;
+  __u64 return_mask;
+
+};
+
+    #define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+    #define PAGE_IS_WRITTEN (1 << 1)
+  #endif
+
+  #define PM_SOFT_DIRTY (1ULL << 55)
+  /* How many written regions we get from one PAGEMAP_SCAN */
+  #define MEM_SNAPSHOT_SCAN_REGIONS (64)
+
+/* clear_refs clears the soft-dirty bits of the whole process, so only one snapshot at a time may use them */
+static afl_mem_snapshot_t *afl_mem_snapshot_soft_dirty_owner;
+#endif
+
+afl_ret_t afl_mem_snapshot_init(afl_mem_snapshot_t *snapshot) {
+
+  memset(snapshot, 0, sizeof(afl_mem_snapshot_t));
+
+  snapshot->tracking = AFL_MEM_SNAPSHOT_FULL;
+  snapshot->page_size = sysconf(_SC_PAGESIZE);
+  snapshot->uffd = -1;
+  snapshot->pagemap_fd = -1;
+  snapshot->clear_refs_fd = -1;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+void afl_mem_snapshot_deinit(afl_mem_snapshot_t *snapshot) {
+
+  size_t i;
+  for (i = 0; i < snapshot->ranges_count; i++) {
+
+    free(snapshot->ranges[i].copy);
+
+  }
+
+  afl_free(snapshot->ranges);
+  afl_free(snapshot->pagemap_buf);
+  snapshot->ranges = NULL;
+  snapshot->pagemap_buf = NULL;
+  snapshot->ranges_count = 0;
+
+  if (snapshot->uffd >= 0) { close(snapshot->uffd); }
+  if (snapshot->pagemap_fd >= 0) { close(snapshot->pagemap_fd); }
+  if (snapshot->clear_refs_fd >= 0) { close(snapshot->clear_refs_fd); }
+  snapshot->uffd = -1;
+  snapshot->pagemap_fd = -1;
+  snapshot->clear_refs_fd = -1;
+
+#ifdef __linux__
+  afl_mem_snapshot_t *owner = snapshot;
+  __atomic_compare_exchange_n(&afl_mem_snapshot_soft_dirty_owner, &owner, NULL, false, __ATOMIC_ACQ_REL,
+                              __ATOMIC_ACQUIRE);
+#endif
+
+  snapshot->taken = false;
+
+}
+
+afl_ret_t afl_mem_snapshot_add_range(afl_mem_snapshot_t *snapshot, void *start, size_t len) {
+
+  uintptr_t page_mask = snapshot->page_size - 1;
+  uintptr_t range_start = (uintptr_t)start & ~page_mask;
+  uintptr_t range_end = ((uintptr_t)start + len + page_mask) & ~page_mask;
+
+  if (!len) { return AFL_RET_SUCCESS; }
+
+  afl_mem_snapshot_range_t *ranges =
+      afl_realloc(snapshot->ranges, (snapshot->ranges_count + 1) * sizeof(afl_mem_snapshot_range_t));
+  if (!ranges) { return AFL_RET_ALLOC; }
+
+  snapshot->ranges = ranges;
+  afl_mem_snapshot_range_t *range = &snapshot->ranges[snapshot->ranges_count++];
+  range->start = (u8 *)range_start;
+  range->len = range_end - range_start;
+  range->copy = NULL;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+typedef struct afl_mem_snapshot_module {
+
+  afl_mem_snapshot_t *snapshot;
+  uintptr_t           addr;
+  afl_ret_t           ret;
+
+} afl_mem_snapshot_module_t;
+
+static int afl_mem_snapshot_add_module_cb(struct dl_phdr_info *info, size_t size, void *data) {
+
+  (void)size;
+
+  afl_mem_snapshot_module_t *module = (afl_mem_snapshot_module_t *)data;
+  uintptr_t                  page_mask = module->snapshot->page_size - 1, relro_end = 0;
+  bool                       in_module = false;
+  int                        i;
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uintptr_t         start = info->dlpi_addr + phdr->p_vaddr;
+
+    if (phdr->p_type == PT_LOAD && module->addr >= start && module->addr < start + phdr->p_memsz) { in_module = true; }
+    /* The loader makes it read only once relocated, from its start to the page its end is in */
+    if (phdr->p_type == PT_GNU_RELRO) { relro_end = (start + phdr->p_memsz) & ~page_mask; }
+
+  }
+
+  if (!in_module) { return 0; }
+  module->ret = AFL_RET_SUCCESS;
+
+  /* The writable segments, their .bss up to p_memsz */
+  for (i = 0; i < info->dlpi_phnum; i++) {
+
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_W)) { continue; }
+
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr, end = start + phdr->p_memsz;
+    if (start < relro_end) { start = relro_end; }
+    if (start >= end) { continue; }
+
+    module->ret = afl_mem_snapshot_add_range(module->snapshot, (void *)start, end - start);
+    if (module->ret != AFL_RET_SUCCESS) { break; }
+
+  }
+
+  return 1;
+
+}
+
+afl_ret_t afl_mem_snapshot_add_module(afl_mem_snapshot_t *snapshot, void *addr) {
+
+  afl_mem_snapshot_module_t module = {.snapshot = snapshot, .addr = (uintptr_t)addr, .ret = AFL_RET_NULL_PTR};
+
+  /* Stays AFL_RET_NULL_PTR if no module has addr */
+  dl_iterate_phdr(afl_mem_snapshot_add_module_cb, &module);
+  return module.ret;
+
+}
+
+#ifdef __linux__
+/* Async write protection marks the pages written, without us handling any fault */
+static bool afl_mem_snapshot_init_uffd(afl_mem_snapshot_t *snapshot) {
+
+  struct uffdio_api api = {.api = UFFD_API, .features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED};
+
+  if (snapshot->uffd < 0) {
+
+    snapshot->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    /* Without privileges, if vm.unprivileged_userfaultfd is 0 */
+    if (snapshot->uffd < 0) { snapshot->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY); }
+    if (snapshot->uffd < 0) { return false; }
+
+    if (ioctl(snapshot->uffd, UFFDIO_API, &api)) {
+
+      close(snapshot->uffd);
+      snapshot->uffd = -1;
+      return false;
+
+    }
+
+  }
+
+  size_t i;
+  for (i = 0; i < snapshot->ranges_count; i++) {
+
+    afl_mem_snapshot_range_t *  range = &snapshot->ranges[i];
+    struct uffdio_register      reg = {.range = {(u64)range->start, range->len}, .mode = UFFDIO_REGISTER_MODE_WP};
+    struct uffdio_writeprotect  wp = {.range = {(u64)range->start, range->len}, .mode = UFFDIO_WRITEPROTECT_MODE_WP};
+
+    if (ioctl(snapshot->uffd, UFFDIO_REGISTER, &reg) || ioctl(snapshot->uffd, UFFDIO_WRITEPROTECT, &wp)) {
+
+      return false;
+
+    }
+
+  }
+
+  /* Older kernels can do the above, but not tell us what got written */
+  struct page_region  region;
+  struct pm_scan_arg  scan = {.size = sizeof(scan),
+                             .start = (u64)snapshot->ranges[0].start,
+                             .end = (u64)snapshot->ranges[0].start + snapshot->page_size,
+                             .vec = (u64)&region,
+                             .vec_len = 1,
+                             .category_mask = PAGE_IS_WRITTEN,
+                             .return_mask = PAGE_IS_WRITTEN};
+  return ioctl(snapshot->pagemap_fd, PAGEMAP_SCAN, &scan) >= 0;
+
+}
+
+static bool afl_mem_snapshot_clear_soft_dirty(afl_mem_snapshot_t *snapshot) {
+
+  return pwrite(snapshot->clear_refs_fd, "4", 1, 0) == 1;
+
+}
+
+/* If the kernel keeps the soft-dirty bits (CONFIG_MEM_SOFT_DIRTY), a write to our first page sets its bit.
+   Only for the first snapshot to ask, the others copy whole ranges. */
+static bool afl_mem_snapshot_init_soft_dirty(afl_mem_snapshot_t *snapshot) {
+
+  afl_mem_snapshot_t *owner = NULL;
+  if (!__atomic_compare_exchange_n(&afl_mem_snapshot_soft_dirty_owner, &owner, snapshot, false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE) &&
+      owner != snapshot) {
+
+    return false;
+
+  }
+
+  if (snapshot->clear_refs_fd < 0) { snapshot->clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC); }
+  if (snapshot->clear_refs_fd < 0 || !afl_mem_snapshot_clear_soft_dirty(snapshot)) { return false; }
+
+  volatile u8 *page = snapshot->ranges[0].start;
+  u64          entry;
+  off_t        offset = ((uintptr_t)page / snapshot->page_size) * sizeof(u64);
+
+  *page = *page;
+  if (pread(snapshot->pagemap_fd, &entry, sizeof(entry), offset) != sizeof(entry) || !(entry & PM_SOFT_DIRTY)) {
+
+    return false;
+
+  }
+
+  return afl_mem_snapshot_clear_soft_dirty(snapshot);
+
+}
+
+#endif
+
+afl_ret_t afl_mem_snapshot_take(afl_mem_snapshot_t *snapshot) {
+
+  size_t i;
+  for (i = 0; i < snapshot->ranges_count; i++) {
+
+    afl_mem_snapshot_range_t *range = &snapshot->ranges[i];
+
+    if (!range->copy) { range->copy = malloc(range->len); }
+    if (!range->copy) { return AFL_RET_ALLOC; }
+
+  }
+
+  snapshot->tracking = AFL_MEM_SNAPSHOT_FULL;
+
+#ifdef __linux__
+  if (snapshot->ranges_count) {
+
+    if (snapshot->pagemap_fd < 0) { snapshot->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC); }
+
+    if (snapshot->pagemap_fd >= 0 && afl_mem_snapshot_init_uffd(snapshot)) {
+
+      snapshot->tracking = AFL_MEM_SNAPSHOT_UFFD_WP;
+
+    } else if (snapshot->pagemap_fd >= 0 && afl_mem_snapshot_init_soft_dirty(snapshot)) {
+
+      snapshot->tracking = AFL_MEM_SNAPSHOT_SOFT_DIRTY;
+
+    }
+
+  }
+
+  /* Someone else may use the soft-dirty bits now */
+  afl_mem_snapshot_t *owner = snapshot;
+  if (snapshot->tracking != AFL_MEM_SNAPSHOT_SOFT_DIRTY) {
+
+    __atomic_compare_exchange_n(&afl_mem_snapshot_soft_dirty_owner, &owner, NULL, false, __ATOMIC_ACQ_REL,
+                                __ATOMIC_ACQUIRE);
+
+  }
+
+#endif
+
+  /* Write protection and dirty bits are in place, everything from here on counts */
+  for (i = 0; i < snapshot->ranges_count; i++) {
+
+    memcpy(snapshot->ranges[i].copy, snapshot->ranges[i].start, snapshot->ranges[i].len);
+
+  }
+
+  snapshot->taken = true;
+  return AFL_RET_SUCCESS;
+
+}
+
+static void afl_mem_snapshot_restore_pages(afl_mem_snapshot_t *snapshot, afl_mem_snapshot_range_t *range, u8 *start,
+                                           u8 *end) {
+
+  memcpy(start, range->copy + (start - range->start), end - start);
+  snapshot->restored_pages += (end - start) / snapshot->page_size;
+
+}
+
+#ifdef __linux__
+static void afl_mem_snapshot_restore_uffd(afl_mem_snapshot_t *snapshot, afl_mem_snapshot_range_t *range) {
+
+  struct page_region regions[MEM_SNAPSHOT_SCAN_REGIONS];
+  struct pm_scan_arg scan = {.size = sizeof(scan),
+                             .start = (u64)range->start,
+                             .end = (u64)range->start + range->len,
+                             .vec = (u64)regions,
+                             .vec_len = MEM_SNAPSHOT_SCAN_REGIONS,
+                             .category_mask = PAGE_IS_WRITTEN,
+                             .return_mask = PAGE_IS_WRITTEN};
+
+  while (scan.start < scan.end) {
+
+    long n = ioctl(snapshot->pagemap_fd, PAGEMAP_SCAN, &scan);
+    if (n < 0) { PFATAL("PAGEMAP_SCAN failed"); }
+
+    long j;
+    for (j = 0; j < n; j++) {
+
+      afl_mem_snapshot_restore_pages(snapshot, range, (u8 *)regions[j].start, (u8 *)regions[j].end);
+
+      /* Our own writes just now count as well */
+      struct uffdio_writeprotect wp = {.range = {regions[j].start, regions[j].end - regions[j].start},
+                                       .mode = UFFDIO_WRITEPROTECT_MODE_WP};
+      if (ioctl(snapshot->uffd, UFFDIO_WRITEPROTECT, &wp)) { PFATAL("UFFDIO_WRITEPROTECT failed"); }
+
+    }
+
+    /* The whole range, unless regions ran out */
+    scan.start = scan.walk_end;
+
+  }
+
+}
+
+static void afl_mem_snapshot_restore_soft_dirty(afl_mem_snapshot_t *snapshot, afl_mem_snapshot_range_t *range) {
+
+  size_t pages = range->len / snapshot->page_size;
+  off_t  offset = ((uintptr_t)range->start / snapshot->page_size) * sizeof(u64);
+
+  snapshot->pagemap_buf = afl_realloc(snapshot->pagemap_buf, pages * sizeof(u64));
+  if (!snapshot->pagemap_buf) { FATAL("Out of memory"); }
+
+  ssize_t read_len = pread(snapshot->pagemap_fd, snapshot->pagemap_buf, pages * sizeof(u64), offset);
+  if (read_len < 0 || (size_t)read_len != pages * sizeof(u64)) { PFATAL("Could not read /proc/self/pagemap"); }
+
+  /* Copy runs of dirty pages at once */
+  size_t page = 0, run_start;
+  while (page < pages) {
+
+    if (!(snapshot->pagemap_buf[page] & PM_SOFT_DIRTY)) {
+
+      page++;
+      continue;
+
+    }
+
+    run_start = page;
+    while (page < pages && (snapshot->pagemap_buf[page] & PM_SOFT_DIRTY)) {
+
+      page++;
+
+    }
+
+    afl_mem_snapshot_restore_pages(snapshot, range, range->start + run_start * snapshot->page_size,
+                                   range->start + page * snapshot->page_size);
+
+  }
+
+}
+
+#endif
+
+void afl_mem_snapshot_restore(afl_mem_snapshot_t *snapshot) {
+
+  size_t i;
+  for (i = 0; i < snapshot->ranges_count; i++) {
+
+    afl_mem_snapshot_range_t *range = &snapshot->ranges[i];
+
+    switch (snapshot->tracking) {
+
+#ifdef __linux__
+      case AFL_MEM_SNAPSHOT_UFFD_WP:
+        afl_mem_snapshot_restore_uffd(snapshot, range);
+        break;
+      case AFL_MEM_SNAPSHOT_SOFT_DIRTY:
+        afl_mem_snapshot_restore_soft_dirty(snapshot, range);
+        break;
+#endif
+      default:
+        afl_mem_snapshot_restore_pages(snapshot, range, range->start, range->start + range->len);
+        break;
+
+    }
+
+  }
+
+#ifdef __linux__
+  if (snapshot->tracking == AFL_MEM_SNAPSHOT_SOFT_DIRTY && !afl_mem_snapshot_clear_soft_dirty(snapshot)) {
+
+    PFATAL("Could not clear the soft-dirty bits");
+
+  }
+
+#endif
+
+}
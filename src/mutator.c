@@ -44,6 +44,8 @@ afl_ret_t afl_mutator_init(afl_mutator_t *mutator, afl_engine_t *engine) {
 
 void afl_mutator_deinit(afl_mutator_t *mutator) {
 
+  afl_free(mutator->mutate_buf);
+  mutator->mutate_buf = NULL;
   mutator->engine = NULL;
 
 }
@@ -311,6 +313,17 @@ inline void afl_mutfunc_delete_bytes(afl_mutator_t *mutator, afl_input_t *input)
 
 }
 
+/* The mutation was written to mutate_buf: it becomes the input's own buf, and the mutator keeps the one the input had.
+   So no two inputs ever share the bytes, even with several copies in flight. */
+static void afl_mutator_swap_buf(afl_mutator_t *mutator, afl_input_t *input) {
+
+  u8 *buf = mutator->mutate_buf;
+  mutator->mutate_buf = input->copy_buf;
+  input->copy_buf = buf;
+  input->bytes = buf;
+
+}
+
 void afl_mutfunc_clone_bytes(afl_mutator_t *mutator, afl_input_t *input) {
 
   if (unlikely(!input->len)) { return; }
@@ -331,23 +344,26 @@ void afl_mutfunc_clone_bytes(afl_mutator_t *mutator, afl_input_t *input) {
     clone_len = choose_block_len(rand, size);
     clone_from = afl_rand_below(rand, size - clone_len + 1);
 
-    mutator->mutate_buf = afl_realloc(mutator->mutate_buf, clone_len + size);
+    u8 *buf = afl_realloc(mutator->mutate_buf, clone_len + size);
+    if (!buf) { return; }
+    mutator->mutate_buf = buf;
 
-    input->bytes =
-        afl_insert_substring(input->bytes, mutator->mutate_buf, size, input->bytes + clone_from, clone_len, clone_to);
-    input->len += clone_len;
+    afl_insert_substring(input->bytes, buf, size, input->bytes + clone_from, clone_len, clone_to);
 
   } else {
 
     clone_len = choose_block_len(rand, HAVOC_BLK_XL);
 
-    input->bytes =
-        afl_insert_bytes(input->bytes, mutator->mutate_buf, size, afl_rand_below(rand, 255), clone_len, clone_to);
+    u8 *buf = afl_realloc(mutator->mutate_buf, clone_len + size);
+    if (!buf) { return; }
+    mutator->mutate_buf = buf;
 
-    input->len += clone_len;
+    afl_insert_bytes(input->bytes, buf, size, afl_rand_below(rand, 255), clone_len, clone_to);
 
   }
 
+  afl_mutator_swap_buf(mutator, input);
+  input->len += clone_len;
 
 }
 
@@ -434,13 +450,16 @@ void afl_mutfunc_splice(afl_mutator_t *mutator, afl_input_t *input) {
 
   /* Do the thing. */
 
-  input->len = splice_input->len;
-
   /* Let's use the mutate_buf for splicing */
-  mutator->mutate_buf = afl_realloc(mutator->mutate_buf, input->len);
-  memcpy(mutator->mutate_buf, input->bytes, split_at);
-  input->bytes = mutator->mutate_buf;
-  memcpy(input->bytes + split_at, splice_input->bytes + split_at, splice_input->len - split_at);
+  u8 *buf = afl_realloc(mutator->mutate_buf, splice_input->len);
+  if (!buf) { return; }
+  mutator->mutate_buf = buf;
+
+  memcpy(buf, input->bytes, split_at);
+  memcpy(buf + split_at, splice_input->bytes + split_at, splice_input->len - split_at);
+
+  afl_mutator_swap_buf(mutator, input);
+  input->len = splice_input->len;
 
 }
 
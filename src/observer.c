@@ -71,6 +71,20 @@ void afl_observer_post_exec(afl_observer_t *channel) {
 
 }
 
+const u8 afl_count_class_lookup8[256] = {
+
+    [0] = 0,
+    [1] = 1,
+    [2] = 2,
+    [3] = 4,
+    [4 ... 7] = 8,
+    [8 ... 15] = 16,
+    [16 ... 31] = 32,
+    [32 ... 127] = 64,
+    [128 ... 255] = 128
+
+};
+
 afl_ret_t afl_observer_covmap_init(afl_observer_covmap_t *map_channel, size_t map_size) {
 
   afl_observer_init(&map_channel->base);
@@ -79,6 +93,13 @@ afl_ret_t afl_observer_covmap_init(afl_observer_covmap_t *map_channel, size_t ma
   if (!afl_shmem_init(&map_channel->shared_map, map_size)) { return AFL_RET_ERROR_INITIALIZE; }
 
   map_channel->base.funcs.reset = afl_observer_covmap_reset;
+  map_channel->base.funcs.post_exec = afl_observer_covmap_post_exec;
+
+  map_channel->classify_counts = false;
+  map_channel->counts_raw = false;
+
+  map_channel->dirty_map.map = NULL;
+  map_channel->dirty_map.map_size = 0;
 
   map_channel->funcs.get_map_size = afl_observer_covmap_get_map_size;
   map_channel->funcs.get_trace_bits = afl_observer_covmap_get_trace_bits;
@@ -90,6 +111,7 @@ afl_ret_t afl_observer_covmap_init(afl_observer_covmap_t *map_channel, size_t ma
 void afl_observer_covmap_deinit(afl_observer_covmap_t *map_channel) {
 
   afl_shmem_deinit(&map_channel->shared_map);
+  if (map_channel->dirty_map.map) { afl_shmem_deinit(&map_channel->dirty_map); }
 
   afl_observer_deinit(&map_channel->base);
 
@@ -99,12 +121,164 @@ void afl_observer_covmap_reset(afl_observer_t *channel) {
 
   afl_observer_covmap_t *map_channel = (afl_observer_covmap_t *)channel;
 
+  map_channel->counts_raw = false;
+
+  if (!map_channel->dirty_map.map) {
+
+    memset(map_channel->shared_map.map, 0, map_channel->shared_map.map_size);
+    return;
+
+  }
+
+  /* Only clear what was written to */
+  for (size_t block = afl_observer_covmap_next_dirty(map_channel, 0); block != SIZE_MAX;
+       block = afl_observer_covmap_next_dirty(map_channel, block + 1)) {
+
+    memset(map_channel->shared_map.map + (block << DIRTY_BLOCK_SHIFT), 0,
+           afl_observer_covmap_block_len(map_channel, block));
+
+  }
+
+  /* The marker stays, it is set once when the instrumentation attaches */
+  memset(map_channel->dirty_map.map, 0, DIRTY_MAP_BLOCKS(map_channel->shared_map.map_size));
+
+}
+
+afl_ret_t afl_observer_covmap_track_dirty(afl_observer_covmap_t *map_channel) {
+
+  if (map_channel->dirty_map.map) { return AFL_RET_SUCCESS; }
+
+  if (!afl_shmem_init(&map_channel->dirty_map, DIRTY_MAP_SIZE(map_channel->shared_map.map_size))) {
+
+    map_channel->dirty_map.map = NULL;
+    return AFL_RET_ERROR_INITIALIZE;
+
+  }
+
+  /* Whatever is in the map right now was written without us knowing */
   memset(map_channel->shared_map.map, 0, map_channel->shared_map.map_size);
 
+  return AFL_RET_SUCCESS;
+
+}
+
+size_t afl_observer_covmap_next_dirty(afl_observer_covmap_t *map_channel, size_t block) {
+
+  u8 *   dirty = map_channel->dirty_map.map;
+  size_t blocks = DIRTY_MAP_BLOCKS(map_channel->shared_map.map_size);
+
+  /* Nobody vouched for marking every write (e.g. inline instrumentation), so scan it all */
+  if (unlikely(!dirty[DIRTY_MAP_COMPLETE(map_channel->shared_map.map_size)])) {
+
+    return block < blocks ? block : SIZE_MAX;
+
+  }
+
+  /* Walk the unaligned head bytewise, then skip 8 clean blocks at a time */
+  while (block < blocks && (block & 7)) {
+
+    if (dirty[block]) { return block; }
+    block++;
+
+  }
+
+  while (block < blocks) {
+
+    if (likely(!*(u64 *)(dirty + block))) {
+
+      block += 8;
+      continue;
+
+    }
+
+    while (!dirty[block]) {
+
+      block++;
+
+    }
+
+    return block < blocks ? block : SIZE_MAX;
+
+  }
+
+  return SIZE_MAX;
+
+}
+
+void afl_observer_covmap_post_exec(afl_observer_t *channel, afl_engine_t *engine) {
+
+  (void)engine;
+
+  afl_observer_covmap_t *map_channel = (afl_observer_covmap_t *)channel;
+
+  /* Only mark the map here, whoever reads it first does the bucketing. */
+  map_channel->counts_raw = map_channel->classify_counts;
+
+}
+
+void afl_observer_covmap_classify_counts(afl_observer_covmap_t *obs_channel) {
+
+  if (!obs_channel->counts_raw) { return; }
+
+  if (obs_channel->dirty_map.map) {
+
+    for (size_t block = afl_observer_covmap_next_dirty(obs_channel, 0); block != SIZE_MAX;
+         block = afl_observer_covmap_next_dirty(obs_channel, block + 1)) {
+
+      u8 *   cur = obs_channel->shared_map.map + (block << DIRTY_BLOCK_SHIFT);
+      size_t len = afl_observer_covmap_block_len(obs_channel, block);
+
+      for (size_t j = 0; j < len; j++) {
+
+        cur[j] = afl_count_class_lookup8[cur[j]];
+
+      }
+
+    }
+
+    obs_channel->counts_raw = false;
+    return;
+
+  }
+
+#ifdef WORD_SIZE_64
+
+  u64 *current = (u64 *)obs_channel->shared_map.map;
+  u32  i = (obs_channel->shared_map.map_size >> 3);
+
+#else
+
+  u32 *current = (u32 *)obs_channel->shared_map.map;
+  u32  i = (obs_channel->shared_map.map_size >> 2);
+
+#endif                                                                                             /* ^WORD_SIZE_64 */
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*current)) {
+
+      u8 *cur = (u8 *)current;
+      for (u32 j = 0; j < sizeof(*current); j++) {
+
+        cur[j] = afl_count_class_lookup8[cur[j]];
+
+      }
+
+    }
+
+    current++;
+
+  }
+
+  obs_channel->counts_raw = false;
+
 }
 
 u8 *afl_observer_covmap_get_trace_bits(afl_observer_covmap_t *obs_channel) {
 
+  afl_observer_covmap_classify_counts(obs_channel);
   return obs_channel->shared_map.map;
 
 }
@@ -115,3 +289,46 @@ size_t afl_observer_covmap_get_map_size(afl_observer_covmap_t *obs_channel) {
 
 }
 
+
+afl_ret_t afl_observer_edgelist_init(afl_observer_edgelist_t *list_channel, u32 max_edges, u32 capacity) {
+
+  afl_observer_init(&list_channel->base);
+  list_channel->base.tag = AFL_OBSERVER_TAG_EDGELIST;
+
+  if (!capacity) { return AFL_RET_ERROR_INITIALIZE; }
+
+  if (!afl_shmem_init(&list_channel->shared_list, AFL_EDGE_LIST_SIZE(capacity))) { return AFL_RET_ERROR_INITIALIZE; }
+
+  list_channel->edges = (afl_edge_list_t *)list_channel->shared_list.map;
+  list_channel->edges->epoch = 1;
+  list_channel->edges->count = 0;
+  list_channel->edges->capacity = capacity;
+  list_channel->edges->max_id = max_edges;
+  list_channel->edges->dropped = 0;
+
+  list_channel->base.funcs.reset = afl_observer_edgelist_reset;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+void afl_observer_edgelist_deinit(afl_observer_edgelist_t *list_channel) {
+
+  afl_shmem_deinit(&list_channel->shared_list);
+  list_channel->edges = NULL;
+
+  afl_observer_deinit(&list_channel->base);
+
+}
+
+void afl_observer_edgelist_reset(afl_observer_t *channel) {
+
+  afl_edge_list_t *edges = ((afl_observer_edgelist_t *)channel)->edges;
+
+  /* Entries of older epochs are stale for the instrumentation, no need to touch them */
+  edges->count = 0;
+  edges->dropped = 0;
+  edges->epoch++;
+  if (unlikely(!edges->epoch)) { edges->epoch = 1; }
+
+}
@@ -167,9 +167,9 @@ afl_ret_t afl_for_each_file(char *dirpath, bool (*handle_file)(char *filename, v
 /* WIP: Let's implement a simple function which binds the cpu to the current process
    The code is very similar to how we do it in AFL++ */
 
-/* bind process to a specific cpu. Returns 0 on failure. */
+/* bind process to a specific cpu. Returns 0 on failure. On Linux, it's only the calling thread. */
 
-static u8 bind_cpu(s32 cpuid) {
+u8 bind_cpu(s32 cpuid) {
 
   #if defined(__linux__) || defined(__FreeBSD__) || defined(__DragonFly__)
   cpu_set_t c;
@@ -0,0 +1,480 @@
+/*
+   american fuzzy lop++ - fuzzer header
+   ------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2020 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+ */
+
+#include <string.h>
+
+#include "runner.h"
+#include "engine.h"
+#include "fuzzone.h"
+#include "os.h"
+#include "alloc-inl.h"
+
+/* The worker of the thread we're on, NULL outside of the runner */
+static __thread afl_runner_worker_t *afl_runner_current_worker;
+
+afl_ret_t afl_runner_init(afl_runner_t *runner) {
+
+  memset(runner, 0, sizeof(afl_runner_t));
+
+  if (pthread_rwlock_init(&runner->corpus_lock, NULL)) { return AFL_RET_ERRNO; }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+void afl_runner_deinit(afl_runner_t *runner) {
+
+  size_t i;
+
+  if (runner->running) {
+
+    afl_runner_stop(runner);
+    afl_runner_join(runner);
+
+  }
+
+  for (i = 0; i < runner->workers_count; i++) {
+
+    afl_runner_worker_t *worker = runner->workers[i];
+
+    pthread_mutex_destroy(&worker->lock);
+    afl_free(worker->deque);
+    afl_input_deinit(&worker->input);
+    free(worker);
+
+  }
+
+  afl_free(runner->workers);
+  runner->workers = NULL;
+  runner->workers_count = 0;
+
+  for (i = 0; i < runner->corpus_count; i++) {
+
+    afl_entry_delete(runner->corpus[i]);
+
+  }
+
+  afl_free(runner->corpus);
+  runner->corpus = NULL;
+  runner->corpus_count = 0;
+
+  pthread_rwlock_destroy(&runner->corpus_lock);
+
+}
+
+afl_ret_t afl_runner_add_engine(afl_runner_t *runner, afl_engine_t *engine, s32 cpu) {
+
+  if (runner->running) { return AFL_RET_UNKNOWN_ERROR; }
+  if (!engine->global_queue || !engine->fuzz_one) { return AFL_RET_NULL_PTR; }
+
+  if (engine->llmp_client) { WARNF("Engine %u has an llmp client, its new entries go to the broker", engine->id); }
+
+  afl_runner_worker_t *worker = calloc(1, sizeof(afl_runner_worker_t));
+  if (!worker) { return AFL_RET_ALLOC; }
+
+  worker->runner = runner;
+  worker->engine = engine;
+  worker->cpu = cpu;
+  afl_input_init(&worker->input);
+
+  if (pthread_mutex_init(&worker->lock, NULL)) {
+
+    free(worker);
+    return AFL_RET_ERRNO;
+
+  }
+
+  runner->workers = afl_realloc(runner->workers, (runner->workers_count + 1) * sizeof(afl_runner_worker_t *));
+  if (!runner->workers) {
+
+    pthread_mutex_destroy(&worker->lock);
+    free(worker);
+    runner->workers_count = 0;
+    return AFL_RET_ALLOC;
+
+  }
+
+  runner->workers[runner->workers_count] = worker;
+  runner->workers_count++;
+
+  engine->global_queue->base.funcs.get_next_in_queue = afl_runner_next_in_queue;
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Queues up a corpus index for the worker, at the back */
+static bool afl_runner_push(afl_runner_worker_t *worker, u32 idx) {
+
+  pthread_mutex_lock(&worker->lock);
+
+  if (worker->deque_start + worker->deque_count == worker->deque_size) {
+
+    if (worker->deque_start) {
+
+      /* Thieves left room at the front */
+      memmove(worker->deque, worker->deque + worker->deque_start, worker->deque_count * sizeof(u32));
+      worker->deque_start = 0;
+
+    } else {
+
+      u32 *deque = afl_realloc(worker->deque, (worker->deque_size + 1) * sizeof(u32));
+      if (!deque) {
+
+        pthread_mutex_unlock(&worker->lock);
+        return false;
+
+      }
+
+      worker->deque = deque;
+      worker->deque_size = afl_alloc_bufsize(deque) / sizeof(u32);
+
+    }
+
+  }
+
+  worker->deque[worker->deque_start + worker->deque_count] = idx;
+  worker->deque_count++;
+
+  pthread_mutex_unlock(&worker->lock);
+  return true;
+
+}
+
+/* The owner takes the newest index, from the back */
+static bool afl_runner_pop(afl_runner_worker_t *worker, u32 *idx) {
+
+  bool ret = false;
+
+  pthread_mutex_lock(&worker->lock);
+
+  if (worker->deque_count) {
+
+    worker->deque_count--;
+    *idx = worker->deque[worker->deque_start + worker->deque_count];
+    ret = true;
+
+  }
+
+  pthread_mutex_unlock(&worker->lock);
+  return ret;
+
+}
+
+/* Thieves take the oldest index, from the front */
+static bool afl_runner_steal(afl_runner_worker_t *victim, u32 *idx) {
+
+  bool ret = false;
+
+  pthread_mutex_lock(&victim->lock);
+
+  if (victim->deque_count) {
+
+    *idx = victim->deque[victim->deque_start];
+    victim->deque_start++;
+    victim->deque_count--;
+    if (!victim->deque_count) { victim->deque_start = 0; }
+    ret = true;
+
+  }
+
+  pthread_mutex_unlock(&victim->lock);
+  return ret;
+
+}
+
+/* Tries every other worker, starting from a random one */
+static bool afl_runner_steal_any(afl_runner_worker_t *worker, u32 *idx) {
+
+  afl_runner_t *runner = worker->runner;
+  size_t        start = afl_rand_below(&worker->engine->rand, runner->workers_count);
+  size_t        i;
+
+  for (i = 0; i < runner->workers_count; i++) {
+
+    afl_runner_worker_t *victim = runner->workers[(start + i) % runner->workers_count];
+    if (victim == worker) { continue; }
+
+    if (afl_runner_steal(victim, idx)) {
+
+      __atomic_fetch_add(&worker->steals, 1, __ATOMIC_RELAXED);
+      return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+/* Nobody has anything queued up: the next chunk of the pass over the corpus. Returns the first index of it, and queues
+  up the rest for us (or whoever steals them). */
+static u32 afl_runner_take_chunk(afl_runner_worker_t *worker) {
+
+  afl_runner_t *runner = worker->runner;
+  size_t        corpus_count = __atomic_load_n(&runner->corpus_count, __ATOMIC_ACQUIRE);
+  size_t        start = __atomic_fetch_add(&runner->cursor, AFL_RUNNER_CHUNK, __ATOMIC_RELAXED);
+  size_t        len = MIN((size_t)AFL_RUNNER_CHUNK, corpus_count);
+  size_t        i;
+
+  /* Backwards, so that we pop them in order. If we can't queue them up, the next pass will get them. */
+  for (i = len - 1; i > 0; i--) {
+
+    afl_runner_push(worker, (start + i) % corpus_count);
+
+  }
+
+  return start % corpus_count;
+
+}
+
+afl_entry_t *afl_runner_next_in_queue(afl_queue_t *queue, int engine_id) {
+
+  afl_runner_worker_t *worker = afl_runner_current_worker;
+
+  /* The engine fuzzes on its own, outside of the runner */
+  if (!worker) { return afl_queue_next_global_queue(queue, engine_id); }
+
+  afl_runner_t *runner = worker->runner;
+  u32           idx = 0;
+
+  if (__atomic_load_n(&runner->stop, __ATOMIC_RELAXED)) { return NULL; }
+
+  if (!afl_runner_pop(worker, &idx) && !afl_runner_steal_any(worker, &idx)) { idx = afl_runner_take_chunk(worker); }
+
+  pthread_rwlock_rdlock(&runner->corpus_lock);
+  afl_entry_t *entry = runner->corpus[idx];
+  pthread_rwlock_unlock(&runner->corpus_lock);
+
+  /* Corpus entries never change once published, no need for the lock of the worker that found it */
+  afl_input_deserialize(&worker->input, entry->input->bytes, entry->input->len);
+  if (worker->input.len != entry->input->len) { return NULL; }
+
+  memcpy(&worker->entry, entry, sizeof(afl_entry_t));
+  worker->entry.input = &worker->input;
+
+  return &worker->entry;
+
+}
+
+/* A copy of the engine's entry for the corpus. Only the engine's thread may touch its entry, so this runs there. */
+static afl_entry_t *afl_runner_snapshot(afl_entry_t *orig) {
+
+  afl_input_t *input = orig->input->funcs.copy(orig->input);
+  if (!input) { return NULL; }
+
+  afl_entry_t *entry = afl_entry_new(input, NULL);
+  if (!entry) {
+
+    afl_input_delete(input);
+    return NULL;
+
+  }
+
+  memcpy(entry->info, orig->info, sizeof(afl_entry_info_t));
+  return entry;
+
+}
+
+/* Puts what the worker's engine found since the last time into the corpus. Once running, the worker fuzzes them next,
+  unless someone else is idle. */
+static afl_ret_t afl_runner_publish(afl_runner_worker_t *worker, bool queue_up) {
+
+  afl_runner_t *runner = worker->runner;
+  afl_queue_t * queue = &worker->engine->global_queue->base;
+
+  while (worker->published < queue->entries_count) {
+
+    afl_entry_t *entry = afl_runner_snapshot(queue->entries[worker->published]);
+    if (!entry) { return AFL_RET_ALLOC; }
+
+    pthread_rwlock_wrlock(&runner->corpus_lock);
+
+    afl_entry_t **corpus = afl_realloc(runner->corpus, (runner->corpus_count + 1) * sizeof(afl_entry_t *));
+    if (!corpus) {
+
+      pthread_rwlock_unlock(&runner->corpus_lock);
+      afl_entry_delete(entry);
+      return AFL_RET_ALLOC;
+
+    }
+
+    runner->corpus = corpus;
+    size_t idx = runner->corpus_count;
+    runner->corpus[idx] = entry;
+    __atomic_store_n(&runner->corpus_count, idx + 1, __ATOMIC_RELEASE);
+
+    pthread_rwlock_unlock(&runner->corpus_lock);
+
+    worker->published++;
+    if (queue_up) { afl_runner_push(worker, idx); }
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+static void *afl_runner_worker_loop(void *data) {
+
+  afl_runner_worker_t *worker = (afl_runner_worker_t *)data;
+  afl_runner_t *       runner = worker->runner;
+  afl_engine_t *       engine = worker->engine;
+
+  afl_runner_current_worker = worker;
+
+  if (worker->cpu >= 0) {
+
+    if (bind_cpu(worker->cpu)) {
+
+      engine->cpu_bound = worker->cpu;
+
+    } else {
+
+      WARNF("Could not pin engine %u to core %d", engine->id, worker->cpu);
+
+    }
+
+  }
+
+  /* Like afl_engine_loop, without the broker */
+  while (!__atomic_load_n(&runner->stop, __ATOMIC_RELAXED)) {
+
+    afl_ret_t fuzz_one_ret = engine->fuzz_one->funcs.perform(engine->fuzz_one);
+
+    AFL_TRY(afl_runner_publish(worker, true), {
+
+      worker->ret = err;
+      break;
+
+    });
+
+    if (fuzz_one_ret == AFL_RET_ERROR_INPUT_COPY ||
+        (fuzz_one_ret == AFL_RET_NULL_QUEUE_ENTRY && !__atomic_load_n(&runner->stop, __ATOMIC_RELAXED))) {
+
+      worker->ret = fuzz_one_ret;
+      break;
+
+    }
+
+  }
+
+  return NULL;
+
+}
+
+afl_ret_t afl_runner_start(afl_runner_t *runner) {
+
+  size_t i;
+
+  if (runner->running) { return AFL_RET_UNKNOWN_ERROR; }
+  if (!runner->workers_count) { return AFL_RET_NO_FUZZ_WORKERS; }
+
+  for (i = 0; i < runner->workers_count; i++) {
+
+    AFL_TRY(afl_runner_publish(runner->workers[i], false), { return err; });
+
+  }
+
+  if (!runner->corpus_count) { return AFL_RET_EMPTY; }
+
+  runner->stop = false;
+  runner->running = true;
+
+  for (i = 0; i < runner->workers_count; i++) {
+
+    afl_runner_worker_t *worker = runner->workers[i];
+    worker->ret = AFL_RET_SUCCESS;
+
+    if (pthread_create(&worker->thread, NULL, afl_runner_worker_loop, worker)) {
+
+      /* All or none */
+      afl_runner_stop(runner);
+      while (i--) {
+
+        pthread_join(runner->workers[i]->thread, NULL);
+
+      }
+
+      runner->running = false;
+      return AFL_RET_ERRNO;
+
+    }
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Only sets a flag, so it's fine from a signal handler */
+void afl_runner_stop(afl_runner_t *runner) {
+
+  __atomic_store_n(&runner->stop, true, __ATOMIC_RELAXED);
+
+}
+
+/* Returns the first error a worker stopped with */
+afl_ret_t afl_runner_join(afl_runner_t *runner) {
+
+  afl_ret_t ret = AFL_RET_SUCCESS;
+  size_t    i;
+
+  if (!runner->running) { return AFL_RET_SUCCESS; }
+
+  for (i = 0; i < runner->workers_count; i++) {
+
+    pthread_join(runner->workers[i]->thread, NULL);
+    if (ret == AFL_RET_SUCCESS) { ret = runner->workers[i]->ret; }
+
+  }
+
+  runner->running = false;
+  return ret;
+
+}
+
+void afl_runner_get_stats(afl_runner_t *runner, afl_runner_stats_t *stats) {
+
+  size_t i;
+
+  memset(stats, 0, sizeof(afl_runner_stats_t));
+  stats->workers_count = runner->workers_count;
+  stats->corpus_count = __atomic_load_n(&runner->corpus_count, __ATOMIC_RELAXED);
+
+  for (i = 0; i < runner->workers_count; i++) {
+
+    afl_runner_worker_t *worker = runner->workers[i];
+    afl_engine_t *       engine = worker->engine;
+
+    stats->executions += __atomic_load_n(&engine->executions, __ATOMIC_RELAXED);
+    stats->crashes += __atomic_load_n(&engine->crashes, __ATOMIC_RELAXED);
+    stats->steals += __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+
+    u64 start_time = __atomic_load_n(&engine->start_time, __ATOMIC_RELAXED);
+    if (start_time && (!stats->start_time || start_time < stats->start_time)) { stats->start_time = start_time; }
+
+  }
+
+}
+
@@ -47,6 +47,8 @@ void afl_shmem_deinit(afl_shmem_t *shm) {
 
 #else
   shmctl(shm->shm_id, IPC_RMID, NULL);
+  /* The segment only goes away once all processes detached */
+  shmdt(shm->map);
 #endif
 
   shm->map = NULL;
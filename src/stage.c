@@ -24,6 +24,7 @@
 #include "engine.h"
 #include "fuzzone.h"
 #include "mutator.h"
+#include "aflpp.h"
 
 afl_ret_t afl_stage_init(afl_stage_t *stage, afl_engine_t *engine) {
 
@@ -75,6 +76,20 @@ size_t afl_stage_get_iters(afl_stage_t *stage) {
 
 }
 
+/* Lets the mutators post process the mutated data */
+static void afl_stage_post_process(afl_stage_t *stage, afl_input_t *input) {
+
+  size_t j;
+  for (j = 0; j < stage->mutators_count; ++j) {
+
+    afl_mutator_t *mutator = stage->mutators[j];
+
+    if (mutator->funcs.post_process) { mutator->funcs.post_process(mutator, input); }
+
+  }
+
+}
+
 afl_ret_t afl_stage_run(afl_stage_t *stage, afl_input_t *input, bool overwrite) {
 
   afl_input_t *copy;
@@ -84,14 +99,7 @@ afl_ret_t afl_stage_run(afl_stage_t *stage, afl_input_t *input, bool overwrite)
     copy = input;
 
   /* Let's post process the mutated data now. */
-  size_t j;
-  for (j = 0; j < stage->mutators_count; ++j) {
-
-    afl_mutator_t *mutator = stage->mutators[j];
-
-    if (mutator->funcs.post_process) { mutator->funcs.post_process(mutator, copy); }
-
-  }
+  afl_stage_post_process(stage, copy);
 
   afl_ret_t ret = stage->engine->funcs.execute(stage->engine, copy);
 
@@ -117,103 +125,342 @@ float afl_stage_is_interesting(afl_stage_t *stage) {
 
 }
 
-/* Perform default for fuzzing stage */
-afl_ret_t afl_stage_perform(afl_stage_t *stage, afl_input_t *input) {
+/* The first coverage map observer of the executor, if any */
+static afl_observer_covmap_t *afl_stage_get_covmap(afl_stage_t *stage) {
 
-  // size_t i;
-  // This is to stop from compiler complaining about the incompatible pointer
-  // type for the function ptrs. We need a better solution for this to pass the
-  // scheduled_mutator rather than the mutator as an argument.
+  afl_executor_t *executor = stage->engine->executor;
 
-  size_t num = stage->funcs.get_iters(stage);
+  for (u32 i = 0; i < executor->observors_count; i++) {
 
-  for (size_t i = 0; i < num; ++i) {
+    if (executor->observors[i]->tag == AFL_OBSERVER_TAG_COVMAP) {
 
-    afl_input_t *copy = input->funcs.copy(input);
-    if (!copy) { return AFL_RET_ERROR_INPUT_COPY; }
+      return (afl_observer_covmap_t *)executor->observors[i];
 
-    size_t j;
-    for (j = 0; j < stage->mutators_count; ++j) {
+    }
 
-      afl_mutator_t *mutator = stage->mutators[j];
-      // If the mutator decides not to fuzz this input, don't fuzz it. This is to support the custom mutator API of
-      // AFL++
-      if (mutator->funcs.custom_queue_get) {
+  }
 
-        mutator->funcs.custom_queue_get(mutator, copy);
-        continue;
+  return NULL;
 
-      }
+}
 
-      if (mutator->funcs.trim) {
+/* Collects the (bucketed) entries hit in the coverage map into cov.
+   With cov == NULL, only counts them. */
+static u32 afl_stage_collect_cov(afl_observer_covmap_t *obs_channel, afl_edge_t *cov) {
 
-        size_t orig_len = copy->len;
-        size_t trim_len = mutator->funcs.trim(mutator, copy);
+  u8 *   trace_bits = obs_channel->funcs.get_trace_bits(obs_channel);
+  size_t block = 0, offset = 0, len = obs_channel->shared_map.map_size, k;
+  u32    count = 0;
 
-        if (trim_len > orig_len) { return AFL_RET_TRIM_FAIL; }
+  while (!obs_channel->dirty_map.map || (block = afl_observer_covmap_next_dirty(obs_channel, block)) != SIZE_MAX) {
+
+    if (obs_channel->dirty_map.map) {
+
+      offset = block << DIRTY_BLOCK_SHIFT;
+      len = afl_observer_covmap_block_len(obs_channel, block);
+
+    }
+
+    for (k = offset; k < offset + len; k++) {
+
+      if (!trace_bits[k]) { continue; }
+      if (cov) {
+
+        cov[count].id = k;
+        cov[count].count = trace_bits[k];
 
       }
 
-      mutator->funcs.mutate(mutator, copy);
+      count++;
 
     }
 
-    afl_ret_t ret = afl_stage_run(stage, copy, true);
+    if (!obs_channel->dirty_map.map) { break; }
+    block++;
 
-    /* Let's collect some feedback on the input now */
-    float interestingness = afl_stage_is_interesting(stage);
+  }
 
-    if (interestingness >= 0.5) {
+  return count;
 
-      /* TODO: Use queue abstraction instead */
-      llmp_message_t *msg = llmp_client_alloc_next(stage->engine->llmp_client, copy->len + sizeof(afl_entry_info_t));
-      if (!msg) {
+}
 
-        DBG("Error allocating llmp message");
-        return AFL_RET_ALLOC;
+/* Runs all mutators of the stage on input */
+static afl_ret_t afl_stage_mutate(afl_stage_t *stage, afl_input_t *input) {
 
-      }
+  size_t j;
+  for (j = 0; j < stage->mutators_count; ++j) {
+
+    afl_mutator_t *mutator = stage->mutators[j];
+    // If the mutator decides not to fuzz this input, don't fuzz it. This is to support the custom mutator API of
+    // AFL++
+    if (mutator->funcs.custom_queue_get) {
+
+      mutator->funcs.custom_queue_get(mutator, input);
+      continue;
+
+    }
+
+    if (mutator->funcs.trim) {
+
+      size_t orig_len = input->len;
+      size_t trim_len = mutator->funcs.trim(mutator, input);
+
+      if (trim_len > orig_len) { return AFL_RET_TRIM_FAIL; }
+
+    }
+
+    mutator->funcs.mutate(mutator, input);
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Asks the feedbacks about the input that just ran, and shares it if it is interesting */
+static afl_ret_t afl_stage_evaluate(afl_stage_t *stage, afl_input_t *copy) {
+
+  /* Let's collect some feedback on the input now */
+  float interestingness = afl_stage_is_interesting(stage);
+
+  /* With a broker, it gets to everyone (including us) through llmp */
+  if (interestingness >= 0.5 && stage->engine->llmp_client) {
+
+    /* TODO: Use queue abstraction instead */
+    afl_observer_covmap_t *observer_covmap = afl_stage_get_covmap(stage);
+    u32                    cov_count = observer_covmap ? afl_stage_collect_cov(observer_covmap, NULL) : 0;
+
+    /* Batched: a campaign start can find lots of entries in a row */
+    llmp_message_t *msg =
+        llmp_client_batch_alloc(stage->engine->llmp_client, AFL_ENTRY_MSG_SIZE(cov_count, copy->len));
+    if (!msg) {
+
+      DBG("Error allocating llmp message");
+      return AFL_RET_ALLOC;
+
+    }
+
+    afl_entry_msg_t *entry_msg = (afl_entry_msg_t *)msg->buf;
+    memset(&entry_msg->info, 0, sizeof(afl_entry_info_t));
+    entry_msg->input_len = copy->len;
+    entry_msg->cov_count = cov_count;
+    if (cov_count) { afl_stage_collect_cov(observer_covmap, afl_entry_msg_cov(entry_msg)); }
+    memcpy(afl_entry_msg_input(entry_msg), copy->bytes, copy->len);
+
+    msg->tag = LLMP_TAG_NEW_QUEUE_ENTRY_V1;
+    if (!llmp_client_batch_send(stage->engine->llmp_client, msg)) {
+
+      DBG("An error occurred sending our previously allocated msg");
+      return AFL_RET_UNKNOWN_ERROR;
+
+    }
+
+    /* we don't add it to the queue but wait for it to come back from the broker for now.
+    TODO: Tidy this up. */
+    interestingness = 0.0f;
+
+  }
+
+  /* If the input is interesting and there is a global queue add the input to
+   * the queue */
+  /* TODO: 0.5 is a random value. How do we want to chose interesting input? */
+  /* Only reached without a broker, like for the engines of an afl_runner_t */
+  if (interestingness >= 0.5 && stage->engine->global_queue) {
+
+    afl_input_t *input_copy = copy->funcs.copy(copy);
+    if (!input_copy) { return AFL_RET_ERROR_INPUT_COPY; }
+
+    afl_entry_t *entry = afl_entry_new(input_copy, NULL);
+
+    if (!entry) {
+
+      afl_input_delete(input_copy);
+      return AFL_RET_ALLOC;
+
+    }
+
+    afl_queue_global_t *queue = stage->engine->global_queue;
+
+    queue->base.funcs.insert((afl_queue_t *)queue, entry);
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* afl_stage_perform for executors running several inputs at once (see submit_cb): mutates and submits inputs as long
+   as the executor has room, and evaluates the ones that finished meanwhile. The first error stops the mutations, the
+   inputs still running get evaluated before we return it. */
+static afl_ret_t afl_stage_perform_pipelined(afl_stage_t *stage, afl_input_t *input, size_t num) {
+
+  afl_engine_t *  engine = stage->engine;
+  afl_executor_t *executor = engine->executor;
+  afl_input_t *   copy = NULL;
+  afl_ret_t       ret = AFL_RET_SUCCESS;
+  size_t          i = 0;
 
-      memcpy(msg->buf, copy->bytes, copy->len);
+  if (engine->start_time == 0) { engine->start_time = time(NULL); }
 
-      /* TODO FIXME - here we fill in the entry info structure on the queue */
-      // afl_entry_info_t *info_ptr = (afl_entry_info_t*)((u8*)(msg->buf + copy->len));
-      // e.g. fill map hash
+  while (true) {
 
-      msg->tag = LLMP_TAG_NEW_QUEUE_ENTRY_V1;
-      if (!llmp_client_send(stage->engine->llmp_client, msg)) {
+    /* The next input, unless the executor had no room for the last one yet */
+    if (!copy && i < num && ret == AFL_RET_SUCCESS) {
 
-        DBG("An error occurred sending our previously allocated msg");
-        return AFL_RET_UNKNOWN_ERROR;
+      i++;
+      copy = input->funcs.copy(input);
+      if (!copy) {
+
+        ret = AFL_RET_ERROR_INPUT_COPY;
+
+      } else if ((ret = afl_stage_mutate(stage, copy)) != AFL_RET_SUCCESS) {
+
+        afl_input_delete(copy);
+        copy = NULL;
+
+      } else {
+
+        afl_stage_post_process(stage, copy);
 
       }
 
-      /* we don't add it to the queue but wait for it to come back from the broker for now.
-      TODO: Tidy this up. */
-      interestingness = 0.0f;
+    }
+
+    if (copy && executor->funcs.submit_cb(executor, copy)) {
+
+      copy = NULL;
+      continue;
 
     }
 
-    /* If the input is interesting and there is a global queue add the input to
-     * the queue */
-    /* TODO: 0.5 is a random value. How do we want to chose interesting input? */
-    /* This block of code is never reached in the above case where we wait for it to return from the broker*/
-    if (interestingness >= 0.5 && stage->engine->global_queue) {
+    /* All busy, or nothing left to submit: wait for a run to finish */
+    afl_exit_t   run_result;
+    afl_input_t *done = executor->funcs.collect_cb(executor, -1, &run_result);
+    if (!done) { break; }
 
-      afl_input_t *input_copy = copy->funcs.copy(copy);
+    afl_ret_t run_ret = afl_engine_handle_run_result(engine, run_result);
+    afl_ret_t eval_ret = afl_stage_evaluate(stage, done);
+    afl_input_delete(done);
 
-      if (!input_copy) { return AFL_RET_ERROR_INPUT_COPY; }
+    if (ret == AFL_RET_SUCCESS) { ret = eval_ret != AFL_RET_SUCCESS ? eval_ret : run_ret; }
 
-      afl_entry_t *entry = afl_entry_new(input_copy, NULL);
+  }
 
-      if (!entry) { return AFL_RET_ALLOC; }
+  if (copy) { afl_input_delete(copy); }
 
-      afl_queue_global_t *queue = stage->engine->global_queue;
+  return ret;
 
-      queue->base.funcs.insert((afl_queue_t *)queue, entry);
+}
+
+typedef struct afl_stage_batch {
+
+  afl_stage_t * stage;
+  afl_input_t **inputs;
+  afl_ret_t     ret;  /* The first error of the batch */
+
+} afl_stage_batch_t;
+
+static void afl_stage_batch_on_run(afl_executor_t *executor, u32 idx, afl_exit_t exit_code, void *data) {
+
+  (void)executor;
+
+  afl_stage_batch_t *batch = (afl_stage_batch_t *)data;
+  afl_ret_t          ret = afl_stage_evaluate(batch->stage, batch->inputs[idx]);
+
+  /* What afl_engine_handle_run_result returned for the run */
+  if (ret == AFL_RET_SUCCESS && exit_code != AFL_EXIT_OK && exit_code != AFL_EXIT_TIMEOUT) {
+
+    ret = AFL_RET_WRITE_TO_CRASH;
+
+  }
+
+  if (batch->ret == AFL_RET_SUCCESS) { batch->ret = ret; }
+
+}
+
+/* afl_stage_perform for all other executors: mutates up to AFL_STAGE_BATCH_SIZE inputs, runs them in one
+   afl_engine_execute_batch and evaluates each while the observers still hold its coverage. A crash or an error stops
+   the mutations after the batch it happened in. */
+static afl_ret_t afl_stage_perform_batched(afl_stage_t *stage, afl_input_t *input, size_t num) {
+
+  afl_input_t *     inputs[AFL_STAGE_BATCH_SIZE];
+  afl_exit_t        exit_codes[AFL_STAGE_BATCH_SIZE];
+  afl_stage_batch_t batch = {.stage = stage, .inputs = inputs, .ret = AFL_RET_SUCCESS};
+  size_t            done = 0;
+
+  while (done < num) {
+
+    u32       count = MIN(num - done, (size_t)AFL_STAGE_BATCH_SIZE), mutated = 0, j;
+    afl_ret_t ret = AFL_RET_SUCCESS;
+
+    while (mutated < count && ret == AFL_RET_SUCCESS) {
+
+      afl_input_t *copy = input->funcs.copy(input);
+      if (!copy) {
+
+        ret = AFL_RET_ERROR_INPUT_COPY;
+        break;
+
+      }
+
+      inputs[mutated++] = copy;
+      if ((ret = afl_stage_mutate(stage, copy)) == AFL_RET_SUCCESS) { afl_stage_post_process(stage, copy); }
+
+    }
+
+    if (ret == AFL_RET_SUCCESS) {
+
+      ret = afl_engine_execute_batch(stage->engine, inputs, count, exit_codes, afl_stage_batch_on_run, &batch);
+      if (ret == AFL_RET_SUCCESS) { ret = batch.ret; }
 
     }
 
+    for (j = 0; j < mutated; j++) {
+
+      afl_input_delete(inputs[j]);
+
+    }
+
+    if (ret != AFL_RET_SUCCESS) { return ret; }
+    done += count;
+
+  }
+
+  return AFL_RET_SUCCESS;
+
+}
+
+/* Perform default for fuzzing stage */
+afl_ret_t afl_stage_perform(afl_stage_t *stage, afl_input_t *input) {
+
+  // size_t i;
+  // This is to stop from compiler complaining about the incompatible pointer
+  // type for the function ptrs. We need a better solution for this to pass the
+  // scheduled_mutator rather than the mutator as an argument.
+
+  size_t num = stage->funcs.get_iters(stage);
+
+  /* Keep all runs of the executor busy */
+  if (stage->engine->executor->funcs.submit_cb && stage->engine->funcs.execute == afl_engine_execute) {
+
+    return afl_stage_perform_pipelined(stage, input, num);
+
+  }
+
+  /* Several inputs per run_batch of the executor, unless a custom execute wants to see each input */
+  if (stage->engine->funcs.execute == afl_engine_execute) { return afl_stage_perform_batched(stage, input, num); }
+
+  for (size_t i = 0; i < num; ++i) {
+
+    afl_input_t *copy = input->funcs.copy(input);
+    if (!copy) { return AFL_RET_ERROR_INPUT_COPY; }
+
+    AFL_TRY(afl_stage_mutate(stage, copy), { return err; });
+
+    afl_ret_t ret = afl_stage_run(stage, copy, true);
+
+    AFL_TRY(afl_stage_evaluate(stage, copy), { return err; });
+
     afl_input_delete(copy);
 
     switch (ret) {
@@ -232,4 +479,3 @@ afl_ret_t afl_stage_perform(afl_stage_t *stage, afl_input_t *input) {
   return AFL_RET_SUCCESS;
 
 }
-
@@ -0,0 +1,114 @@
+/* Benchmarks the coverage novelty kernels of afl_feedback_cov on sparse and
+   dense maps. Run with `make bench` */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "feedback.h"
+
+#define BENCH_MAP_SIZE (1 << 23)
+#define BENCH_ROUNDS (64)
+
+typedef struct bench_kernel {
+
+  char *                         name;
+  afl_feedback_cov_novelty_func *kernel;
+  int                            supported;
+
+} bench_kernel_t;
+
+static u64 bench_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/* Fill the trace map: one set byte every `stride` bytes */
+static void bench_fill(u8 *trace_bits, size_t map_size, size_t stride) {
+
+  memset(trace_bits, 0, map_size);
+  for (size_t i = 0; i < map_size; i += stride) {
+
+    trace_bits[i] = 1 + (i & 0x7f);
+
+  }
+
+}
+
+static double bench_run(afl_feedback_cov_novelty_func *kernel, u8 *trace_bits, u8 *virgin_bits, size_t map_size) {
+
+  /* The first round learns the map, all later rounds see nothing new, just like most fuzzer runs */
+  memset(virgin_bits, 0xff, map_size);
+  kernel(trace_bits, virgin_bits, map_size);
+
+  u64 start = bench_ns();
+  for (u32 i = 0; i < BENCH_ROUNDS; i++) {
+
+    if (kernel(trace_bits, virgin_bits, map_size) != 0.0) {
+
+      printf("Kernel reported novelty on a known map!\n");
+      exit(1);
+
+    }
+
+  }
+
+  return (double)(bench_ns() - start) / BENCH_ROUNDS;
+
+}
+
+int main(int argc, char **argv) {
+
+  (void)argc;
+  (void)argv;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#endif
+
+  bench_kernel_t kernels[] = {
+
+    {"scalar", afl_feedback_cov_novelty_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", afl_feedback_cov_novelty_avx2, __builtin_cpu_supports("avx2")},
+    {"avx512", afl_feedback_cov_novelty_avx512, __builtin_cpu_supports("avx512bw")},
+#endif
+
+  };
+
+  size_t strides[] = {4096, 512, 64, 8, 1};
+
+  u8 *trace_bits = malloc(BENCH_MAP_SIZE);
+  u8 *virgin_bits = malloc(BENCH_MAP_SIZE);
+  if (!trace_bits || !virgin_bits) { return 1; }
+
+  printf("map_size=%u rounds=%u\n", BENCH_MAP_SIZE, BENCH_ROUNDS);
+  printf("%-8s %10s %14s %10s\n", "kernel", "stride", "ns/run", "speedup");
+
+  for (size_t s = 0; s < sizeof(strides) / sizeof(strides[0]); s++) {
+
+    bench_fill(trace_bits, BENCH_MAP_SIZE, strides[s]);
+    double scalar_ns = 0;
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+
+      if (!kernels[k].supported) { continue; }
+
+      double ns = bench_run(kernels[k].kernel, trace_bits, virgin_bits, BENCH_MAP_SIZE);
+      if (!k) { scalar_ns = ns; }
+
+      printf("%-8s %10zu %14.0f %9.2fx\n", kernels[k].name, strides[s], ns, scalar_ns / ns);
+
+    }
+
+  }
+
+  free(trace_bits);
+  free(virgin_bits);
+  return 0;
+
+}
@@ -0,0 +1,362 @@
+/* Benchmarks llmp: throughput one-to-many and many-to-one, end-to-end latency,
+   the cost of switching to a new out page, and the broker's cpu time,
+   for threaded and forked clients.
+   Prints one json object per measurement, to compare runs. Run with `make bench`,
+   or `./bench_llmp [msgs_per_sender] [max_clients]` */
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aflpp.h"
+#include "llmp.h"
+
+#define BENCH_TAG (0xBE7C4)
+/* Don't let a single sender fill more than this many bytes */
+#define BENCH_MAX_BYTES_PER_SENDER (32U << 20)
+/* Latency runs wait for every msg to arrive, so they get fewer */
+#define BENCH_LATENCY_MSGS (5000U)
+#define BENCH_EOP_SWITCHES (32)
+
+typedef enum bench_kind {
+
+  BENCH_ONE_TO_MANY,
+  BENCH_MANY_TO_ONE,
+  /* One sender, waits for all receivers to get each msg before it sends the next one */
+  BENCH_LATENCY,
+
+} bench_kind_t;
+
+/* Lives in a shared mapping, so threaded and forked clients can report back */
+typedef struct bench_shared {
+
+  u32 ready;
+  u32 go;
+  u32 done;
+  u64 received;
+  u64 end_ns;
+  /* Latency of each msg, per receiver */
+  u64 latencies[];
+
+} bench_shared_t;
+
+typedef struct bench_run {
+
+  bench_kind_t    kind;
+  u32             senders;
+  u32             receivers;
+  size_t          msg_size;
+  u32             msg_count;
+  bool            forked;
+  bench_shared_t *shared;
+  size_t          shared_size;
+
+} bench_run_t;
+
+typedef struct bench_client {
+
+  bench_run_t *run;
+  bool         is_sender;
+  u32          idx;
+
+} bench_client_t;
+
+static char *bench_kind_names[] = {"one_to_many", "many_to_one", "latency"};
+
+static u64 bench_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static u64 bench_thread_cpu_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+
+  u64 x = *(u64 *)a, y = *(u64 *)b;
+  return x < y ? -1 : x > y;
+
+}
+
+static void bench_send(bench_client_t *bench_client, llmp_client_t *client) {
+
+  bench_run_t *   run = bench_client->run;
+  bench_shared_t *shared = run->shared;
+  u32             i;
+
+  for (i = 0; i < run->msg_count; i++) {
+
+    llmp_message_t *msg = llmp_client_alloc_next(client, run->msg_size);
+    if (!msg) { FATAL("Could not allocate msg"); }
+    msg->tag = BENCH_TAG;
+    *(u64 *)msg->buf = bench_ns();
+    if (!llmp_client_send(client, msg)) { FATAL("Could not send msg"); }
+
+    if (run->kind == BENCH_LATENCY) {
+
+      while (__atomic_load_n(&shared->received, __ATOMIC_ACQUIRE) < (u64)(i + 1) * run->receivers) {
+
+        sched_yield();
+
+      }
+
+    }
+
+  }
+
+}
+
+static void bench_recv(bench_client_t *bench_client, llmp_client_t *client) {
+
+  bench_run_t *   run = bench_client->run;
+  bench_shared_t *shared = run->shared;
+  u64             expected = (u64)run->senders * run->msg_count;
+  u64 *           latencies = &shared->latencies[bench_client->idx * expected];
+  u64             i = 0;
+
+  while (i < expected) {
+
+    llmp_message_t *msg = llmp_client_recv(client);
+    if (!msg) {
+
+      sched_yield();
+      continue;
+
+    }
+
+    latencies[i++] = bench_ns() - *(u64 *)msg->buf;
+    __atomic_fetch_add(&shared->received, 1, __ATOMIC_RELEASE);
+
+  }
+
+}
+
+static void bench_clientloop(llmp_client_t *client, void *data) {
+
+  bench_client_t *bench_client = (bench_client_t *)data;
+  bench_shared_t *shared = bench_client->run->shared;
+
+  if (!bench_client->is_sender && llmp_client_subscribe(client, BENCH_TAG) != AFL_RET_SUCCESS) {
+
+    FATAL("Could not subscribe");
+
+  }
+
+  __atomic_fetch_add(&shared->ready, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&shared->go, __ATOMIC_ACQUIRE)) {
+
+    sched_yield();
+
+  }
+
+  if (bench_client->is_sender) {
+
+    bench_send(bench_client, client);
+
+  } else {
+
+    bench_recv(bench_client, client);
+
+  }
+
+  u64 now = bench_ns();
+  u64 end_ns = __atomic_load_n(&shared->end_ns, __ATOMIC_ACQUIRE);
+  while (end_ns < now && !__atomic_compare_exchange_n(&shared->end_ns, &end_ns, now, false, __ATOMIC_ACQ_REL,
+                                                       __ATOMIC_ACQUIRE)) {}
+
+  __atomic_fetch_add(&shared->done, 1, __ATOMIC_RELEASE);
+
+  /* Leave right here, instead of warning about the loop that exited */
+  if (bench_client->run->forked) { _exit(0); }
+  pthread_exit(NULL);
+
+}
+
+static void bench_run(bench_run_t *run) {
+
+  bool            forked = run->forked;
+  u32             client_count = run->senders + run->receivers;
+  u64             expected = (u64)run->senders * run->msg_count;
+  bench_client_t *bench_clients = calloc(client_count, sizeof(bench_client_t));
+
+  run->shared_size = sizeof(bench_shared_t) + run->receivers * expected * sizeof(u64);
+  run->shared = mmap(NULL, run->shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (!bench_clients || run->shared == MAP_FAILED) { FATAL("Out of memory"); }
+
+  llmp_broker_t *broker = llmp_broker_new();
+  if (!broker) { FATAL("Could not create broker"); }
+
+  u32 i;
+  for (i = 0; i < client_count; i++) {
+
+    bench_clients[i].run = run;
+    bench_clients[i].is_sender = i < run->senders;
+    bench_clients[i].idx = bench_clients[i].is_sender ? i : i - run->senders;
+
+    if (!(forked ? llmp_broker_register_childprocess_clientloop(broker, bench_clientloop, &bench_clients[i])
+                 : llmp_broker_register_threaded_clientloop(broker, bench_clientloop, &bench_clients[i]))) {
+
+      FATAL("Could not register client");
+
+    }
+
+  }
+
+  if (!llmp_broker_launch_clientloops(broker)) { FATAL("Could not launch clients"); }
+
+  while (__atomic_load_n(&run->shared->ready, __ATOMIC_ACQUIRE) < client_count) {
+
+    sched_yield();
+
+  }
+
+  u64 cpu_start = bench_thread_cpu_ns();
+  u64 start = bench_ns();
+  __atomic_store_n(&run->shared->go, 1, __ATOMIC_RELEASE);
+
+  while (__atomic_load_n(&run->shared->done, __ATOMIC_ACQUIRE) < client_count) {
+
+    llmp_broker_once(broker);
+    llmp_broker_await_msgs(broker, 1);
+
+  }
+
+  u64 broker_cpu_ns = bench_thread_cpu_ns() - cpu_start;
+  u64 wall_ns = run->shared->end_ns - start;
+
+  for (i = 0; i < client_count; i++) {
+
+    llmp_broker_clientdata_t *clientdata = &broker->llmp_clients[i];
+    if (forked) {
+
+      waitpid(clientdata->pid, NULL, 0);
+
+    } else {
+
+      pthread_join(*clientdata->pthread, NULL);
+
+    }
+
+    llmp_client_delete(clientdata->client_state);
+
+  }
+
+  llmp_broker_delete(broker);
+
+  u64 *latencies = run->shared->latencies;
+  u64  latency_count = run->receivers * expected;
+  qsort(latencies, latency_count, sizeof(u64), bench_cmp_u64);
+
+  printf(
+      "{\"bench\": \"%s\", \"clients\": \"%s\", \"senders\": %u, \"receivers\": %u, \"msg_size\": %zu, "
+      "\"msgs\": %llu, \"msgs_per_sec\": %.0f, \"deliveries_per_sec\": %.0f, \"mb_per_sec\": %.2f, "
+      "\"p50_ns\": %llu, \"p99_ns\": %llu, \"broker_cpu_ms\": %.3f, \"broker_cpu_ns_per_msg\": %.1f}\n",
+      bench_kind_names[run->kind], forked ? "forked" : "threaded", run->senders, run->receivers, run->msg_size,
+      (unsigned long long)expected, expected * 1e9 / wall_ns, latency_count * 1e9 / wall_ns,
+      expected * run->msg_size * 1e3 / wall_ns, (unsigned long long)latencies[latency_count / 2],
+      (unsigned long long)latencies[latency_count * 99 / 100], broker_cpu_ns / 1e6, (double)broker_cpu_ns / expected);
+  fflush(stdout);
+
+  munmap(run->shared, run->shared_size);
+  free(bench_clients);
+
+}
+
+/* Times allocs on a client that fit the current out page, and those that need a new one */
+static void bench_eop(void) {
+
+  llmp_client_t *client = llmp_client_new_unconnected();
+  if (!client) { FATAL("Could not create client"); }
+
+  /* A few msgs fill a page */
+  size_t msg_size = LLMP_INITIAL_MAP_SIZE / 8;
+  u64    alloc_ns = 0, switch_ns = 0;
+  u32    allocs = 0, switches = 0;
+
+  while (switches < BENCH_EOP_SWITCHES) {
+
+    size_t          out_map_count = client->out_map_count;
+    u64             start = bench_ns();
+    llmp_message_t *msg = llmp_client_alloc_next(client, msg_size);
+    u64             ns = bench_ns() - start;
+    if (!msg) { FATAL("Could not allocate msg"); }
+
+    if (client->out_map_count != out_map_count) {
+
+      switch_ns += ns;
+      switches++;
+
+    } else {
+
+      alloc_ns += ns;
+      allocs++;
+
+    }
+
+    msg->tag = BENCH_TAG;
+    if (!llmp_client_send(client, msg)) { FATAL("Could not send msg"); }
+
+  }
+
+  llmp_client_delete(client);
+
+  printf("{\"bench\": \"eop\", \"page_size\": %u, \"msg_size\": %zu, \"alloc_ns\": %.0f, \"page_switch_ns\": %.0f}\n",
+         LLMP_INITIAL_MAP_SIZE, msg_size, (double)alloc_ns / allocs, (double)switch_ns / switches);
+  fflush(stdout);
+
+}
+
+int main(int argc, char **argv) {
+
+  u32 msgs_per_sender = argc > 1 ? atoi(argv[1]) : 20000;
+  u32 max_clients = argc > 2 ? atoi(argv[2]) : 4;
+
+  size_t msg_sizes[] = {64, 1024, 16384};
+  u32    forked, kind, clients;
+  size_t s;
+
+  bench_eop();
+
+  for (forked = 0; forked < 2; forked++) {
+
+    for (kind = BENCH_ONE_TO_MANY; kind <= BENCH_LATENCY; kind++) {
+
+      for (clients = 1; clients <= max_clients; clients *= 2) {
+
+        for (s = 0; s < sizeof(msg_sizes) / sizeof(msg_sizes[0]); s++) {
+
+          bench_run_t run = {0};
+          run.kind = kind;
+          run.forked = forked;
+          run.senders = kind == BENCH_MANY_TO_ONE ? clients : 1;
+          run.receivers = kind == BENCH_MANY_TO_ONE ? 1 : clients;
+          run.msg_size = msg_sizes[s];
+          run.msg_count = kind == BENCH_LATENCY ? MIN(msgs_per_sender, BENCH_LATENCY_MSGS) : msgs_per_sender;
+          run.msg_count = MIN(run.msg_count, BENCH_MAX_BYTES_PER_SENDER / run.msg_size);
+
+          bench_run(&run);
+
+        }
+
+      }
+
+    }
+
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,144 @@
+/*
+   A tiny target for the forkserver tests in unit_test.c, linked against the
+   runtime in examples/afl-compiler-rt.o.c. The Makefile builds it once per
+   forkserver mode:
+
+     FSRV_TARGET_SHMEM       reads its inputs from shared memory, if we agree
+     FSRV_TARGET_PERSISTENT  loops over its inputs in __afl_persistent_loop
+     FSRV_TARGET_DEFERRED    starts the forkserver only after its setup
+
+   The input comes from stdin, or from the file given as the argument (@@).
+   Each run hits the edge of the first input byte, or of that byte | 0x80 if
+   the setup happened before the fork (so only in deferred mode). 'C' crashes,
+   'T' hangs, 'M' hits edges 1 to 63 from FSRV_TARGET_THREADS threads at once.
+
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "config.h"
+
+void __afl_trace(const u32 x);
+int  __afl_persistent_loop(unsigned int max_cnt);
+void __afl_manual_init(void);
+
+extern u8 * __afl_fuzz_ptr;
+extern u32 *__afl_fuzz_len;
+
+#ifdef FSRV_TARGET_SHMEM
+int __afl_sharedmem_fuzzing = 1;
+#endif
+
+/* What the forkserver looks for in the binary to pick the mode */
+#ifdef FSRV_TARGET_PERSISTENT
+__attribute__((used)) static const char persist_sig[] = PERSIST_SIG;
+#endif
+#ifdef FSRV_TARGET_DEFERRED
+__attribute__((used)) static const char defer_sig[] = DEFER_SIG;
+#endif
+
+static pid_t setup_pid;
+
+#define FSRV_TARGET_THREADS 4
+#define FSRV_TARGET_THREAD_ITERS 20000
+
+static void *hit_edges(void *arg) {
+
+  (void)arg;
+
+  /* Edge i after edge 0, so each i hits edge i itself (the prev one is 0) */
+  for (u32 n = 0; n < FSRV_TARGET_THREAD_ITERS; n++) {
+
+    for (u32 i = 1; i < 64; i++) {
+
+      __afl_trace(0);
+      __afl_trace(i);
+
+    }
+
+  }
+
+  return NULL;
+
+}
+
+static void run_one(char *path) {
+
+  u8      stdin_buf[256];
+  u8 *    buf = stdin_buf;
+  ssize_t len;
+
+  if (__afl_fuzz_ptr) {
+
+    buf = __afl_fuzz_ptr;
+    len = *__afl_fuzz_len;
+
+  } else if (path) {
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return; }
+    len = read(fd, stdin_buf, sizeof(stdin_buf));
+    close(fd);
+
+  } else {
+
+    len = read(0, stdin_buf, sizeof(stdin_buf));
+
+  }
+
+  if (len <= 0) { return; }
+
+  __afl_trace(setup_pid != getpid() ? buf[0] | 0x80 : buf[0]);
+
+  if (buf[0] == 'C') { abort(); }
+  if (buf[0] == 'T') { pause(); }
+
+  if (buf[0] == 'M') {
+
+    pthread_t threads[FSRV_TARGET_THREADS];
+    for (u32 i = 0; i < FSRV_TARGET_THREADS; i++) {
+
+      pthread_create(&threads[i], NULL, hit_edges, NULL);
+
+    }
+
+    for (u32 i = 0; i < FSRV_TARGET_THREADS; i++) {
+
+      pthread_join(threads[i], NULL);
+
+    }
+
+  }
+
+}
+
+int main(int argc, char **argv) {
+
+  char *path = argc > 1 ? argv[1] : NULL;
+
+  setup_pid = getpid();
+
+#ifdef FSRV_TARGET_DEFERRED
+  __afl_manual_init();
+#endif
+
+#ifdef FSRV_TARGET_PERSISTENT
+  while (__afl_persistent_loop(1000)) {
+
+    run_one(path);
+
+  }
+
+#else
+  run_one(path);
+#endif
+
+  return 0;
+
+}
+
@@ -119,6 +119,17 @@ void test_input_copy(void **state) {
   assert_string_equal(copy->bytes, input.bytes);
   assert_int_equal(input.len, copy->len);
 
+  /* Each copy has bytes of its own, and leaves the original alone */
+  afl_input_t *copy2 = input.funcs.copy(&input);
+  assert_ptr_not_equal(copy->bytes, input.bytes);
+  assert_ptr_not_equal(copy->bytes, copy2->bytes);
+  assert_ptr_equal(copy->bytes, copy->copy_buf);
+  assert_null(input.copy_buf);
+
+  copy->bytes[0] = 'B';
+  assert_string_equal(copy2->bytes, input.bytes);
+
+  afl_input_delete(copy2);
   afl_input_delete(copy);
 
 }
@@ -143,7 +154,7 @@ void test_input_load_from_file(void **state) {
   assert_string_equal(input.bytes, test_string);
   assert_int_equal(input.len, write_len);
 
-  free(input.bytes);
+  afl_input_deinit(&input);
   unlink(fname);
 
 }
@@ -351,9 +362,7 @@ void test_basic_mutator_functions(void **state) {
   afl_rand_seed(&engine.rand, 42);
 
   char *test_string = "AAAAAAAAAAAAA";
-  input.bytes = calloc(strlen(test_string), 1);
-  memcpy(input.bytes, test_string, strlen(test_string));
-  input.len = 13;
+  afl_input_deserialize(&input, (u8 *)test_string, strlen(test_string));
 
   /* We test the different mutation functions now */
   afl_mutfunc_flip_bit(&mutator, &input);
@@ -416,6 +425,125 @@ void test_basic_mutator_functions(void **state) {
 
 }
 
+/* Takes up to 4 inputs at once and only "runs" them once collected, oldest first. By then, the stage has copied and
+  mutated the inputs submitted after them, which must not have touched their bytes. */
+#define TEST_PIPELINE_SLOTS 4
+
+typedef struct test_pipeline_executor {
+
+  afl_executor_t base;
+
+  afl_input_t *inputs[TEST_PIPELINE_SLOTS];
+  u8           submitted[TEST_PIPELINE_SLOTS][256];
+  size_t       submitted_len[TEST_PIPELINE_SLOTS];
+  u32          start, count;
+
+  u32 runs, changed;
+
+} test_pipeline_executor_t;
+
+static bool test_pipeline_submit(afl_executor_t *executor, afl_input_t *input) {
+
+  test_pipeline_executor_t *pipeline = (test_pipeline_executor_t *)executor;
+
+  if (pipeline->count == TEST_PIPELINE_SLOTS) { return false; }
+
+  u32 slot = (pipeline->start + pipeline->count++) % TEST_PIPELINE_SLOTS;
+  pipeline->inputs[slot] = input;
+  pipeline->submitted_len[slot] = MIN(input->len, sizeof(pipeline->submitted[slot]));
+  memcpy(pipeline->submitted[slot], input->bytes, pipeline->submitted_len[slot]);
+  return true;
+
+}
+
+static afl_input_t *test_pipeline_collect(afl_executor_t *executor, s32 timeout_ms, afl_exit_t *exit_code) {
+
+  (void)timeout_ms;
+  test_pipeline_executor_t *pipeline = (test_pipeline_executor_t *)executor;
+
+  if (!pipeline->count) { return NULL; }
+
+  u32          slot = pipeline->start;
+  afl_input_t *input = pipeline->inputs[slot];
+  pipeline->start = (slot + 1) % TEST_PIPELINE_SLOTS;
+  pipeline->count--;
+
+  if (MIN(input->len, sizeof(pipeline->submitted[slot])) != pipeline->submitted_len[slot] ||
+      memcmp(input->bytes, pipeline->submitted[slot], pipeline->submitted_len[slot])) {
+
+    pipeline->changed++;
+
+  }
+
+  pipeline->runs++;
+  executor->current_input = input;
+  *exit_code = AFL_EXIT_OK;
+  return input;
+
+}
+
+static size_t test_pipeline_mutate(afl_mutator_t *mutator, afl_input_t *input) {
+
+  /* Grows the input through the mutator's mutate_buf */
+  if (input->len < 128) { afl_mutfunc_clone_bytes(mutator, input); }
+  afl_mutfunc_random_byte(mutator, input);
+  return input->len;
+
+}
+
+static size_t test_pipeline_get_iters(afl_stage_t *stage) {
+
+  (void)stage;
+  return 64;
+
+}
+
+void test_stage_pipelined(void **state) {
+
+  (void)state;
+
+  test_pipeline_executor_t pipeline = {0};
+  afl_executor_init(&pipeline.base);
+  pipeline.base.funcs.submit_cb = test_pipeline_submit;
+  pipeline.base.funcs.collect_cb = test_pipeline_collect;
+
+  afl_engine_t engine = {0};
+  afl_engine_init(&engine, &pipeline.base, NULL, NULL);
+  afl_rand_seed(&engine.rand, 42);
+
+  afl_fuzz_one_t fuzz_one = {0};
+  afl_fuzz_one_init(&fuzz_one, &engine);
+  afl_stage_t stage = {0};
+  afl_stage_init(&stage, &engine);
+  stage.funcs.get_iters = test_pipeline_get_iters;
+
+  afl_mutator_t mutator = {0};
+  afl_mutator_init(&mutator, &engine);
+  mutator.funcs.mutate = test_pipeline_mutate;
+  stage.funcs.add_mutator_to_stage(&stage, &mutator);
+
+  afl_input_t input = {0};
+  afl_input_init(&input);
+  afl_input_deserialize(&input, (u8 *)"0123456789abcdef", 16);
+
+  assert_int_equal(stage.funcs.perform(&stage, &input), AFL_RET_SUCCESS);
+  assert_int_equal(pipeline.runs, 64);
+  assert_int_equal(pipeline.changed, 0);
+  assert_int_equal(engine.executions, 64);
+
+  /* The input we fuzzed stays as it was */
+  assert_int_equal(input.len, 16);
+  assert_memory_equal(input.bytes, "0123456789abcdef", 16);
+
+  afl_input_deinit(&input);
+  afl_mutator_deinit(&mutator);
+  afl_stage_deinit(&stage);
+  afl_fuzz_one_deinit(&fuzz_one);
+  afl_engine_deinit(&engine);
+  afl_executor_deinit(&pipeline.base);
+
+}
+
 /* Unittests for queue and queue entry based stuff */
 
 #include "queue.h"
@@ -485,27 +613,2010 @@ void test_base_queue_get_next(void **state) {
 
 }
 
-int main(int argc, char **argv) {
+#include "feedback.h"
 
-  (void)argc;
-  (void)argv;
+/* Runs a kernel on a copy of the virgin map, so all kernels see the same state */
+static float run_novelty_kernel(afl_feedback_cov_novelty_func *kernel, u8 *trace_bits, u8 *virgin_bits,
+                                u8 *virgin_out, size_t map_size) {
 
-  const struct CMUnitTest tests[] = {
+  memcpy(virgin_out, virgin_bits, map_size);
+  return kernel(trace_bits, virgin_out, map_size);
 
-      cmocka_unit_test(test_insert_substring),
-      cmocka_unit_test(test_insert_bytes),
-      cmocka_unit_test(test_erase_bytes),
+}
 
-      cmocka_unit_test(test_input_load_from_file),
-      cmocka_unit_test(test_input_save_to_file),
-      cmocka_unit_test(test_input_copy),
+void test_feedback_cov_novelty_kernels(void **state) {
 
-      cmocka_unit_test(test_engine_load_testcase_from_dir),
+  (void)state;
 
-      cmocka_unit_test(test_basic_mutator_functions),
+  /* Not a multiple of any vector width, to hit the tails, too */
+  size_t map_size = 4096 + 128 + 64 + 8;
 
-      cmocka_unit_test(test_queue_set_directory),
-      cmocka_unit_test(test_base_queue_get_next),
+  u8 *trace_bits = calloc(1, map_size);
+  u8 *virgin_bits = malloc(map_size);
+  u8 *virgin_scalar = malloc(map_size);
+  u8 *virgin_simd = malloc(map_size);
+  memset(virgin_bits, 0xff, map_size);
+
+  afl_feedback_cov_novelty_func *best = afl_feedback_cov_novelty_best();
+
+  /* Empty map, nothing new */
+  assert_true(run_novelty_kernel(best, trace_bits, virgin_bits, virgin_simd, map_size) == 0.0);
+
+  srand(1337);
+  for (u32 round = 0; round < 32; round++) {
+
+    /* Sprinkle some hits over the map, including the last bytes */
+    for (u32 i = 0; i < 16; i++) {
+
+      trace_bits[rand() % map_size] = 1 << (rand() % 8);
+
+    }
+
+    trace_bits[map_size - 1] = 1 << (round % 8);
+
+    float expected = run_novelty_kernel(afl_feedback_cov_novelty_scalar, trace_bits, virgin_bits, virgin_scalar, map_size);
+    assert_true(expected == run_novelty_kernel(best, trace_bits, virgin_bits, virgin_simd, map_size));
+    assert_memory_equal(virgin_scalar, virgin_simd, map_size);
+
+    memcpy(virgin_bits, virgin_scalar, map_size);
+    /* Seen it all by now */
+    assert_true(run_novelty_kernel(best, trace_bits, virgin_bits, virgin_simd, map_size) == 0.0);
+
+    memset(trace_bits, 0, map_size);
+
+  }
+
+  /* A new hitcount for a known edge */
+  trace_bits[100] = 1;
+  best(trace_bits, virgin_bits, map_size);
+  trace_bits[100] = 2;
+  assert_true(best(trace_bits, virgin_bits, map_size) == 0.5);
+
+  free(trace_bits);
+  free(virgin_bits);
+  free(virgin_scalar);
+  free(virgin_simd);
+
+}
+
+void test_observer_covmap_classify_counts(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t observer = {0};
+  assert_int_equal(afl_observer_covmap_init(&observer, 4096), AFL_RET_SUCCESS);
+  /* Raw counts by default */
+  assert_false(observer.classify_counts);
+  observer.classify_counts = true;
+  afl_feedback_cov_t feedback = {0};
+  assert_int_equal(afl_feedback_cov_init(&feedback, NULL, &observer), AFL_RET_SUCCESS);
+
+  u8 *map = observer.shared_map.map;
+  u8  raw[] = {1, 2, 3, 4, 7, 8, 15, 16, 31, 32, 127, 128, 255};
+  u8  bucketed[] = {1, 2, 4, 8, 8, 16, 16, 32, 32, 64, 64, 128, 128};
+
+  /* The feedback buckets the raw counts on the fly */
+  memcpy(map + 3000, raw, sizeof(raw));
+  observer.base.funcs.post_exec(&observer.base, NULL);
+  assert_true(observer.counts_raw);
+  assert_true(feedback.base.funcs.is_interesting(&feedback.base, NULL) == 1.0);
+  assert_false(observer.counts_raw);
+  assert_memory_equal(map + 3000, bucketed, sizeof(bucketed));
+
+  /* Same buckets, other counts: nothing new */
+  observer.base.funcs.reset(&observer.base);
+  map[3003] = 5;
+  map[3011] = 200;
+  observer.base.funcs.post_exec(&observer.base, NULL);
+  assert_true(feedback.base.funcs.is_interesting(&feedback.base, NULL) == 0.0);
+
+  /* Without a feedback, reading the map does the bucketing */
+  observer.base.funcs.reset(&observer.base);
+  memcpy(map + 5, raw, sizeof(raw));
+  observer.base.funcs.post_exec(&observer.base, NULL);
+  assert_memory_equal(observer.funcs.get_trace_bits(&observer) + 5, bucketed, sizeof(bucketed));
+
+  afl_feedback_cov_deinit(&feedback);
+  afl_observer_covmap_deinit(&observer);
+
+}
+
+void test_observer_covmap_dirty_blocks(void **state) {
+
+  (void)state;
+
+  size_t                map_size = 1 << 16;
+  afl_observer_covmap_t observer = {0};
+  assert_int_equal(afl_observer_covmap_init(&observer, map_size), AFL_RET_SUCCESS);
+  assert_int_equal(afl_observer_covmap_track_dirty(&observer), AFL_RET_SUCCESS);
+  assert_int_equal(observer.dirty_map.map_size, DIRTY_MAP_SIZE(map_size));
+
+  afl_feedback_cov_t feedback = {0};
+  assert_int_equal(afl_feedback_cov_init(&feedback, NULL, &observer), AFL_RET_SUCCESS);
+
+  u8 *map = observer.shared_map.map;
+  u8 *dirty = observer.dirty_map.map;
+
+  /* Until the instrumentation sets the marker, every block is dirty */
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, 0), 0);
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, 42), 42);
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, DIRTY_MAP_BLOCKS(map_size)), SIZE_MAX);
+
+  dirty[DIRTY_MAP_COMPLETE(map_size)] = 1;
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, 0), SIZE_MAX);
+
+  /* What the instrumentation does */
+  u32 edges[] = {0, 63, 64, 4097, 40000, map_size - 1};
+  for (u32 i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+
+    map[edges[i]]++;
+    dirty[edges[i] >> DIRTY_BLOCK_SHIFT] = 1;
+
+  }
+
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, 0), 0);
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, 1), 1);
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, 2), 4097 >> DIRTY_BLOCK_SHIFT);
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, (40000 >> DIRTY_BLOCK_SHIFT) + 1),
+                   (map_size - 1) >> DIRTY_BLOCK_SHIFT);
+
+  assert_true(feedback.base.funcs.is_interesting(&feedback.base, NULL) == 1.0);
+  for (u32 i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+
+    assert_int_equal(feedback.virgin_bits[edges[i]], 0xfe);
+
+  }
+
+  /* Reset clears the dirty blocks, and the dirty map but for the marker */
+  observer.base.funcs.reset(&observer.base);
+  for (u32 i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+
+    assert_int_equal(map[edges[i]], 0);
+
+  }
+
+  assert_int_equal(dirty[DIRTY_MAP_COMPLETE(map_size)], 1);
+  assert_int_equal(afl_observer_covmap_next_dirty(&observer, 0), SIZE_MAX);
+  assert_true(feedback.base.funcs.is_interesting(&feedback.base, NULL) == 0.0);
+
+  afl_feedback_cov_deinit(&feedback);
+  afl_observer_covmap_deinit(&observer);
+
+}
+
+void test_feedback_cov_shared_virgin_bits(void **state) {
+
+  (void)state;
+
+  size_t                map_size = 1 << 12;
+  afl_observer_covmap_t observer = {0};
+  assert_int_equal(afl_observer_covmap_init(&observer, map_size), AFL_RET_SUCCESS);
+
+  afl_feedback_cov_t feedback1 = {0}, feedback2 = {0};
+  assert_int_equal(afl_feedback_cov_init(&feedback1, NULL, &observer), AFL_RET_SUCCESS);
+  assert_int_equal(afl_feedback_cov_init(&feedback2, NULL, &observer), AFL_RET_SUCCESS);
+
+  u8 *shared = malloc(map_size);
+  assert_non_null(shared);
+  memset(shared, 0xff, map_size);
+  afl_feedback_cov_set_shared_virgin_bits(&feedback1, shared);
+  afl_feedback_cov_set_shared_virgin_bits(&feedback2, shared);
+
+  u8 *map = observer.shared_map.map;
+  map[42] = 1;
+  map[1000] = 2;
+
+  /* The first one to see the edges claims them */
+  assert_true(feedback1.base.funcs.is_interesting(&feedback1.base, NULL) == 1.0);
+  assert_int_equal(shared[42], 0xfe);
+  assert_int_equal(shared[1000], 0xfd);
+  assert_true(feedback2.base.funcs.is_interesting(&feedback2.base, NULL) == 0.0);
+
+  /* The local cache of the loser got updated too */
+  assert_int_equal(feedback2.virgin_bits[42], 0xfe);
+
+  /* A new bucket is still news */
+  map[42] = 4;
+  assert_true(feedback2.base.funcs.is_interesting(&feedback2.base, NULL) == 0.5);
+  assert_true(feedback1.base.funcs.is_interesting(&feedback1.base, NULL) == 0.0);
+
+  free(shared);
+  afl_feedback_cov_deinit(&feedback1);
+  afl_feedback_cov_deinit(&feedback2);
+  afl_observer_covmap_deinit(&observer);
+
+}
+
+/* What the instrumentation does for a hit, minus the slot bookkeeping */
+static void edgelist_hit(afl_edge_list_t *edges, u32 id, u32 count) {
+
+  edges->edges[edges->count].id = id;
+  edges->edges[edges->count].count = count;
+  edges->count++;
+
+}
+
+void test_feedback_edgelist(void **state) {
+
+  (void)state;
+
+  /* A huge id space costs nothing as long as we don't touch it */
+  afl_observer_edgelist_t *observer = afl_observer_edgelist_new(1 << 26, 64);
+  assert_non_null(observer);
+  afl_feedback_edgelist_t *feedback = afl_feedback_edgelist_new(NULL, observer);
+  assert_non_null(feedback);
+
+  afl_edge_list_t *edges = observer->edges;
+  u32              epoch = edges->epoch;
+
+  assert_true(feedback->base.funcs.is_interesting(&feedback->base, NULL) == 0.0);
+
+  edgelist_hit(edges, 1337, 1);
+  edgelist_hit(edges, (1 << 26) - 1, 300);
+  assert_true(feedback->base.funcs.is_interesting(&feedback->base, NULL) == 1.0);
+
+  observer->base.funcs.reset(&observer->base);
+  assert_int_equal(edges->count, 0);
+  assert_int_not_equal(edges->epoch, epoch);
+
+  /* Same buckets */
+  edgelist_hit(edges, 1337, 1);
+  edgelist_hit(edges, (1 << 26) - 1, 1000);
+  assert_true(feedback->base.funcs.is_interesting(&feedback->base, NULL) == 0.0);
+
+  /* New bucket for a known edge */
+  observer->base.funcs.reset(&observer->base);
+  edgelist_hit(edges, 1337, 3);
+  assert_true(feedback->base.funcs.is_interesting(&feedback->base, NULL) == 0.5);
+
+  afl_feedback_edgelist_delete(feedback);
+  afl_observer_edgelist_delete(observer);
+
+}
+
+/* Builds a queue entry msg with the given coverage (and a one byte input) in buf */
+static llmp_message_t *entry_msg_with_cov(u8 *buf, afl_edge_t *cov, u32 cov_count) {
+
+  llmp_message_t *msg = (llmp_message_t *)buf;
+  msg->tag = LLMP_TAG_NEW_QUEUE_ENTRY_V1;
+  msg->buf_len = AFL_ENTRY_MSG_SIZE(cov_count, 1);
+
+  afl_entry_msg_t *entry_msg = (afl_entry_msg_t *)msg->buf;
+  memset(&entry_msg->info, 0, sizeof(afl_entry_info_t));
+  entry_msg->input_len = 1;
+  entry_msg->cov_count = cov_count;
+  memcpy(afl_entry_msg_cov(entry_msg), cov, cov_count * sizeof(afl_edge_t));
+  afl_entry_msg_input(entry_msg)[0] = 'A';
+
+  return msg;
+
+}
+
+void test_broker_cov_filter(void **state) {
+
+  (void)state;
+
+  afl_broker_cov_filter_t *filter = afl_broker_cov_filter_new(1 << 16);
+  assert_non_null(filter);
+
+  u8         buf[sizeof(llmp_message_t) + AFL_ENTRY_MSG_SIZE(4, 1)];
+  afl_edge_t cov[] = {{1, 1}, {42, 2}, {1000, 8}};
+
+  /* New, then exactly the same coverage */
+  assert_true(afl_broker_cov_filter_hook(NULL, NULL, entry_msg_with_cov(buf, cov, 2), filter));
+  assert_int_not_equal(((afl_entry_msg_t *)((llmp_message_t *)buf)->buf)->info.hash, 0);
+  assert_false(afl_broker_cov_filter_hook(NULL, NULL, entry_msg_with_cov(buf, cov, 2), filter));
+
+  /* A subset of what we know, new hash but nothing novel */
+  assert_false(afl_broker_cov_filter_hook(NULL, NULL, entry_msg_with_cov(buf, cov + 1, 1), filter));
+
+  /* One more edge */
+  assert_true(afl_broker_cov_filter_hook(NULL, NULL, entry_msg_with_cov(buf, cov, 3), filter));
+
+  /* No coverage info, and other tags, always pass */
+  assert_true(afl_broker_cov_filter_hook(NULL, NULL, entry_msg_with_cov(buf, cov, 0), filter));
+  ((llmp_message_t *)buf)->tag = 0x5747;
+  assert_true(afl_broker_cov_filter_hook(NULL, NULL, (llmp_message_t *)buf, filter));
+
+  assert_int_equal(filter->forwarded, 3);
+  assert_int_equal(filter->dropped, 2);
+
+  afl_broker_cov_filter_delete(filter);
+
+}
+
+static void noop_clientloop(llmp_client_t *client, void *data) {
+
+  (void)client;
+  (void)data;
+
+}
+
+/* A broker with two threaded clients that never get launched: the tests play
+   the clients (usually client 0 receives and client 1 sends) and call
+   llmp_broker_once themselves. */
+static llmp_broker_t *test_llmp_broker_new(llmp_client_t **client0, llmp_client_t **client1) {
+
+  llmp_broker_t *broker = llmp_broker_new();
+  assert_non_null(broker);
+  assert_true(llmp_broker_register_threaded_clientloop(broker, noop_clientloop, NULL));
+  assert_true(llmp_broker_register_threaded_clientloop(broker, noop_clientloop, NULL));
+
+  *client0 = broker->llmp_clients[0].client_state;
+  *client1 = broker->llmp_clients[1].client_state;
+  return broker;
+
+}
+
+void test_llmp_zero_copy(void **state) {
+
+  (void)state;
+
+  llmp_client_t *receiver, *sender;
+  llmp_broker_t *broker = test_llmp_broker_new(&receiver, &sender);
+
+  size_t lens[] = {16, LLMP_ZERO_COPY_MIN_LEN, 1 << 20};
+  size_t i;
+  for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+
+    llmp_message_t *msg = llmp_client_alloc_next(sender, lens[i]);
+    assert_non_null(msg);
+    msg->tag = 0x7357;
+    memset(msg->buf, 'A' + i, lens[i]);
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  llmp_broker_once(broker);
+
+  u8 *broadcast_page = receiver->current_broadcast_map->map;
+  for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+
+    llmp_message_t *msg = llmp_client_recv(receiver);
+    assert_non_null(msg);
+    assert_int_equal(msg->tag, 0x7357);
+    assert_int_equal(msg->buf_len, lens[i]);
+    assert_int_equal(msg->buf[0], 'A' + i);
+    assert_int_equal(msg->buf[lens[i] - 1], 'A' + i);
+
+    /* Only the small one got copied into the broadcast page */
+    bool copied = (u8 *)msg > broadcast_page && (u8 *)msg < broadcast_page + receiver->current_broadcast_map->map_size;
+    assert_int_equal(copied, lens[i] < LLMP_ZERO_COPY_MIN_LEN);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+  assert_int_equal(receiver->ref_map_count, 1);
+
+  llmp_broker_delete(broker);
+
+}
+
+static bool drop_every_third_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *msg,
+                                  void *data) {
+
+  (void)broker;
+  (void)client;
+  (void)data;
+  return msg->buf[0] % 3;
+
+}
+
+static void count_batches_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *first,
+                               size_t count, bool *forward, void *data) {
+
+  (void)broker;
+  (void)client;
+  (void)forward;
+
+  size_t *batches = (size_t *)data;
+  batches[0]++;
+  batches[1] += count;
+  assert_int_equal(first->buf[0], 0);
+
+}
+
+void test_llmp_batch_forward(void **state) {
+
+  (void)state;
+
+  llmp_client_t *receiver, *sender;
+  llmp_broker_t *broker = test_llmp_broker_new(&receiver, &sender);
+
+  size_t batches[2] = {0};
+  llmp_broker_add_message_hook(broker, drop_every_third_hook, NULL);
+  llmp_broker_add_message_batch_hook(broker, count_batches_hook, batches);
+
+  u32 i;
+  for (i = 0; i < 240; i++) {
+
+    llmp_message_t *msg = llmp_client_alloc_next(sender, 1 + i);
+    assert_non_null(msg);
+    msg->tag = 0x7357;
+    memset(msg->buf, i, 1 + i);
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  llmp_broker_once(broker);
+
+  /* All of them in one batch */
+  assert_int_equal(batches[0], 1);
+  assert_int_equal(batches[1], 240);
+
+  for (i = 0; i < 240; i++) {
+
+    if (!(i % 3)) { continue; }
+    llmp_message_t *msg = llmp_client_recv(receiver);
+    assert_non_null(msg);
+    assert_int_equal(msg->buf_len, 1 + i);
+    assert_int_equal(msg->buf[0], i);
+    assert_int_equal(msg->buf[i], i);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+
+  llmp_broker_delete(broker);
+
+}
+
+void test_llmp_broadcast_page_gc(void **state) {
+
+  (void)state;
+
+  llmp_client_t *receiver, *sender;
+  llmp_broker_t *broker = test_llmp_broker_new(&receiver, &sender);
+  broker->gc_broadcast_pages = true;
+  /* The large msgs get referenced, the small ones fill up the broadcast pages */
+  broker->zero_copy_min_len = 16 << 20;
+
+  size_t max_broadcast_maps = 0, max_ref_maps = 0;
+  u32    i, received = 0;
+  for (i = 0; i < 144; i++) {
+
+    size_t          len = i % 2 ? 8 << 20 : 16 << 20;
+    llmp_message_t *msg = llmp_client_alloc_next(sender, len);
+    assert_non_null(msg);
+    msg->tag = 0x7357;
+    msg->buf[0] = i;
+    msg->buf[len - 1] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+    llmp_broker_once(broker);
+
+    while ((msg = llmp_client_recv(receiver))) {
+
+      assert_int_equal(msg->buf_len, received % 2 ? 8 << 20 : 16 << 20);
+      assert_int_equal(msg->buf[0], received);
+      assert_int_equal(msg->buf[msg->buf_len - 1], received);
+      received++;
+
+    }
+
+    /* The sender has to keep reading, too, else it pins the pages */
+    while (llmp_client_recv(sender)) {}
+
+    max_broadcast_maps = MAX(max_broadcast_maps, broker->broadcast_map_count);
+    max_ref_maps = MAX(max_ref_maps, broker->ref_map_count);
+
+  }
+
+  assert_int_equal(received, 144);
+  assert_true(shmem2page(&broker->broadcast_maps[0])->page_seq >= 2);
+  assert_true(max_broadcast_maps <= 2);
+  /* Referenced client pages got unmapped along the way, too */
+  assert_true(max_ref_maps <= 3);
+
+  llmp_client_delete(receiver);
+  llmp_client_delete(sender);
+  llmp_broker_delete(broker);
+
+}
+
+static void send_tagged(llmp_client_t *client, u32 tag, char *str) {
+
+  llmp_message_t *msg = llmp_client_alloc_next(client, strlen(str) + 1);
+  assert_non_null(msg);
+  msg->tag = tag;
+  strcpy((char *)msg->buf, str);
+  assert_true(llmp_client_send(client, msg));
+
+}
+
+/* Receives all pending msgs, returns how many there were */
+static size_t recv_all(llmp_client_t *client) {
+
+  size_t count = 0;
+  while (llmp_client_recv(client)) {
+
+    count++;
+
+  }
+
+  return count;
+
+}
+
+void test_llmp_subscribe(void **state) {
+
+  (void)state;
+
+  llmp_client_t *receiver, *sender;
+  llmp_broker_t *broker = test_llmp_broker_new(&receiver, &sender);
+  broker->zero_copy_min_len = 4096;
+
+  assert_int_equal(llmp_client_subscribe(receiver, 0x7357), AFL_RET_SUCCESS);
+  assert_int_equal(llmp_client_subscribe(receiver, 0x7358), AFL_RET_SUCCESS);
+  assert_int_equal(llmp_client_subscribe(receiver, 0x7357), AFL_RET_SUCCESS);
+  assert_int_equal(receiver->subscribed_tag_count, 2);
+
+  /* Small and large (by reference) msgs, with tags we want and tags we don't */
+  u32    tags[] = {0x7357, 0xEC574751, 0x7358, 0xEC574751, 0x7357, 0x101DEAD1};
+  size_t lens[] = {8, 8, 8192, 8192, 16, 16};
+  u32    i;
+  for (i = 0; i < 6; i++) {
+
+    llmp_message_t *msg = llmp_client_alloc_next(sender, lens[i]);
+    assert_non_null(msg);
+    msg->tag = tags[i];
+    msg->buf[0] = i;
+    assert_true(llmp_client_send(sender, msg));
+
+  }
+
+  llmp_broker_once(broker);
+
+  u32 expected[] = {0, 2, 4};
+  for (i = 0; i < 3; i++) {
+
+    llmp_message_t *msg = llmp_client_recv(receiver);
+    assert_non_null(msg);
+    assert_int_equal(msg->buf[0], expected[i]);
+    assert_int_equal(msg->tag, tags[expected[i]]);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+  /* Only the page of the referenced msg we wanted got mapped */
+  assert_int_equal(receiver->ref_map_count, 1);
+
+  /* Without subscriptions, a client gets everything */
+  assert_int_equal(recv_all(sender), 6);
+
+  llmp_client_delete(receiver);
+  llmp_client_delete(sender);
+  llmp_broker_delete(broker);
+
+}
+
+void test_llmp_client_batch(void **state) {
+
+  (void)state;
+
+  llmp_client_t *receiver, *sender;
+  llmp_broker_t *broker = test_llmp_broker_new(&receiver, &sender);
+  llmp_page_t *  sender_page = shmem2page(&sender->out_maps[0]);
+  sender->batch_max_len = 256;
+  sender->batch_max_ms = 10000;
+
+  /* Three small msgs, then one too large to batch */
+  size_t lens[] = {1, 13, 40, 300};
+  u32    i;
+  for (i = 0; i < 4; i++) {
+
+    llmp_message_t *msg = llmp_client_batch_alloc(sender, lens[i]);
+    assert_non_null(msg);
+    msg->tag = 0x7357 + i;
+    memset(msg->buf, i, lens[i]);
+    assert_true(llmp_client_batch_send(sender, msg));
+    /* The small ones wait in the batch until the large one flushes them */
+    assert_int_equal(sender_page->current_msg_id, i < 3 ? 0 : 2);
+
+  }
+
+  llmp_broker_once(broker);
+
+  for (i = 0; i < 4; i++) {
+
+    llmp_message_t *msg = llmp_client_recv(receiver);
+    assert_non_null(msg);
+    assert_int_equal(msg->tag, 0x7357 + i);
+    assert_int_equal(msg->buf_len, lens[i]);
+    assert_int_equal(msg->buf[0], i);
+    assert_int_equal(msg->buf[lens[i] - 1], i);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+
+  /* Once the batch is old enough, it goes out */
+  sender->batch_max_ms = 1;
+  llmp_message_t *msg = llmp_client_batch_alloc(sender, 8);
+  assert_non_null(msg);
+  msg->tag = 0x7357;
+  assert_true(llmp_client_batch_send(sender, msg));
+  usleep(2000);
+  assert_true(llmp_client_batch_flush_if_due(sender));
+  assert_int_equal(sender->batch_count, 0);
+
+  llmp_broker_once(broker);
+  assert_non_null(llmp_client_recv(receiver));
+  assert_null(llmp_client_recv(receiver));
+
+  /* A crash report, with the batch still pending: the batch goes out first, in the room reserved up front */
+  sender->batch_max_ms = 10000;
+  for (i = 0; i < 3; i++) {
+
+    msg = llmp_client_batch_alloc(sender, lens[i]);
+    assert_non_null(msg);
+    msg->tag = 0x7357 + i;
+    assert_true(llmp_client_batch_send(sender, msg));
+
+  }
+
+  u32             out_map_count = sender->out_map_count;
+  llmp_message_t *reserved = llmp_client_alloc_after_batch(sender, 1000);
+  assert_non_null(reserved);
+  assert_int_equal(reserved->buf_len, 1000);
+  reserved->tag = 0x735a;
+  u8 *reserved_end = (u8 *)reserved + sizeof(llmp_message_t) + reserved->buf_len_padded;
+
+  msg = llmp_client_batch_flush_before(sender, reserved);
+  assert_non_null(msg);
+  assert_int_equal(sender->out_map_count, out_map_count);
+  assert_true((u8 *)msg > (u8 *)reserved);
+  assert_true((u8 *)msg + sizeof(llmp_message_t) + msg->buf_len_padded <= reserved_end);
+  assert_int_equal(msg->tag, 0x735a);
+  assert_int_equal(msg->buf_len, 1000);
+  assert_true(llmp_client_send(sender, msg));
+
+  llmp_broker_once(broker);
+  for (i = 0; i < 4; i++) {
+
+    msg = llmp_client_recv(receiver);
+    assert_non_null(msg);
+    assert_int_equal(msg->tag, 0x7357 + i);
+
+  }
+
+  assert_null(llmp_client_recv(receiver));
+
+  llmp_client_delete(receiver);
+  llmp_client_delete(sender);
+  llmp_broker_delete(broker);
+
+}
+
+/* Sees every msg the way the sender wrote it, counts the large ones */
+static bool count_large_msgs_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *msg,
+                                  void *data) {
+
+  (void)broker;
+  (void)client;
+
+  if (msg->tag == 0x7357 && msg->buf_len == 65536 && msg->buf[0] == 0xff && msg->buf[4096] == 0x42) {
+
+    (*(u32 *)data)++;
+
+  }
+
+  return true;
+
+}
+
+/* Changes the large msgs on their way */
+static bool mark_large_msgs_hook(llmp_broker_t *broker, llmp_broker_clientdata_t *client, llmp_message_t *msg,
+                                 void *data) {
+
+  (void)broker;
+  (void)client;
+  (void)data;
+
+  if (msg->buf_len == 65536) { msg->buf[8] = 0x17; }
+
+  return true;
+
+}
+
+void test_llmp_compression(void **state) {
+
+  (void)state;
+
+  /* Copied into the broadcast page, by reference, and changed by a hook */
+  u32 variant;
+  for (variant = 0; variant < 3; variant++) {
+
+    llmp_client_t *receiver, *sender;
+    llmp_broker_t *broker = test_llmp_broker_new(&receiver, &sender);
+    broker->zero_copy_min_len = variant ? 64 : 0;
+    u32 hook_seen = 0;
+    assert_int_equal(llmp_broker_add_message_hook(broker, count_large_msgs_hook, &hook_seen), AFL_RET_SUCCESS);
+    if (variant == 2) {
+
+      assert_int_equal(llmp_broker_add_message_hook(broker, mark_large_msgs_hook, NULL), AFL_RET_SUCCESS);
+
+    }
+
+    llmp_page_t *  sender_page = shmem2page(&sender->out_maps[0]);
+    /* Compress everything large, or just the first msg, explicitly */
+    if (variant < 2) {
+
+      sender->compress_min_len = LLMP_COMPRESS_MIN_LEN;
+
+    } else {
+
+      assert_int_equal(llmp_client_compress_reserve(sender, 65536), AFL_RET_SUCCESS);
+
+    }
+
+    /* A mostly-0xff map, noise that does not compress, and a msg too small to bother */
+    size_t lens[] = {65536, 8192, 16};
+    u32    i, j;
+    for (i = 0; i < 3; i++) {
+
+      llmp_message_t *msg = llmp_client_alloc_next(sender, lens[i]);
+      assert_non_null(msg);
+      msg->tag = 0x7357;
+      for (j = 0; j < lens[i]; j++) {
+
+        msg->buf[j] = i == 0 ? 0xff : (u8)(j * 2654435761U >> 13);
+
+      }
+
+      if (i == 0) { msg->buf[4096] = 0x42; }
+      size_t size_used = sender_page->size_used;
+      if (variant == 2 && i == 0) {
+
+        u8 *compress_buf = sender->compress_buf;
+        llmp_client_compress(sender, msg);
+        /* No allocation */
+        assert_ptr_equal(sender->compress_buf, compress_buf);
+
+      }
+
+      assert_true(llmp_client_send(sender, msg));
+
+      if (i == 0) {
+
+        /* The space saved went back to the page */
+        assert_true(sender_page->size_used < 1024);
+        assert_true(sender_page->size_used < size_used);
+
+      } else {
+
+        assert_int_equal(sender_page->size_used, size_used);
+
+      }
+
+    }
+
+    llmp_broker_once(broker);
+    assert_int_equal(hook_seen, 1);
+
+    for (i = 0; i < 3; i++) {
+
+      llmp_message_t *msg = llmp_client_recv(receiver);
+      assert_non_null(msg);
+      assert_int_equal(msg->tag, 0x7357);
+      assert_int_equal(msg->buf_len, lens[i]);
+      for (j = 0; j < lens[i]; j++) {
+
+        u8 expected = i ? (u8)(j * 2654435761U >> 13) : j == 4096 ? 0x42 : j == 8 && variant == 2 ? 0x17 : 0xff;
+        if (msg->buf[j] != expected) { assert_int_equal(msg->buf[j], expected); }
+
+      }
+
+    }
+
+    assert_null(llmp_client_recv(receiver));
+
+    llmp_client_delete(receiver);
+    llmp_client_delete(sender);
+    llmp_broker_delete(broker);
+
+  }
+
+}
+
+void test_llmp_b2b_link(void **state) {
+
+  (void)state;
+
+  llmp_client_t * root_fuzzer, *root_link, *sub_fuzzer, *sub_link;
+  llmp_broker_t * root = test_llmp_broker_new(&root_fuzzer, &root_link);
+  llmp_broker_t * sub = test_llmp_broker_new(&sub_fuzzer, &sub_link);
+  llmp_b2b_link_t link = {0};
+  assert_int_equal(llmp_b2b_link_init(&link, sub_link, root_link), AFL_RET_SUCCESS);
+
+  /* Equal payloads are still different msgs */
+  send_tagged(root_fuzzer, 0x7357, "a");
+  send_tagged(sub_fuzzer, 0x7357, "a");
+  send_tagged(sub_fuzzer, 0x7357, "b");
+  send_tagged(sub_fuzzer, 0x7357, "b");
+  send_tagged(sub_fuzzer, 0x7358, "b");
+
+  u32 i;
+  for (i = 0; i < 4; i++) {
+
+    llmp_broker_once(root);
+    llmp_broker_once(sub);
+    llmp_b2b_link_once(&link);
+
+  }
+
+  /* Its own "a", then the sub's 4, without echos */
+  assert_int_equal(recv_all(root_fuzzer), 5);
+  /* Its own 4, then the root's "a" */
+  assert_int_equal(recv_all(sub_fuzzer), 5);
+
+  /* A link can sleep until the broker rings its doorbell after a broadcast */
+  afl_shmem_t doorbell_map = {0};
+  assert_non_null(afl_shmem_init(&doorbell_map, sizeof(llmp_doorbell_t)));
+  memset(doorbell_map.map, 0, sizeof(llmp_doorbell_t));
+  llmp_doorbell_t *doorbell = (llmp_doorbell_t *)doorbell_map.map;
+  assert_int_equal(llmp_client_register_doorbell(link.parent, &doorbell_map), AFL_RET_SUCCESS);
+  llmp_broker_once(root);
+  assert_int_equal(doorbell->ring, 0);
+  send_tagged(root_fuzzer, 0x7357, "c");
+  llmp_broker_once(root);
+  assert_int_equal(doorbell->ring, 1);
+  afl_shmem_deinit(&doorbell_map);
+
+  llmp_b2b_link_deinit(&link);
+  llmp_broker_delete(sub);
+  llmp_broker_delete(root);
+
+}
+
+#include <arpa/inet.h>
+
+void test_llmp_tcp_bridge(void **state) {
+
+  (void)state;
+
+  llmp_broker_t *brokers[2];
+  llmp_client_t *fuzzers[2], *bridges[2];
+  u32            i;
+  for (i = 0; i < 2; i++) {
+
+    brokers[i] = test_llmp_broker_new(&fuzzers[i], &bridges[i]);
+
+  }
+
+  llmp_tcp_bridge_t listener = {0}, connector = {0};
+  assert_int_equal(llmp_tcp_bridge_init(&listener, bridges[0], NULL, 0), AFL_RET_SUCCESS);
+  assert_int_not_equal(listener.port, 0);
+
+  /* Only local peers, by default */
+  struct sockaddr_in listen_addr;
+  socklen_t          addr_len = sizeof(listen_addr);
+  assert_int_equal(getsockname(listener.listenfd, (struct sockaddr *)&listen_addr, &addr_len), 0);
+  assert_int_equal(ntohl(listen_addr.sin_addr.s_addr), INADDR_LOOPBACK);
+  assert_int_equal(llmp_tcp_bridge_init(&connector, bridges[1], "localhost", listener.port), AFL_RET_SUCCESS);
+
+  /* Connect first, peers only get what got broadcasted after */
+  for (i = 0; i < 10 && !listener.peer_count; i++) {
+
+    llmp_tcp_bridge_once(&connector, 10);
+    llmp_tcp_bridge_once(&listener, 10);
+
+  }
+
+  assert_int_equal(listener.peer_count, 1);
+  assert_int_equal(connector.peer_count, 1);
+
+  send_tagged(fuzzers[0], 0x7357, "a");
+  send_tagged(fuzzers[0], 0x7357, "a");
+  send_tagged(fuzzers[0], 0x7357, "b");
+  send_tagged(fuzzers[1], 0x7357, "c");
+
+  size_t received[2] = {0};
+  for (i = 0; i < 100 && (received[0] < 4 || received[1] < 4); i++) {
+
+    llmp_broker_once(brokers[0]);
+    llmp_broker_once(brokers[1]);
+    llmp_tcp_bridge_once(&listener, 1);
+    llmp_tcp_bridge_once(&connector, 1);
+    received[0] += recv_all(fuzzers[0]);
+    received[1] += recv_all(fuzzers[1]);
+
+  }
+
+  /* A few more rounds, to catch echos */
+  for (i = 0; i < 10; i++) {
+
+    llmp_broker_once(brokers[0]);
+    llmp_broker_once(brokers[1]);
+    llmp_tcp_bridge_once(&listener, 1);
+    llmp_tcp_bridge_once(&connector, 1);
+    received[0] += recv_all(fuzzers[0]);
+    received[1] += recv_all(fuzzers[1]);
+
+  }
+
+  /* Its own 3, then "c" */
+  assert_int_equal(received[0], 4);
+  /* Its own "c", then the other 3 */
+  assert_int_equal(received[1], 4);
+
+  /* A peer announcing a frame larger than any msg gets dropped, before we allocate for it */
+  int                rogue = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in rogue_addr = {.sin_family = AF_INET, .sin_port = htons(listener.port)};
+  rogue_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert_int_equal(connect(rogue, (struct sockaddr *)&rogue_addr, sizeof(rogue_addr)), 0);
+  for (i = 0; i < 10 && listener.peer_count < 2; i++) {
+
+    llmp_tcp_bridge_once(&listener, 10);
+
+  }
+
+  assert_int_equal(listener.peer_count, 2);
+  u32 rogue_hdr[4] = {htonl(0x7357), htonl(0xffffffff), htonl(1), htonl(1)};
+  assert_int_equal(write(rogue, rogue_hdr, sizeof(rogue_hdr)), sizeof(rogue_hdr));
+  for (i = 0; i < 10 && listener.peer_count > 1; i++) {
+
+    llmp_tcp_bridge_once(&listener, 10);
+
+  }
+
+  assert_int_equal(listener.peer_count, 1);
+  close(rogue);
+
+  /* So does one sending llmp's own control msgs: an end of page, and a msg by reference, with junk payloads */
+  u32 internal_tags[] = {0xAF1E0F1, 0x2EF2EF1};
+  u32 t;
+  for (t = 0; t < 2; t++) {
+
+    rogue = socket(AF_INET, SOCK_STREAM, 0);
+    assert_int_equal(connect(rogue, (struct sockaddr *)&rogue_addr, sizeof(rogue_addr)), 0);
+    for (i = 0; i < 10 && listener.peer_count < 2; i++) {
+
+      llmp_tcp_bridge_once(&listener, 10);
+
+    }
+
+    assert_int_equal(listener.peer_count, 2);
+    u32 rogue_frame[4 + 64] = {htonl(internal_tags[t]), htonl(64 * sizeof(u32)), htonl(1), htonl(1)};
+    memset(&rogue_frame[4], 0x41, 64 * sizeof(u32));
+    assert_int_equal(write(rogue, rogue_frame, sizeof(rogue_frame)), sizeof(rogue_frame));
+    for (i = 0; i < 10 && listener.peer_count > 1; i++) {
+
+      llmp_tcp_bridge_once(&listener, 10);
+
+    }
+
+    assert_int_equal(listener.peer_count, 1);
+    close(rogue);
+
+  }
+
+  /* Nothing reached our broker */
+  llmp_broker_once(brokers[0]);
+  assert_null(llmp_client_recv(fuzzers[0]));
+
+  llmp_tcp_bridge_deinit(&connector);
+  llmp_tcp_bridge_deinit(&listener);
+  for (i = 0; i < 2; i++) {
+
+    llmp_broker_delete(brokers[i]);
+
+  }
+
+}
+
+/* Forkserver tests, against the fsrv_target* binaries the Makefile builds from fsrv_target.c */
+
+static afl_forkserver_t *test_fsrv_new(char **argv, afl_observer_covmap_t *covmap) {
+
+  afl_forkserver_t *fsrv = fsrv_init(argv[0], argv);
+  assert_non_null(fsrv);
+
+  fsrv->exec_tmout = 1000;
+  fsrv->covmap = covmap;
+  fsrv->base.funcs.observer_add(&fsrv->base, &covmap->base);
+  return fsrv;
+
+}
+
+/* Runs the target on bytes, its coverage ends up in covmap */
+static afl_exit_t test_fsrv_run(afl_forkserver_t *fsrv, afl_observer_covmap_t *covmap, char *bytes) {
+
+  afl_input_t input;
+  afl_input_init(&input);
+  input.bytes = (u8 *)bytes;
+  input.len = strlen(bytes);
+
+  memset(covmap->shared_map.map, 0, covmap->shared_map.map_size);
+  fsrv->base.funcs.place_input_cb(&fsrv->base, &input);
+  afl_exit_t exit_code = fsrv->base.funcs.run_target_cb(&fsrv->base);
+
+  afl_input_deinit(&input);
+  return exit_code;
+
+}
+
+static void test_fsrv_delete(afl_forkserver_t *fsrv) {
+
+  unlink(fsrv->out_file);
+  fsrv_destroy(&fsrv->base);
+  free(fsrv);
+
+}
+
+void test_fsrv_shmem(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *covmap = afl_observer_covmap_new(MAP_SIZE);
+  char *                 argv[] = {"./fsrv_target_shmem", NULL};
+
+  afl_forkserver_t *fsrv = test_fsrv_new(argv, covmap);
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+  assert_true(fsrv->use_shmem_fuzz);
+
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['A'], 0);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "B"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['B'], 0);
+  assert_int_equal(covmap->shared_map.map['A'], 0);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "C"), AFL_EXIT_CRASH);
+  assert_int_equal(fsrv->total_execs, 3);
+
+  test_fsrv_delete(fsrv);
+
+  /* Without the shared memory, the target still gets its answer, and reads from the file */
+  fsrv = test_fsrv_new(argv, covmap);
+  afl_shmem_deinit(&fsrv->shmem_fuzz);
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+  assert_false(fsrv->use_shmem_fuzz);
+
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['A'], 0);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "C"), AFL_EXIT_CRASH);
+
+  test_fsrv_delete(fsrv);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+void test_fsrv_dirty_blocks(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *covmap = afl_observer_covmap_new(MAP_SIZE);
+  char *                 argv[] = {"./fsrv_target", NULL};
+  assert_int_equal(afl_observer_covmap_track_dirty(covmap), AFL_RET_SUCCESS);
+
+  afl_feedback_cov_t feedback = {0};
+  assert_int_equal(afl_feedback_cov_init(&feedback, NULL, covmap), AFL_RET_SUCCESS);
+
+  afl_forkserver_t *fsrv = test_fsrv_new(argv, covmap);
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+
+  u8 *dirty = covmap->dirty_map.map;
+
+  /* The target calls __afl_trace, which marks its block, but the runtime can't
+     tell it from inline instrumentation, so it leaves the marker alone */
+  covmap->base.funcs.reset(&covmap->base);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_not_equal(dirty['A' >> DIRTY_BLOCK_SHIFT], 0);
+  assert_int_equal(dirty[DIRTY_MAP_COMPLETE(MAP_SIZE)], 0);
+
+  /* So a write nobody marked still counts, and gets cleared */
+  covmap->shared_map.map[MAP_SIZE - 1] = 1;
+  assert_true(feedback.base.funcs.is_interesting(&feedback.base, NULL) > 0.0);
+  assert_int_equal(feedback.virgin_bits['A'], 0xfe);
+  assert_int_equal(feedback.virgin_bits[MAP_SIZE - 1], 0xfe);
+  covmap->base.funcs.reset(&covmap->base);
+  assert_int_equal(covmap->shared_map.map[MAP_SIZE - 1], 0);
+
+  /* With the marker, only the marked block is left to visit */
+  dirty[DIRTY_MAP_COMPLETE(MAP_SIZE)] = 1;
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_equal(afl_observer_covmap_next_dirty(covmap, 0), 'A' >> DIRTY_BLOCK_SHIFT);
+  assert_int_equal(afl_observer_covmap_next_dirty(covmap, ('A' >> DIRTY_BLOCK_SHIFT) + 1), SIZE_MAX);
+
+  test_fsrv_delete(fsrv);
+  afl_feedback_cov_deinit(&feedback);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+void test_fsrv_edgelist_threads(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *  covmap = afl_observer_covmap_new(MAP_SIZE);
+  afl_observer_edgelist_t *observer = afl_observer_edgelist_new(MAP_SIZE, 256);
+  char *                   argv[] = {"./fsrv_target", NULL};
+  assert_non_null(observer);
+
+  /* The forkserver doesn't know about edge lists, the target gets it through our env */
+  afl_shmem_to_env_var(&observer->shared_list, EDGES_SHM_ENV_VAR);
+  afl_forkserver_t *fsrv = test_fsrv_new(argv, covmap);
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+  unsetenv(EDGES_SHM_ENV_VAR);
+
+  afl_edge_list_t *edges = observer->edges;
+  u8               seen[128] = {0};
+
+  /* Edge 'M' of the input, then all threads hit edges 0 to 63 at once: each one
+     is in the list once, and only hits racing with its insertion may be
+     missing from the count */
+  observer->base.funcs.reset(&observer->base);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "M"), AFL_EXIT_OK);
+  assert_int_equal(edges->count, 64 + 1);
+  assert_int_equal(edges->dropped, 0);
+
+  for (u32 i = 0; i < edges->count; i++) {
+
+    assert_true(edges->edges[i].id < 64 || edges->edges[i].id == 'M');
+    assert_false(seen[edges->edges[i].id]);
+    seen[edges->edges[i].id] = 1;
+
+    /* 4 threads, 20000 times each. Edges below 32 also come after each i. */
+    if (edges->edges[i].id >= 32 && edges->edges[i].id < 64) {
+
+      assert_true(edges->edges[i].count >= 4 * 20000 - 4 && edges->edges[i].count <= 4 * 20000);
+
+    }
+
+  }
+
+  test_fsrv_delete(fsrv);
+  afl_observer_edgelist_delete(observer);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+void test_fsrv_persistent(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *covmap = afl_observer_covmap_new(MAP_SIZE);
+  char *                 argv[] = {"./fsrv_target_persistent", NULL};
+
+  afl_forkserver_t *fsrv = test_fsrv_new(argv, covmap);
+  assert_true(fsrv->persistent_mode);
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+
+  /* One child for all runs, until it crashes */
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['A'], 0);
+  s32 child_pid = fsrv->child_pid;
+  assert_true(child_pid > 0);
+
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "B"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['B'], 0);
+  assert_int_equal(covmap->shared_map.map['A'], 0);
+  assert_int_equal(fsrv->child_pid, child_pid);
+
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "C"), AFL_EXIT_CRASH);
+  assert_int_equal(fsrv->child_pid, 0);
+
+  /* The next run gets a new child */
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['A'], 0);
+  assert_int_not_equal(fsrv->child_pid, child_pid);
+
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "T"), AFL_EXIT_TIMEOUT);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "B"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['B'], 0);
+
+  test_fsrv_delete(fsrv);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+typedef struct test_fsrv_batch {
+
+  afl_observer_covmap_t *covmap;
+  afl_input_t **         inputs;
+  s32                    child_pids[6];
+
+} test_fsrv_batch_t;
+
+static void test_fsrv_batch_on_run(afl_executor_t *executor, u32 idx, afl_exit_t exit_code, void *data) {
+
+  test_fsrv_batch_t *batch = (test_fsrv_batch_t *)data;
+  u8                 first = batch->inputs[idx]->bytes[0];
+
+  if (exit_code == AFL_EXIT_OK) { assert_int_not_equal(batch->covmap->shared_map.map[first], 0); }
+  batch->child_pids[idx] = ((afl_forkserver_t *)executor)->child_pid;
+
+}
+
+void test_fsrv_run_batch(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *covmap = afl_observer_covmap_new(MAP_SIZE);
+  char *                 argv[] = {"./fsrv_target_persistent", "@@", NULL};
+  afl_input_t            inputs[6];
+  afl_input_t *          input_ptrs[6];
+  afl_exit_t             exit_codes[6];
+  u32                    i;
+
+  afl_forkserver_t *fsrv = test_fsrv_new(argv, covmap);
+  assert_false(fsrv->use_stdin);
+  assert_ptr_equal(fsrv->base.funcs.run_batch, fsrv_run_batch);
+  fsrv->exec_tmout = 200;
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+
+  for (i = 0; i < 6; i++) {
+
+    afl_input_init(&inputs[i]);
+    inputs[i].bytes = (u8 *)&"ABCATB"[i];
+    inputs[i].len = 1;
+    input_ptrs[i] = &inputs[i];
+
+  }
+
+  /* All from the same file, and from the same child until one crashes */
+  test_fsrv_batch_t batch = {.covmap = covmap, .inputs = input_ptrs};
+  assert_int_equal(
+      fsrv->base.funcs.run_batch(&fsrv->base, input_ptrs, 6, exit_codes, test_fsrv_batch_on_run, &batch),
+      AFL_RET_SUCCESS);
+
+  assert_int_equal(exit_codes[0], AFL_EXIT_OK);
+  assert_int_equal(exit_codes[1], AFL_EXIT_OK);
+  assert_int_equal(exit_codes[2], AFL_EXIT_CRASH);
+  assert_int_equal(exit_codes[3], AFL_EXIT_OK);
+  assert_int_equal(exit_codes[4], AFL_EXIT_TIMEOUT);
+  assert_int_equal(exit_codes[5], AFL_EXIT_OK);
+  assert_int_equal(batch.child_pids[0], batch.child_pids[1]);
+  assert_int_not_equal(batch.child_pids[3], batch.child_pids[0]);
+  assert_int_equal(fsrv->total_execs, 6);
+
+  /* Gone after the batch, single runs create it again */
+  assert_int_not_equal(access(fsrv->out_file, F_OK), 0);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "B"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['B'], 0);
+
+  for (i = 0; i < 6; i++) {
+
+    afl_input_deinit(&inputs[i]);
+
+  }
+
+  test_fsrv_delete(fsrv);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+void test_fsrv_deferred(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *covmap = afl_observer_covmap_new(MAP_SIZE);
+  char *                 argv[] = {"./fsrv_target", NULL};
+
+  /* Without __afl_manual_init, each child does the setup itself */
+  afl_forkserver_t *fsrv = test_fsrv_new(argv, covmap);
+  assert_false(fsrv->deferred_mode);
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['A'], 0);
+  assert_int_equal(covmap->shared_map.map['A' | 0x80], 0);
+  test_fsrv_delete(fsrv);
+
+  /* With it, the children get forked after the setup */
+  argv[0] = "./fsrv_target_deferred";
+  fsrv = test_fsrv_new(argv, covmap);
+  assert_true(fsrv->deferred_mode);
+  assert_int_equal(fsrv->base.funcs.init_cb(&fsrv->base), AFL_RET_SUCCESS);
+
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "A"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['A' | 0x80], 0);
+  assert_int_equal(covmap->shared_map.map['A'], 0);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "C"), AFL_EXIT_CRASH);
+  assert_int_equal(test_fsrv_run(fsrv, covmap, "B"), AFL_EXIT_OK);
+  assert_int_not_equal(covmap->shared_map.map['B' | 0x80], 0);
+
+  test_fsrv_delete(fsrv);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+void test_fsrv_group(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *covmaps[2];
+  afl_forkserver_t *     fsrvs[2];
+  char *                 argv[2][2] = {{"./fsrv_target", NULL}, {"./fsrv_target", NULL}};
+  afl_input_t            inputs[2];
+  size_t                 i;
+
+  s32 group_fd = fsrv_group_new();
+  assert_true(group_fd >= 0);
+
+  for (i = 0; i < 2; i++) {
+
+    covmaps[i] = afl_observer_covmap_new(MAP_SIZE);
+    fsrvs[i] = test_fsrv_new(argv[i], covmaps[i]);
+    fsrvs[i]->exec_tmout = 200;
+    assert_int_equal(fsrvs[i]->base.funcs.init_cb(&fsrvs[i]->base), AFL_RET_SUCCESS);
+    assert_int_equal(fsrv_group_add(group_fd, fsrvs[i]), AFL_RET_SUCCESS);
+
+    afl_input_init(&inputs[i]);
+    inputs[i].bytes = (u8 *)(i ? "A" : "T");
+    inputs[i].len = 1;
+
+  }
+
+  /* Nothing running, nothing to wait for */
+  assert_null(fsrv_group_wait(group_fd, 0));
+
+  u64 start_us = afl_get_cur_time_us();
+  for (i = 0; i < 2; i++) {
+
+    fsrvs[i]->base.funcs.place_input_cb(&fsrvs[i]->base, &inputs[i]);
+    fsrv_run_target_async(fsrvs[i]);
+
+  }
+
+  /* The hang keeps running while the other one is done */
+  assert_ptr_equal(fsrv_group_wait(group_fd, 2000), fsrvs[1]);
+  assert_int_equal(fsrv_run_target_collect(fsrvs[1]), AFL_EXIT_OK);
+  assert_int_not_equal(covmaps[1]->shared_map.map['A'], 0);
+  assert_false(fsrv_poll(fsrvs[0], 0));
+
+  /* Until its timer fires */
+  assert_ptr_equal(fsrv_group_wait(group_fd, 2000), fsrvs[0]);
+  assert_int_equal(fsrv_run_target_collect(fsrvs[0]), AFL_EXIT_TIMEOUT);
+  u64 elapsed_ms = (afl_get_cur_time_us() - start_us) / 1000;
+  assert_true(elapsed_ms >= 150 && elapsed_ms < 2000);
+
+  /* Both still good for the next run */
+  for (i = 0; i < 2; i++) {
+
+    assert_int_equal(test_fsrv_run(fsrvs[i], covmaps[i], "B"), AFL_EXIT_OK);
+    assert_int_not_equal(covmaps[i]->shared_map.map['B'], 0);
+
+    afl_input_deinit(&inputs[i]);
+    test_fsrv_delete(fsrvs[i]);
+    afl_observer_covmap_delete(covmaps[i]);
+
+  }
+
+  close(group_fd);
+
+}
+
+static void test_fsrv_pool_on_run(afl_executor_t *executor, u32 idx, afl_exit_t exit_code, void *data) {
+
+  afl_fsrv_pool_t *pool = (afl_fsrv_pool_t *)executor;
+  afl_input_t **   inputs = data;
+
+  /* The coverage in the pool's covmap is the one of this input */
+  assert_ptr_equal(executor->current_input, inputs[idx]);
+  if (exit_code == AFL_EXIT_OK) { assert_int_not_equal(pool->covmap->shared_map.map[inputs[idx]->bytes[0]], 0); }
+
+}
+
+void test_fsrv_pool(void **state) {
+
+  (void)state;
+
+  afl_observer_covmap_t *covmap = afl_observer_covmap_new(MAP_SIZE);
+  char *                 argv[] = {"./fsrv_target", NULL};
+  afl_input_t            inputs[8];
+  afl_input_t *          batch[9];
+  afl_exit_t             exit_codes[9];
+  u32                    i;
+
+  afl_fsrv_pool_t *pool = fsrv_pool_init(argv[0], argv, 4);
+  assert_non_null(pool);
+  pool->exec_tmout = 500;
+  pool->base.funcs.observer_add(&pool->base, &covmap->base);
+
+  /* One forkserver that won't come up, and none keep running */
+  char *target_path = pool->fsrvs[2]->target_path;
+  pool->fsrvs[2]->target_path = "./no_such_target";
+  assert_int_not_equal(pool->base.funcs.init_cb(&pool->base), AFL_RET_SUCCESS);
+  for (i = 0; i < 4; i++) {
+
+    assert_int_equal(pool->fsrvs[i]->fsrv_pid, -1);
+
+  }
+
+  pool->fsrvs[2]->target_path = target_path;
+  assert_int_equal(pool->base.funcs.init_cb(&pool->base), AFL_RET_SUCCESS);
+
+  /* Twice as many inputs as forkservers, the last one twice */
+  for (i = 0; i < 8; i++) {
+
+    afl_input_init(&inputs[i]);
+    inputs[i].bytes = (u8 *)&"ABCDEFGH"[i];
+    inputs[i].len = 1;
+    batch[i] = &inputs[i];
+
+  }
+
+  batch[8] = &inputs[7];
+  assert_int_equal(pool->base.funcs.run_batch(&pool->base, batch, 9, exit_codes, test_fsrv_pool_on_run, batch),
+                   AFL_RET_SUCCESS);
+
+  for (i = 0; i < 9; i++) {
+
+    assert_int_equal(exit_codes[i], batch[i]->bytes[0] == 'C' ? AFL_EXIT_CRASH : AFL_EXIT_OK);
+
+  }
+
+  assert_int_equal(pool->total_execs, 9);
+  assert_int_equal(pool->running, 0);
+
+  /* Submitting and collecting by hand, as the pipelined stage does */
+  for (i = 0; i < 4; i++) {
+
+    assert_true(pool->base.funcs.submit_cb(&pool->base, &inputs[i]));
+
+  }
+
+  assert_false(pool->base.funcs.submit_cb(&pool->base, &inputs[4]));
+
+  for (i = 0; i < 4; i++) {
+
+    afl_exit_t   exit_code;
+    afl_input_t *input = pool->base.funcs.collect_cb(&pool->base, -1, &exit_code);
+    assert_non_null(input);
+    assert_int_equal(exit_code, input->bytes[0] == 'C' ? AFL_EXIT_CRASH : AFL_EXIT_OK);
+
+  }
+
+  assert_null(pool->base.funcs.collect_cb(&pool->base, 0, NULL));
+
+  for (i = 0; i < 4; i++) {
+
+    unlink(pool->fsrvs[i]->out_file);
+
+  }
+
+  for (i = 0; i < 8; i++) {
+
+    afl_input_deinit(&inputs[i]);
+
+  }
+
+  fsrv_pool_destroy(&pool->base);
+  free(pool);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+#include <sys/mman.h>
+
+/* A global, to look up the module it is in */
+static int test_mem_snapshot_global = 1;
+
+void test_mem_snapshot(void **state) {
+
+  (void)state;
+
+  afl_mem_snapshot_t snapshot;
+  assert_int_equal(afl_mem_snapshot_init(&snapshot), AFL_RET_SUCCESS);
+
+  /* Like an arena the harness allocates from */
+  size_t page_size = snapshot.page_size;
+  size_t len = 4 * page_size;
+  u8 *   arena = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  u8 *   expected = malloc(len);
+  assert_ptr_not_equal(arena, MAP_FAILED);
+  assert_non_null(expected);
+
+  memset(arena, 'A', len);
+  memset(arena + page_size, 0, page_size);
+  memcpy(expected, arena, len);
+
+  /* Unaligned, still the whole pages */
+  assert_int_equal(afl_mem_snapshot_add_range(&snapshot, arena + 1, len - 2), AFL_RET_SUCCESS);
+  assert_int_equal(afl_mem_snapshot_take(&snapshot), AFL_RET_SUCCESS);
+  assert_true(snapshot.taken);
+
+  int i;
+  for (i = 0; i < 3; i++) {
+
+    arena[0] = 'B';
+    arena[2 * page_size + 7] = 'C';
+    afl_mem_snapshot_restore(&snapshot);
+    assert_memory_equal(arena, expected, len);
+
+  }
+
+  /* Only the two pages written each time, unless we can't tell which */
+  if (snapshot.tracking != AFL_MEM_SNAPSHOT_FULL) { assert_int_equal(snapshot.restored_pages, 3 * 2); }
+
+  /* Nothing written, nothing to do */
+  u64 restored_pages = snapshot.restored_pages;
+  afl_mem_snapshot_restore(&snapshot);
+  if (snapshot.tracking != AFL_MEM_SNAPSHOT_FULL) { assert_int_equal(snapshot.restored_pages, restored_pages); }
+  assert_memory_equal(arena, expected, len);
+
+  /* A second snapshot of the upper half can't have the soft-dirty bits as well, restoring it would clear ours */
+  afl_mem_snapshot_t other;
+  assert_int_equal(afl_mem_snapshot_init(&other), AFL_RET_SUCCESS);
+  assert_int_equal(afl_mem_snapshot_add_range(&other, arena + 2 * page_size, 2 * page_size), AFL_RET_SUCCESS);
+  assert_int_equal(afl_mem_snapshot_take(&other), AFL_RET_SUCCESS);
+  if (snapshot.tracking == AFL_MEM_SNAPSHOT_SOFT_DIRTY) { assert_int_equal(other.tracking, AFL_MEM_SNAPSHOT_FULL); }
+
+  arena[0] = 'B';
+  arena[3 * page_size] = 'D';
+  afl_mem_snapshot_restore(&other);
+  assert_int_equal(arena[3 * page_size], 'A');
+  afl_mem_snapshot_restore(&snapshot);
+  assert_memory_equal(arena, expected, len);
+
+  afl_mem_snapshot_deinit(&other);
+  afl_mem_snapshot_deinit(&snapshot);
+
+  /* Our globals are in one of the ranges of our module */
+  assert_int_equal(afl_mem_snapshot_init(&snapshot), AFL_RET_SUCCESS);
+  assert_int_equal(afl_mem_snapshot_add_module(&snapshot, &test_mem_snapshot_global), AFL_RET_SUCCESS);
+
+  bool found = false;
+  size_t j;
+  for (j = 0; j < snapshot.ranges_count; j++) {
+
+    u8 *global = (u8 *)&test_mem_snapshot_global;
+    if (global >= snapshot.ranges[j].start && global < snapshot.ranges[j].start + snapshot.ranges[j].len) {
+
+      found = true;
+
+    }
+
+  }
+
+  assert_true(found);
+
+  /* But not the heap, even if it comes right after our .bss */
+  u8 *heap = malloc(16);
+  assert_non_null(heap);
+  for (j = 0; j < snapshot.ranges_count; j++) {
+
+    assert_false(heap >= snapshot.ranges[j].start && heap < snapshot.ranges[j].start + snapshot.ranges[j].len);
+
+  }
+
+  free(heap);
+
+  /* Nothing loaded there */
+  assert_int_equal(afl_mem_snapshot_add_module(&snapshot, (void *)16), AFL_RET_NULL_PTR);
+
+  afl_mem_snapshot_deinit(&snapshot);
+  munmap(arena, len);
+  free(expected);
+
+}
+
+/* Crashes the way the first byte says */
+static afl_exit_t test_crashing_harness(afl_executor_t *executor, u8 *data, size_t len) {
+
+  (void)executor;
+  volatile int zero = 0;
+
+  if (!len) { return AFL_EXIT_OK; }
+
+  switch (data[0]) {
+
+    case 'S':
+      *(volatile int *)NULL = 1;
+      break;
+    case 'F':
+      zero = (int)len / zero;
+      break;
+    case 'A':
+      abort();
+
+  }
+
+  return AFL_EXIT_OK;
+
+}
+
+void test_in_memory_catch_crashes(void **state) {
+
+  (void)state;
+
+  in_memory_executor_t in_memory_executor;
+  in_memory_executor_init(&in_memory_executor, test_crashing_harness);
+  in_memory_executor.catch_crashes = 1;
+
+  afl_input_t input;
+  afl_input_init(&input);
+
+  u8 data[1] = {'S'};
+  input.bytes = data;
+  input.len = 1;
+
+  in_memory_executor.base.funcs.place_input_cb(&in_memory_executor.base, &input);
+
+  /* Twice, the handler has to work after a jump out of it as well */
+  int i;
+  for (i = 0; i < 2; i++) {
+
+    data[0] = 'S';
+    assert_int_equal(in_memory_executor.base.funcs.run_target_cb(&in_memory_executor.base), AFL_EXIT_SEGV);
+    data[0] = 'F';
+    assert_int_equal(in_memory_executor.base.funcs.run_target_cb(&in_memory_executor.base), AFL_EXIT_FPE);
+    data[0] = 'A';
+    assert_int_equal(in_memory_executor.base.funcs.run_target_cb(&in_memory_executor.base), AFL_EXIT_ABRT);
+    data[0] = 'X';
+    assert_int_equal(in_memory_executor.base.funcs.run_target_cb(&in_memory_executor.base), AFL_EXIT_OK);
+
+  }
+
+  afl_input_deinit(&input);
+  afl_executor_deinit(&in_memory_executor.base);
+
+}
+
+typedef struct test_batch_runs {
+
+  afl_input_t **inputs;
+  u32           idxs[4];
+  u32           runs;
+
+} test_batch_runs_t;
+
+static void test_batch_on_run(afl_executor_t *executor, u32 idx, afl_exit_t exit_code, void *data) {
+
+  test_batch_runs_t *runs = (test_batch_runs_t *)data;
+
+  (void)exit_code;
+  assert_ptr_equal(executor->current_input, runs->inputs[idx]);
+  runs->idxs[runs->runs++] = idx;
+
+}
+
+void test_executor_run_batch(void **state) {
+
+  (void)state;
+
+  in_memory_executor_t in_memory_executor;
+  in_memory_executor_init(&in_memory_executor, test_crashing_harness);
+  in_memory_executor.catch_crashes = 1;
+
+  assert_ptr_equal(in_memory_executor.base.funcs.run_batch, in_memory_run_batch);
+
+  afl_input_t  inputs[4];
+  afl_input_t *input_ptrs[4];
+  u8           data[4] = {'X', 'S', 'A', 'X'};
+  afl_exit_t   exit_codes[4];
+  u32          i;
+
+  for (i = 0; i < 4; i++) {
+
+    afl_input_init(&inputs[i]);
+    inputs[i].bytes = &data[i];
+    inputs[i].len = 1;
+    input_ptrs[i] = &inputs[i];
+
+  }
+
+  /* Twice, the batch goes on after each crash, and the next batch starts over */
+  u32 pass;
+  for (pass = 0; pass < 2; pass++) {
+
+    test_batch_runs_t runs = {.inputs = input_ptrs, .runs = 0};
+
+    assert_int_equal(in_memory_executor.base.funcs.run_batch(&in_memory_executor.base, input_ptrs, 4, exit_codes,
+                                                             test_batch_on_run, &runs),
+                     AFL_RET_SUCCESS);
+
+    assert_int_equal(runs.runs, 4);
+    for (i = 0; i < 4; i++) {
+
+      assert_int_equal(runs.idxs[i], i);
+
+    }
+
+    assert_int_equal(exit_codes[0], AFL_EXIT_OK);
+    assert_int_equal(exit_codes[1], AFL_EXIT_SEGV);
+    assert_int_equal(exit_codes[2], AFL_EXIT_ABRT);
+    assert_int_equal(exit_codes[3], AFL_EXIT_OK);
+
+  }
+
+  for (i = 0; i < 4; i++) {
+
+    afl_input_deinit(&inputs[i]);
+
+  }
+
+  afl_executor_deinit(&in_memory_executor.base);
+
+}
+
+static int test_snapshot_executor_global;
+
+/* Counts its runs in a global, which is back to 0 for each run if the executor undid the one before */
+static afl_exit_t test_snapshot_executor_harness(afl_executor_t *executor, u8 *data, size_t len) {
+
+  afl_observer_covmap_t *covmap = (afl_observer_covmap_t *)executor->observors[0];
+  covmap->shared_map.map[0] = ++test_snapshot_executor_global;
+
+  if (len && data[0] == 'T') { pause(); }
+  return test_crashing_harness(executor, data, len);
+
+}
+
+void test_snapshot_executor(void **state) {
+
+  (void)state;
+
+  snapshot_executor_t    snapshot_executor;
+  afl_observer_covmap_t *covmap = afl_observer_covmap_new(MAP_SIZE);
+  afl_executor_t *       executor = &snapshot_executor.base.base;
+  afl_input_t            input;
+  u8                     data[1];
+  int                    i;
+
+  assert_int_equal(snapshot_executor_init(&snapshot_executor, test_snapshot_executor_harness), AFL_RET_SUCCESS);
+  executor->funcs.observer_add(executor, &covmap->base);
+  snapshot_executor.exec_tmout = 200;
+
+  /* Only used with the LKM, but kept either way */
+  assert_int_equal(snapshot_executor_add_range(&snapshot_executor, data, data + 1, true), AFL_RET_SUCCESS);
+  assert_int_equal(snapshot_executor_add_range(&snapshot_executor, data, data + 1, false), AFL_RET_SUCCESS);
+  assert_int_equal(snapshot_executor.ranges_count, 2);
+  assert_false(snapshot_executor.ranges[1].include);
+
+  /* No LKM around here: the child forks for each run */
+  assert_int_equal(executor->funcs.init_cb(executor), AFL_RET_SUCCESS);
+
+  afl_input_init(&input);
+  input.bytes = data;
+  input.len = 1;
+
+  for (i = 0; i < 3; i++) {
+
+    data[0] = 'X';
+    executor->funcs.place_input_cb(executor, &input);
+    assert_int_equal(executor->funcs.run_target_cb(executor), AFL_EXIT_OK);
+    assert_int_equal(covmap->shared_map.map[0], 1);
+
+  }
+
+  s32 child_pid = snapshot_executor.child.handler_process;
+
+  /* A crash only takes the run with it. An abort, as ASan would turn a segfault into an exit. */
+  data[0] = 'A';
+  executor->funcs.place_input_cb(executor, &input);
+  assert_int_equal(executor->funcs.run_target_cb(executor), AFL_EXIT_ABRT);
+  if (!snapshot_executor.use_snapshot) { assert_int_equal(snapshot_executor.child.handler_process, child_pid); }
+
+  /* A hang takes the child, the next run spawns a new one */
+  data[0] = 'T';
+  executor->funcs.place_input_cb(executor, &input);
+  assert_int_equal(executor->funcs.run_target_cb(executor), AFL_EXIT_TIMEOUT);
+  assert_int_equal(snapshot_executor.child.handler_process, 0);
+
+  data[0] = 'X';
+  executor->funcs.place_input_cb(executor, &input);
+  assert_int_equal(executor->funcs.run_target_cb(executor), AFL_EXIT_OK);
+  assert_int_equal(covmap->shared_map.map[0], 1);
+  assert_int_not_equal(snapshot_executor.child.handler_process, child_pid);
+
+  afl_input_deinit(&input);
+  snapshot_executor_deinit(&snapshot_executor);
+  afl_observer_covmap_delete(covmap);
+
+}
+
+/* One edge for each first byte */
+static afl_exit_t test_runner_harness(afl_executor_t *executor, u8 *data, size_t len) {
+
+  afl_observer_covmap_t *covmap = (afl_observer_covmap_t *)executor->observors[0];
+  if (len) { covmap->shared_map.map[data[0]] = 1; }
+  return AFL_EXIT_OK;
+
+}
+
+static size_t test_runner_mutate(afl_mutator_t *mutator, afl_input_t *input) {
+
+  input->bytes[0] = afl_rand_below(&mutator->engine->rand, 256);
+  return input->len;
+
+}
+
+typedef struct test_runner_engine {
+
+  in_memory_executor_t   executor;
+  afl_observer_covmap_t *covmap;
+  afl_queue_feedback_t * feedback_queue;
+  afl_queue_global_t *   global_queue;
+  afl_feedback_cov_t *   feedback;
+  afl_engine_t *         engine;
+  afl_fuzz_one_t *       fuzz_one;
+  afl_mutator_t *        mutator;
+  afl_stage_t *          stage;
+
+} test_runner_engine_t;
+
+void test_runner(void **state) {
+
+  (void)state;
+
+  size_t               map_size = 1 << 12;
+  u8 *                 shared_virgin_bits = malloc(map_size);
+  test_runner_engine_t engines[3];
+  afl_runner_t         runner;
+  afl_runner_stats_t   stats;
+  size_t               i, j;
+
+  assert_non_null(shared_virgin_bits);
+  memset(shared_virgin_bits, 0xff, map_size);
+  assert_int_equal(afl_runner_init(&runner), AFL_RET_SUCCESS);
+
+  /* Nothing to run yet */
+  assert_int_equal(afl_runner_start(&runner), AFL_RET_NO_FUZZ_WORKERS);
+
+  for (i = 0; i < 3; i++) {
+
+    test_runner_engine_t *e = &engines[i];
+
+    in_memory_executor_init(&e->executor, test_runner_harness);
+    e->covmap = afl_observer_covmap_new(map_size);
+    e->executor.base.funcs.observer_add(&e->executor.base, &e->covmap->base);
+
+    e->feedback_queue = afl_queue_feedback_new(NULL, "cov");
+    e->global_queue = afl_queue_global_new();
+    e->global_queue->funcs.add_feedback_queue(e->global_queue, e->feedback_queue);
+    e->feedback = afl_feedback_cov_new(e->feedback_queue, e->covmap);
+    e->feedback_queue->feedback = &e->feedback->base;
+    afl_feedback_cov_set_shared_virgin_bits(e->feedback, shared_virgin_bits);
+
+    e->engine = afl_engine_new(&e->executor.base, NULL, e->global_queue);
+    e->engine->funcs.add_feedback(e->engine, &e->feedback->base);
+    e->fuzz_one = afl_fuzz_one_new(e->engine);
+    e->mutator = afl_mutator_new(e->engine);
+    e->mutator->funcs.mutate = test_runner_mutate;
+    e->stage = afl_stage_new(e->engine);
+    e->stage->funcs.add_mutator_to_stage(e->stage, e->mutator);
+
+    assert_int_equal(afl_runner_add_engine(&runner, e->engine, -1), AFL_RET_SUCCESS);
+
+  }
+
+  /* No entries anywhere */
+  assert_int_equal(afl_runner_start(&runner), AFL_RET_EMPTY);
+
+  /* The seed only goes to the last engine, all of them get to fuzz it */
+  afl_input_t *seed = afl_input_new();
+  seed->funcs.deserialize(seed, (u8 *)"abcd", 4);
+  afl_entry_t *seed_entry = afl_entry_new(seed, NULL);
+  engines[2].global_queue->base.funcs.insert(&engines[2].global_queue->base, seed_entry);
+
+  assert_int_equal(afl_runner_start(&runner), AFL_RET_SUCCESS);
+
+  u64 start_time = afl_get_cur_time();
+  do {
+
+    usleep(1000);
+    afl_runner_get_stats(&runner, &stats);
+
+  } while (stats.corpus_count < 64 && afl_get_cur_time() - start_time < 10000);
+
+  afl_runner_stop(&runner);
+  assert_int_equal(afl_runner_join(&runner), AFL_RET_SUCCESS);
+
+  afl_runner_get_stats(&runner, &stats);
+  assert_int_equal(stats.workers_count, 3);
+  assert_true(stats.corpus_count >= 64);
+  assert_int_equal(stats.crashes, 0);
+
+  u64 executions = 0;
+  for (i = 0; i < 3; i++) {
+
+    assert_true(engines[i].engine->executions > 0);
+    executions += engines[i].engine->executions;
+
+  }
+
+  assert_int_equal(stats.executions, executions);
+
+  /* Each edge was new to one engine only. The seed itself never ran, its byte may come again. */
+  for (i = 1; i < stats.corpus_count; i++) {
+
+    for (j = i + 1; j < stats.corpus_count; j++) {
+
+      assert_int_not_equal(runner.corpus[i]->input->bytes[0], runner.corpus[j]->input->bytes[0]);
+
+    }
+
+  }
+
+  /* The corpus has copies, the engines may change or drop their entries */
+  assert_ptr_not_equal(runner.corpus[0]->input, seed);
+  assert_memory_equal(runner.corpus[0]->input->bytes, "abcd", 4);
+
+  afl_runner_deinit(&runner);
+
+  for (i = 0; i < 3; i++) {
+
+    test_runner_engine_t *e = &engines[i];
+
+    afl_stage_delete(e->stage);
+    afl_mutator_delete(e->mutator);
+    afl_fuzz_one_delete(e->fuzz_one);
+    afl_engine_delete(e->engine);
+    afl_feedback_cov_delete(e->feedback);
+
+    /* The queue leaves its entries to us */
+    for (j = 0; j < e->global_queue->base.entries_count; j++) {
+
+      afl_entry_delete(e->global_queue->base.entries[j]);
+
+    }
+
+    afl_queue_global_delete(e->global_queue);
+    afl_queue_feedback_delete(e->feedback_queue);
+    afl_executor_deinit(&e->executor.base);
+    afl_observer_covmap_delete(e->covmap);
+
+  }
+
+  free(shared_virgin_bits);
+
+}
+
+int main(int argc, char **argv) {
+
+  (void)argc;
+  (void)argv;
+
+  const struct CMUnitTest tests[] = {
+
+      cmocka_unit_test(test_insert_substring),
+      cmocka_unit_test(test_insert_bytes),
+      cmocka_unit_test(test_erase_bytes),
+
+      cmocka_unit_test(test_input_load_from_file),
+      cmocka_unit_test(test_input_save_to_file),
+      cmocka_unit_test(test_input_copy),
+
+      cmocka_unit_test(test_engine_load_testcase_from_dir),
+
+      cmocka_unit_test(test_basic_mutator_functions),
+      cmocka_unit_test(test_stage_pipelined),
+
+      cmocka_unit_test(test_queue_set_directory),
+      cmocka_unit_test(test_base_queue_get_next),
+
+      cmocka_unit_test(test_feedback_cov_novelty_kernels),
+      cmocka_unit_test(test_observer_covmap_classify_counts),
+      cmocka_unit_test(test_observer_covmap_dirty_blocks),
+      cmocka_unit_test(test_feedback_cov_shared_virgin_bits),
+      cmocka_unit_test(test_feedback_edgelist),
+      cmocka_unit_test(test_broker_cov_filter),
+      cmocka_unit_test(test_llmp_zero_copy),
+      cmocka_unit_test(test_llmp_batch_forward),
+      cmocka_unit_test(test_llmp_broadcast_page_gc),
+      cmocka_unit_test(test_llmp_b2b_link),
+      cmocka_unit_test(test_llmp_tcp_bridge),
+      cmocka_unit_test(test_llmp_subscribe),
+      cmocka_unit_test(test_llmp_client_batch),
+      cmocka_unit_test(test_llmp_compression),
+
+      cmocka_unit_test(test_fsrv_shmem),
+      cmocka_unit_test(test_fsrv_dirty_blocks),
+      cmocka_unit_test(test_fsrv_edgelist_threads),
+      cmocka_unit_test(test_fsrv_persistent),
+      cmocka_unit_test(test_fsrv_run_batch),
+      cmocka_unit_test(test_fsrv_deferred),
+      cmocka_unit_test(test_fsrv_group),
+      cmocka_unit_test(test_fsrv_pool),
+
+      cmocka_unit_test(test_mem_snapshot),
+
+      cmocka_unit_test(test_in_memory_catch_crashes),
+
+      cmocka_unit_test(test_executor_run_batch),
+      cmocka_unit_test(test_snapshot_executor),
+
+      cmocka_unit_test(test_runner),
 
   };
 